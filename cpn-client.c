@@ -59,6 +59,8 @@ static struct cpn_opt opts[] = {
             "Network address of the host to query", "ADDRESS", false),
     CPN_OPTS_OPT_UINT32(0, "--remote-port",
             "Port of the host to query", "PORT", false),
+    CPN_OPTS_OPT_STRING(0, "--ticket",
+            "File to store tickets for resuming connections in", "FILE", true),
     CPN_OPTS_OPT_COUNTER('v', "--verbose", "Control logging verbosity"),
     CPN_OPTS_OPT_ACTION("query", NULL, NULL),
     CPN_OPTS_OPT_ACTION("request", NULL, request_opts),
@@ -74,6 +76,31 @@ static struct cpn_sign_keys local_keys;
 static struct cpn_sign_pk remote_key;
 static const char *remote_host;
 static uint32_t remote_port;
+static const char *ticket_file;
+
+static int connect_remote(struct cpn_channel *channel)
+{
+    struct cpn_ticket ticket;
+    int err;
+
+    if (ticket_file == NULL)
+        return cpn_client_connect(channel, remote_host, remote_port,
+                &local_keys, &remote_key);
+
+    /* Without a valid ticket we simply perform a full handshake */
+    if (cpn_ticket_from_file(&ticket, ticket_file) < 0)
+        cpn_ticket_clear(&ticket);
+
+    err = cpn_client_connect_resumable(channel, remote_host, remote_port,
+            &local_keys, &remote_key, &ticket);
+
+    if (err == 0 && ticket.len && cpn_ticket_to_file(ticket_file, &ticket) < 0)
+        puts("Could not store ticket");
+
+    cpn_ticket_clear(&ticket);
+
+    return err;
+}
 
 static int cmd_query(void)
 {
@@ -81,9 +108,7 @@ static int cmd_query(void)
     struct cpn_query_results results;
     struct cpn_channel channel;
 
-    if (cpn_client_connect(&channel, remote_host, remote_port,
-                &local_keys, &remote_key) < 0)
-    {
+    if (connect_remote(&channel) < 0) {
         puts("Could not establish connection");
         return -1;
     }
@@ -137,9 +162,7 @@ static int cmd_request(const char *service_type, const struct cpn_opts_stringlis
         goto out_err;
     }
 
-    if (cpn_client_connect(&channel, remote_host, remote_port,
-                &local_keys, &remote_key) < 0)
-    {
+    if (connect_remote(&channel) < 0) {
         puts("Could not establish connection");
         goto out_err;
     }
@@ -192,9 +215,7 @@ static int cmd_connect(const char *service_type, uint32_t sessionid,
         goto out;
     }
 
-    if (cpn_client_connect(&channel, remote_host, remote_port,
-                &local_keys, &remote_key) < 0)
-    {
+    if (connect_remote(&channel) < 0) {
         puts("Could not start connection");
         goto out;
     }
@@ -230,9 +251,7 @@ static int cmd_terminate(uint32_t sessionid, const char *capability)
         goto out;
     }
 
-    if (cpn_client_connect(&channel, remote_host, remote_port,
-                &local_keys, &remote_key) < 0)
-    {
+    if (connect_remote(&channel) < 0) {
         puts("Could not start connection");
         goto out;
     }
@@ -288,6 +307,8 @@ int main(int argc, const char *argv[])
     memcpy(&remote_key, &cpn_opts_get(opts, 0, "--remote-key")->sigkey, sizeof(struct cpn_sign_pk));
     remote_host = cpn_opts_get(opts, 0, "--remote-host")->string;
     remote_port = cpn_opts_get(opts, 0, "--remote-port")->uint32;
+    if (cpn_opts_get(opts, 0, "--ticket"))
+        ticket_file = cpn_opts_get(opts, 0, "--ticket")->string;
 
     if (cpn_opts_get(opts, 0, "query"))
         return cmd_query();
@@ -15,29 +15,65 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "config.h"
+
+#ifdef HAVE_SCHED
+# define __USE_GNU
+#  include <sched.h>
+#  include <pthread.h>
+# undef __USE_GNU
+#endif
+
+#include <pthread.h>
 #include <signal.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sys/select.h>
 #include <netdb.h>
 
 #include "capone/acl.h"
 #include "capone/common.h"
 #include "capone/global.h"
 #include "capone/log.h"
+#include "capone/mux.h"
 #include "capone/opts.h"
+#include "capone/pool.h"
+#include "capone/reactor.h"
 #include "capone/server.h"
 #include "capone/service.h"
 #include "capone/socket.h"
 
 #define LISTEN_PORT 6667
+/* Time persistent connections may stay idle between commands */
+#define IDLE_TIMEOUT (30 * 1000)
+/* Interval in milliseconds between reports of the worker pool's
+ * statistics */
+#define STATS_INTERVAL (60 * 1000)
+/* Time to wait before accepting again after running out of file
+ * descriptors or memory */
+#define ACCEPT_BACKOFF (100)
+/* Discovery probes have to fit into a single datagram */
+#define DISCOVERY_MAXLEN 4096
 
 struct handle_connection_args {
     const struct cpn_cfg *cfg;
     const struct cpn_service *service;
+    struct cpn_reactor *reactor;
+    struct cpn_pool_limit *limit;
     struct cpn_channel channel;
+    struct cpn_sign_pk remote_key;
+    /* Held while waiting for the next command is registered with
+     * the reactor, whose callbacks must not run before */
+    pthread_mutex_t mutex;
+};
+
+struct mux_connection {
+    struct handle_connection_args *args;
+    struct cpn_mux mux;
 };
 
 struct handle_discovery_args {
@@ -46,12 +82,60 @@ struct handle_discovery_args {
     struct cpn_service *services;
 };
 
+struct listener {
+    struct cpn_socket socket;
+    struct cpn_reactor *reactor;
+    const struct cpn_service *service;
+    struct cpn_pool_limit *limit;
+    const struct cpn_cfg *cfg;
+};
+
+struct discovery_listener {
+    struct cpn_socket socket;
+    struct cpn_reactor *reactor;
+    int nservices;
+    struct cpn_service *services;
+};
+
+struct acceptor {
+    struct cpn_reactor reactor;
+    struct listener *listeners;
+    uint32_t nlisteners;
+    int cpu;
+};
+
 static struct cpn_acl request_acl = CPN_ACL_INIT;
 static struct cpn_acl query_acl = CPN_ACL_INIT;
 
 static struct cpn_sign_keys local_keys;
 static const char *name;
 
+/* Number of threads accepting connections on shared sockets. If
+ * unset, all connections are accepted by the main thread. */
+static bool shared_acceptors;
+static uint32_t nacceptors;
+static uint32_t backlog = CPN_SOCKET_BACKLOG;
+static bool pin_cpus;
+
+/* Connections are handled by a fixed number of workers. Every
+ * service may additionally limit how many of them it occupies.
+ * New connections are shed as soon as queued ones have waited
+ * longer than the target for a whole interval. */
+static struct cpn_pool pool;
+static struct cpn_pool_limit *limits;
+static uint32_t nworkers = 64;
+static uint32_t maxqueue = 256;
+static uint32_t queue_target = 100;
+#define QUEUE_INTERVAL(target) ((target) * 10)
+
+/* Handshakes are driven by the reactors, which hand off all
+ * expensive cryptographic operations to a separate pool */
+static struct cpn_pool crypto_pool;
+static uint32_t ncryptoworkers;
+static uint32_t max_handshakes = 1024;
+
+static enum cpn_channel_io io = CPN_CHANNEL_IO_SYSCALL;
+
 static int read_acl(struct cpn_acl *acl, const char *file)
 {
     struct cpn_sign_pk pk;
@@ -131,100 +215,729 @@ static int setup_signals(void)
 static void *handle_discovery(void *payload)
 {
     struct handle_discovery_args *args = (struct handle_discovery_args *) payload;
-    struct cpn_sign_pk remote_sign_key;
-
-    if (args->channel.type == CPN_CHANNEL_TYPE_TCP) {
-        if (cpn_server_await_encryption(&args->channel, &local_keys, &remote_sign_key) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Unable to await encryption");
-            goto out;
-        }
-    }
 
     if (cpn_server_handle_discovery(&args->channel, name, args->nservices, args->services, &local_keys.pk) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not announce message");
     }
 
-out:
-    if (args->channel.type == CPN_CHANNEL_TYPE_TCP)
-        cpn_channel_close(&args->channel);
+    cpn_channel_close(&args->channel);
     free(payload);
 
     return NULL;
 }
 
-static void *handle_connection(void *payload)
+/* Handle a single command. Returns 0 if the channel may carry
+ * further commands afterwards. */
+static int handle_command(enum cpn_command type,
+        struct cpn_channel *channel,
+        const struct cpn_sign_pk *remote_key,
+        const struct cpn_service *service,
+        const struct cpn_cfg *cfg)
 {
-    struct handle_connection_args *args = (struct handle_connection_args *) payload;
-    struct cpn_sign_pk remote_key;
-    enum cpn_command type;
-
-    if (cpn_server_await_encryption(&args->channel, &local_keys, &remote_key) < 0) {
-        cpn_log(LOG_LEVEL_ERROR, "Unable to negotiate encryption");
-        goto out;
-    }
-
-    if (cpn_server_await_command(&type, &args->channel) < 0) {
-        cpn_log(LOG_LEVEL_ERROR, "Could not receive connection type");
-        goto out;
-    }
-
     switch (type) {
         case CPN_COMMAND_QUERY:
             cpn_log(LOG_LEVEL_DEBUG, "Received query");
 
-            if (!cpn_acl_is_allowed(&query_acl, &remote_key, CPN_ACL_RIGHT_EXEC)) {
+            if (!cpn_acl_is_allowed(&query_acl, remote_key, CPN_ACL_RIGHT_EXEC)) {
                 cpn_log(LOG_LEVEL_ERROR, "Received unauthorized query");
-                goto out;
+                return -1;
             }
 
-            if (cpn_server_handle_query(&args->channel, args->service) < 0) {
+            if (cpn_server_handle_query(channel, service) < 0) {
                 cpn_log(LOG_LEVEL_ERROR, "Received invalid query");
-                goto out;
+                return -1;
             }
 
-            goto out;
+            return 0;
         case CPN_COMMAND_REQUEST:
             cpn_log(LOG_LEVEL_DEBUG, "Received request");
 
-            if (!cpn_acl_is_allowed(&request_acl, &remote_key, CPN_ACL_RIGHT_EXEC)) {
+            if (!cpn_acl_is_allowed(&request_acl, remote_key, CPN_ACL_RIGHT_EXEC)) {
                 cpn_log(LOG_LEVEL_ERROR, "Received unauthorized query");
-                goto out;
+                return -1;
             }
 
-            if (cpn_server_handle_request(&args->channel, &remote_key, args->service->plugin) < 0) {
+            if (cpn_server_handle_request(channel, remote_key, service->plugin) < 0) {
                 cpn_log(LOG_LEVEL_ERROR, "Received invalid request");
-                goto out;
+                return -1;
             }
 
-            goto out;
+            return 0;
         case CPN_COMMAND_CONNECT:
             cpn_log(LOG_LEVEL_DEBUG, "Received connect");
 
-            if (cpn_server_handle_session(&args->channel, &remote_key, args->service, args->cfg) < 0)
+            if (cpn_server_handle_session(channel, remote_key, service, cfg) < 0)
             {
                 cpn_log(LOG_LEVEL_ERROR, "Received invalid connect");
             }
 
-            goto out;
+            /* The session has taken over the channel */
+            return -1;
         case CPN_COMMAND_TERMINATE:
             cpn_log(LOG_LEVEL_DEBUG, "Received termination request");
 
-            if (cpn_server_handle_termination(&args->channel, &remote_key) < 0) {
+            if (cpn_server_handle_termination(channel, remote_key) < 0) {
                 cpn_log(LOG_LEVEL_ERROR, "Received invalid termination request");
+                return -1;
             }
 
-            goto out;
+            return 0;
         default:
             cpn_log(LOG_LEVEL_ERROR, "Unknown connection envelope type %d", type);
-            goto out;
+            return -1;
+    }
+}
+
+static struct handle_connection_args *new_connection(
+        const struct cpn_cfg *cfg,
+        const struct cpn_service *service,
+        struct cpn_reactor *reactor,
+        struct cpn_pool_limit *limit)
+{
+    struct handle_connection_args *args;
+
+    if ((args = malloc(sizeof(*args))) == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&args->mutex, NULL) != 0) {
+        free(args);
+        return NULL;
+    }
+
+    args->cfg = cfg;
+    args->service = service;
+    args->reactor = reactor;
+    args->limit = limit;
+    args->channel.fd = -1;
+
+    return args;
+}
+
+static void free_connection(struct handle_connection_args *args)
+{
+    /* Services may have handed the channel over to a relay */
+    if (args->channel.fd >= 0)
+        cpn_channel_close(&args->channel);
+    pthread_mutex_destroy(&args->mutex);
+    free(args);
+}
+
+static void *handle_commands(void *payload);
+
+static void await_registration(struct handle_connection_args *args)
+{
+    pthread_mutex_lock(&args->mutex);
+    pthread_mutex_unlock(&args->mutex);
+}
+
+static void expire_connection(void *payload)
+{
+    struct handle_connection_args *args = (struct handle_connection_args *) payload;
+
+    await_registration(args);
+
+    cpn_log(LOG_LEVEL_DEBUG, "Connection idle for too long");
+    cpn_reactor_remove(args->reactor, args->channel.fd);
+    free_connection(args);
+}
+
+static void handle_next_command(int fd, void *payload)
+{
+    struct handle_connection_args *args = (struct handle_connection_args *) payload;
+    char c;
+
+    await_registration(args);
+
+    cpn_reactor_remove(args->reactor, fd);
+
+    /* A timeout which cannot be removed anymore is about to fire
+     * and closes the connection by itself */
+    if (cpn_reactor_remove_timeout(args->reactor, expire_connection, args) < 0)
+        return;
+
+    /* Clients simply close the connection after their last
+     * command, which is not an error */
+    if (recv(fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT) == 0) {
+        cpn_log(LOG_LEVEL_DEBUG, "Connection closed by client");
+        free_connection(args);
+        return;
     }
 
+    if (cpn_pool_submit(&pool, args->limit, handle_commands, args) < 0) {
+        cpn_log(LOG_LEVEL_WARNING, "Worker queue is full, dropping connection");
+        free_connection(args);
+    }
+}
+
+/* Hand the connection to the reactor until the client sends its
+ * next command. The connection must not be touched afterwards, as
+ * it may already be handled by another thread. */
+static int await_next_command(struct handle_connection_args *args)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&args->mutex);
+
+    if (cpn_reactor_add_timeout(args->reactor, IDLE_TIMEOUT,
+                expire_connection, args) < 0)
+    {
+        err = -1;
+        goto out;
+    }
+
+    if (cpn_reactor_add(args->reactor, args->channel.fd, false,
+                handle_next_command, args) < 0 &&
+            cpn_reactor_remove_timeout(args->reactor, expire_connection, args) == 0)
+        err = -1;
+
 out:
+    pthread_mutex_unlock(&args->mutex);
+    return err;
+}
+
+static void *handle_commands(void *payload)
+{
+    struct handle_connection_args *args = (struct handle_connection_args *) payload;
+    enum cpn_command type;
+
+    /* Commands pipelined by the client may already have been read
+     * ahead by the channel, which the reactor cannot notice */
+    do {
+        if (cpn_server_await_command(&type, &args->channel) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Could not receive connection type");
+            goto out;
+        }
+
+        if (handle_command(type, &args->channel, &args->remote_key,
+                    args->service, args->cfg) < 0)
+            goto out;
+    } while (cpn_channel_has_pending_input(&args->channel));
+
+    /* Keep the connection alive for further commands until the
+     * client closes it or stays idle for too long, without
+     * occupying a worker in the meantime */
+    if (await_next_command(args) == 0)
+        return NULL;
+
+out:
+    free_connection(args);
+    return NULL;
+}
+
+static void accept_streams(int fd, void *payload)
+{
+    struct mux_connection *m = (struct mux_connection *) payload;
+    struct handle_connection_args *conn = m->args;
+    struct handle_connection_args *args;
+    int err;
+
+    /* Every stream carries a command of its own. Streams are
+     * handed to the workers like connections are, so that a
+     * multiplexed connection cannot exceed its service's limit. */
+    while (1) {
+        if ((args = new_connection(conn->cfg, conn->service,
+                        conn->reactor, conn->limit)) == NULL)
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to allocate stream");
+            return;
+        }
+
+        memcpy(&args->remote_key, &conn->remote_key, sizeof(args->remote_key));
+
+        if ((err = cpn_mux_try_accept(&m->mux, &args->channel)) != 0) {
+            free_connection(args);
+            break;
+        }
+
+        if (cpn_pool_submit(&pool, conn->limit, handle_commands, args) < 0) {
+            cpn_log(LOG_LEVEL_WARNING, "Worker queue is full, dropping stream");
+            free_connection(args);
+        }
+    }
+
+    if (err == CPN_CHANNEL_WOULD_BLOCK)
+        return;
+
+    /* The client has closed the connection */
+    cpn_reactor_remove(conn->reactor, fd);
+    cpn_mux_free(&m->mux);
+    free_connection(conn);
+    free(m);
+}
+
+static int handle_streams(struct handle_connection_args *args)
+{
+    struct mux_connection *m;
+
+    if ((m = malloc(sizeof(*m))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate multiplexed connection");
+        return -1;
+    }
+    m->args = args;
+
+    if (cpn_mux_init(&m->mux, &args->channel, CPN_MUX_ROLE_SERVER) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to multiplex connection");
+        free(m);
+        return -1;
+    }
+
+    /* Instead of keeping a worker blocked until the client opens
+     * streams, the reactor accepts them as they arrive. The
+     * connection is owned by the reactor from here on. */
+    if (cpn_reactor_add(args->reactor, cpn_mux_accept_fd(&m->mux), false,
+                accept_streams, m) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to register multiplexed connection");
+        cpn_mux_free(&m->mux);
+        free(m);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *handle_connection(void *payload)
+{
+    struct handle_connection_args *args = (struct handle_connection_args *) payload;
+
+    if (io != CPN_CHANNEL_IO_SYSCALL && cpn_channel_set_io(&args->channel, io) < 0)
+        cpn_log(LOG_LEVEL_WARNING, "Unable to set I/O backend, using system calls");
+
+    if (!args->channel.multiplexed)
+        return handle_commands(args);
+
+    if (handle_streams(args) < 0)
+        free_connection(args);
+    return NULL;
+}
+
+static void handle_handshake(struct cpn_channel *channel,
+        const struct cpn_sign_pk *remote_key, int result, void *payload)
+{
+    struct handle_connection_args *args = (struct handle_connection_args *) payload;
+
+    UNUSED(channel);
+
+    if (result < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to negotiate encryption");
+        goto out_err;
+    }
+
+    memcpy(&args->remote_key, remote_key, sizeof(args->remote_key));
+
+    /* Refusing connections while overloaded is preferable to
+     * letting the queue grow without bounds */
+    if (cpn_pool_submit(&pool, args->limit, handle_connection, args) < 0) {
+        cpn_log(LOG_LEVEL_WARNING, "Worker queue is full, dropping connection");
+        goto out_err;
+    }
+
+    return;
+
+out_err:
+    free_connection(args);
+}
+
+static int accept_connection(struct cpn_socket *socket,
+        struct cpn_reactor *reactor,
+        const struct cpn_service *service,
+        struct cpn_pool_limit *limit,
+        const struct cpn_cfg *cfg)
+{
+    struct handle_connection_args *args;
+    int err;
+
+    if ((args = new_connection(cfg, service, reactor, limit)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (cpn_socket_accept(socket, &args->channel) < 0) {
+        err = errno;
+        free_connection(args);
+        errno = err;
+        return -1;
+    }
+
+    /* Shedding connections before the handshake keeps the cost
+     * of refusing them as low as possible */
+    if (!cpn_pool_admits(&pool, limit)) {
+        cpn_log(LOG_LEVEL_VERBOSE, "Server is overloaded, shedding connection");
+        free_connection(args);
+        return 0;
+    }
+
+    if (cpn_server_await_encryption_async(reactor, &crypto_pool, &args->channel,
+                &local_keys, handle_handshake, args) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to start handshake");
+        free_connection(args);
+    }
+
+    return 0;
+}
+
+static void handle_listener(int fd, void *payload);
+
+static void resume_listener(void *payload)
+{
+    struct listener *l = (struct listener *) payload;
+
+    /* Registering the edge-triggered listener again reports
+     * connections that have queued up in the meantime */
+    if (cpn_reactor_add(l->reactor, l->socket.fd, true, handle_listener, l) < 0)
+        cpn_log(LOG_LEVEL_ERROR, "Unable to resume listener");
+}
+
+static void pause_listener(struct listener *l, int err)
+{
+    cpn_log(LOG_LEVEL_WARNING, "Unable to accept connections, pausing listener: %s",
+            strerror(err));
+
+    /* Retrying right away would only spin on the same error while
+     * connections keep waiting in the backlog */
+    if (cpn_reactor_remove(l->reactor, l->socket.fd) < 0)
+        return;
+
+    if (cpn_reactor_add_timeout(l->reactor, ACCEPT_BACKOFF, resume_listener, l) < 0)
+        resume_listener(l);
+}
+
+static void handle_listener(int fd, void *payload)
+{
+    struct listener *l = (struct listener *) payload;
+
+    UNUSED(fd);
+
+    /* Listeners are edge-triggered, so we have to accept all
+     * pending connections */
+    while (1) {
+        if (accept_connection(&l->socket, l->reactor, l->service, l->limit, l->cfg) == 0)
+            continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+
+        /* Connections aborted by their peers must not keep us
+         * from accepting the remaining ones */
+        if (errno == ECONNABORTED || errno == EPROTO || errno == EPERM || errno == EINTR)
+            continue;
+
+        pause_listener(l, errno);
+        break;
+    }
+}
+
+static void handle_discovery_handshake(struct cpn_channel *channel,
+        const struct cpn_sign_pk *remote_key, int result, void *payload)
+{
+    struct handle_discovery_args *args = (struct handle_discovery_args *) payload;
+
+    UNUSED(channel);
+    UNUSED(remote_key);
+
+    if (result < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to await encryption");
+        goto out_err;
+    }
+
+    /* Only the announcement is left to the workers */
+    if (cpn_pool_submit(&pool, NULL, handle_discovery, args) < 0) {
+        cpn_log(LOG_LEVEL_WARNING, "Worker queue is full, dropping discovery");
+        goto out_err;
+    }
+
+    return;
+
+out_err:
     cpn_channel_close(&args->channel);
-    free(payload);
+    free(args);
+}
+
+static void handle_tcp_discovery(int fd, void *payload)
+{
+    struct discovery_listener *l = (struct discovery_listener *) payload;
+    struct handle_discovery_args *args;
+
+    UNUSED(fd);
+
+    while (1) {
+        if ((args = malloc(sizeof(*args))) == NULL) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to allocate discovery");
+            break;
+        }
+        args->nservices = l->nservices;
+        args->services = l->services;
+
+        if (cpn_socket_accept(&l->socket, &args->channel) < 0) {
+            free(args);
+            break;
+        }
+
+        /* Discoveries are encrypted like any other connection, so
+         * they are subject to the same admission control and
+         * handshake limits */
+        if (!cpn_pool_admits(&pool, NULL)) {
+            cpn_log(LOG_LEVEL_VERBOSE, "Server is overloaded, shedding discovery");
+            cpn_channel_close(&args->channel);
+            free(args);
+            continue;
+        }
+
+        if (cpn_server_await_encryption_async(l->reactor, &crypto_pool, &args->channel,
+                    &local_keys, handle_discovery_handshake, args) < 0)
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to start handshake");
+            cpn_channel_close(&args->channel);
+            free(args);
+        }
+    }
+}
+
+static void handle_udp_discovery(int fd, void *payload)
+{
+    struct discovery_listener *l = (struct discovery_listener *) payload;
+    struct handle_discovery_args *args;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint8_t datagram[DISCOVERY_MAXLEN];
+    ssize_t len;
+    int probefd;
+
+    UNUSED(fd);
+
+    /* Probes are read right away, as the datagram would otherwise
+     * be reported again until it has been received. Answering is
+     * left to the workers, which only ever get to see this single
+     * datagram. */
+    addrlen = sizeof(addr);
+    if ((len = recvfrom(l->socket.fd, datagram, sizeof(datagram), MSG_DONTWAIT,
+                    (struct sockaddr *) &addr, &addrlen)) < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            cpn_log(LOG_LEVEL_ERROR, "Could not receive probe: %s", strerror(errno));
+        return;
+    }
+
+    if ((args = malloc(sizeof(*args))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate discovery");
+        return;
+    }
+    args->nservices = l->nservices;
+    args->services = l->services;
+
+    /* The listening socket is shared by all probes, so each one
+     * gets its own descriptor to answer on */
+    if ((probefd = dup(l->socket.fd)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to duplicate discovery socket");
+        free(args);
+        return;
+    }
+
+    if (cpn_channel_init_from_datagram(&args->channel, probefd,
+                (struct sockaddr *) &addr, addrlen, datagram, len) < 0)
+    {
+        cpn_channel_close(&args->channel);
+        free(args);
+        return;
+    }
+
+    if (cpn_pool_submit(&pool, NULL, handle_discovery, args) < 0) {
+        cpn_log(LOG_LEVEL_WARNING, "Worker queue is full, dropping discovery");
+        cpn_channel_close(&args->channel);
+        free(args);
+    }
+}
+
+static void report_pool_stats(const char *name, struct cpn_pool *p)
+{
+    struct cpn_pool_stats stats;
+
+    cpn_pool_get_stats(&stats, p);
+
+    cpn_log(LOG_LEVEL_VERBOSE, "%s: %lu active, %lu queued (max %lu), "
+            "%"PRIu64" completed, %"PRIu64" rejected, %"PRIu64" shed, "
+            "%"PRIu64"ms sojourn, priority %"PRIu32" required", name,
+            (unsigned long) stats.active, (unsigned long) stats.queued,
+            (unsigned long) stats.max_queued, stats.completed, stats.rejected,
+            stats.shed, stats.sojourn, stats.min_priority);
+}
+
+static void report_stats(void *payload)
+{
+    UNUSED(payload);
+
+    report_pool_stats("Workers", &pool);
+    report_pool_stats("Crypto workers", &crypto_pool);
+}
+
+static int open_listener(struct cpn_reactor *reactor, struct listener *l,
+        const struct cpn_service *service, struct cpn_pool_limit *limit,
+        const struct cpn_cfg *cfg, bool shared, int cpu)
+{
+    int err;
+
+    l->reactor = reactor;
+    l->service = service;
+    l->limit = limit;
+    l->cfg = cfg;
+
+    if (shared)
+        err = cpn_socket_init_shared(&l->socket, NULL, service->port, CPN_CHANNEL_TYPE_TCP);
+    else
+        err = cpn_socket_init(&l->socket, NULL, service->port, CPN_CHANNEL_TYPE_TCP);
+
+    if (err < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not set up socket");
+        return -1;
+    }
+
+    if (cpn_socket_set_backlog(&l->socket, backlog) < 0 ||
+            cpn_socket_set_nonblocking(&l->socket) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Could not configure socket");
+        goto out_err;
+    }
+
+    /* Ask the kernel to hand us connections processed on our
+     * own CPU, such that they do not have to migrate */
+    if (cpu >= 0 && cpn_socket_set_incoming_cpu(&l->socket, cpu) < 0)
+        cpn_log(LOG_LEVEL_WARNING, "Could not set incoming CPU");
+
+    if (cpn_socket_listen(&l->socket) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not start listening");
+        goto out_err;
+    }
+
+    if (cpn_reactor_add(reactor, l->socket.fd, true, handle_listener, l) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not register listener");
+        goto out_err;
+    }
+
+    return 0;
+
+out_err:
+    cpn_socket_close(&l->socket);
+
+    return -1;
+}
+
+static int open_listeners(struct cpn_reactor *reactor, struct listener *listeners,
+        const struct cpn_service *services, uint32_t n,
+        const struct cpn_cfg *cfg, bool shared, int cpu)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        if (open_listener(reactor, &listeners[i], &services[i], &limits[i],
+                    cfg, shared, cpu) < 0)
+            goto out_err;
+    }
+
+    return 0;
+
+out_err:
+    while (i--) {
+        cpn_reactor_remove(reactor, listeners[i].socket.fd);
+        cpn_socket_close(&listeners[i].socket);
+    }
+
+    return -1;
+}
+
+static int pin_to_cpu(int cpu)
+{
+#ifdef HAVE_SCHED
+    cpu_set_t mask;
+
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+#else
+    UNUSED(cpu);
+    return -1;
+#endif
+}
+
+static void *accept_connections(void *payload)
+{
+    struct acceptor *acceptor = (struct acceptor *) payload;
+    uint32_t i;
+
+    /* Only accepting connections and waiting for their handshake
+     * stays on this CPU. Connections are handled by the shared
+     * worker pools, whose threads may run on any CPU. */
+    if (acceptor->cpu >= 0 && pin_to_cpu(acceptor->cpu) != 0)
+        cpn_log(LOG_LEVEL_WARNING, "Could not pin acceptor to CPU %d", acceptor->cpu);
+
+    if (cpn_reactor_run(&acceptor->reactor) < 0)
+        cpn_log(LOG_LEVEL_ERROR, "Acceptor stopped unexpectedly");
+
+    for (i = 0; i < acceptor->nlisteners; i++)
+        cpn_socket_close(&acceptor->listeners[i].socket);
+
     return NULL;
 }
 
+static int start_acceptors(struct acceptor **out,
+        const struct cpn_service *services, uint32_t n,
+        const struct cpn_cfg *cfg)
+{
+    struct acceptor *acceptors, *a;
+    long ncpus;
+    uint32_t i;
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus <= 0)
+        ncpus = 1;
+    if (nacceptors == 0)
+        nacceptors = ncpus;
+
+    if ((acceptors = malloc(sizeof(*acceptors) * nacceptors)) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate acceptors");
+        nacceptors = 0;
+        *out = NULL;
+        return -1;
+    }
+
+    /* Every acceptor listens on its own socket per service, all
+     * of which share the same port. The kernel spreads incoming
+     * connections across them. */
+    for (i = 0; i < nacceptors; i++) {
+        a = &acceptors[i];
+        a->cpu = pin_cpus ? (int) (i % ncpus) : -1;
+        a->nlisteners = n;
+
+        if ((a->listeners = malloc(sizeof(struct listener) * n)) == NULL)
+            goto out_err;
+
+        if (cpn_reactor_init(&a->reactor) < 0) {
+            free(a->listeners);
+            goto out_err;
+        }
+
+        if (open_listeners(&a->reactor, a->listeners, services, n, cfg, true, a->cpu) < 0 ||
+                cpn_spawn(NULL, accept_connections, a) != 0)
+        {
+            cpn_reactor_free(&a->reactor);
+            free(a->listeners);
+            goto out_err;
+        }
+    }
+
+    *out = acceptors;
+
+    return 0;
+
+out_err:
+    cpn_log(LOG_LEVEL_ERROR, "Could not start acceptor");
+    nacceptors = i;
+    *out = acceptors;
+
+    return -1;
+}
+
 static int setup(struct cpn_cfg *cfg, int argc, const char *argv[])
 {
     struct cpn_opt opts[] = {
@@ -236,6 +949,37 @@ static int setup(struct cpn_cfg *cfg, int argc, const char *argv[])
         CPN_OPTS_OPT_STRING(0, "--query-acl",
                 "Path to file containing access control list for queries",
                 "FILE", true),
+        CPN_OPTS_OPT_UINT32(0, "--acceptors",
+                "Number of threads accepting connections on shared sockets, 0 for one per CPU",
+                "COUNT", true),
+        CPN_OPTS_OPT_UINT32(0, "--backlog",
+                "Maximum number of pending connections per socket",
+                "COUNT", true),
+        CPN_OPTS_OPT_COUNTER(0, "--pin-cpus",
+                "Pin acceptors to CPUs and accept connections on the CPU they arrived on"),
+        CPN_OPTS_OPT_UINT32(0, "--workers",
+                "Number of threads handling connections",
+                "COUNT", true),
+        CPN_OPTS_OPT_UINT32(0, "--queue",
+                "Maximum number of connections waiting for a worker",
+                "COUNT", true),
+        CPN_OPTS_OPT_UINT32(0, "--queue-target",
+                "Milliseconds connections may wait for a worker before new ones are shed, 0 to disable",
+                "MSECS", true),
+        CPN_OPTS_OPT_UINT32(0, "--crypto-workers",
+                "Number of threads computing handshakes, 0 for one per CPU",
+                "COUNT", true),
+        CPN_OPTS_OPT_UINT32(0, "--cookie-threshold",
+                "Number of queued handshakes at which clients have to answer a cookie, 0 to disable",
+                "COUNT", true),
+        CPN_OPTS_OPT_UINT32(0, "--handshake-timeout",
+                "Milliseconds clients may take to finish a handshake, 0 to disable",
+                "MSECS", true),
+        CPN_OPTS_OPT_UINT32(0, "--max-handshakes",
+                "Maximum number of pending handshakes, 0 for no limit",
+                "COUNT", true),
+        CPN_OPTS_OPT_COUNTER(0, "--io-uring",
+                "Batch channel I/O via io_uring where available"),
         CPN_OPTS_OPT_COUNTER('v', "--verbose", "Verbosity"),
         CPN_OPTS_OPT_END
     };
@@ -287,6 +1031,56 @@ static int setup(struct cpn_cfg *cfg, int argc, const char *argv[])
         cpn_acl_add_wildcard(&query_acl, CPN_ACL_RIGHT_EXEC);
     }
 
+    if (cpn_opts_get(opts, 0, "--acceptors")) {
+        shared_acceptors = true;
+        nacceptors = cpn_opts_get(opts, 0, "--acceptors")->uint32;
+    }
+
+    if (cpn_opts_get(opts, 0, "--backlog"))
+        backlog = cpn_opts_get(opts, 0, "--backlog")->uint32;
+
+    if (cpn_opts_get(opts, 0, "--workers"))
+        nworkers = cpn_opts_get(opts, 0, "--workers")->uint32;
+
+    if (cpn_opts_get(opts, 0, "--queue"))
+        maxqueue = cpn_opts_get(opts, 0, "--queue")->uint32;
+
+    if (cpn_opts_get(opts, 0, "--queue-target"))
+        queue_target = cpn_opts_get(opts, 0, "--queue-target")->uint32;
+
+    if (cpn_opts_get(opts, 0, "--crypto-workers"))
+        ncryptoworkers = cpn_opts_get(opts, 0, "--crypto-workers")->uint32;
+    if (ncryptoworkers == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        ncryptoworkers = ncpus > 0 ? ncpus : 1;
+    }
+
+    if (cpn_opts_get(opts, 0, "--cookie-threshold"))
+        cpn_server_set_cookie_threshold(cpn_opts_get(opts, 0, "--cookie-threshold")->uint32);
+
+    if (cpn_opts_get(opts, 0, "--handshake-timeout"))
+        cpn_server_set_handshake_timeout(cpn_opts_get(opts, 0, "--handshake-timeout")->uint32);
+
+    if (cpn_opts_get(opts, 0, "--max-handshakes"))
+        max_handshakes = cpn_opts_get(opts, 0, "--max-handshakes")->uint32;
+    cpn_server_set_max_handshakes(max_handshakes);
+
+    if (cpn_opts_get(opts, 0, "--io-uring")) {
+        if (cpn_channel_io_is_available(CPN_CHANNEL_IO_URING))
+            io = CPN_CHANNEL_IO_URING;
+        else
+            cpn_log(LOG_LEVEL_WARNING, "io_uring is not available, using system calls");
+    }
+
+    if (cpn_opts_get(opts, 0, "--pin-cpus")) {
+        if (!shared_acceptors) {
+            cpn_log(LOG_LEVEL_ERROR, "Pinning CPUs requires shared acceptors");
+            err = -1;
+            goto out;
+        }
+        pin_cpus = true;
+    }
+
     if (setup_signals() < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not set up signal handlers");
         err = -1;
@@ -316,110 +1110,100 @@ out:
 int main(int argc, const char *argv[])
 {
     struct cpn_service *services;
-    struct cpn_socket *sockets;
-    struct cpn_socket udp_socket, tcp_socket;
+    struct listener *listeners = NULL;
+    struct discovery_listener udp_listener, tcp_listener;
+    struct acceptor *acceptors = NULL;
+    struct cpn_reactor reactor;
     struct cpn_cfg cfg;
-    uint32_t i, n;
+    uint32_t i, n, nlisteners = 0, max_priority;
 
     if (setup(&cfg, argc, argv) < 0) {
         return -1;
     }
 
     n = cpn_services_from_config(&services, &cfg);
-    sockets = malloc(sizeof(struct cpn_socket) * n);
 
-    if (cpn_socket_init(&udp_socket, NULL, LISTEN_PORT, CPN_CHANNEL_TYPE_UDP) < 0) {
+    if ((limits = malloc(sizeof(struct cpn_pool_limit) * n)) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate service limits");
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        limits[i].max = services[i].concurrency;
+        limits[i].active = 0;
+        limits[i].priority = services[i].priority;
+    }
+
+    if (cpn_pool_init(&pool, nworkers, maxqueue) < 0 ||
+            cpn_pool_init(&crypto_pool, ncryptoworkers, maxqueue) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to start workers");
+        goto out;
+    }
+    for (i = 0, max_priority = 0; i < n; i++)
+        max_priority = MAX(max_priority, limits[i].priority);
+    cpn_pool_set_target(&pool, queue_target, QUEUE_INTERVAL(queue_target), max_priority);
+
+    if (cpn_reactor_init(&reactor) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to set up reactor");
+        goto out;
+    }
+
+    udp_listener.reactor = tcp_listener.reactor = &reactor;
+    udp_listener.nservices = tcp_listener.nservices = n;
+    udp_listener.services = tcp_listener.services = services;
+
+    if (cpn_socket_init(&udp_listener.socket, NULL, LISTEN_PORT, CPN_CHANNEL_TYPE_UDP) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to init listening channel");
         goto out;
     }
 
-    if (cpn_socket_init(&tcp_socket, NULL, LISTEN_PORT, CPN_CHANNEL_TYPE_TCP) < 0) {
+    if (cpn_socket_init(&tcp_listener.socket, NULL, LISTEN_PORT, CPN_CHANNEL_TYPE_TCP) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to init listening channel");
         goto out;
     }
-    if (cpn_socket_listen(&tcp_socket) < 0) {
+    if (cpn_socket_set_nonblocking(&tcp_listener.socket) < 0 ||
+            cpn_socket_listen(&tcp_listener.socket) < 0)
+    {
         cpn_log(LOG_LEVEL_ERROR, "Unable to listen on TCP channel");
         goto out;
     }
 
-    for (i = 0; i < n; i++) {
-        if (cpn_socket_init(&sockets[i], NULL, services[i].port, CPN_CHANNEL_TYPE_TCP) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Could not set up socket");
-            goto out;
-        }
+    if (cpn_reactor_add(&reactor, udp_listener.socket.fd, false,
+                handle_udp_discovery, &udp_listener) < 0 ||
+            cpn_reactor_add(&reactor, tcp_listener.socket.fd, true,
+                handle_tcp_discovery, &tcp_listener) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to register discovery listeners");
+        goto out;
+    }
 
-        if (cpn_socket_listen(&sockets[i]) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Could not start listening");
+    if (shared_acceptors) {
+        if (start_acceptors(&acceptors, services, n, &cfg) < 0)
+            goto out;
+    } else {
+        if ((listeners = malloc(sizeof(struct listener) * n)) == NULL) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to allocate listeners");
             goto out;
         }
+        if (open_listeners(&reactor, listeners, services, n, &cfg, false, -1) < 0)
+            goto out;
+        nlisteners = n;
     }
 
-    while (1) {
-        fd_set fds;
-        int maxfd = -1;
-
-        FD_ZERO(&fds);
-        FD_SET(tcp_socket.fd, &fds);
-        maxfd = MAX(maxfd, tcp_socket.fd);
-        FD_SET(udp_socket.fd, &fds);
-        maxfd = MAX(maxfd, udp_socket.fd);
-
-        for (i = 0; i < n; i++) {
-            FD_SET(sockets[i].fd, &fds);
-            maxfd = MAX(maxfd, sockets[i].fd);
-        }
-
-        if (select(maxfd + 1, &fds, NULL, NULL, NULL) == -1)
-            continue;
-
-        if (FD_ISSET(tcp_socket.fd, &fds)) {
-            struct handle_discovery_args *args = malloc(sizeof(*args));
-            args->nservices = n;
-            args->services = services;
-            if (cpn_socket_accept(&tcp_socket, &args->channel) < 0) {
-                free(args);
-            } else {
-                cpn_spawn(NULL, handle_discovery, args);
-            }
-        }
-
-        if (FD_ISSET(udp_socket.fd, &fds)) {
-            struct handle_discovery_args *args = malloc(sizeof(*args));
-            args->nservices = n;
-            args->services = services;
-            if (cpn_socket_accept(&udp_socket, &args->channel) < 0) {
-                free(args);
-            } else {
-                cpn_spawn(NULL, handle_discovery, args);
-            }
-        }
-
-        for (i = 0; i < n; i++) {
-            struct handle_connection_args *args;
-
-            if (!FD_ISSET(sockets[i].fd, &fds))
-                continue;
-
-            args = malloc(sizeof(*args));;
-
-            if (cpn_socket_accept(&sockets[i], &args->channel) < 0) {
-                cpn_log(LOG_LEVEL_ERROR, "Could not accept connection");
-                goto out;
-            }
-
-            args->cfg = &cfg;
-            args->service = &services[i];
+    if (cpn_reactor_set_timer(&reactor, STATS_INTERVAL, report_stats, NULL) < 0)
+        goto out;
 
-            cpn_spawn(NULL, handle_connection, args);
-        }
-    }
+    if (cpn_reactor_run(&reactor) < 0)
+        cpn_log(LOG_LEVEL_ERROR, "Reactor stopped unexpectedly");
 
 out:
-    for (i = 0; i < n; i++)
-        cpn_socket_close(&sockets[i]);
+    for (i = 0; i < nlisteners; i++)
+        cpn_socket_close(&listeners[i].socket);
     cpn_cfg_free(&cfg);
     free(services);
-    free(sockets);
+    free(listeners);
+    free(limits);
 
     return -1;
 }
@@ -28,6 +28,18 @@ struct cpn_buf {
 
 #define CPN_BUF_INIT { NULL, 0, 0 }
 
+/** @brief Reserve memory for buffer contents
+ *
+ * Make sure that the buffer has at least `len` bytes allocated
+ * such that appending data up to that length does not require
+ * any further allocations.
+ *
+ * @param[in] buf Buffer to reserve memory for
+ * @param[in] len Number of bytes to reserve
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_buf_reserve(struct cpn_buf *buf, size_t len);
+
 /** @brief Set contents of buffer to string
  *
  * Overwrite the current contents of the buffer with the contents
@@ -32,12 +32,24 @@
  * boundary and thus split packages accordingly, which is
  * required for TCP streams.
  *
+ * Alternatively, TCP channels may use variable-length frames
+ * instead of fixed-size blocks. Each frame is prefixed by its
+ * length and only as long as required by the data it carries,
+ * up to a maximum frame length. As with blocks, the first
+ * frame additionally carries the whole data's length. As both
+ * sides have to agree on the framing, frames are usually only
+ * enabled after both parties negotiated them.
+ *
  * It is possible to use encrypted channels. After a potential
  * key exchange, one can enable encryption and thus have the
  * complete traffic encrypted with the specified key. We use an
  * authenticated encryption, that is all blocks are prefixed with
  * a message authentication code which is used to determine if
- * the message has been tampered with.
+ * the message has been tampered with. The cipher used for this
+ * is negotiated while establishing encryption, preferring
+ * hardware-accelerated AES-256-GCM over XChaCha20-Poly1305 and
+ * falling back to XSalsa20-Poly1305 for peers unaware of cipher
+ * negotiation.
  *
  * To guarantee that no message is encrypted twice with the same
  * key and same output, nonces are counted up. Nonces are
@@ -49,11 +61,43 @@
  * nonces overflow. As they are sufficiently big, though, this
  * will likely never happen.
  *
+ * Channels may be switched into non-blocking mode, which allows
+ * a single thread to drive many channels from an event loop.
+ * In this mode, writing and receiving never block. Instead,
+ * partially received and sealed but not yet written data is kept
+ * with the channel and operations which cannot complete right
+ * away return <code>CPN_CHANNEL_WOULD_BLOCK</code>. Callers are
+ * expected to retry as soon as the channel's file descriptor
+ * becomes readable or writable again.
+ *
  * One has to remain careful to not re-use the same key, though,
  * as there would be repeated nonces then. It is thus advisable
  * to create ephemeral session keys which are only used for a
  * single session and then discarded.
  *
+ * Messages may additionally be compressed before they are split
+ * up and encrypted. Like the cipher, the compression algorithm
+ * is negotiated while establishing encryption, while each side
+ * chooses its own compression level. Messages which do not
+ * shrink are sent uncompressed.
+ *
+ * Keys may be updated while data is in flight. Data sent
+ * afterwards is encrypted with the new key, while received data
+ * is decrypted with the previous key until the remote side
+ * starts using the new key, too. The switch is detected by the
+ * first block failing to authenticate with the previous key.
+ * Nonces keep counting across key updates.
+ *
+ * Clients may additionally negotiate multiplexing, in which case
+ * the channel carries multiple logical streams after encryption
+ * has been established.
+ *
+ * Blocking TCP channels may optionally use io_uring instead of
+ * a system call per write or read. Sealed data is then handed to
+ * the kernel in batches of registered buffers, while received
+ * data is read ahead by a multishot receive. This is transparent
+ * to the remote side.
+ *
  * @{
  */
 
@@ -65,8 +109,16 @@
 
 #include <protobuf-c/protobuf-c.h>
 
+#include "capone/buf.h"
+#include "capone/compression.h"
 #include "capone/crypto/symmetric.h"
 
+/** @brief Return value of non-blocking operations that would block */
+#define CPN_CHANNEL_WOULD_BLOCK (-2)
+
+/** @brief Maximum length of frames sent or received on channels */
+#define CPN_CHANNEL_MAX_FRAMELEN (32 * 1024)
+
 /** @brief Network communication type */
 enum cpn_channel_type {
     /** Use UDP as underlying network protocol */
@@ -83,6 +135,26 @@ enum cpn_channel_crypto {
     CPN_CHANNEL_CRYPTO_SYMMETRIC
 };
 
+/** @brief Framing used to split data */
+enum cpn_channel_framing {
+    /** Split data into fixed-size, zero-padded blocks */
+    CPN_CHANNEL_FRAMING_BLOCKS,
+    /** Split data into length-prefixed, variable-size frames */
+    CPN_CHANNEL_FRAMING_FRAMES,
+    /** Send each message as a single datagram carrying its
+     * sequence number */
+    CPN_CHANNEL_FRAMING_DATAGRAMS
+};
+
+/** @brief Backend used to send and receive data */
+enum cpn_channel_io {
+    /** Issue system calls for each write or read */
+    CPN_CHANNEL_IO_SYSCALL,
+    /** Batch writes and reads via io_uring, only available if
+     * built with liburing */
+    CPN_CHANNEL_IO_URING
+};
+
 /** @brief Wether to generate the client- or server-side nonce */
 enum cpn_channel_nonce {
     /** Use a client-side nonce starting at <code>0</code> */
@@ -91,6 +163,31 @@ enum cpn_channel_nonce {
     CPN_CHANNEL_NONCE_SERVER
 };
 
+/** @brief Callback invoked for chunks of a received message
+ *
+ * @param[in] data Chunk of decrypted message data.
+ * @param[in] len Length of the chunk.
+ * @param[in] total Total length of the message the chunk is
+ *            part of.
+ * @param[in] payload Payload passed in by the caller.
+ * @return <code>0</code> to continue receiving, <code>-1</code>
+ *         to abort
+ */
+typedef int (*cpn_channel_receive_fn)(const uint8_t *data, size_t len,
+        uint32_t total, void *payload);
+
+struct cpn_channel;
+struct cpn_uring;
+
+/** @brief Callback invoked before receiving the first message
+ *
+ * @param[in] c Channel which is about to receive
+ * @param[in] payload Payload passed in when setting the callback
+ * @return <code>0</code> on success, <code>-1</code> to abort
+ *         receiving
+ */
+typedef int (*cpn_channel_pending_fn)(struct cpn_channel *c, void *payload);
+
 /** @brief A channel representing a connection to a remote peer
  *
  * A channel bundles together all data required to communicate
@@ -102,13 +199,47 @@ struct cpn_channel {
     socklen_t addrlen;
 
     size_t blocklen;
+    size_t batchlen;
+    size_t framelen;
+    uint32_t maxmsglen;
 
     enum cpn_channel_type type;
+    enum cpn_channel_framing framing;
     enum cpn_channel_crypto crypto;
+    enum cpn_symmetric_cipher cipher;
+    enum cpn_compression compression;
+    int compression_level;
+    bool multiplexed;
 
     struct cpn_symmetric_key key;
+    struct cpn_symmetric_key remote_key;
+    bool rekeying;
     struct cpn_symmetric_key_nonce remote_nonce;
     struct cpn_symmetric_key_nonce local_nonce;
+
+    uint64_t txseq;
+    uint64_t rxseq;
+    uint64_t rxwindow;
+
+    bool nonblocking;
+    struct cpn_buf txbuf;
+    size_t txoff;
+    struct cpn_buf rxbuf;
+    struct cpn_buf rxmsg;
+    uint32_t rxlen;
+    bool rxstarted;
+
+    enum cpn_channel_io io;
+    struct cpn_uring *uring;
+    struct cpn_buf rxahead;
+    size_t rxaheadoff;
+    bool rxahead_only;
+
+    bool parallel;
+
+    cpn_channel_pending_fn pending_fn;
+    void (*pending_free)(void *payload);
+    void *pending_payload;
 };
 
 /** @brief Initialize a channel with a host and port
@@ -155,6 +286,29 @@ int cpn_channel_init_from_fd(struct cpn_channel *c,
         int fd, const struct sockaddr *addr, size_t addrlen,
         enum cpn_channel_type type);
 
+/** @brief Initialize a UDP channel from an already received datagram
+ *
+ * This function initializes a UDP channel just like
+ * `cpn_channel_init_from_fd`, but additionally seeds it with the
+ * contents of a datagram that has already been read from the
+ * file descriptor. Receiving on the channel will only ever
+ * return data contained in this datagram and fail as soon as it
+ * has been consumed, so that a peer cannot make the channel wait
+ * for further datagrams. Sending is not affected and goes to the
+ * given address.
+ *
+ * @param[out] c Pointer to an allocated channel to initialize.
+ * @param[in] fd Open UDP file descriptor to send replies on
+ * @param[in] addr Address the datagram has been received from
+ * @param[in] addrlen Length of the address
+ * @param[in] data Contents of the received datagram
+ * @param[in] len Length of the datagram
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_channel_init_from_datagram(struct cpn_channel *c,
+        int fd, const struct sockaddr *addr, size_t addrlen,
+        const uint8_t *data, size_t len);
+
 /** @brief Set block length used to split messages
  *
  * When sending a message of a certain length, the package may
@@ -166,7 +320,7 @@ int cpn_channel_init_from_fd(struct cpn_channel *c,
  * metadata, where the first block carries 4 bytes of total
  * length and each block contains a message authentication code
  * of 20 bytes. As such, the minimum block length is 21. The
- * maximum block length is fixed at 4096 bytes.
+ * maximum block length is fixed at 16384 bytes.
  *
  * @param[in] c Channel to set block length for
  * @param[in] len Length of a single block
@@ -174,6 +328,250 @@ int cpn_channel_init_from_fd(struct cpn_channel *c,
  */
 int cpn_channel_set_blocklen(struct cpn_channel *c, size_t len);
 
+/** @brief Set maximum frame length used to split messages
+ *
+ * When the channel uses frames, messages are split into frames
+ * which are at most `len` bytes long, excluding the four bytes
+ * of each frame's length prefix. Similar to blocks, the first
+ * frame carries 4 bytes of total length and each frame contains
+ * a message authentication code when encryption is enabled. As
+ * such, the minimum frame length is 21 bytes. The maximum frame
+ * length is fixed at 32768 bytes, which is also the default.
+ *
+ * Both sides have to use the same maximum frame length, as
+ * frames exceeding it are rejected by the receiving side.
+ *
+ * @param[in] c Channel to set frame length for
+ * @param[in] len Maximum length of a single frame
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_channel_set_framelen(struct cpn_channel *c, size_t len);
+
+/** @brief Set framing used to split messages
+ *
+ * Set wether the channel should use fixed-size blocks or
+ * variable-length frames to split messages. Frames are only
+ * supported on TCP channels. Both sides of the channel need to
+ * agree on the framing used.
+ *
+ * Datagrams are only supported on UDP channels. Each message is
+ * sent as a single datagram which is prefixed with its sequence
+ * number and which may not exceed the channel's maximum frame
+ * length. With encryption enabled, every datagram is sealed
+ * with a nonce derived from its sequence number, so that it can
+ * be opened independently of any datagrams lost before it.
+ * Datagrams failing authentication, and datagrams whose
+ * sequence number has already been seen or is too old for the
+ * replay window of 64 datagrams, are silently dropped by the
+ * receiving side. Replies are sent to the address of the last
+ * authenticated datagram, so that peers may roam. Without
+ * encryption, datagrams can neither be authenticated nor checked
+ * for replays and replies always go to the initial address.
+ * Datagrams are never compressed.
+ *
+ * @param[in] c Channel to set framing for
+ * @param[in] framing Framing to use
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_channel_set_framing(struct cpn_channel *c, enum cpn_channel_framing framing);
+
+/** @brief Set cipher used to encrypt data
+ *
+ * Set the cipher used when encryption is enabled on the channel.
+ * By default, channels use XSalsa20-Poly1305 as provided by
+ * secretbox. Both sides of the channel need to agree on the
+ * cipher, which is usually negotiated while establishing
+ * encryption.
+ *
+ * @param[in] c Channel to set cipher for
+ * @param[in] cipher Cipher to use
+ * @return <code>0</code> on success, <code>-1</code> if the
+ *         cipher is not available
+ */
+int cpn_channel_set_cipher(struct cpn_channel *c, enum cpn_symmetric_cipher cipher);
+
+/** @brief Set algorithm used to compress messages
+ *
+ * Set the algorithm used to compress messages before they are
+ * written to the channel and to decompress them after they have
+ * been received. By default, channels do not compress messages.
+ * Both sides of the channel need to agree on whether messages
+ * are compressed, which is usually negotiated while establishing
+ * encryption.
+ *
+ * @param[in] c Channel to set compression for
+ * @param[in] compression Compression algorithm to use
+ * @return <code>0</code> on success, <code>-1</code> if the
+ *         algorithm is not available
+ */
+int cpn_channel_set_compression(struct cpn_channel *c, enum cpn_compression compression);
+
+/** @brief Set level used to compress messages
+ *
+ * Set the level used to compress outgoing messages, ranging from
+ * <code>1</code> for fastest to `CPN_COMPRESSION_LEVEL_MAX` for
+ * best compression. The level is local to each side of the
+ * channel. A level of <code>0</code> disables compression,
+ * causing it to be neither offered nor accepted while
+ * establishing encryption.
+ *
+ * @param[in] c Channel to set compression level for
+ * @param[in] level Compression level to use
+ * @return <code>0</code> on success, <code>-1</code> if the
+ *         level is out of range
+ */
+int cpn_channel_set_compression_level(struct cpn_channel *c, int level);
+
+/** @brief Set maximum length of messages received into allocated buffers
+ *
+ * Messages received via `cpn_channel_receive_buf`,
+ * `cpn_channel_receive_stream` and `cpn_channel_receive_protobuf`
+ * are not bounded by a caller-provided buffer. To avoid remote
+ * parties announcing arbitrarily large messages, messages
+ * exceeding this length are rejected. The default maximum
+ * message length is 1MB.
+ *
+ * @param[in] c Channel to set maximum message length for
+ * @param[in] len Maximum length of received messages
+ * @return <code>0</code>
+ */
+int cpn_channel_set_maxmsglen(struct cpn_channel *c, uint32_t len);
+
+/** @brief Set number of blocks written with a single system call
+ *
+ * When writing messages on encrypted TCP channels, blocks are
+ * encrypted into a staging area first and then handed to the
+ * kernel in batches of up to `len` blocks. This reduces the
+ * number of system calls required for large messages. The
+ * batch is additionally bounded by a staging area of 64 kB, so
+ * large block lengths will result in smaller batches.
+ *
+ * Unencrypted TCP channels write the whole message with a
+ * single vectored write and UDP channels always send one block
+ * per datagram, so neither is affected by this setting. Frames
+ * are only bounded by the staging area.
+ *
+ * @param[in] c Channel to set batch length for
+ * @param[in] len Number of blocks to write at once. Has to be
+ *            in the range of 1 to 256.
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_channel_set_batchlen(struct cpn_channel *c, size_t len);
+
+/** @brief Switch channel between blocking and non-blocking mode
+ *
+ * In non-blocking mode, the channel's socket is set to
+ * non-blocking and writing and receiving data keeps state of
+ * partial operations with the channel instead of waiting for
+ * them to complete.
+ *
+ * Writing data seals the complete message and queues it with
+ * the channel before trying to write as much as possible. If
+ * not all data could be written, <code>CPN_CHANNEL_WOULD_BLOCK</code>
+ * is returned. The message is accepted nonetheless and the
+ * remaining data has to be written by calling
+ * `cpn_channel_flush` as soon as the socket becomes writable.
+ *
+ * Receiving data reads from the socket until either a complete
+ * message has been received or no more data is available. In
+ * the latter case, <code>CPN_CHANNEL_WOULD_BLOCK</code> is
+ * returned and the partial message is kept until the next
+ * call. As further messages may remain unread on the socket,
+ * callers using edge-triggered notifications need to keep
+ * receiving until <code>CPN_CHANNEL_WOULD_BLOCK</code> is
+ * returned.
+ *
+ * Non-blocking mode is only supported for TCP channels and for
+ * UDP channels using datagrams, which never keep partial
+ * messages. It is not possible to switch back to blocking mode
+ * while data is pending. As pending data is owned by the
+ * channel, channels in non-blocking mode must not be copied.
+ * Datagrams which cannot be sent immediately are dropped.
+ *
+ * @param[in] c Channel to set mode for
+ * @param[in] nonblocking Wether to enable non-blocking mode
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_channel_set_nonblocking(struct cpn_channel *c, bool nonblocking);
+
+/** @brief Determine whether an I/O backend is available
+ *
+ * Besides being built with liburing, io_uring requires support
+ * by the running kernel, which is checked by this function.
+ *
+ * @param[in] io I/O backend to check
+ * @return <code>true</code> if the backend can be used,
+ *         <code>false</code> otherwise
+ */
+bool cpn_channel_io_is_available(enum cpn_channel_io io);
+
+/** @brief Set I/O backend used to send and receive data
+ *
+ * Select whether data is sent and received with a system call
+ * per operation or batched via io_uring. io_uring is only
+ * supported on TCP channels and only used while the channel is
+ * in blocking mode. Switching a channel into non-blocking mode
+ * stops io_uring until it is switched back.
+ *
+ * As io_uring reads ahead, data may be buffered with the channel
+ * which is not visible on its file descriptor anymore. Callers
+ * waiting for the file descriptor to become readable thus need
+ * to check `cpn_channel_has_pending_input` first.
+ *
+ * Callers should fall back to system calls if this function
+ * fails, which is the default for new channels.
+ *
+ * @param[in] c Channel to set I/O backend for
+ * @param[in] io I/O backend to use
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_channel_set_io(struct cpn_channel *c, enum cpn_channel_io io);
+
+/** @brief Set whether large messages are encrypted in parallel
+ *
+ * Units of an encrypted message are independent of each other,
+ * as each unit's nonce is derived from the nonce of the
+ * message's first unit. Large messages are thus sealed and
+ * opened by a small pool of threads shared by all channels,
+ * which is started when first needed. The data on the wire is
+ * the same either way, so both sides may choose independently.
+ * This is enabled by default for TCP channels.
+ *
+ * @param[in] c Channel to set parallel encryption for
+ * @param[in] parallel Whether to encrypt large messages in
+ *            parallel
+ * @return <code>0</code> on success, <code>-1</code> if parallel
+ *         encryption is requested for a UDP channel
+ */
+int cpn_channel_set_parallel(struct cpn_channel *c, bool parallel);
+
+/** @brief Determine whether received data is buffered
+ *
+ * Blocking receives on TCP channels read ahead as much data as
+ * is available, so data of subsequent messages may be buffered
+ * with the channel after a message has been received. This data
+ * does not make the channel's file descriptor readable, so
+ * callers waiting for it to become readable need to check this
+ * function first.
+ *
+ * @param[in] c Channel to check
+ * @return <code>true</code> if the channel has buffered data
+ *         which has been received but not yet consumed,
+ *         <code>false</code> otherwise
+ */
+bool cpn_channel_has_pending_input(const struct cpn_channel *c);
+
+/** @brief Write pending data of a non-blocking channel
+ *
+ * Try to write all data queued with a non-blocking channel.
+ *
+ * @param[in] c Channel to flush
+ * @return <code>0</code> if all pending data has been written,
+ *         <code>CPN_CHANNEL_WOULD_BLOCK</code> if data is still
+ *         pending, <code>-1</code> otherwise
+ */
+int cpn_channel_flush(struct cpn_channel *c);
+
 /** @brief Close the file descriptor of the channel
  *
  * Close the file descriptor such that the channel cannot be used
@@ -184,6 +582,20 @@ int cpn_channel_set_blocklen(struct cpn_channel *c, size_t len);
  */
 int cpn_channel_close(struct cpn_channel *c);
 
+/** @brief Move a channel
+ *
+ * Hand over the connection and all state of a channel, including
+ * pending data, to another channel. The source channel is left
+ * without a file descriptor and must not be closed anymore.
+ * This is the only way to transfer channels in non-blocking
+ * mode, e.g. when handing them over to a thread which outlives
+ * the current owner.
+ *
+ * @param[out] dst Channel taking over the connection
+ * @param[in] src Channel to move
+ */
+void cpn_channel_move(struct cpn_channel *dst, struct cpn_channel *src);
+
 /** @brief Enable encryption for a channel
  *
  * Enable encryption for a channel with a given shared secret.
@@ -205,6 +617,67 @@ int cpn_channel_close(struct cpn_channel *c);
 int cpn_channel_enable_encryption(struct cpn_channel *c,
         const struct cpn_symmetric_key *key, enum cpn_channel_nonce nonce);
 
+/** @brief Enable encryption for a datagram channel
+ *
+ * Derive a key for the datagram channel from the key of an
+ * encrypted stream channel, e.g. the channel a session has been
+ * established on. Both sides derive the same key and take their
+ * nonces from the stream channel, so no further handshake is
+ * required. The datagram channel should use datagram framing.
+ *
+ * @param[out] c Channel to enable encryption for.
+ * @param[in] stream Encrypted channel to derive the key from.
+ * @return <code>0</code> on success, <code>-1</code> if the
+ *         stream channel is not encrypted
+ */
+int cpn_channel_enable_datagram_encryption(struct cpn_channel *c,
+        const struct cpn_channel *stream);
+
+/** @brief Update the key of an encrypted channel
+ *
+ * Data sent afterwards is encrypted with the new key. Received
+ * data is still decrypted with the previous key until the
+ * remote side has updated its key, too.
+ *
+ * @param[in] c Channel to update the key for. Encryption must
+ *            have been enabled.
+ * @param[in] key New key to use for encryption.
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_channel_update_key(struct cpn_channel *c,
+        const struct cpn_symmetric_key *key);
+
+/** @brief Set a callback to invoke before receiving
+ *
+ * The callback is invoked exactly once, right before the next
+ * message is received from the channel. This allows deferring
+ * work until the remote side's data is actually required, e.g.
+ * completing a handshake while already sending data.
+ *
+ * @param[in] c Channel to set the callback for.
+ * @param[in] fn Callback to invoke. It takes ownership of the
+ *            payload.
+ * @param[in] free_fn Function to free the payload if the channel
+ *            is closed without invoking the callback.
+ * @param[in] payload Payload passed to the callback.
+ */
+void cpn_channel_set_pending(struct cpn_channel *c,
+        cpn_channel_pending_fn fn, void (*free_fn)(void *payload),
+        void *payload);
+
+/** @brief Invoke the pending callback right away
+ *
+ * Invoke the callback set via `cpn_channel_set_pending` without
+ * waiting for the next message to be received, e.g. because
+ * data that follows must not be sent before the handshake has
+ * completed.
+ *
+ * @param[in] c Channel to invoke the callback for.
+ * @return <code>0</code> on success or if no callback is
+ *         pending, <code>-1</code> otherwise
+ */
+int cpn_channel_run_pending(struct cpn_channel *c);
+
 /** @brief Connect a channel
  *
  * Connect the channel with the initialized data. Note that this
@@ -225,7 +698,12 @@ int cpn_channel_connect(struct cpn_channel *c);
  * @param[in] c Channel to send data on.
  * @param[in] buf Data to send.
  * @param[in] len Length of data to send.
- * @return <code>0</code> on success, <code>-1</code> otherwise
+ * @return <code>0</code> on success, <code>-1</code> otherwise.
+ *         Non-blocking channels return
+ *         <code>CPN_CHANNEL_WOULD_BLOCK</code> if data is still
+ *         pending.
+ *
+ * \see cpn_channel_set_nonblocking
  */
 int cpn_channel_write_data(struct cpn_channel *c, uint8_t *buf, uint32_t len);
 
@@ -244,15 +722,60 @@ int cpn_channel_write_data(struct cpn_channel *c, uint8_t *buf, uint32_t len);
  * @param[out] buf Buffer to write data to.
  * @param[in] maxlen Maximum length of the buffer.
  * @return Length of the received data or <code>-1</code> on
- *         error
+ *         error. Non-blocking channels return
+ *         <code>CPN_CHANNEL_WOULD_BLOCK</code> if the message
+ *         has not been received completely.
+ *
+ * \see cpn_channel_set_nonblocking
  */
 ssize_t cpn_channel_receive_data(struct cpn_channel *c, uint8_t *buf, size_t maxlen);
 
+/** @brief Receive data from the channel into a growable buffer
+ *
+ * Receive a message and append it to the buffer. The buffer is
+ * grown to fit the complete message as soon as its length is
+ * known, so it is not limited to a fixed size. Messages
+ * exceeding the channel's maximum message length are rejected.
+ *
+ * @param[in] c Channel to receive data on.
+ * @param[out] buf Buffer to append received data to.
+ * @return Length of the received data or <code>-1</code> on
+ *         error
+ *
+ * \see cpn_channel_set_maxmsglen
+ */
+ssize_t cpn_channel_receive_buf(struct cpn_channel *c, struct cpn_buf *buf);
+
+/** @brief Receive data from the channel incrementally
+ *
+ * Receive a message and pass it to the callback block by block
+ * as soon as each block has been received and decrypted. This
+ * allows callers to process arbitrarily large messages without
+ * holding all of the message in memory. Messages exceeding the
+ * channel's maximum message length are rejected.
+ *
+ * Note that the callback is always invoked at least once, even
+ * for empty messages. If the callback aborts, the channel is
+ * left in the middle of a message and cannot be used anymore.
+ *
+ * @param[in] c Channel to receive data on.
+ * @param[in] fn Callback invoked for each chunk of data.
+ * @param[in] payload Payload passed to the callback.
+ * @return Length of the received data or <code>-1</code> on
+ *         error
+ *
+ * \see cpn_channel_set_maxmsglen
+ */
+ssize_t cpn_channel_receive_stream(struct cpn_channel *c,
+        cpn_channel_receive_fn fn, void *payload);
+
 /** @brief Write a protocol buffer to the channel
  *
  * Write the serialized representation of a protocol buffer
  * message to the channel. All semantics are the same as for
- * writing normal data.
+ * writing normal data. The message is serialized directly into
+ * the blocks written to the channel, so there is no limit on
+ * its size.
  *
  * @param[in] c Channel to write data to.
  * @param[in] msg Protobuf message to serialize and write.
@@ -270,7 +793,8 @@ int cpn_channel_write_protobuf(struct cpn_channel *c, const ProtobufCMessage *ms
  *
  * The received protobuf message will be newly allocated and
  * needs to be freed by the caller by calling the protobuf
- * message's <code>__free_unpacked</code> function.
+ * message's <code>__free_unpacked</code> function. Its size is
+ * bounded by the channel's maximum message length.
  *
  * @param[in] c Channel to receive protobuf message on.
  * @param[in] descr Descriptor of the protobuf message.
@@ -297,6 +821,12 @@ int cpn_channel_receive_protobuf(struct cpn_channel *c, const ProtobufCMessageDe
  * Data received on the channel will be written to the first file
  * descriptor specified.
  *
+ * The relay is serviced by a relay engine private to the calling
+ * thread, which returns as soon as the relay has finished. See
+ * `cpn_relay_await` to service relays of multiple threads with a
+ * single shared engine instead. Only TCP channels can be
+ * relayed.
+ *
  * @param[in] c Channel to relay data to/from.
  * @param[in] nfds Number of file descriptors following.
  * @param[in] fds File descriptors to relay data to/from. Only
@@ -21,7 +21,9 @@
 #include "capone/caps.h"
 #include "capone/channel.h"
 #include "capone/list.h"
+#include "capone/mux.h"
 #include "capone/server.h"
+#include "capone/ticket.h"
 
 #include "capone/crypto/symmetric.h"
 
@@ -111,6 +113,12 @@ void cpn_discovery_results_clear(struct cpn_discovery_results *results);
  *  3. establish an encrypted connection
  *  4. issue the connection type
  *
+ * The connection is kept alive by the server after a command
+ * has been handled, so the channel may be passed to multiple
+ * query, request and termination commands in sequence. Starting
+ * a session hands the channel over to the session, so it cannot
+ * be used for further commands afterwards.
+ *
  * @param[out] channel Channel to initialize and connect
  * @param[in] host Host to connect to
  * @param[in] port Port to connect to
@@ -125,6 +133,95 @@ int cpn_client_connect(struct cpn_channel *channel,
         const struct cpn_sign_keys *local_keys,
         const struct cpn_sign_pk *remote_key);
 
+/** @brief Initiate a new resumable connection to a service
+ *
+ * Initiate a new connection just like `cpn_client_connect`, but
+ * present the ticket to the server if it has been issued by the
+ * remote key. If the server accepts the ticket, the connection is
+ * established without asymmetric cryptography. Otherwise, a full
+ * handshake is performed and the ticket is replaced with the new
+ * one issued by the server, if any.
+ *
+ * @param[out] channel Channel to initialize and connect
+ * @param[in] host Host to connect to
+ * @param[in] port Port to connect to
+ * @param[in] local_keys Local long-term signature keys
+ * @param[in] remote_key Remote long-term signature key
+ * @param[in,out] ticket Ticket to present and store newly
+ *                issued tickets in. Should be cleared before
+ *                its first use.
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_client_connect_resumable(struct cpn_channel *channel,
+        const char *host,
+        uint32_t port,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        struct cpn_ticket *ticket);
+
+/** @brief Initiate a new connection in a single round trip
+ *
+ * Initiate a new connection just like `cpn_client_connect`, but
+ * without waiting for the server's response. Data written to the
+ * channel right after this function returns is encrypted with a
+ * key derived from the remote key and sent along with the
+ * handshake, such that the first command does not have to wait
+ * for an additional round trip. The server's response is
+ * verified as soon as the first message is received from the
+ * channel, after which the channel switches to a key providing
+ * forward secrecy.
+ *
+ * Data sent before the switch may be replayed by an attacker
+ * and is not protected against later compromise of the server's
+ * long-term key. Servers thus only accept queries, which are
+ * safe to repeat, before the switch. Any other command first
+ * receives the server's response and switches keys before
+ * being sent, costing the round trip that would have been
+ * saved. Only ciphers supported by every server are used, and
+ * neither compression nor multiplexing is negotiated.
+ *
+ * @param[out] channel Channel to initialize and connect
+ * @param[in] host Host to connect to
+ * @param[in] port Port to connect to
+ * @param[in] local_keys Local long-term signature keys
+ * @param[in] remote_key Remote long-term signature key
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_client_connect_ik(struct cpn_channel *channel,
+        const char *host,
+        uint32_t port,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key);
+
+/** @brief Initiate a new multiplexed connection to a server
+ *
+ * Initiate a new connection just like `cpn_client_connect`, but
+ * additionally negotiate multiplexing with the server and start
+ * multiplexing the channel. Streams opened on the multiplexer
+ * can then be passed to any of the functions below, such that
+ * multiple commands share the same connection and the cost of
+ * establishing it is only paid once.
+ *
+ * After all streams have been closed, the multiplexer has to be
+ * freed before closing the channel.
+ *
+ * @param[out] mux Multiplexer to initialize
+ * @param[out] channel Channel to initialize and connect
+ * @param[in] host Host to connect to
+ * @param[in] port Port to connect to
+ * @param[in] local_keys Local long-term signature keys
+ * @param[in] remote_key Remote long-term signature key
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ *
+ * \see cpn_mux_open
+ */
+int cpn_client_connect_mux(struct cpn_mux *mux,
+        struct cpn_channel *channel,
+        const char *host,
+        uint32_t port,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key);
+
 /** @brief Query a remote service for its parameters
  *
  * This function will start the protocol associated with querying
@@ -177,7 +274,8 @@ int cpn_client_request_session(uint32_t *sessionid,
  * actually handle its functionality.
  *
  * The channel has to be initialized with the connect connection
- * type.
+ * type. When the server has accepted the session, the channel
+ * is set up for the plugin via cpn_service_plugin_setup_channel.
  *
  * @param[out] out Session that was started
  * @param[in] channel Channel connected to the server
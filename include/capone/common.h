@@ -76,8 +76,12 @@ struct cpn_thread {
  * the function is running, otherwise the spawned thread will
  * dereference invalid data.
  *
+ * Threads spawned without a handle are detached, so they
+ * release their resources as soon as they return.
+ *
  * @param[out] t Thread handle that is being spawned. May be
- *             <code>NULL</code>.
+ *             <code>NULL</code>, in which case the thread cannot
+ *             be joined.
  * @param[in] fn Function to spawn.
  * @param[in] payload Payload that is passed to the function.
  * @return <code>0</code> on success, <code>-1</code> otherwise.
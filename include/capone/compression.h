@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \defgroup cpn-compression Compression
+ * \ingroup cpn-lib
+ *
+ * @brief Module for compressing messages
+ *
+ * Messages are compressed as a whole, each of them prefixed by a
+ * single byte identifying the algorithm it has been compressed
+ * with. Messages which are too small or do not shrink when being
+ * compressed are stored as-is, so that incompressible data only
+ * costs a single byte and no time for decompression.
+ *
+ * @{
+ */
+
+#ifndef CPN_LIB_COMPRESSION_H
+#define CPN_LIB_COMPRESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "capone/buf.h"
+
+/** @brief Default compression level */
+#define CPN_COMPRESSION_LEVEL_DEFAULT 1
+/** @brief Highest compression level */
+#define CPN_COMPRESSION_LEVEL_MAX 12
+
+/** @brief Algorithm used to compress data */
+enum cpn_compression {
+    /** Data is stored without compression */
+    CPN_COMPRESSION_NONE = 0,
+    /** LZ4, only available if built with liblz4 */
+    CPN_COMPRESSION_LZ4 = 1
+};
+
+/** @brief Determine whether a compression algorithm is available
+ *
+ * @param[in] compression Compression algorithm to check
+ * @return <code>true</code> if the algorithm can be used,
+ *         <code>false</code> otherwise
+ */
+bool cpn_compression_is_available(enum cpn_compression compression);
+
+/** @brief Get the name of a compression algorithm
+ *
+ * @param[in] compression Compression algorithm to get name for
+ * @return Name of the algorithm or <code>NULL</code> if it is
+ *         unknown
+ */
+const char *cpn_compression_to_string(enum cpn_compression compression);
+
+/** @brief Compress data
+ *
+ * Compress data and append the result to the buffer. The level
+ * ranges from <code>1</code>, which is the fastest, to
+ * `CPN_COMPRESSION_LEVEL_MAX`, which compresses best. Data which
+ * is not worth compressing is appended uncompressed, which
+ * enlarges it by a single byte.
+ *
+ * @param[out] out Buffer to append compressed data to
+ * @param[in] compression Compression algorithm to use
+ * @param[in] level Compression level to use
+ * @param[in] data Data to compress
+ * @param[in] len Length of data
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_compress(struct cpn_buf *out, enum cpn_compression compression,
+        int level, const uint8_t *data, size_t len);
+
+/** @brief Decompress data
+ *
+ * Decompress data previously compressed with `cpn_compress` and
+ * append the result to the buffer. Decompression fails without
+ * allocating memory for the data if the decompressed data would
+ * exceed `maxlen`.
+ *
+ * @param[out] out Buffer to append decompressed data to
+ * @param[in] data Data to decompress
+ * @param[in] len Length of data
+ * @param[in] maxlen Maximum length of decompressed data
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_decompress(struct cpn_buf *out, const uint8_t *data, size_t len, size_t maxlen);
+
+#endif
+
+/** @} */
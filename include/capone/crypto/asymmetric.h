@@ -22,6 +22,7 @@
 #include <stdint.h>
 
 #include "capone/proto/core.pb-c.h"
+#include "capone/crypto/sign.h"
 
 #define CPN_CRYPTO_ASYMMETRIC_SKBYTES 32
 #define CPN_CRYPTO_ASYMMETRIC_PKBYTES 32
@@ -67,4 +68,25 @@ int cpn_asymmetric_pk_from_proto(struct cpn_asymmetric_pk *out,
 int cpn_asymmetric_pk_to_proto(PublicKeyMessage **out,
         const struct cpn_asymmetric_pk *pk);
 
+/** @brief Convert a signature key pair to an encryption key pair
+ *
+ * This allows performing Diffie-Hellman with long-term
+ * identities, which are signature keys.
+ *
+ * @param[out] out Pointer to store encryption key pair at.
+ * @param[in] keys Signature key pair to convert.
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_asymmetric_keys_from_sign_keys(struct cpn_asymmetric_keys *out,
+        const struct cpn_sign_keys *keys);
+
+/** @brief Convert a public signature key to a public encryption key
+ *
+ * @param[out] out Pointer to store public encryption key at.
+ * @param[in] pk Public signature key to convert.
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_asymmetric_pk_from_sign_pk(struct cpn_asymmetric_pk *out,
+        const struct cpn_sign_pk *pk);
+
 #endif
@@ -51,6 +51,24 @@
 #include "capone/cfg.h"
 #include "capone/crypto/asymmetric.h"
 
+/** @brief Cipher used to encrypt/decrypt data
+ *
+ * All ciphers use keys of `CPN_CRYPTO_SYMMETRIC_KEYBYTES` and
+ * produce message authentication codes of
+ * `CPN_CRYPTO_SYMMETRIC_MACBYTES`, so they can be used
+ * interchangeably. AES-256-GCM only uses the first 12 bytes of
+ * the nonce and is only available on CPUs providing hardware
+ * acceleration for it.
+ */
+enum cpn_symmetric_cipher {
+    /** XSalsa20 with Poly1305 as provided by secretbox */
+    CPN_SYMMETRIC_CIPHER_SECRETBOX = 0,
+    /** XChaCha20 with Poly1305 as specified by the IETF */
+    CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305 = 1,
+    /** AES-256 in Galois/Counter mode */
+    CPN_SYMMETRIC_CIPHER_AES256GCM = 2
+};
+
 /** @brief Symmetric key used to encrypt/decrypt data */
 struct cpn_symmetric_key {
     uint8_t data[CPN_CRYPTO_SYMMETRIC_KEYBYTES];
@@ -120,16 +138,32 @@ int cpn_symmetric_key_hex_from_bin(struct cpn_symmetric_key_hex *out, const uint
  */
 void cpn_symmetric_key_hex_from_key(struct cpn_symmetric_key_hex *out, const struct cpn_symmetric_key *key);
 
+/** @brief Check whether a cipher is available
+ *
+ * @param[in] cipher Cipher to check
+ * @return <code>true</code> if the cipher can be used on this
+ *         machine, <code>false</code> otherwise
+ */
+bool cpn_symmetric_cipher_is_available(enum cpn_symmetric_cipher cipher);
+
+/** @brief Get a human readable name of a cipher
+ *
+ * @param[in] cipher Cipher to get name for
+ * @return Static string naming the cipher or <code>NULL</code>
+ *         if the cipher is unknown
+ */
+const char *cpn_symmetric_cipher_to_string(enum cpn_symmetric_cipher cipher);
+
 /** @brief Encrypt data
  *
- * Evaluate the message authentication tag and, if successful,
- * decrypt the ciphertext. Cipher and plaintext buffers may
- * overlap.
+ * Encrypt the plaintext and compute its message authentication
+ * tag. Cipher and plaintext buffers may overlap.
  *
  * @param[out] out Buffer to store encrypted data and message
  *             authentication at. Needs to be of size
  *             <code>datalen + CPN_CRYPTO_SYMMETRIC_MACBYTES</code>.
  * @param[in] key Key to encrypt with
+ * @param[in] cipher Cipher to encrypt with
  * @param[in] nonce Nonce to encrypt with
  * @param[in] data Data to encrypt
  * @param[in] datalen Length of data to encrypt
@@ -137,7 +171,8 @@ void cpn_symmetric_key_hex_from_key(struct cpn_symmetric_key_hex *out, const str
  * @retval -1 otherwise
  */
 int cpn_symmetric_key_encrypt(uint8_t *out, const struct cpn_symmetric_key *key,
-        const struct cpn_symmetric_key_nonce *nonce, uint8_t *data, size_t datalen);
+        enum cpn_symmetric_cipher cipher, const struct cpn_symmetric_key_nonce *nonce,
+        uint8_t *data, size_t datalen);
 
 /** @brief Decrypt data
  *
@@ -149,6 +184,7 @@ int cpn_symmetric_key_encrypt(uint8_t *out, const struct cpn_symmetric_key *key,
  *            of size <code>datalen -
  *            CPN_CRYPTO_SYMMETRIC_MACBYTES</code>.
  * @param[in] key Key to decrypt with
+ * @param[in] cipher Cipher to decrypt with
  * @param[in] nonce Nonce to decrypt with
  * @param[in] data Data to decrypt
  * @param[in] datalen Length of data to decrypt
@@ -156,7 +192,8 @@ int cpn_symmetric_key_encrypt(uint8_t *out, const struct cpn_symmetric_key *key,
  * @retval -1 otherwise
  */
 int cpn_symmetric_key_decrypt(uint8_t *out, const struct cpn_symmetric_key *key,
-        const struct cpn_symmetric_key_nonce *nonce, uint8_t *data, size_t datalen);
+        enum cpn_symmetric_cipher cipher, const struct cpn_symmetric_key_nonce *nonce,
+        uint8_t *data, size_t datalen);
 
 /** @brief Increment nonce by `count` */
 void cpn_symmetric_key_nonce_increment(struct cpn_symmetric_key_nonce *nonce, size_t count);
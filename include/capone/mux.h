@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * \defgroup cpn-mux Multiplexer
+ * \ingroup cpn-lib
+ *
+ * @brief Module multiplexing logical streams over a channel
+ *
+ * A multiplexer carries an arbitrary number of concurrent
+ * logical streams over a single channel, such that multiple
+ * commands can be exchanged with a remote party while only
+ * establishing the connection and its encryption once.
+ *
+ * Each stream is handed out to the caller as a channel of its
+ * own, which can be used with all of the usual channel
+ * functions, including relays. Data written to a stream is
+ * forwarded by the multiplexer in frames tagged with the
+ * stream's identifier. Streams opened by the client side have
+ * odd identifiers, streams opened by the server side have even
+ * ones, such that both sides may open streams at the same time.
+ * A stream is opened implicitly with its first frame and
+ * announced to the remote side's `cpn_mux_accept`. The number of
+ * streams the remote side may have open at the same time is
+ * limited. Streams exceeding the limit are closed right away,
+ * so that their channels only receive end of file.
+ *
+ * Flow control is handled per stream. Each side may only send
+ * as much data on a stream as the receiving side has granted,
+ * and the receiving side only grants more as soon as the
+ * stream's consumer has picked up the data. Like this, a stream
+ * whose consumer stalls does not hold up any other stream.
+ *
+ * Closing a stream's channel signals end of file to the remote
+ * side of the stream after all data written to it has been
+ * delivered. When the underlying channel gets closed, all
+ * streams are closed as well.
+ *
+ * @{
+ */
+
+#ifndef CPN_LIB_MUX_H
+#define CPN_LIB_MUX_H
+
+#include <pthread.h>
+
+#include "capone/channel.h"
+#include "capone/common.h"
+#include "capone/list.h"
+
+/** @brief Side of the connection the multiplexer is running on */
+enum cpn_mux_role {
+    /** Open streams with odd identifiers */
+    CPN_MUX_ROLE_CLIENT,
+    /** Open streams with even identifiers */
+    CPN_MUX_ROLE_SERVER
+};
+
+/** @brief Multiplexer servicing streams of a single channel */
+struct cpn_mux {
+    struct cpn_channel *channel;
+    enum cpn_mux_role role;
+    uint32_t next_id;
+
+    /** Pipe used to wake up the multiplexer when opening streams */
+    int wakefds[2];
+    /** Pipe signalling accepted streams and closing of the channel */
+    int acceptfds[2];
+    struct cpn_thread thread;
+
+    /** Mutex protecting pending and accepted streams as well as
+     * the stop and close flags */
+    pthread_mutex_t mutex;
+    /** Condition signalled when streams have been accepted or
+     * the channel has been closed */
+    pthread_cond_t cond;
+    /** Streams opened locally, not yet picked up by the thread */
+    struct cpn_list pending;
+    /** Streams opened remotely, not yet accepted */
+    struct cpn_list accepted;
+    bool stopping;
+    bool closed;
+
+    /** Streams currently serviced by the multiplexer thread */
+    struct cpn_list streams;
+    /** Number of serviced streams opened by the remote side */
+    unsigned nremote;
+    struct cpn_buf rxframe;
+    uint8_t *txframe;
+};
+
+/** @brief Start multiplexing a channel
+ *
+ * Start a thread servicing streams on the given channel. The
+ * channel has to be connected and is switched into non-blocking
+ * mode. It must not be used by the caller until the multiplexer
+ * has been freed. Only TCP channels can be multiplexed.
+ *
+ * @param[out] mux Multiplexer to initialize
+ * @param[in] channel Channel to multiplex
+ * @param[in] role Side of the connection
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_mux_init(struct cpn_mux *mux, struct cpn_channel *channel,
+        enum cpn_mux_role role);
+
+/** @brief Stop multiplexing a channel
+ *
+ * Stop the multiplexer's thread and free all associated
+ * resources. Streams that are still open are closed on the
+ * multiplexer's side, but their channels still have to be
+ * closed by their owners. Frames which have been queued already
+ * are flushed to the underlying channel before it is left in
+ * non-blocking mode. It is not closed, but may not be used for
+ * anything else than closing it anymore.
+ *
+ * @param[in] mux Multiplexer to free
+ */
+void cpn_mux_free(struct cpn_mux *mux);
+
+/** @brief Open a new stream
+ *
+ * Initialize a channel for a new stream. The remote side
+ * learns about the stream as soon as the first data has been
+ * written to it. This function may be called from any thread.
+ *
+ * @param[in] mux Multiplexer to open the stream on
+ * @param[out] stream Channel to initialize for the stream
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_mux_open(struct cpn_mux *mux, struct cpn_channel *stream);
+
+/** @brief Accept a stream opened by the remote side
+ *
+ * Wait until the remote side has opened a new stream and
+ * initialize a channel for it. This function may be called
+ * from any thread.
+ *
+ * @param[in] mux Multiplexer to accept the stream on
+ * @param[out] stream Channel to initialize for the stream
+ * @return <code>0</code> on success, <code>-1</code> if the
+ *         channel has been closed or an error occurred
+ */
+int cpn_mux_accept(struct cpn_mux *mux, struct cpn_channel *stream);
+
+/** @brief Get a file descriptor signalling accepted streams
+ *
+ * The returned file descriptor becomes readable as soon as the
+ * remote side has opened a stream or the channel has been
+ * closed. It stays readable until `cpn_mux_try_accept` has
+ * reported that no stream is left, so it can be waited for with
+ * level-triggered polling, e.g. via a reactor. The file
+ * descriptor is owned by the multiplexer.
+ *
+ * @param[in] mux Multiplexer to get the file descriptor for
+ * @return File descriptor signalling accepted streams
+ */
+int cpn_mux_accept_fd(const struct cpn_mux *mux);
+
+/** @brief Accept a stream opened by the remote side if any
+ *
+ * Accept a stream like `cpn_mux_accept`, but return right away
+ * if the remote side has not opened any stream. This function
+ * may be called from any thread.
+ *
+ * @param[in] mux Multiplexer to accept the stream on
+ * @param[out] stream Channel to initialize for the stream
+ * @return <code>0</code> on success,
+ *         <code>CPN_CHANNEL_WOULD_BLOCK</code> if no stream has
+ *         been opened, <code>-1</code> if the channel has been
+ *         closed or an error occurred
+ */
+int cpn_mux_try_accept(struct cpn_mux *mux, struct cpn_channel *stream);
+
+#endif
+
+/** @} */
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * \defgroup cpn-pool Worker pool
+ * \ingroup cpn-lib
+ *
+ * @brief Module providing a bounded pool of worker threads
+ *
+ * Instead of spawning a new thread for every job, jobs are
+ * submitted to a queue which is processed by a fixed number of
+ * worker threads. The queue is bounded, such that bursts of jobs
+ * can neither exhaust memory nor threads. Submitting a job to a
+ * full queue fails and leaves it to the caller to reject the job.
+ *
+ * Jobs may additionally be associated with a limit, which bounds
+ * the number of jobs sharing the limit that are run
+ * concurrently. Jobs exceeding their limit stay queued until
+ * another job of the same limit has finished, while jobs
+ * queued after them may already be run. Limits also carry a
+ * priority: among all runnable jobs, the one with the highest
+ * priority is run first.
+ *
+ * To detect overload, the pool tracks how long jobs wait in the
+ * queue before being run, in the style of CoDel. Once this
+ * sojourn time has stayed above a target for a whole interval,
+ * the pool stops admitting jobs of the lowest priority. Every
+ * further interval above the target raises the priority required
+ * to be admitted by one, until the sojourn time falls below the
+ * target again. Jobs of the highest priority are never shed.
+ * Only jobs which could be run right away count towards the
+ * sojourn time, as jobs held back by their limit wait for their
+ * own limit instead of the pool. Callers check admission before
+ * doing any work for a new job, so that it can be shed early
+ * and cheaply.
+ *
+ * @{
+ */
+
+#ifndef CPN_LIB_POOL_H
+#define CPN_LIB_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "capone/common.h"
+#include "capone/list.h"
+
+/** @brief Limit of concurrently running jobs
+ *
+ * A limit may be shared by multiple jobs and is only accessed
+ * by the pool while holding its lock.
+ */
+struct cpn_pool_limit {
+    /** Maximum number of concurrent jobs, <code>0</code> for
+     * no limit */
+    size_t max;
+    /** Number of jobs currently running */
+    size_t active;
+    /** Priority of jobs sharing the limit. Higher values take
+     * precedence. */
+    uint32_t priority;
+};
+
+/** @brief Statistics of a worker pool */
+struct cpn_pool_stats {
+    /** Number of jobs currently queued */
+    size_t queued;
+    /** Maximum number of jobs that have been queued at once */
+    size_t max_queued;
+    /** Number of jobs currently running */
+    size_t active;
+    /** Number of jobs that have finished */
+    uint64_t completed;
+    /** Number of jobs rejected due to a full queue */
+    uint64_t rejected;
+    /** Number of jobs not admitted due to overload */
+    uint64_t shed;
+    /** Milliseconds the oldest job has most recently been found
+     * waiting in the queue */
+    uint64_t sojourn;
+    /** Minimum priority jobs currently need to be admitted */
+    uint32_t min_priority;
+};
+
+/** @brief A pool of worker threads */
+struct cpn_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct cpn_thread *threads;
+    size_t nthreads;
+
+    struct cpn_list queue;
+    size_t maxqueue;
+    bool stopping;
+
+    uint64_t target;
+    uint64_t interval;
+    uint64_t deadline;
+    uint32_t max_priority;
+
+    struct cpn_pool_stats stats;
+};
+
+/** @brief Initialize a worker pool
+ *
+ * Initialize the pool and start its worker threads. The pool
+ * has to be freed with `cpn_pool_free` after use.
+ *
+ * @param[out] pool Pool to initialize
+ * @param[in] nthreads Number of worker threads to start
+ * @param[in] maxqueue Maximum number of queued jobs
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_pool_init(struct cpn_pool *pool, size_t nthreads, size_t maxqueue);
+
+/** @brief Stop and free a worker pool
+ *
+ * All jobs still queued are run before the worker threads stop.
+ * This function waits for all of them to finish.
+ *
+ * @param[in] pool Pool to free
+ */
+void cpn_pool_free(struct cpn_pool *pool);
+
+/** @brief Submit a job to the worker pool
+ *
+ * Queue a job which is run as soon as a worker thread is
+ * available and the job's limit allows it. The payload needs
+ * to be available until the job has finished. If the job
+ * could not be queued, the caller retains ownership of the
+ * payload.
+ *
+ * @param[in] pool Pool to submit the job to
+ * @param[in] limit Limit of concurrent jobs the job counts
+ *            against. May be <code>NULL</code>.
+ * @param[in] fn Function to run
+ * @param[in] payload Payload passed to the function
+ * @return <code>0</code> on success, <code>-1</code> if the
+ *         queue is full or the pool is stopping
+ */
+int cpn_pool_submit(struct cpn_pool *pool, struct cpn_pool_limit *limit,
+        thread_fn fn, void *payload);
+
+/** @brief Set the sojourn time target of a worker pool
+ *
+ * Enable admission control for the pool. Jobs are shed as soon
+ * as the sojourn time of queued jobs has stayed above the target
+ * for a whole interval.
+ *
+ * @param[in] pool Pool to set the target for
+ * @param[in] target Target sojourn time in milliseconds or
+ *            <code>0</code> to admit all jobs
+ * @param[in] interval Interval in milliseconds the sojourn time
+ *            needs to stay above the target
+ * @param[in] max_priority Highest priority of jobs submitted to
+ *            the pool. Jobs of this priority are never shed.
+ */
+void cpn_pool_set_target(struct cpn_pool *pool, uint64_t target, uint64_t interval,
+        uint32_t max_priority);
+
+/** @brief Check whether a job would be admitted
+ *
+ * Check whether the pool is currently able to handle a new job
+ * of the given limit's priority in time. Jobs which are not
+ * admitted are counted as shed, and the caller should refuse
+ * them before doing any further work.
+ *
+ * @param[in] pool Pool to check admission for
+ * @param[in] limit Limit of the new job. May be
+ *            <code>NULL</code>, in which case the lowest
+ *            priority is assumed.
+ * @return <code>true</code> if the job should be submitted,
+ *         <code>false</code> if it should be shed
+ */
+bool cpn_pool_admits(struct cpn_pool *pool, const struct cpn_pool_limit *limit);
+
+/** @brief Get statistics of a worker pool
+ *
+ * @param[out] out Statistics of the pool
+ * @param[in] pool Pool to get statistics for
+ */
+void cpn_pool_get_stats(struct cpn_pool_stats *out, struct cpn_pool *pool);
+
+#endif
+
+/** @} */
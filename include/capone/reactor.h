@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * \defgroup cpn-reactor Reactor
+ * \ingroup cpn-lib
+ *
+ * @brief Module dispatching readiness of file descriptors
+ *
+ * A reactor waits for any number of registered file descriptors
+ * to become readable and invokes the callback registered for
+ * each of them. It uses epoll where available and poll
+ * otherwise, so it is not bound to `FD_SETSIZE`.
+ *
+ * File descriptors may either be registered edge-triggered or
+ * level-triggered. Callbacks of edge-triggered file descriptors
+ * are only invoked when new data arrives, so they have to
+ * consume all data until the file descriptor would block. This
+ * is most useful for non-blocking listening sockets, where the
+ * callback accepts connections until none are pending anymore.
+ *
+ * Registering and removing file descriptors is possible from any
+ * thread, also while the reactor is running. Other threads wake
+ * up the reactor by signalling an eventfd, or a pipe where
+ * eventfds are not available. A periodic timer may additionally
+ * be set up for housekeeping, which is driven by a timerfd where
+ * available. One-shot timeouts may be added for any number of
+ * callbacks, e.g. to bound the time spent waiting for a file
+ * descriptor.
+ *
+ * @{
+ */
+
+#ifndef CPN_LIB_REACTOR_H
+#define CPN_LIB_REACTOR_H
+
+#include <stdbool.h>
+
+#include "capone/common.h"
+#include "capone/list.h"
+
+/** @brief Callback invoked for ready file descriptors
+ *
+ * @param[in] fd File descriptor which has become readable or
+ *            writable
+ * @param[in] payload Payload passed in when registering the
+ *            file descriptor
+ */
+typedef void (*cpn_reactor_fn)(int fd, void *payload);
+
+/** @brief Callback invoked when the timer expires
+ *
+ * @param[in] payload Payload passed in when setting the timer
+ */
+typedef void (*cpn_reactor_timer_fn)(void *payload);
+
+/** @brief Reactor dispatching readiness of file descriptors */
+struct cpn_reactor {
+    /** epoll file descriptor, <code>-1</code> when using poll */
+    int fd;
+    /** File descriptors used to wake up the reactor. Both refer
+     * to the same eventfd if available. */
+    int wakefds[2];
+    /** timerfd driving the timer, <code>-1</code> if not
+     * available */
+    int timerfd;
+
+    /** Mutex protecting handlers, timer and the stop flag */
+    pthread_mutex_t mutex;
+    /** Registered file descriptors */
+    struct cpn_list handlers;
+    bool stopping;
+
+    unsigned interval;
+    cpn_reactor_timer_fn timer_fn;
+    void *timer_payload;
+    /** Next expiry of the timer if there is no timerfd */
+    uint64_t next_tick;
+
+    /** Pending one-shot timeouts */
+    struct cpn_list timeouts;
+};
+
+/** @brief Initialize a reactor
+ *
+ * @param[out] reactor Reactor to initialize
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_reactor_init(struct cpn_reactor *reactor);
+
+/** @brief Free a reactor
+ *
+ * Free all resources associated with the reactor. The reactor
+ * must not be running anymore. Registered file descriptors are
+ * not closed.
+ *
+ * @param[in] reactor Reactor to free
+ */
+void cpn_reactor_free(struct cpn_reactor *reactor);
+
+/** @brief Register a file descriptor with the reactor
+ *
+ * Invoke the callback whenever the file descriptor becomes
+ * readable. Each file descriptor may only be registered once.
+ *
+ * @param[in] reactor Reactor to register the file descriptor
+ *            with
+ * @param[in] fd File descriptor to wait for
+ * @param[in] edge Whether to only invoke the callback when new
+ *            data arrives. The file descriptor should be
+ *            non-blocking in that case.
+ * @param[in] fn Callback invoked by the thread running the
+ *            reactor
+ * @param[in] payload Payload passed to the callback
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_reactor_add(struct cpn_reactor *reactor, int fd, bool edge,
+        cpn_reactor_fn fn, void *payload);
+
+/** @brief Register a file descriptor waiting to become writable
+ *
+ * Invoke the callback whenever the file descriptor becomes
+ * writable, e.g. to flush data which could not be written
+ * without blocking. The file descriptor is level-triggered and
+ * should be removed as soon as no more data is pending. As with
+ * `cpn_reactor_add`, each file descriptor may only be registered
+ * once, so it is not possible to wait for both readability and
+ * writability at the same time.
+ *
+ * @param[in] reactor Reactor to register the file descriptor
+ *            with
+ * @param[in] fd File descriptor to wait for
+ * @param[in] fn Callback invoked by the thread running the
+ *            reactor
+ * @param[in] payload Payload passed to the callback
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_reactor_add_writable(struct cpn_reactor *reactor, int fd,
+        cpn_reactor_fn fn, void *payload);
+
+/** @brief Remove a file descriptor from the reactor
+ *
+ * The callback is not invoked anymore after this function has
+ * returned, except if it is already running in the reactor's
+ * thread while another thread removes the file descriptor.
+ *
+ * @param[in] reactor Reactor to remove the file descriptor from
+ * @param[in] fd File descriptor to remove
+ * @return <code>0</code> on success, <code>-1</code> if the file
+ *         descriptor is not registered
+ */
+int cpn_reactor_remove(struct cpn_reactor *reactor, int fd);
+
+/** @brief Set up a periodic timer
+ *
+ * Invoke the callback periodically, e.g. for housekeeping. A
+ * previously set timer is replaced.
+ *
+ * @param[in] reactor Reactor to set the timer for
+ * @param[in] interval Interval in milliseconds. A value of
+ *            <code>0</code> disables the timer.
+ * @param[in] fn Callback invoked by the thread running the
+ *            reactor
+ * @param[in] payload Payload passed to the callback
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_reactor_set_timer(struct cpn_reactor *reactor, unsigned interval,
+        cpn_reactor_timer_fn fn, void *payload);
+
+/** @brief Add a one-shot timeout
+ *
+ * Invoke the callback once after the given time has passed.
+ * Timeouts are identified by their callback and payload, which
+ * are used to remove them again.
+ *
+ * @param[in] reactor Reactor to add the timeout to
+ * @param[in] timeout Time in milliseconds until the callback is
+ *            invoked
+ * @param[in] fn Callback invoked by the thread running the
+ *            reactor
+ * @param[in] payload Payload passed to the callback
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_reactor_add_timeout(struct cpn_reactor *reactor, unsigned timeout,
+        cpn_reactor_timer_fn fn, void *payload);
+
+/** @brief Remove a one-shot timeout
+ *
+ * Remove a timeout which has been added with the same callback
+ * and payload. Failing to remove a timeout means that it has
+ * expired already, in which case its callback is either running
+ * or has run already.
+ *
+ * @param[in] reactor Reactor to remove the timeout from
+ * @param[in] fn Callback of the timeout
+ * @param[in] payload Payload of the timeout
+ * @return <code>0</code> on success, <code>-1</code> if no such
+ *         timeout is pending
+ */
+int cpn_reactor_remove_timeout(struct cpn_reactor *reactor,
+        cpn_reactor_timer_fn fn, void *payload);
+
+/** @brief Run the reactor
+ *
+ * Dispatch events until `cpn_reactor_stop` is called.
+ *
+ * @param[in] reactor Reactor to run
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_reactor_run(struct cpn_reactor *reactor);
+
+/** @brief Stop a running reactor
+ *
+ * Ask the reactor to return from `cpn_reactor_run`. May be
+ * called from any thread. The reactor stops after having
+ * dispatched the current batch of events.
+ *
+ * @param[in] reactor Reactor to stop
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_reactor_stop(struct cpn_reactor *reactor);
+
+#endif
+
+/** @} */
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \defgroup cpn-relay Relay
+ * \ingroup cpn-lib
+ *
+ * @brief Module relaying data between channels and file descriptors
+ *
+ * A relay engine services an arbitrary number of relays with a
+ * single thread. Each relay forwards data received on a channel
+ * to a file descriptor and data read from one or more file
+ * descriptors to the channel. The engine waits for readiness of
+ * all involved file descriptors at once, using epoll where
+ * available and poll otherwise, so it is not bound to
+ * `FD_SETSIZE`.
+ *
+ * Readiness is tracked per direction and each direction has a
+ * bounded buffer of its own. The engine keeps on reading from
+ * the channel until data pending to be written to the file
+ * descriptor exceeds a high watermark, and it keeps on reading
+ * from the file descriptors until data pending to be written to
+ * the channel does. Reading resumes as soon as the respective
+ * buffer has drained below a low watermark. Like this, a slow
+ * consumer on one side only throttles the producer feeding it,
+ * while the opposite direction and other relays keep flowing.
+ *
+ * Channels without encryption are relayed with `splice` where
+ * available and all file descriptors are sockets or pipes. Only
+ * the framing is handled in user space, while the payload is
+ * moved between the file descriptors by the kernel. All other
+ * relays copy data through user-space buffers.
+ *
+ * A relay finishes with <code>0</code> as soon as all file
+ * descriptors have been closed and all of their data has been
+ * written to the channel. It finishes with <code>-1</code> when
+ * the channel gets closed or an error occurs.
+ *
+ * @{
+ */
+
+#ifndef CPN_LIB_RELAY_H
+#define CPN_LIB_RELAY_H
+
+#include "capone/channel.h"
+#include "capone/common.h"
+#include "capone/list.h"
+
+/** @brief Callback invoked when a relay has finished
+ *
+ * @param[in] result <code>0</code> if all file descriptors have
+ *            been closed, <code>-1</code> if the channel has
+ *            been closed or an error occurred
+ * @param[in] payload Payload passed in when adding the relay
+ */
+typedef void (*cpn_relay_done_fn)(int result, void *payload);
+
+/** @brief Engine servicing multiple relays */
+struct cpn_relay {
+    /** epoll file descriptor, <code>-1</code> when using poll */
+    int fd;
+    /** Pipe used to wake up the engine when adding relays */
+    int wakefds[2];
+
+    /** Mutex protecting pending relays and the stop flag */
+    pthread_mutex_t mutex;
+    /** Relays added but not yet picked up by the engine */
+    struct cpn_list pending;
+    /** Relays currently serviced by the engine */
+    struct cpn_list active;
+    bool stopping;
+};
+
+/** @brief Initialize a relay engine
+ *
+ * @param[out] relay Relay engine to initialize
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_relay_init(struct cpn_relay *relay);
+
+/** @brief Free a relay engine
+ *
+ * Free all resources associated with the relay engine. The
+ * engine must not be running anymore. Relays which have not yet
+ * finished are aborted without invoking their callbacks.
+ *
+ * @param[in] relay Relay engine to free
+ */
+void cpn_relay_free(struct cpn_relay *relay);
+
+/** @brief Add a relay to the engine
+ *
+ * Register a new relay between the channel and the given file
+ * descriptors. Data received on the channel is written to the
+ * first file descriptor, data read from any of the file
+ * descriptors is written to the channel. This function may be
+ * called from any thread, also while the engine is running.
+ *
+ * The channel is switched into non-blocking mode while it is
+ * being relayed, and so is the first file descriptor. Both are
+ * reset when the relay finishes, right before the callback is
+ * invoked. Neither the channel nor the file descriptors may be
+ * used by the caller until then. Only TCP channels can be
+ * relayed.
+ *
+ * @param[in] relay Relay engine to add relay to
+ * @param[in] channel Channel to relay
+ * @param[in] fds File descriptors to relay
+ * @param[in] nfds Number of file descriptors
+ * @param[in] fn Callback invoked when the relay has finished.
+ *            Invoked by the thread running the engine.
+ * @param[in] payload Payload passed to the callback
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_relay_add(struct cpn_relay *relay, struct cpn_channel *channel,
+        const int *fds, int nfds, cpn_relay_done_fn fn, void *payload);
+
+/** @brief Run the relay engine
+ *
+ * Service all relays registered with the engine until either
+ * `cpn_relay_stop` is called or, if `until_idle` is set, no
+ * relays remain.
+ *
+ * @param[in] relay Relay engine to run
+ * @param[in] until_idle Whether to return as soon as all relays
+ *            have finished
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_relay_run(struct cpn_relay *relay, bool until_idle);
+
+/** @brief Stop a running relay engine
+ *
+ * Ask the engine to return from `cpn_relay_run`. The engine
+ * will stop after having serviced the current batch of events.
+ *
+ * @param[in] relay Relay engine to stop
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_relay_stop(struct cpn_relay *relay);
+
+/** @brief Relay a channel with the shared relay engine
+ *
+ * Register a relay with a process-wide relay engine which is
+ * serviced by a single background thread and wait for the relay
+ * to finish. The calling thread sleeps without handling any I/O
+ * while all relays of the process are serviced by the engine.
+ *
+ * @param[in] channel Channel to relay
+ * @param[in] fds File descriptors to relay
+ * @param[in] nfds Number of file descriptors
+ * @return <code>0</code> if all file descriptors have been
+ *         closed, <code>-1</code> otherwise
+ */
+int cpn_relay_await(struct cpn_channel *channel, const int *fds, int nfds);
+
+/** @brief Relay a channel in the background
+ *
+ * Register a relay with the process-wide relay engine and return
+ * right away instead of waiting for it to finish. The relay takes
+ * over the channel and the file descriptors, which are closed
+ * when it finishes, right before the callback is invoked. The
+ * channel is moved into the relay, so the caller's channel is
+ * left without a file descriptor. Like this, service handlers do
+ * not need to keep a thread around for the whole session.
+ *
+ * If registering the relay fails, neither the channel nor the
+ * file descriptors are taken over.
+ *
+ * @param[in] channel Channel to relay
+ * @param[in] fds File descriptors to relay
+ * @param[in] nfds Number of file descriptors
+ * @param[in] fn Callback invoked when the relay has finished, or
+ *            <code>NULL</code>. Invoked by the engine's thread.
+ * @param[in] payload Payload passed to the callback
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ *
+ * \see cpn_channel_move
+ */
+int cpn_relay_detach(struct cpn_channel *channel, const int *fds, int nfds,
+        cpn_relay_done_fn fn, void *payload);
+
+#endif
+
+/** @} */
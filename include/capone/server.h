@@ -42,8 +42,13 @@
 
 #include "capone/caps.h"
 #include "capone/channel.h"
+#include "capone/pool.h"
+#include "capone/reactor.h"
 #include "capone/service.h"
 
+/** @brief Maximum length of handshake cookies */
+#define CPN_SERVER_COOKIE_MAXLEN 64
+
 /** @brief Connection types specifying the end point
  *
  * These types specify the different protocol end points of a
@@ -73,6 +78,25 @@ enum cpn_command {
 int cpn_server_await_command(enum cpn_command *out,
         struct cpn_channel *channel);
 
+/** @brief Receive a further command on a persistent connection
+ *
+ * Clients may issue multiple commands one after another on the
+ * same connection, such that encryption only needs to be
+ * established once. After a command has been handled, this
+ * function waits for the client to issue its next command. It
+ * fails without logging an error if the client closes the
+ * connection or does not issue another command within the
+ * given timeout.
+ *
+ * @param[out] out Connection type requested by the client
+ * @param[in] channel Channel connected to the client
+ * @param[in] timeout Time in milliseconds to wait for the next
+ *            command, or <code>-1</code> to wait indefinitely
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_server_await_next_command(enum cpn_command *out,
+        struct cpn_channel *channel, int timeout);
+
 /** @brief Await encryption initiated by the client
  *
  * Wait for the client to start the encryption protocol. This
@@ -89,6 +113,94 @@ int cpn_server_await_encryption(struct cpn_channel *channel,
         const struct cpn_sign_keys *sign_keys,
         struct cpn_sign_pk *remote_sign_key);
 
+/** @brief Set the load above which handshakes require cookies
+ *
+ * Asynchronous handshakes ask clients supporting cookies to
+ * prove their reachability first whenever the number of jobs
+ * queued in the handshake's pool reaches the threshold. The
+ * cookie is a cheap keyed hash over the client's address and
+ * keys, so that floods of initiations do not cause any
+ * asymmetric operations until the client has answered it.
+ * Handshakes of clients not supporting cookies, including all
+ * one-round-trip handshakes, are refused while the threshold
+ * is reached.
+ *
+ * @param[in] queued Number of queued jobs at which cookies are
+ *            required or <code>0</code> to never require them
+ */
+void cpn_server_set_cookie_threshold(size_t queued);
+
+/** @brief Set the time clients may take for a handshake
+ *
+ * Asynchronous handshakes fail if the client has not finished
+ * the handshake within the given time after it has been started,
+ * so that clients cannot keep handshakes pending indefinitely.
+ *
+ * @param[in] timeout Timeout in milliseconds or <code>0</code>
+ *            to let handshakes wait indefinitely
+ */
+void cpn_server_set_handshake_timeout(unsigned timeout);
+
+/** @brief Set the maximum number of pending handshakes
+ *
+ * Starting an asynchronous handshake fails while the given number
+ * of handshakes is still pending, such that the memory used by
+ * them stays bounded.
+ *
+ * @param[in] max Maximum number of pending handshakes or
+ *            <code>0</code> to not limit them
+ */
+void cpn_server_set_max_handshakes(size_t max);
+
+/** @brief Callback invoked when an asynchronous handshake is done
+ *
+ * @param[in] channel Channel the handshake has been performed on
+ * @param[in] remote_sign_key Remote long-term signature key if
+ *            the handshake succeeded, <code>NULL</code>
+ *            otherwise. It is only valid during the callback.
+ * @param[in] result <code>0</code> if encryption has been
+ *            established, <code>-1</code> otherwise
+ * @param[in] payload Payload passed in when starting the
+ *            handshake
+ */
+typedef void (*cpn_server_handshake_fn)(struct cpn_channel *channel,
+        const struct cpn_sign_pk *remote_sign_key, int result, void *payload);
+
+/** @brief Await encryption initiated by the client asynchronously
+ *
+ * Perform the same handshake as `cpn_server_await_encryption`
+ * without blocking the calling thread. The channel is switched
+ * into non-blocking mode and waits for the client's messages
+ * via the reactor, such that slow clients do not occupy any
+ * thread. Generating ephemeral keys, key exchanges and
+ * signatures are computed by the given pool.
+ *
+ * The callback is invoked exactly once when the handshake has
+ * finished, either by the thread running the reactor or by one
+ * of the pool's workers. This includes handshakes exceeding the
+ * timeout set via `cpn_server_set_handshake_timeout`. The channel is switched back into
+ * blocking mode on success. It has to stay valid and must not be
+ * used by the caller until the callback has been invoked.
+ *
+ * @param[in] reactor Reactor waiting for the client's messages
+ * @param[in] pool Pool computing cryptographic operations
+ * @param[in] channel TCP channel connected to the client
+ * @param[in] sign_keys Local long-term signature keys, which
+ *            have to stay valid until the callback is invoked
+ * @param[in] fn Callback invoked when the handshake is done
+ * @param[in] payload Payload passed to the callback
+ * @return <code>0</code> if the handshake has been started,
+ *         <code>-1</code> otherwise, e.g. if the maximum number
+ *         of pending handshakes has been reached. The callback
+ *         is not invoked in the latter case.
+ */
+int cpn_server_await_encryption_async(struct cpn_reactor *reactor,
+        struct cpn_pool *pool,
+        struct cpn_channel *channel,
+        const struct cpn_sign_keys *sign_keys,
+        cpn_server_handshake_fn fn,
+        void *payload);
+
 /** @brief Answer a discovery probe
  *
  * Receive a discovery probe and, if the server is not already
@@ -146,6 +258,8 @@ int cpn_server_handle_request(struct cpn_channel *channel,
  * This function will receive an incomming session initiation
  * request and start the service handler when the session
  * initiation and remote identity match a local capability.
+ * Before starting the handler, the channel is set up for the
+ * service's plugin via cpn_service_plugin_setup_channel.
  *
  * @param[in] channel Channel connected to the client
  * @param[in] remote_key Long term signature key of the client
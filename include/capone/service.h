@@ -81,6 +81,13 @@ typedef int (*cpn_service_server_fn)(struct cpn_channel *channel,
  * */
 typedef int (*cpn_service_parse_fn)(ProtobufCMessage **out, int argc, const char **argv);
 
+/** @brief Priority of bulk services like command execution */
+#define CPN_SERVICE_PRIORITY_BULK 0
+/** @brief Priority of services controlling the server */
+#define CPN_SERVICE_PRIORITY_CONTROL 1
+/** @brief Priority of interactive services like input sharing */
+#define CPN_SERVICE_PRIORITY_INTERACTIVE 2
+
 struct cpn_service_plugin {
     /** @brief Category of the sevice
      *
@@ -110,6 +117,25 @@ struct cpn_service_plugin {
     cpn_service_parse_fn parse_fn;
     /** @brief Protobuf descriptor for parameters */
     const ProtobufCMessageDescriptor *params_desc;
+
+    /** @brief Default priority of services of this type
+     *
+     * \see cpn_service::priority
+     */
+    uint32_t priority;
+
+    /** @brief Frame length used for sessions of this type
+     *
+     * Sessions use the smaller one of this frame length and the
+     * frame length negotiated for the connection. Interactive
+     * services use small frames such that the receiver
+     * processes data as it arrives, while bulk services should
+     * keep the negotiated frame length by setting this to
+     * <code>0</code>.
+     *
+     * \see cpn_service_plugin_setup_channel
+     */
+    uint32_t framelen;
 };
 
 /** @brief Structure wrapping a service's functionality
@@ -137,6 +163,24 @@ struct cpn_service {
      */
     char *location;
 
+    /** @brief Maximum number of concurrent connections
+     *
+     * Limits the number of connections to the service which
+     * are handled concurrently. Further connections are queued
+     * until one of them has finished. A value of
+     * <code>0</code> does not limit connections.
+     */
+    uint32_t concurrency;
+
+    /** @brief Priority of connections to the service
+     *
+     * When the server is overloaded, connections to services
+     * of lower priority are refused first and queued connections
+     * of higher priority are handled first. Defaults to the
+     * priority of the service's plugin.
+     */
+    uint32_t priority;
+
     const struct cpn_service_plugin *plugin;
 };
 
@@ -181,6 +225,21 @@ int cpn_service_plugin_register_builtins(void);
  */
 int cpn_service_plugin_for_type(const struct cpn_service_plugin **out, const char *type);
 
+/** @brief Set up a channel for a session of the plugin
+ *
+ * Adjust the channel's frame length to the frame length
+ * preferred by the plugin. This function is invoked by both the
+ * client and the server after the session has been connected
+ * such that both sides switch to the same frame length before
+ * the service starts communicating.
+ *
+ * @param[in] plugin Plugin of the connected session
+ * @param[in] channel Channel the session is connected on
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_service_plugin_setup_channel(const struct cpn_service_plugin *plugin,
+        struct cpn_channel *channel);
+
 /** @brief Initialize a service from a configuration file
  *
  * Services started up by a server are usually specified in a
@@ -26,6 +26,15 @@
  * remote server. The synergy client will be executed on the
  * server and connect to a synergy instance spawned at the
  * client's device.
+ *
+ * Pointer motion is forwarded via an encrypted datagram channel
+ * keyed from the session, such that a lost datagram does not
+ * stall the following ones. All other events are forwarded via
+ * the session's channel to preserve their delivery and order.
+ *
+ * All sessions of a process are relayed by a single reactor
+ * thread, so the server does not keep a thread around for as
+ * long as synergy is running.
  */
 
 struct cpn_service_plugin;
@@ -27,6 +27,11 @@
  *
  * The module provides UDP and TCP sockets.
  *
+ * Multiple sockets may share the same port by initializing each
+ * of them with `cpn_socket_init_shared`. The kernel then spreads
+ * incoming connections across all of them, which allows
+ * accepting connections on multiple threads at once.
+ *
  * @{
  */
 
@@ -35,6 +40,10 @@
 
 #include "capone/channel.h"
 
+/** @brief Default number of pending connections of listening
+ * sockets */
+#define CPN_SOCKET_BACKLOG 16
+
 /** @brief Socket struct bundling data for a socket
  *
  * This struct bundles together data required for accepting
@@ -49,6 +58,11 @@ struct cpn_socket {
     socklen_t addrlen;
     /** Type of the socket, either UDP or TCP. */
     enum cpn_channel_type type;
+    /** Maximum number of pending connections */
+    int backlog;
+    /** Whether accepting returns instead of waiting for
+     * connections */
+    bool nonblocking;
 };
 
 /** Initialize a socket with host and port
@@ -66,6 +80,21 @@ struct cpn_socket {
 int cpn_socket_init(struct cpn_socket *socket,
         const char *host, uint32_t port, enum cpn_channel_type type);
 
+/** Initialize a socket sharing its port with other sockets
+ *
+ * Initialize a socket just like `cpn_socket_init`, but allow
+ * other sockets of the same user to bind to the same address
+ * and port by setting `SO_REUSEPORT`.
+ *
+ * @param[out] socket Socket struct to initialize.
+ * @param[in] host Host to bind to.
+ * @param[in] port Port to bind to.
+ * @param[in] type Type of the socket, either UDP or TCP.
+ * @return <code>0</code> on success, <code>1</code> otherwise
+ */
+int cpn_socket_init_shared(struct cpn_socket *socket,
+        const char *host, uint32_t port, enum cpn_channel_type type);
+
 /** Close a socket
  *
  * @param[in] socket Socket to close
@@ -84,6 +113,42 @@ int cpn_socket_close(struct cpn_socket *socket);
  */
 int cpn_socket_enable_broadcast(struct cpn_socket *socket);
 
+/** Set maximum number of pending connections
+ *
+ * Set the number of connections which may be pending before
+ * being accepted. Has to be called before setting the socket
+ * into listening state. Defaults to `CPN_SOCKET_BACKLOG`.
+ *
+ * @param[in] socket Socket to set backlog for.
+ * @param[in] backlog Maximum number of pending connections.
+ * @return <code>0</code> on success, <code>1</code> otherwise
+ */
+int cpn_socket_set_backlog(struct cpn_socket *socket, int backlog);
+
+/** Prefer connections arriving on a given CPU
+ *
+ * Set `SO_INCOMING_CPU` on the socket. For sockets sharing the
+ * same port, the kernel will then prefer this socket for
+ * connections processed on the given CPU, such that connections
+ * can be handled on the same CPU they have arrived on.
+ *
+ * @param[in] socket Socket to set the CPU for.
+ * @param[in] cpu CPU to prefer connections of.
+ * @return <code>0</code> on success, <code>1</code> otherwise
+ */
+int cpn_socket_set_incoming_cpu(struct cpn_socket *socket, int cpu);
+
+/** Set socket into non-blocking mode
+ *
+ * Accepting connections on non-blocking sockets fails instead
+ * of waiting if no connection is pending. Accepted channels are
+ * blocking nevertheless.
+ *
+ * @param[in] socket Socket to set non-blocking.
+ * @return <code>0</code> on success, <code>1</code> otherwise
+ */
+int cpn_socket_set_nonblocking(struct cpn_socket *socket);
+
 /** Set socket into listening state
  *
  * Set the socket into listening state. This is require
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * \defgroup cpn-ticket Tickets
+ * \ingroup cpn-lib
+ *
+ * @brief Module for resuming connections
+ *
+ * After a full handshake, servers may issue a ticket to the
+ * client. The ticket is opaque to the client: it is sealed with
+ * a key only known to the server process and binds a resumption
+ * secret to the client's identity and an expiry date. Returning
+ * clients present the ticket on their next connection, which
+ * allows both sides to derive fresh keys from the resumption
+ * secret without performing any asymmetric cryptography.
+ *
+ * As the ticket key is never persisted, tickets become invalid
+ * when the server restarts. Clients then simply fall back to a
+ * full handshake.
+ *
+ * @{
+ */
+
+#ifndef CPN_LIB_TICKET_H
+#define CPN_LIB_TICKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capone/crypto/sign.h"
+#include "capone/crypto/symmetric.h"
+
+/** @brief Number of seconds tickets are valid for */
+#define CPN_TICKET_LIFETIME (60 * 60)
+/** @brief Maximum length of sealed tickets */
+#define CPN_TICKET_MAXLEN 128
+
+/** @brief Ticket stored by clients to resume connections */
+struct cpn_ticket {
+    /** Identity of the server which issued the ticket */
+    struct cpn_sign_pk identity;
+    /** Secret to derive keys of resumed connections from */
+    struct cpn_symmetric_key secret;
+    /** Sealed ticket as issued by the server */
+    uint8_t data[CPN_TICKET_MAXLEN];
+    /** Length of the sealed ticket or <code>0</code> if no ticket
+     * has been issued yet */
+    size_t len;
+};
+
+/** @brief Clear a ticket
+ *
+ * The ticket's secret is wiped from memory. Afterwards, the
+ * ticket will not be presented to servers anymore.
+ *
+ * @param[in] ticket Ticket to clear
+ */
+void cpn_ticket_clear(struct cpn_ticket *ticket);
+
+/** @brief Read a ticket from a file
+ *
+ * @param[out] out Ticket to read into
+ * @param[in] file Path to the file to read
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_ticket_from_file(struct cpn_ticket *out, const char *file);
+
+/** @brief Write a ticket to a file
+ *
+ * As the ticket contains its secret, the file is only readable
+ * and writeable by its owner.
+ *
+ * @param[in] file Path to the file to write
+ * @param[in] ticket Ticket to write
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_ticket_to_file(const char *file, const struct cpn_ticket *ticket);
+
+/** @brief Seal a ticket
+ *
+ * Bind the resumption secret to the client's identity and seal
+ * it with the process-wide ticket key.
+ *
+ * @param[out] out Buffer of at least `CPN_TICKET_MAXLEN` bytes to
+ *             store the sealed ticket at
+ * @param[out] outlen Length of the sealed ticket
+ * @param[in] client Identity of the client the ticket is issued to
+ * @param[in] secret Resumption secret to seal
+ * @param[in] lifetime Number of seconds the ticket is valid for
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_ticket_seal(uint8_t *out, size_t *outlen,
+        const struct cpn_sign_pk *client,
+        const struct cpn_symmetric_key *secret,
+        uint32_t lifetime);
+
+/** @brief Open a sealed ticket
+ *
+ * Tickets are only accepted if they have been sealed by this
+ * process, have not yet expired and have been issued to the
+ * given client.
+ *
+ * @param[out] out Resumption secret sealed in the ticket
+ * @param[in] data Sealed ticket
+ * @param[in] datalen Length of the sealed ticket
+ * @param[in] client Identity of the client presenting the ticket
+ * @return <code>0</code> on success, <code>-1</code> otherwise
+ */
+int cpn_ticket_open(struct cpn_symmetric_key *out,
+        const uint8_t *data, size_t datalen,
+        const struct cpn_sign_pk *client);
+
+#endif
+
+/** @} */
@@ -26,18 +26,25 @@
 
 static int ensure_allocated(struct cpn_buf *buf, size_t size)
 {
-    if (size == 0)
+    char *data;
+
+    if (size == 0 || buf->allocated >= size)
         return 0;
 
-    if (buf->allocated < size) {
-        buf->data = realloc(buf->data, size);
-    }
+    if ((data = realloc(buf->data, size)) == NULL)
+        return -1;
 
+    buf->data = data;
     buf->allocated = size;
 
     return 0;
 }
 
+int cpn_buf_reserve(struct cpn_buf *buf, size_t len)
+{
+    return ensure_allocated(buf, len);
+}
+
 int cpn_buf_set(struct cpn_buf *buf, const char *string)
 {
     size_t len = strlen(string);
@@ -16,7 +16,9 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
@@ -24,25 +26,72 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include "capone/buf.h"
 #include "capone/log.h"
 #include "capone/common.h"
 #include "capone/channel.h"
+#include "capone/pool.h"
+#include "capone/relay.h"
+#include "capone/crypto/hash.h"
 
 #define DEFAULT_BLOCKLEN 512
-#define MAX_BLOCKLEN 4096
+#define MAX_BLOCKLEN 16384
+
+/* Channels default to the largest frame length such that the
+ * negotiated frame length is only limited by the peer. Services
+ * may lower it for their sessions. Frames including their length
+ * prefix have to fit into MAX_STAGINGLEN. */
+#define DEFAULT_FRAMELEN MAX_FRAMELEN
+#define MAX_FRAMELEN CPN_CHANNEL_MAX_FRAMELEN
+
+#define DEFAULT_MAXMSGLEN (1024 * 1024)
+
+/* Receive buffers grow as data arrives instead of being allocated
+ * for the announced message length, such that a single unit does
+ * not make us allocate up to the maximum message length */
+#define RECEIVE_RESERVELEN (64 * 1024)
+
+#define DEFAULT_BATCHLEN 32
+#define MAX_BATCHLEN 256
+#define MAX_STAGINGLEN (64 * 1024)
+
+/* Blocking TCP receives read up to RXAHEAD_LEN bytes at once and
+ * parse units out of the buffered data */
+#define RXAHEAD_LEN (64 * 1024)
+
+/* Datagrams are prefixed with a 64 bit sequence number. Only the
+ * most recent DATAGRAM_WINDOW sequence numbers are accepted. */
+#define DATAGRAM_SEQLEN 8
+#define DATAGRAM_WINDOW 64
+
+/* Messages of at least PARALLEL_MINLEN bytes are sealed and
+ * opened by multiple threads, in slabs of PARALLEL_SLABLEN bytes
+ * which are split into jobs of PARALLEL_JOBLEN bytes */
+#define PARALLEL_MINLEN (256 * 1024)
+#define PARALLEL_SLABLEN (1024 * 1024)
+#define PARALLEL_JOBLEN (64 * 1024)
+#define PARALLEL_MAXTHREADS 8
 
 extern int get_socket(struct sockaddr_storage *addr, socklen_t *addrlen,
         const char *host, uint32_t port,
         enum cpn_channel_type type,
         bool serverside);
 
+extern int uring_open(struct cpn_uring **out, int fd);
+extern int uring_close(struct cpn_uring *u, struct cpn_buf *leftover);
+extern uint8_t *uring_send_buffer(struct cpn_uring *u, size_t *len);
+extern ssize_t uring_queue_send(struct cpn_uring *u, size_t len, bool last);
+extern ssize_t uring_receive(struct cpn_uring *u, uint8_t *out, size_t len);
+extern bool uring_is_available(void);
+extern bool uring_has_pending(const struct cpn_uring *u);
+
 int cpn_channel_init_from_host(struct cpn_channel *c, const char *host,
         uint32_t port, enum cpn_channel_type type)
 {
@@ -67,15 +116,40 @@ int cpn_channel_init_from_fd(struct cpn_channel *c,
     assert(addrlen <= sizeof(c->addr));
 
     c->blocklen = DEFAULT_BLOCKLEN;
+    c->batchlen = DEFAULT_BATCHLEN;
+    c->framelen = DEFAULT_FRAMELEN;
+    c->framing = CPN_CHANNEL_FRAMING_BLOCKS;
+    c->maxmsglen = DEFAULT_MAXMSGLEN;
     c->fd = fd;
     c->type = type;
     c->crypto = CPN_CHANNEL_CRYPTO_NONE;
+    c->cipher = CPN_SYMMETRIC_CIPHER_SECRETBOX;
+    c->compression = CPN_COMPRESSION_NONE;
+    c->compression_level = CPN_COMPRESSION_LEVEL_DEFAULT;
+    c->io = CPN_CHANNEL_IO_SYSCALL;
+    c->parallel = type == CPN_CHANNEL_TYPE_TCP;
     memcpy(&c->addr, addr, addrlen);
     c->addrlen = addrlen;
 
     return 0;
 }
 
+int cpn_channel_init_from_datagram(struct cpn_channel *c,
+        int fd, const struct sockaddr *addr, size_t addrlen,
+        const uint8_t *data, size_t len)
+{
+    if (cpn_channel_init_from_fd(c, fd, addr, addrlen, CPN_CHANNEL_TYPE_UDP) < 0)
+        return -1;
+
+    if (cpn_buf_append_data(&c->rxahead, data, len) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to store datagram");
+        return -1;
+    }
+    c->rxahead_only = true;
+
+    return 0;
+}
+
 int cpn_channel_set_blocklen(struct cpn_channel *c, size_t len)
 {
     if (len < sizeof(uint32_t) + CPN_CRYPTO_SYMMETRIC_MACBYTES + 1) {
@@ -89,13 +163,101 @@ int cpn_channel_set_blocklen(struct cpn_channel *c, size_t len)
     return 0;
 }
 
+int cpn_channel_set_framelen(struct cpn_channel *c, size_t len)
+{
+    if (len < sizeof(uint32_t) + CPN_CRYPTO_SYMMETRIC_MACBYTES + 1) {
+        return -1;
+    } else if (len > MAX_FRAMELEN) {
+        return -1;
+    }
+
+    c->framelen = len;
+
+    return 0;
+}
+
+int cpn_channel_set_framing(struct cpn_channel *c, enum cpn_channel_framing framing)
+{
+    if (framing == CPN_CHANNEL_FRAMING_FRAMES && c->type != CPN_CHANNEL_TYPE_TCP) {
+        cpn_log(LOG_LEVEL_ERROR, "Frames are only supported on TCP channels");
+        return -1;
+    }
+
+    if (framing == CPN_CHANNEL_FRAMING_DATAGRAMS && c->type != CPN_CHANNEL_TYPE_UDP) {
+        cpn_log(LOG_LEVEL_ERROR, "Datagrams are only supported on UDP channels");
+        return -1;
+    }
+
+    c->framing = framing;
+
+    return 0;
+}
+
+int cpn_channel_set_cipher(struct cpn_channel *c, enum cpn_symmetric_cipher cipher)
+{
+    if (!cpn_symmetric_cipher_is_available(cipher)) {
+        cpn_log(LOG_LEVEL_ERROR, "Cipher is not available");
+        return -1;
+    }
+
+    c->cipher = cipher;
+
+    return 0;
+}
+
+int cpn_channel_set_compression(struct cpn_channel *c, enum cpn_compression compression)
+{
+    if (!cpn_compression_is_available(compression)) {
+        cpn_log(LOG_LEVEL_ERROR, "Compression is not available");
+        return -1;
+    }
+
+    c->compression = compression;
+
+    return 0;
+}
+
+int cpn_channel_set_compression_level(struct cpn_channel *c, int level)
+{
+    if (level < 0 || level > CPN_COMPRESSION_LEVEL_MAX) {
+        cpn_log(LOG_LEVEL_ERROR, "Invalid compression level");
+        return -1;
+    }
+
+    c->compression_level = level;
+
+    return 0;
+}
+
+int cpn_channel_set_maxmsglen(struct cpn_channel *c, uint32_t len)
+{
+    c->maxmsglen = len;
+
+    return 0;
+}
+
+int cpn_channel_set_batchlen(struct cpn_channel *c, size_t len)
+{
+    if (len < 1 || len > MAX_BATCHLEN)
+        return -1;
+
+    c->batchlen = len;
+
+    return 0;
+}
+
 int cpn_channel_enable_encryption(struct cpn_channel *c,
         const struct cpn_symmetric_key *key, enum cpn_channel_nonce nonce)
 {
     memcpy(&c->key, key, sizeof(c->key));
+    memcpy(&c->remote_key, key, sizeof(c->remote_key));
+    c->rekeying = false;
 
     memset(&c->local_nonce, 0, sizeof(c->local_nonce));
     memset(&c->remote_nonce, 0, sizeof(c->remote_nonce));
+    c->txseq = 0;
+    c->rxseq = 0;
+    c->rxwindow = 0;
 
     switch (nonce) {
         case CPN_CHANNEL_NONCE_CLIENT:
@@ -111,6 +273,190 @@ int cpn_channel_enable_encryption(struct cpn_channel *c,
     return 0;
 }
 
+int cpn_channel_enable_datagram_encryption(struct cpn_channel *c,
+        const struct cpn_channel *stream)
+{
+    static const char label[] = "capone datagram key";
+    struct cpn_symmetric_key key;
+    struct cpn_hash_state hash;
+    enum cpn_channel_nonce nonce;
+    int err;
+
+    if (stream->crypto != CPN_CHANNEL_CRYPTO_SYMMETRIC) {
+        cpn_log(LOG_LEVEL_ERROR, "Cannot derive datagram key from unencrypted channel");
+        return -1;
+    }
+
+    /* Stream keys must not be reused, as datagrams start over
+     * with the initial nonces */
+    if (cpn_hash_init(&hash, sizeof(key.data)) < 0 ||
+            cpn_hash_update(&hash, (const uint8_t *) label, sizeof(label) - 1) < 0 ||
+            cpn_hash_update(&hash, stream->key.data, sizeof(stream->key.data)) < 0 ||
+            cpn_hash_final(key.data, &hash) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to derive datagram key");
+        return -1;
+    }
+
+    /* Nonces are always incremented by two, so the least
+     * significant bit tells which side of the stream we are */
+    if (stream->local_nonce.data[0] & 1)
+        nonce = CPN_CHANNEL_NONCE_SERVER;
+    else
+        nonce = CPN_CHANNEL_NONCE_CLIENT;
+
+    c->cipher = stream->cipher;
+    err = cpn_channel_enable_encryption(c, &key, nonce);
+    cpn_memzero(&key, sizeof(key));
+
+    return err;
+}
+
+int cpn_channel_update_key(struct cpn_channel *c,
+        const struct cpn_symmetric_key *key)
+{
+    if (c->crypto != CPN_CHANNEL_CRYPTO_SYMMETRIC) {
+        cpn_log(LOG_LEVEL_ERROR, "Cannot update key of unencrypted channel");
+        return -1;
+    }
+
+    memcpy(&c->key, key, sizeof(c->key));
+    c->rekeying = memcmp(&c->key, &c->remote_key, sizeof(c->key)) != 0;
+
+    return 0;
+}
+
+void cpn_channel_set_pending(struct cpn_channel *c,
+        cpn_channel_pending_fn fn, void (*free_fn)(void *payload),
+        void *payload)
+{
+    c->pending_fn = fn;
+    c->pending_free = free_fn;
+    c->pending_payload = payload;
+}
+
+bool cpn_channel_io_is_available(enum cpn_channel_io io)
+{
+    switch (io) {
+        case CPN_CHANNEL_IO_SYSCALL:
+            return true;
+        case CPN_CHANNEL_IO_URING:
+            return uring_is_available();
+    }
+
+    return false;
+}
+
+static int stop_uring(struct cpn_channel *c)
+{
+    int err;
+
+    if (!c->uring)
+        return 0;
+
+    /* Data which has already been received is kept, as it
+     * would be lost otherwise */
+    err = uring_close(c->uring, &c->rxahead);
+    c->uring = NULL;
+
+    return err;
+}
+
+int cpn_channel_set_io(struct cpn_channel *c, enum cpn_channel_io io)
+{
+    if (io == CPN_CHANNEL_IO_URING && c->type != CPN_CHANNEL_TYPE_TCP) {
+        cpn_log(LOG_LEVEL_ERROR, "io_uring is only supported on TCP channels");
+        return -1;
+    }
+
+    if (!cpn_channel_io_is_available(io)) {
+        cpn_log(LOG_LEVEL_ERROR, "I/O backend is not available");
+        return -1;
+    }
+
+    if (io == CPN_CHANNEL_IO_SYSCALL) {
+        if (stop_uring(c) < 0)
+            return -1;
+    } else if (!c->uring && !c->nonblocking && uring_open(&c->uring, c->fd) < 0) {
+        return -1;
+    }
+
+    c->io = io;
+
+    return 0;
+}
+
+int cpn_channel_set_parallel(struct cpn_channel *c, bool parallel)
+{
+    if (parallel && c->type != CPN_CHANNEL_TYPE_TCP) {
+        cpn_log(LOG_LEVEL_ERROR, "Parallel encryption is only supported on TCP channels");
+        return -1;
+    }
+
+    c->parallel = parallel;
+
+    return 0;
+}
+
+bool cpn_channel_has_pending_input(const struct cpn_channel *c)
+{
+    return c->rxahead.length > c->rxaheadoff ||
+        (c->uring && uring_has_pending(c->uring));
+}
+
+int cpn_channel_set_nonblocking(struct cpn_channel *c, bool nonblocking)
+{
+    int flags;
+
+    if (c->type != CPN_CHANNEL_TYPE_TCP && c->framing != CPN_CHANNEL_FRAMING_DATAGRAMS) {
+        cpn_log(LOG_LEVEL_ERROR, "Non-blocking mode is only supported on TCP channels");
+        return -1;
+    }
+
+    if (!nonblocking && (c->txbuf.length || c->rxbuf.length || c->rxstarted)) {
+        cpn_log(LOG_LEVEL_ERROR, "Cannot switch to blocking mode with pending data");
+        return -1;
+    }
+
+    if ((flags = fcntl(c->fd, F_GETFL)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to get socket flags: %s", strerror(errno));
+        return -1;
+    }
+
+    if (nonblocking)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
+
+    if (fcntl(c->fd, F_SETFL, flags) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to set socket flags: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Blocking channels never keep pending data, so we can
+     * release the buffers used in non-blocking mode */
+    if (!nonblocking) {
+        cpn_buf_clear(&c->txbuf);
+        cpn_buf_clear(&c->rxbuf);
+        cpn_buf_clear(&c->rxmsg);
+    }
+
+    /* io_uring only drives blocking channels, so it is stopped
+     * while the channel is driven by an event loop */
+    if (nonblocking && stop_uring(c) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to stop io_uring");
+        return -1;
+    } else if (!nonblocking && c->io == CPN_CHANNEL_IO_URING && !c->uring &&
+            uring_open(&c->uring, c->fd) < 0) {
+        cpn_log(LOG_LEVEL_WARNING, "Unable to restart io_uring, falling back to system calls");
+        c->io = CPN_CHANNEL_IO_SYSCALL;
+    }
+
+    c->nonblocking = nonblocking;
+
+    return 0;
+}
+
 int cpn_channel_close(struct cpn_channel *c)
 {
     if (c->fd < 0) {
@@ -118,12 +464,35 @@ int cpn_channel_close(struct cpn_channel *c)
         return -1;
     }
 
+    stop_uring(c);
     close(c->fd);
     c->fd = -1;
 
+    if (c->pending_free)
+        c->pending_free(c->pending_payload);
+    c->pending_fn = NULL;
+    c->pending_free = NULL;
+    c->pending_payload = NULL;
+
+    cpn_buf_clear(&c->txbuf);
+    cpn_buf_clear(&c->rxbuf);
+    cpn_buf_clear(&c->rxmsg);
+    cpn_buf_clear(&c->rxahead);
+    c->txoff = 0;
+    c->rxaheadoff = 0;
+    c->rxlen = 0;
+    c->rxstarted = false;
+
     return 0;
 }
 
+void cpn_channel_move(struct cpn_channel *dst, struct cpn_channel *src)
+{
+    memcpy(dst, src, sizeof(*dst));
+    cpn_memzero(src, sizeof(*src));
+    src->fd = -1;
+}
+
 int cpn_channel_connect(struct cpn_channel *c)
 {
     assert(c->fd >= 0);
@@ -172,286 +541,1663 @@ static int write_data(struct cpn_channel *c, uint8_t *data, uint32_t datalen)
     return written;
 }
 
-int cpn_channel_write_data(struct cpn_channel *c, uint8_t *data, uint32_t datalen)
+static int write_vectored(struct cpn_channel *c, struct iovec *iov, int iovcnt)
 {
-    uint8_t block[MAX_BLOCKLEN];
-    size_t written = 0, offset;
-    uint32_t networklen;
+    struct msghdr msg;
+    ssize_t ret;
+    size_t written = 0;
 
-    networklen = htonl(datalen);
-    memcpy(block, &networklen, sizeof(networklen));
-    offset = 4;
+    memset(&msg, 0, sizeof(msg));
 
-    while (offset || written != datalen) {
-        uint32_t len;
-        ssize_t ret;
+    while (iovcnt) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
 
-        if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC) {
-            len = MIN(datalen - written, c->blocklen - offset - CPN_CRYPTO_SYMMETRIC_MACBYTES);
-        } else {
-            len = MIN(datalen - written, c->blocklen - offset);
+        ret = sendmsg(c->fd, &msg, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            cpn_log(LOG_LEVEL_ERROR, "Could not send data: %s",
+                    strerror(errno));
+            return -1;
+        } else if (ret == 0) {
+            cpn_log(LOG_LEVEL_VERBOSE, "Channel closed while writing");
+            return 0;
         }
 
-        memset(block + offset, 0, c->blocklen - offset);
-        memcpy(block + offset, data + written, len);
+        written += ret;
 
-        if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC) {
-            if (cpn_symmetric_key_encrypt(block, &c->key, &c->local_nonce,
-                        block, c->blocklen - CPN_CRYPTO_SYMMETRIC_MACBYTES) < 0)
-            {
-                cpn_log(LOG_LEVEL_ERROR, "Unable to encrypt message");
-                return -1;
-            }
-            cpn_symmetric_key_nonce_increment(&c->local_nonce, 2);
+        while (iovcnt && (size_t) ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
 
-        ret = write_data(c, block, c->blocklen);
-        if (ret == 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Unable to write data: channel closed");
-            return 0;
-        } else if (ret < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Unable to write data");
-            return -1;
+        if (iovcnt) {
+            iov->iov_base = (uint8_t *) iov->iov_base + ret;
+            iov->iov_len -= ret;
         }
-        written += len;
-
-        offset = 0;
     }
 
-    return 0;
+    return written;
 }
 
-int cpn_channel_write_protobuf(struct cpn_channel *c, const ProtobufCMessage *msg)
+/* Without encryption the data can be sent as-is, so we hand
+ * length, payload and padding to the kernel in a single call
+ * without copying the payload into blocks first. The result is
+ * the same stream as if it was split into blocks. */
+static int write_plain_data(struct cpn_channel *c, uint8_t *data, uint32_t datalen)
 {
-    const char *pkgname, *descrname;
-    size_t size;
-    uint8_t buf[4096];
-
-    if (!protobuf_c_message_check(msg)) {
-        cpn_log(LOG_LEVEL_ERROR, "Invalid protobuf message");
-        return -1;
-    }
-
-    size = protobuf_c_message_get_packed_size(msg);
-    if (size > sizeof(buf)) {
-        cpn_log(LOG_LEVEL_ERROR, "Protobuf message exceeds buffer length");
-        return -1;
-    }
-
-    pkgname = msg->descriptor->package_name;
-    descrname = msg->descriptor->name;
+    static const uint8_t padding[MAX_BLOCKLEN];
+    struct iovec iov[3];
+    uint32_t networklen;
+    size_t remainder;
 
-    cpn_log(LOG_LEVEL_TRACE, "Writing protobuf %s:%s of length %"PRIuMAX,
-            pkgname ? pkgname : "", descrname ? descrname : "", size);
+    networklen = htonl(datalen);
+    remainder = (sizeof(networklen) + datalen) % c->blocklen;
 
-    protobuf_c_message_pack(msg, buf);
+    iov[0].iov_base = &networklen;
+    iov[0].iov_len = sizeof(networklen);
+    iov[1].iov_base = data;
+    iov[1].iov_len = datalen;
+    iov[2].iov_base = (void *) padding;
+    iov[2].iov_len = remainder ? c->blocklen - remainder : 0;
 
-    return cpn_channel_write_data(c, buf, size);
+    return write_vectored(c, iov, ARRAY_SIZE(iov));
 }
 
-static int receive_data(struct cpn_channel *c, uint8_t *out, size_t len)
+/* A unit to seal or open in place. When sealing, its length
+ * excludes the MAC, which is appended to the unit. */
+struct parallel_unit {
+    uint8_t *data;
+    size_t len;
+};
+
+/* Units are independent of each other, as the nonce of every
+ * unit is derived from the nonce of the first one. Jobs are
+ * claimed by the pool's threads as well as by the caller, so that
+ * progress does not depend on the pool. Late helpers may still
+ * hold a reference after the caller has returned. */
+struct parallel_crypt {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t refs;
+
+    struct cpn_symmetric_key key;
+    enum cpn_symmetric_cipher cipher;
+    struct cpn_symmetric_key_nonce nonce;
+    bool open;
+
+    struct parallel_unit *units;
+    size_t nunits;
+    size_t jobunits;
+    size_t njobs;
+    size_t next;
+    size_t done;
+    int err;
+};
+
+static pthread_once_t parallel_pool_once = PTHREAD_ONCE_INIT;
+static struct cpn_pool parallel_pool;
+static size_t parallel_threads;
+
+static void init_parallel_pool(void)
 {
-    ssize_t ret;
-    size_t received = 0;
-
-    while (received != len) {
-        switch (c->type) {
-            case CPN_CHANNEL_TYPE_TCP:
-                ret = recv(c->fd, out + received, len - received, 0);
-                break;
-            case CPN_CHANNEL_TYPE_UDP:
-                ret = recvfrom(c->fd, out + received, len - received, 0,
-                        (struct sockaddr *) &c->addr, &c->addrlen);
-                break;
-        }
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads;
 
-        if (ret == 0) {
-            cpn_log(LOG_LEVEL_VERBOSE, "Channel closed while receiving",
-                    strerror(errno));
-            return 0;
-        } else if (ret < 0) {
-            if (errno == EINTR)
-                continue;
-            cpn_log(LOG_LEVEL_ERROR, "Could not receive data: %s",
-                    strerror(errno));
-            return -1;
-        }
+    /* The calling thread takes part in sealing */
+    if (ncpus <= 1)
+        return;
+    nthreads = MIN((size_t) ncpus - 1, PARALLEL_MAXTHREADS);
 
-        received += ret;
+    if (cpn_pool_init(&parallel_pool, nthreads, nthreads * PARALLEL_MAXTHREADS) < 0) {
+        cpn_log(LOG_LEVEL_WARNING, "Unable to start crypto threads");
+        return;
     }
 
-    return received;
+    parallel_threads = nthreads;
 }
 
-ssize_t cpn_channel_receive_data(struct cpn_channel *c, uint8_t *out, size_t maxlen)
+static bool use_parallel(const struct cpn_channel *c, size_t len)
 {
-    uint8_t block[MAX_BLOCKLEN];
-    uint32_t pkglen, received = 0, offset = sizeof(uint32_t);
+    if (!c->parallel || c->crypto != CPN_CHANNEL_CRYPTO_SYMMETRIC ||
+            c->rekeying || c->nonblocking || len < PARALLEL_MINLEN)
+        return false;
 
-    while (offset || received < pkglen) {
-        uint32_t networklen, blocklen;
-        ssize_t ret;
+    pthread_once(&parallel_pool_once, init_parallel_pool);
 
-        ret = receive_data(c, block, c->blocklen);
-        if (ret == 0) {
-            cpn_log(LOG_LEVEL_VERBOSE, "Unable to receive data: channel closed");
-            return 0;
-        } else if (ret < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Unable to receive data");
-            return -1;
-        }
+    return parallel_threads > 0;
+}
 
-        if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC) {
-            if (cpn_symmetric_key_decrypt(block, &c->key, &c->remote_nonce,
-                        block, c->blocklen) < 0)
-            {
-                cpn_log(LOG_LEVEL_ERROR, "Unable to decrypt received block");
-                return -1;
-            }
-            cpn_symmetric_key_nonce_increment(&c->remote_nonce, 2);
-        }
+static void put_parallel(struct parallel_crypt *p)
+{
+    bool last;
 
-        if (offset) {
-            memcpy(&networklen, block, sizeof(networklen));
-            pkglen = ntohl(networklen);
-            if (pkglen > maxlen) {
-                cpn_log(LOG_LEVEL_ERROR, "Received package length exceeds maxlen");
-                return -1;
-            }
-        }
+    pthread_mutex_lock(&p->mutex);
+    last = --p->refs == 0;
+    pthread_mutex_unlock(&p->mutex);
 
-        if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC) {
-            blocklen = MIN(pkglen - received, c->blocklen - offset - CPN_CRYPTO_SYMMETRIC_MACBYTES);
-        } else {
-            blocklen = MIN(pkglen - received, c->blocklen - offset);
-        }
+    if (!last)
+        return;
 
-        memcpy(out + received, block + offset, blocklen);
+    cpn_memzero(&p->key, sizeof(p->key));
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    free(p);
+}
 
-        received += blocklen;
-        offset = 0;
+static bool run_parallel_job(struct parallel_crypt *p)
+{
+    struct cpn_symmetric_key_nonce nonce;
+    size_t job, i, end;
+    int err = 0;
+
+    pthread_mutex_lock(&p->mutex);
+    if (p->next == p->njobs) {
+        pthread_mutex_unlock(&p->mutex);
+        return false;
+    }
+    job = p->next++;
+    pthread_mutex_unlock(&p->mutex);
+
+    memcpy(&nonce, &p->nonce, sizeof(nonce));
+    cpn_symmetric_key_nonce_increment(&nonce, 2 * job * p->jobunits);
+
+    end = MIN(p->nunits, (job + 1) * p->jobunits);
+    for (i = job * p->jobunits; i < end && !err; i++) {
+        struct parallel_unit *u = &p->units[i];
+
+        if (p->open)
+            err = cpn_symmetric_key_decrypt(u->data, &p->key, p->cipher,
+                    &nonce, u->data, u->len);
+        else
+            err = cpn_symmetric_key_encrypt(u->data, &p->key, p->cipher,
+                    &nonce, u->data, u->len);
+        cpn_symmetric_key_nonce_increment(&nonce, 2);
     }
 
-    return received;
+    pthread_mutex_lock(&p->mutex);
+    if (err)
+        p->err = -1;
+    if (++p->done == p->njobs)
+        pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    return true;
 }
 
-int cpn_channel_receive_protobuf(struct cpn_channel *c, const ProtobufCMessageDescriptor *descr, ProtobufCMessage **msg)
+static void *run_parallel_jobs(void *payload)
 {
-    ProtobufCMessage *result = NULL;
-    uint8_t buf[4096];
-    ssize_t len;
-    int ret = -1;
+    struct parallel_crypt *p = (struct parallel_crypt *) payload;
+
+    while (run_parallel_job(p));
+    put_parallel(p);
+
+    return NULL;
+}
+
+/* Seal or open all units in place, starting with the given nonce */
+static int crypt_parallel(struct parallel_unit *units, size_t nunits, size_t unitlen,
+        const struct cpn_symmetric_key *key, enum cpn_symmetric_cipher cipher,
+        const struct cpn_symmetric_key_nonce *nonce, bool open)
+{
+    struct parallel_crypt *p;
+    size_t i;
+    int err;
+
+    if ((p = malloc(sizeof(*p))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate parallel jobs");
+        return -1;
+    }
+
+    if (pthread_mutex_init(&p->mutex, NULL) != 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initialize parallel jobs");
+        free(p);
+        return -1;
+    }
+
+    if (pthread_cond_init(&p->cond, NULL) != 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initialize parallel jobs");
+        pthread_mutex_destroy(&p->mutex);
+        free(p);
+        return -1;
+    }
+
+    p->refs = 1;
+    memcpy(&p->key, key, sizeof(p->key));
+    p->cipher = cipher;
+    memcpy(&p->nonce, nonce, sizeof(p->nonce));
+    p->open = open;
+    p->units = units;
+    p->nunits = nunits;
+    p->jobunits = MAX(1, PARALLEL_JOBLEN / unitlen);
+    p->njobs = (nunits + p->jobunits - 1) / p->jobunits;
+    p->next = 0;
+    p->done = 0;
+    p->err = 0;
+
+    for (i = 0; i + 1 < p->njobs && i < parallel_threads; i++) {
+        pthread_mutex_lock(&p->mutex);
+        p->refs++;
+        pthread_mutex_unlock(&p->mutex);
+
+        if (cpn_pool_submit(&parallel_pool, NULL, run_parallel_jobs, p) < 0) {
+            pthread_mutex_lock(&p->mutex);
+            p->refs--;
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+    }
+
+    while (run_parallel_job(p));
+
+    pthread_mutex_lock(&p->mutex);
+    while (p->done < p->njobs)
+        pthread_cond_wait(&p->cond, &p->mutex);
+    err = p->err;
+    pthread_mutex_unlock(&p->mutex);
+
+    put_parallel(p);
+
+    return err;
+}
+
+struct writer {
+    struct cpn_channel *c;
+    uint8_t buf[MAX_STAGINGLEN];
+    uint8_t *staging;
+    size_t staginglen;
+    size_t staged;
+    size_t units;
+    size_t unitlen;
+    uint32_t remaining;
+    int closed;
+};
+
+struct protobuf_writer {
+    ProtobufCBuffer base;
+    struct writer *w;
+    int err;
+};
+
+static size_t overhead(const struct cpn_channel *c)
+{
+    if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC)
+        return CPN_CRYPTO_SYMMETRIC_MACBYTES;
+    return 0;
+}
+
+static uint8_t *writer_unit(struct writer *w)
+{
+    if (w->c->framing == CPN_CHANNEL_FRAMING_FRAMES)
+        return w->staging + w->staged + sizeof(uint32_t);
+    return w->staging + w->staged;
+}
+
+static size_t writer_capacity(struct writer *w)
+{
+    if (w->c->framing == CPN_CHANNEL_FRAMING_FRAMES)
+        return w->c->framelen - overhead(w->c);
+    return w->c->blocklen - overhead(w->c);
+}
+
+static int writer_flush(struct writer *w)
+{
+    ssize_t ret;
+
+    /* Non-blocking channels only queue sealed data, which is
+     * written by `cpn_channel_flush` */
+    if (w->c->nonblocking) {
+        if (cpn_buf_append_data(&w->c->txbuf, w->staging, w->staged) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to queue data");
+            return -1;
+        }
+        w->staged = 0;
+        w->units = 0;
+        return 0;
+    }
+
+    /* With io_uring, units are sealed into registered buffers
+     * directly, which are only submitted once all of them are
+     * used or the message is complete */
+    if (w->c->uring) {
+        ret = uring_queue_send(w->c->uring, w->staged, w->remaining == 0);
+        w->staging = uring_send_buffer(w->c->uring, &w->staginglen);
+    } else {
+        ret = write_data(w->c, w->staging, w->staged);
+    }
+
+    if (ret == 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to write data: channel closed");
+        w->closed = 1;
+    } else if (ret < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to write data");
+        return -1;
+    }
+
+    w->staged = 0;
+    w->units = 0;
+
+    return 0;
+}
+
+static int writer_seal(struct writer *w)
+{
+    struct cpn_channel *c = w->c;
+    uint8_t *unit = writer_unit(w);
+    size_t len = w->unitlen, maxunit, maxunits;
+    uint32_t networklen;
+
+    if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+        maxunit = sizeof(networklen) + c->framelen;
+        maxunits = SIZE_MAX;
+    } else {
+        len = writer_capacity(w);
+        memset(unit + w->unitlen, 0, len - w->unitlen);
+
+        maxunit = c->blocklen;
+        /* Each UDP datagram has to carry exactly one block, as the
+         * receiving side reads datagrams block by block */
+        maxunits = c->type == CPN_CHANNEL_TYPE_TCP ? c->batchlen : 1;
+    }
+
+    if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC) {
+        if (cpn_symmetric_key_encrypt(unit, &c->key, c->cipher,
+                    &c->local_nonce, unit, len) < 0)
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to encrypt message");
+            return -1;
+        }
+        cpn_symmetric_key_nonce_increment(&c->local_nonce, 2);
+    }
+
+    len += overhead(c);
+
+    if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+        networklen = htonl(len);
+        memcpy(unit - sizeof(networklen), &networklen, sizeof(networklen));
+        len += sizeof(networklen);
+    }
+
+    w->staged += len;
+    w->units++;
+    w->unitlen = 0;
+
+    if (w->remaining == 0 || w->units >= maxunits ||
+            w->staged + maxunit > w->staginglen)
+        return writer_flush(w);
+
+    return 0;
+}
+
+static int writer_init(struct writer *w, struct cpn_channel *c, uint32_t datalen)
+{
+    uint32_t networklen = htonl(datalen);
+
+    w->c = c;
+    if (c->uring && !c->nonblocking) {
+        w->staging = uring_send_buffer(c->uring, &w->staginglen);
+    } else {
+        w->staging = w->buf;
+        w->staginglen = sizeof(w->buf);
+    }
+    w->staged = 0;
+    w->units = 0;
+    w->remaining = datalen;
+    w->closed = 0;
+
+    memcpy(writer_unit(w), &networklen, sizeof(networklen));
+    w->unitlen = sizeof(networklen);
+
+    if (datalen == 0)
+        return writer_seal(w);
+
+    return 0;
+}
+
+static int writer_append(struct writer *w, const uint8_t *data, size_t datalen)
+{
+    while (datalen && !w->closed) {
+        size_t len = MIN(datalen, writer_capacity(w) - w->unitlen);
+
+        if (len > w->remaining) {
+            cpn_log(LOG_LEVEL_ERROR, "Data exceeds announced message length");
+            return -1;
+        }
+
+        memcpy(writer_unit(w) + w->unitlen, data, len);
+
+        w->unitlen += len;
+        w->remaining -= len;
+        data += len;
+        datalen -= len;
+
+        if (w->unitlen == writer_capacity(w) || w->remaining == 0) {
+            if (writer_seal(w) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int writer_finish(struct writer *w)
+{
+    if (!w->closed && w->remaining) {
+        cpn_log(LOG_LEVEL_ERROR, "Data is shorter than announced message length");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void writer_append_protobuf(ProtobufCBuffer *buffer, size_t len, const uint8_t *data)
+{
+    struct protobuf_writer *pw = (struct protobuf_writer *) buffer;
+
+    if (!pw->err && writer_append(pw->w, data, len) < 0)
+        pw->err = -1;
+}
+
+/* Split the message into the same units as the writer does,
+ * but seal a whole slab of them in parallel before writing it */
+static int write_parallel(struct cpn_channel *c, const uint8_t *data, uint32_t datalen)
+{
+    struct parallel_unit *units;
+    uint8_t *slab;
+    uint32_t networklen = htonl(datalen);
+    size_t headerlen, capacity, unitlen, maxunits, offset = 0,
+           total = sizeof(networklen) + (size_t) datalen;
+    int ret, err = -1;
+
+    if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+        headerlen = sizeof(networklen);
+        capacity = c->framelen - CPN_CRYPTO_SYMMETRIC_MACBYTES;
+    } else {
+        headerlen = 0;
+        capacity = c->blocklen - CPN_CRYPTO_SYMMETRIC_MACBYTES;
+    }
+    unitlen = headerlen + capacity + CPN_CRYPTO_SYMMETRIC_MACBYTES;
+    maxunits = MAX(1, PARALLEL_SLABLEN / unitlen);
+
+    slab = malloc(maxunits * unitlen);
+    units = malloc(maxunits * sizeof(*units));
+    if (slab == NULL || units == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate slab");
+        goto out;
+    }
+
+    while (offset < total) {
+        size_t nunits, slablen = 0;
+
+        for (nunits = 0; nunits < maxunits && offset < total; nunits++) {
+            uint8_t *unit = slab + slablen + headerlen;
+            size_t len = MIN(capacity, total - offset);
+
+            if (offset == 0) {
+                memcpy(unit, &networklen, sizeof(networklen));
+                memcpy(unit + sizeof(networklen), data, len - sizeof(networklen));
+            } else {
+                memcpy(unit, data + offset - sizeof(networklen), len);
+            }
+            offset += len;
+
+            /* Blocks are padded to their full length */
+            if (c->framing == CPN_CHANNEL_FRAMING_BLOCKS) {
+                memset(unit + len, 0, capacity - len);
+                len = capacity;
+            } else {
+                uint32_t framelen = htonl(len + CPN_CRYPTO_SYMMETRIC_MACBYTES);
+                memcpy(unit - headerlen, &framelen, sizeof(framelen));
+            }
+
+            units[nunits].data = unit;
+            units[nunits].len = len;
+            slablen += headerlen + len + CPN_CRYPTO_SYMMETRIC_MACBYTES;
+        }
+
+        if (crypt_parallel(units, nunits, unitlen, &c->key, c->cipher,
+                    &c->local_nonce, false) < 0)
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to encrypt message");
+            goto out;
+        }
+        cpn_symmetric_key_nonce_increment(&c->local_nonce, 2 * nunits);
+
+        ret = write_data(c, slab, slablen);
+        if (ret == 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to write data: channel closed");
+            err = 0;
+            goto out;
+        } else if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to write data");
+            goto out;
+        }
+    }
+
+    err = 0;
+
+out:
+    free(units);
+    free(slab);
+
+    return err;
+}
+
+static int write_message(struct cpn_channel *c, uint8_t *data, uint32_t datalen)
+{
+    struct writer w;
+    ssize_t ret;
+
+    if (use_parallel(c, datalen))
+        return write_parallel(c, data, datalen);
+
+    if (c->type == CPN_CHANNEL_TYPE_TCP && c->crypto == CPN_CHANNEL_CRYPTO_NONE &&
+            c->framing == CPN_CHANNEL_FRAMING_BLOCKS && !c->nonblocking && !c->uring)
+    {
+        ret = write_plain_data(c, data, datalen);
+        if (ret == 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to write data: channel closed");
+            return 0;
+        } else if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to write data");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (writer_init(&w, c, datalen) < 0 ||
+            writer_append(&w, data, datalen) < 0 ||
+            writer_finish(&w) < 0)
+        return -1;
+
+    if (c->nonblocking)
+        return cpn_channel_flush(c);
+
+    return 0;
+}
+
+static int write_compressed(struct cpn_channel *c, const uint8_t *data, size_t datalen)
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+    int err = -1;
+
+    if (cpn_compress(&buf, c->compression, c->compression_level, data, datalen) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to compress data");
+        goto out;
+    }
+
+    if (buf.length > UINT32_MAX) {
+        cpn_log(LOG_LEVEL_ERROR, "Compressed data exceeds maximum message length");
+        goto out;
+    }
+
+    err = write_message(c, (uint8_t *) buf.data, buf.length);
+
+out:
+    cpn_buf_clear(&buf);
+
+    return err;
+}
+
+static int write_datagram(struct cpn_channel *c, uint8_t *data, uint32_t datalen)
+{
+    uint8_t datagram[DATAGRAM_SEQLEN + MAX_FRAMELEN];
+    struct cpn_symmetric_key_nonce nonce;
+    size_t len = DATAGRAM_SEQLEN + overhead(c) + datalen;
+    uint64_t seq;
+    ssize_t ret;
+    int i;
+
+    if (len - DATAGRAM_SEQLEN > c->framelen) {
+        cpn_log(LOG_LEVEL_ERROR, "Datagram exceeds maximum frame length");
+        return -1;
+    }
+
+    seq = ++c->txseq;
+    for (i = 0; i < DATAGRAM_SEQLEN; i++)
+        datagram[i] = (seq >> (8 * (DATAGRAM_SEQLEN - i - 1))) & 0xff;
+
+    /* Each datagram's nonce is derived from its sequence number
+     * so that it can be opened without having seen its
+     * predecessors */
+    if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC) {
+        memcpy(&nonce, &c->local_nonce, sizeof(nonce));
+        cpn_symmetric_key_nonce_increment(&nonce, 2 * seq);
+
+        if (cpn_symmetric_key_encrypt(datagram + DATAGRAM_SEQLEN, &c->key, c->cipher,
+                    &nonce, data, datalen) < 0)
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to encrypt datagram");
+            return -1;
+        }
+    } else {
+        memcpy(datagram + DATAGRAM_SEQLEN, data, datalen);
+    }
+
+    do {
+        ret = sendto(c->fd, datagram, len, 0, (struct sockaddr *) &c->addr, c->addrlen);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        /* Datagrams may get lost anyway, so there is no point in
+         * queueing them if the socket buffer is full */
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            cpn_log(LOG_LEVEL_DEBUG, "Dropping datagram, socket buffer is full");
+            return 0;
+        }
+        cpn_log(LOG_LEVEL_ERROR, "Could not send datagram: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int cpn_channel_write_data(struct cpn_channel *c, uint8_t *data, uint32_t datalen)
+{
+    if (c->framing == CPN_CHANNEL_FRAMING_DATAGRAMS)
+        return write_datagram(c, data, datalen);
+
+    if (c->compression != CPN_COMPRESSION_NONE)
+        return write_compressed(c, data, datalen);
+
+    return write_message(c, data, datalen);
+}
+
+int cpn_channel_write_protobuf(struct cpn_channel *c, const ProtobufCMessage *msg)
+{
+    const char *pkgname, *descrname;
+    struct protobuf_writer pw;
+    struct writer w;
+    size_t size;
+
+    if (!protobuf_c_message_check(msg)) {
+        cpn_log(LOG_LEVEL_ERROR, "Invalid protobuf message");
+        return -1;
+    }
+
+    size = protobuf_c_message_get_packed_size(msg);
+    if (size > UINT32_MAX) {
+        cpn_log(LOG_LEVEL_ERROR, "Protobuf message exceeds maximum message length");
+        return -1;
+    }
+
+    pkgname = msg->descriptor->package_name;
+    descrname = msg->descriptor->name;
+
+    cpn_log(LOG_LEVEL_TRACE, "Writing protobuf %s:%s of length %"PRIuMAX,
+            pkgname ? pkgname : "", descrname ? descrname : "", size);
+
+    /* Compression and datagrams need the whole message at once */
+    if (c->compression != CPN_COMPRESSION_NONE ||
+            c->framing == CPN_CHANNEL_FRAMING_DATAGRAMS) {
+        uint8_t *packed;
+        int err;
+
+        if ((packed = malloc(size)) == NULL) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to allocate protobuf");
+            return -1;
+        }
+
+        protobuf_c_message_pack(msg, packed);
+        err = cpn_channel_write_data(c, packed, size);
+        free(packed);
+
+        return err;
+    }
+
+    /* Pack the message directly into the channel's blocks or
+     * frames instead of into an intermediate buffer */
+    pw.base.append = writer_append_protobuf;
+    pw.w = &w;
+    pw.err = 0;
+
+    if (writer_init(&w, c, size) < 0)
+        return -1;
+
+    protobuf_c_message_pack_to_buffer(msg, &pw.base);
+
+    if (pw.err || writer_finish(&w) < 0)
+        return -1;
+
+    if (c->nonblocking)
+        return cpn_channel_flush(c);
+
+    return 0;
+}
+
+int cpn_channel_flush(struct cpn_channel *c)
+{
+    ssize_t ret;
+
+    while (c->txoff < c->txbuf.length) {
+        ret = send(c->fd, c->txbuf.data + c->txoff, c->txbuf.length - c->txoff, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Drop data already sent so that queueing more
+                 * data does not grow the buffer indefinitely */
+                if (c->txoff >= c->txbuf.length / 2) {
+                    memmove(c->txbuf.data, c->txbuf.data + c->txoff,
+                            c->txbuf.length - c->txoff);
+                    c->txbuf.length -= c->txoff;
+                    c->txoff = 0;
+                }
+                return CPN_CHANNEL_WOULD_BLOCK;
+            }
+            cpn_log(LOG_LEVEL_ERROR, "Could not send data: %s", strerror(errno));
+            return -1;
+        }
+
+        c->txoff += ret;
+    }
+
+    cpn_buf_reset(&c->txbuf);
+    c->txoff = 0;
+
+    return 0;
+}
+
+static size_t receive_ahead(struct cpn_channel *c, uint8_t *out, size_t len)
+{
+    size_t n = MIN(len, c->rxahead.length - c->rxaheadoff);
+
+    if (n == 0)
+        return 0;
+
+    memcpy(out, c->rxahead.data + c->rxaheadoff, n);
+    c->rxaheadoff += n;
+
+    if (c->rxaheadoff == c->rxahead.length) {
+        cpn_buf_reset(&c->rxahead);
+        c->rxaheadoff = 0;
+    }
+
+    return n;
+}
+
+static ssize_t read_ahead(struct cpn_channel *c)
+{
+    ssize_t ret;
+
+    if (cpn_buf_reserve(&c->rxahead, RXAHEAD_LEN) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate receive buffer");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ret = recv(c->fd, c->rxahead.data, RXAHEAD_LEN, 0);
+    if (ret > 0)
+        c->rxahead.length = ret;
+
+    return ret;
+}
+
+static int receive_data(struct cpn_channel *c, uint8_t *out, size_t len)
+{
+    ssize_t ret;
+    size_t received;
+
+    received = receive_ahead(c, out, len);
+
+    if (received != len && c->rxahead_only) {
+        cpn_log(LOG_LEVEL_ERROR, "Datagram is truncated");
+        return -1;
+    }
+
+    while (received != len) {
+        if (c->uring) {
+            ret = uring_receive(c->uring, out + received, len - received);
+            if (ret == 0) {
+                cpn_log(LOG_LEVEL_VERBOSE, "Channel closed while receiving");
+                return 0;
+            } else if (ret < 0) {
+                return -1;
+            }
+            received += ret;
+            continue;
+        }
+
+        switch (c->type) {
+            case CPN_CHANNEL_TYPE_TCP:
+                /* Small reads are served from the read-ahead
+                 * buffer, which can only be empty at this point.
+                 * Large ones go to the caller's buffer directly,
+                 * as they would not save any system calls. */
+                if (len - received < RXAHEAD_LEN) {
+                    if ((ret = read_ahead(c)) > 0)
+                        ret = receive_ahead(c, out + received, len - received);
+                } else {
+                    ret = recv(c->fd, out + received, len - received, 0);
+                }
+                break;
+            case CPN_CHANNEL_TYPE_UDP:
+                ret = recvfrom(c->fd, out + received, len - received, 0,
+                        (struct sockaddr *) &c->addr, &c->addrlen);
+                break;
+        }
+
+        if (ret == 0) {
+            cpn_log(LOG_LEVEL_VERBOSE, "Channel closed while receiving",
+                    strerror(errno));
+            return 0;
+        } else if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            cpn_log(LOG_LEVEL_ERROR, "Could not receive data: %s",
+                    strerror(errno));
+            return -1;
+        }
+
+        received += ret;
+    }
+
+    return received;
+}
+
+struct receive_state {
+    uint32_t pkglen;
+    uint32_t received;
+    bool started;
+};
+
+static int check_framelen(const struct cpn_channel *c, uint32_t framelen, bool first)
+{
+    size_t minlen;
+
+    /* Only the first frame may be empty, as it always carries
+     * the package length */
+    if (first)
+        minlen = sizeof(uint32_t) + overhead(c);
+    else
+        minlen = overhead(c) + 1;
+
+    if (framelen < minlen || framelen > c->framelen) {
+        cpn_log(LOG_LEVEL_ERROR, "Received invalid frame length");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int decrypt_unit(struct cpn_channel *c, const struct cpn_symmetric_key_nonce *nonce,
+        uint8_t *out, uint8_t *unit, size_t unitlen)
+{
+    uint8_t *copy = NULL, *ciphertext = unit;
+    int err;
+
+    if (!c->rekeying)
+        return cpn_symmetric_key_decrypt(out, &c->remote_key, c->cipher,
+                nonce, unit, unitlen);
+
+    /* Some ciphers clobber the output if authentication fails,
+     * so we need to keep the ciphertext around to retry
+     * decryption with the updated key when decrypting in place */
+    if (out == unit) {
+        if ((copy = malloc(unitlen)) == NULL)
+            return -1;
+        memcpy(copy, unit, unitlen);
+        ciphertext = copy;
+    }
+
+    if ((err = cpn_symmetric_key_decrypt(out, &c->remote_key, c->cipher,
+                    nonce, ciphertext, unitlen)) < 0 &&
+            (err = cpn_symmetric_key_decrypt(out, &c->key, c->cipher,
+                    nonce, ciphertext, unitlen)) == 0)
+    {
+        memcpy(&c->remote_key, &c->key, sizeof(c->remote_key));
+        c->rekeying = false;
+    }
+
+    free(copy);
+
+    return err;
+}
+
+struct receive_buffer {
+    uint8_t *data;
+    struct cpn_buf *buf;
+    size_t len;
+};
+
+/* Receivers which store data in a buffer of their own may
+ * provide `destination_fn`, returning where the next `len` bytes
+ * would be stored or NULL if they do not fit yet */
+struct receiver {
+    cpn_channel_receive_fn fn;
+    uint8_t *(*destination_fn)(void *payload, size_t len);
+    void *payload;
+};
+
+static void init_receiver(struct receiver *r, cpn_channel_receive_fn fn,
+        uint8_t *(*destination_fn)(void *payload, size_t len), void *payload)
+{
+    r->fn = fn;
+    r->destination_fn = destination_fn;
+    r->payload = payload;
+}
+
+static uint8_t *buf_destination(struct cpn_buf *buf, size_t len)
+{
+    if (buf->allocated - buf->length < len)
+        return NULL;
+    return (uint8_t *) buf->data + buf->length;
+}
+
+static int receive_into_buffer(const uint8_t *data, size_t len, uint32_t total, void *payload)
+{
+    struct receive_buffer *buf = (struct receive_buffer *) payload;
+
+    UNUSED(total);
+
+    if (data != buf->data + buf->len)
+        memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return 0;
+}
+
+static uint8_t *buffer_destination(void *payload, size_t len)
+{
+    struct receive_buffer *buf = (struct receive_buffer *) payload;
+
+    UNUSED(len);
+
+    return buf->data + buf->len;
+}
+
+/* Make room for the next `len` bytes of a message with
+ * `remaining` bytes still to be received. Buffers grow
+ * geometrically to avoid reallocations for every unit, but never
+ * beyond the message's length. */
+static int reserve_message(struct cpn_buf *buf, size_t len, size_t remaining)
+{
+    size_t grow;
+
+    if (buf->allocated - buf->length >= len)
+        return 0;
+
+    grow = MIN(MAX(buf->allocated, RECEIVE_RESERVELEN), remaining);
+
+    return cpn_buf_reserve(buf, buf->length + MAX(grow, len));
+}
+
+static int receive_into_cpn_buf(const uint8_t *data, size_t len, uint32_t total, void *payload)
+{
+    struct cpn_buf *buf = ((struct receive_buffer *) payload)->buf;
+    size_t *received = &((struct receive_buffer *) payload)->len;
+
+    if (reserve_message(buf, len, total - *received) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate receive buffer");
+        return -1;
+    }
+
+    if (data == (uint8_t *) buf->data + buf->length)
+        buf->length += len;
+    else if (cpn_buf_append_data(buf, data, len) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate receive buffer");
+        return -1;
+    }
+    *received += len;
+
+    return 0;
+}
+
+static uint8_t *cpn_buf_destination(void *payload, size_t len)
+{
+    return buf_destination(((struct receive_buffer *) payload)->buf, len);
+}
+
+static int receive_into_pending(const uint8_t *data, size_t len, uint32_t total, void *payload)
+{
+    struct cpn_channel *c = (struct cpn_channel *) payload;
+
+    if (reserve_message(&c->rxmsg, len, total - c->rxmsg.length) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate receive buffer");
+        return -1;
+    }
+
+    if (data == (uint8_t *) c->rxmsg.data + c->rxmsg.length) {
+        c->rxmsg.length += len;
+        return 0;
+    }
+
+    return cpn_buf_append_data(&c->rxmsg, data, len);
+}
+
+static uint8_t *pending_destination(void *payload, size_t len)
+{
+    return buf_destination(&((struct cpn_channel *) payload)->rxmsg, len);
+}
+
+/* Determine where the plaintext of a unit can be decrypted to
+ * such that it ends up in the receiver's buffer without being
+ * copied. The receive callbacks skip copying data that has
+ * already been placed at their current position. */
+static uint8_t *receive_destination(const struct receiver *r, size_t len)
+{
+    if (r->destination_fn == NULL)
+        return NULL;
+    return r->destination_fn(r->payload, len);
+}
+
+static int receive_unit(struct cpn_channel *c, struct receive_state *state,
+        uint8_t *unit, size_t unitlen, size_t maxlen,
+        const struct receiver *r)
+{
+    uint32_t networklen, offset = 0, len;
+
+    if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC) {
+        uint8_t *out = NULL;
+
+        /* Units carrying neither the package length nor padding
+         * are decrypted straight into the receiver's buffer */
+        if (state->started && unitlen - overhead(c) <= state->pkglen - state->received)
+            out = receive_destination(r, unitlen - overhead(c));
+        if (out == NULL)
+            out = unit;
+
+        if (decrypt_unit(c, &c->remote_nonce, out, unit, unitlen) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to decrypt received data");
+            return -1;
+        }
+        cpn_symmetric_key_nonce_increment(&c->remote_nonce, 2);
+
+        unit = out;
+    }
+    unitlen -= overhead(c);
+
+    if (!state->started) {
+        memcpy(&networklen, unit, sizeof(networklen));
+        state->pkglen = ntohl(networklen);
+        state->received = 0;
+        state->started = true;
+
+        if (state->pkglen > maxlen) {
+            cpn_log(LOG_LEVEL_ERROR, "Received package length exceeds maxlen");
+            return -1;
+        }
+
+        offset = sizeof(networklen);
+    }
+
+    len = unitlen - offset;
+    if (len > state->pkglen - state->received) {
+        /* Blocks are padded to their full length */
+        if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+            cpn_log(LOG_LEVEL_ERROR, "Received frame exceeds package length");
+            return -1;
+        }
+        len = state->pkglen - state->received;
+    }
+
+    if (r->fn(unit + offset, len, state->pkglen, r->payload) < 0)
+        return -1;
+
+    state->received += len;
+
+    return 0;
+}
+
+/* Receive the remaining units of a large message in slabs,
+ * which are opened in parallel before being passed on */
+static ssize_t receive_parallel(struct cpn_channel *c, struct receive_state *state,
+        const struct receiver *r)
+{
+    struct parallel_unit *units;
+    uint8_t *slab;
+    size_t headerlen, maxunitlen, maxunits;
+    ssize_t ret = -1;
+
+    if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+        headerlen = sizeof(uint32_t);
+        maxunitlen = c->framelen;
+    } else {
+        headerlen = 0;
+        maxunitlen = c->blocklen;
+    }
+    maxunits = MAX(1, PARALLEL_SLABLEN / (headerlen + maxunitlen));
 
-    if ((len = cpn_channel_receive_data(c, buf, sizeof(buf))) < 0)
+    slab = malloc(maxunits * maxunitlen);
+    units = malloc(maxunits * sizeof(*units));
+    if (slab == NULL || units == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate slab");
         goto out;
+    }
 
-    cpn_log(LOG_LEVEL_TRACE, "Receiving protobuf %s:%s of length %"PRIuMAX,
-            descr->package_name, descr->name, len);
+    while (state->received < state->pkglen) {
+        size_t i, nunits = 0, slablen = 0, expected = 0;
 
-    if ((result = protobuf_c_message_unpack(descr, NULL, len, buf)) == NULL) {
-        cpn_log(LOG_LEVEL_ERROR, "Protobuf message could not be unpacked");
-        goto out;
+        while (nunits < maxunits && state->received + expected < state->pkglen) {
+            uint32_t networklen, unitlen = c->blocklen;
+
+            if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+                if ((ret = receive_data(c, (uint8_t *) &networklen, sizeof(networklen))) <= 0)
+                    goto out_receive;
+                unitlen = ntohl(networklen);
+                if (check_framelen(c, unitlen, false) < 0) {
+                    ret = -1;
+                    goto out;
+                }
+            }
+
+            if ((ret = receive_data(c, slab + slablen, unitlen)) <= 0)
+                goto out_receive;
+
+            units[nunits].data = slab + slablen;
+            units[nunits].len = unitlen;
+            slablen += unitlen;
+            expected += unitlen - CPN_CRYPTO_SYMMETRIC_MACBYTES;
+            nunits++;
+        }
+
+        if (crypt_parallel(units, nunits, maxunitlen, &c->remote_key, c->cipher,
+                    &c->remote_nonce, true) < 0)
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to decrypt received data");
+            ret = -1;
+            goto out;
+        }
+        cpn_symmetric_key_nonce_increment(&c->remote_nonce, 2 * nunits);
+
+        for (i = 0; i < nunits; i++) {
+            size_t len = units[i].len - CPN_CRYPTO_SYMMETRIC_MACBYTES;
+
+            if (len > state->pkglen - state->received) {
+                if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+                    cpn_log(LOG_LEVEL_ERROR, "Received frame exceeds package length");
+                    ret = -1;
+                    goto out;
+                }
+                len = state->pkglen - state->received;
+            }
+
+            if (r->fn(units[i].data, len, state->pkglen, r->payload) < 0) {
+                ret = -1;
+                goto out;
+            }
+            state->received += len;
+        }
     }
 
-    ret = 0;
+    ret = state->received;
+    goto out;
 
+out_receive:
+    if (ret == 0)
+        cpn_log(LOG_LEVEL_VERBOSE, "Unable to receive data: channel closed");
+    else
+        cpn_log(LOG_LEVEL_ERROR, "Unable to receive data");
 out:
-    *msg = result;
+    free(units);
+    free(slab);
 
     return ret;
 }
 
-int cpn_channel_relay(struct cpn_channel *channel, int nfds, ...)
+static ssize_t receive_blocks(struct cpn_channel *c, size_t maxlen,
+        const struct receiver *r)
 {
-    fd_set fds;
-    uint8_t buf[2048];
-    int closed = 0, written, received, maxfd, infd, fd, i, ret;
-    va_list ap;
+    struct receive_state state;
+    uint8_t block[MAX_BLOCKLEN];
 
-    if (nfds <= 0) {
-        cpn_log(LOG_LEVEL_ERROR, "Relay called with nfds == 0");
-        return -1;
-    }
+    state.started = false;
 
-    FD_ZERO(&fds);
-    FD_SET(channel->fd, &fds);
-    maxfd = channel->fd;
+    while (!state.started || state.received < state.pkglen) {
+        ssize_t ret;
 
-    va_start(ap, nfds);
-    for (i = 0; i < nfds; i++) {
-        fd = va_arg(ap, int);
-        FD_SET(fd, &fds);
-        maxfd = MAX(maxfd, fd);
+        ret = receive_data(c, block, c->blocklen);
+        if (ret == 0) {
+            cpn_log(LOG_LEVEL_VERBOSE, "Unable to receive data: channel closed");
+            return 0;
+        } else if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to receive data");
+            return -1;
+        }
 
-        if (i == 0)
-            infd = fd;
+        if (receive_unit(c, &state, block, c->blocklen, maxlen, r) < 0)
+            return -1;
+
+        if (use_parallel(c, state.pkglen - state.received))
+            return receive_parallel(c, &state, r);
     }
-    va_end(ap);
 
-    while (1) {
-        fd_set tfds;
+    return state.received;
+}
 
-        memcpy(&tfds, &fds, sizeof(fd_set));
+static ssize_t receive_frames(struct cpn_channel *c, size_t maxlen,
+        const struct receiver *r)
+{
+    struct receive_state state;
+    uint8_t frame[MAX_FRAMELEN];
 
-        if (select(maxfd + 1, &tfds, NULL, NULL, NULL) < 0) {
-            if (errno == EINTR)
-                continue;
-            cpn_log(LOG_LEVEL_ERROR, "Error selecting fds");
+    state.started = false;
+
+    while (!state.started || state.received < state.pkglen) {
+        uint32_t networklen, framelen;
+        ssize_t ret;
+
+        ret = receive_data(c, (uint8_t *) &networklen, sizeof(networklen));
+        if (ret == 0) {
+            cpn_log(LOG_LEVEL_VERBOSE, "Unable to receive data: channel closed");
+            return 0;
+        } else if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to receive data");
             return -1;
         }
 
-        if (FD_ISSET(channel->fd, &tfds)) {
-            received = cpn_channel_receive_data(channel, buf, sizeof(buf));
-            if (received == 0) {
-                cpn_log(LOG_LEVEL_TRACE, "Channel closed, stopping relay");
-                return -1;
-            } else if (received < 0) {
-                cpn_log(LOG_LEVEL_ERROR, "Error relaying data from channel: %s", strerror(errno));
-                return -1;
-            }
+        framelen = ntohl(networklen);
+        if (check_framelen(c, framelen, !state.started) < 0)
+            return -1;
 
-            written = 0;
-            while (written != received) {
-                ret = write(infd, buf + written, received - written);
-                if (ret <= 0) {
-                    cpn_log(LOG_LEVEL_ERROR, "Error relaying data to fd: %s", strerror(errno));
+        ret = receive_data(c, frame, framelen);
+        if (ret == 0) {
+            cpn_log(LOG_LEVEL_VERBOSE, "Unable to receive data: channel closed");
+            return 0;
+        } else if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to receive data");
+            return -1;
+        }
+
+        if (receive_unit(c, &state, frame, framelen, maxlen, r) < 0)
+            return -1;
+
+        if (use_parallel(c, state.pkglen - state.received))
+            return receive_parallel(c, &state, r);
+    }
+
+    return state.received;
+}
+
+static ssize_t receive_nonblocking(struct cpn_channel *c, size_t maxlen,
+        const struct receiver *r)
+{
+    struct receive_state state;
+    struct receiver pending;
+    ssize_t ret;
+
+    init_receiver(&pending, receive_into_pending, pending_destination, c);
+
+    /* The state of partially received messages is kept in the
+     * channel, so that we can pick up where we left off as soon
+     * as more data becomes available */
+    state.pkglen = c->rxlen;
+    state.received = c->rxmsg.length;
+    state.started = c->rxstarted;
+
+    while (!state.started || state.received < state.pkglen) {
+        size_t unitlen, headerlen = 0;
+
+        if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+            uint32_t networklen;
+
+            headerlen = sizeof(networklen);
+            unitlen = 0;
+
+            if (c->rxbuf.length >= headerlen) {
+                memcpy(&networklen, c->rxbuf.data, sizeof(networklen));
+                unitlen = ntohl(networklen);
+                if (check_framelen(c, unitlen, !state.started) < 0)
                     return -1;
-                }
-                written += ret;
             }
+        } else {
+            unitlen = c->blocklen;
         }
 
-        va_start(ap, nfds);
-        for (i = 0; i < nfds; i++) {
-            fd = va_arg(ap, int);
+        if (c->rxbuf.length < headerlen + unitlen || unitlen == 0) {
+            size_t missing = (unitlen ? headerlen + unitlen : headerlen) - c->rxbuf.length;
 
-            if (FD_ISSET(fd, &tfds)) {
-                received = read(fd, buf, sizeof(buf));
-                if (received == 0) {
-                    FD_CLR(fd, &fds);
-                    closed++;
-                    cpn_log(LOG_LEVEL_TRACE, "Relay file descriptor %d/%d closed", closed, nfds);
-                    continue;
-                } else if (received < 0) {
-                    if (errno == EINTR)
-                        continue;
-                    cpn_log(LOG_LEVEL_ERROR, "Error relaying data from fd");
-                    return -1;
-                }
+            if (cpn_buf_reserve(&c->rxbuf, c->rxbuf.length + missing) < 0) {
+                cpn_log(LOG_LEVEL_ERROR, "Unable to allocate receive buffer");
+                return -1;
+            }
 
-                if (cpn_channel_write_data(channel, buf, received) < 0) {
-                    cpn_log(LOG_LEVEL_ERROR, "Error relaying data to channel");
-                    return -1;
-                }
+            ret = receive_ahead(c, (uint8_t *) c->rxbuf.data + c->rxbuf.length, missing);
+            if (ret == 0)
+                ret = recv(c->fd, c->rxbuf.data + c->rxbuf.length, missing, 0);
+            if (ret == 0) {
+                cpn_log(LOG_LEVEL_VERBOSE, "Unable to receive data: channel closed");
+                return 0;
+            } else if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    goto out_pending;
+                cpn_log(LOG_LEVEL_ERROR, "Could not receive data: %s", strerror(errno));
+                return -1;
             }
+
+            c->rxbuf.length += ret;
+            continue;
         }
-        va_end(ap);
 
-        if (closed == nfds) {
-            cpn_log(LOG_LEVEL_TRACE, "All relay file descriptors closed");
-            return 0;
+        if (receive_unit(c, &state, (uint8_t *) c->rxbuf.data + headerlen, unitlen,
+                    maxlen, &pending) < 0)
+            return -1;
+
+        cpn_buf_reset(&c->rxbuf);
+    }
+
+    ret = c->rxmsg.length;
+    if (r->fn((uint8_t *) c->rxmsg.data, c->rxmsg.length, state.pkglen, r->payload) < 0)
+        ret = -1;
+
+    cpn_buf_reset(&c->rxmsg);
+    c->rxlen = 0;
+    c->rxstarted = false;
+
+    return ret;
+
+out_pending:
+    c->rxlen = state.pkglen;
+    c->rxstarted = state.started;
+
+    return CPN_CHANNEL_WOULD_BLOCK;
+}
+
+static ssize_t receive_units(struct cpn_channel *c, size_t maxlen,
+        const struct receiver *r)
+{
+    if (c->nonblocking)
+        return receive_nonblocking(c, maxlen, r);
+
+    switch (c->framing) {
+        case CPN_CHANNEL_FRAMING_FRAMES:
+            return receive_frames(c, maxlen, r);
+        case CPN_CHANNEL_FRAMING_BLOCKS:
+        default:
+            return receive_blocks(c, maxlen, r);
+    }
+}
+
+static ssize_t receive_compressed(struct cpn_channel *c, size_t maxlen,
+        const struct receiver *r)
+{
+    struct cpn_buf compressed = CPN_BUF_INIT, buf = CPN_BUF_INIT;
+    struct receive_buffer rbuf;
+    struct receiver receiver;
+    ssize_t ret;
+
+    rbuf.data = NULL;
+    rbuf.buf = &compressed;
+    rbuf.len = 0;
+    init_receiver(&receiver, receive_into_cpn_buf, cpn_buf_destination, &rbuf);
+
+    /* Uncompressed messages are stored with a single byte of
+     * overhead, so compressed messages are never longer */
+    ret = receive_units(c, maxlen < SIZE_MAX ? maxlen + 1 : maxlen,
+            &receiver);
+    if (ret <= 0)
+        goto out;
+
+    if (cpn_decompress(&buf, (uint8_t *) compressed.data, compressed.length, maxlen) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to decompress received data");
+        ret = -1;
+        goto out;
+    }
+
+    ret = buf.length;
+    if (r->fn((uint8_t *) buf.data, buf.length, buf.length, r->payload) < 0)
+        ret = -1;
+
+out:
+    cpn_buf_clear(&compressed);
+    cpn_buf_clear(&buf);
+
+    return ret;
+}
+
+static bool datagram_is_replayed(const struct cpn_channel *c, uint64_t seq)
+{
+    if (seq > c->rxseq)
+        return false;
+    if (c->rxseq - seq >= DATAGRAM_WINDOW)
+        return true;
+    return (c->rxwindow >> (c->rxseq - seq)) & 1;
+}
+
+static void datagram_set_received(struct cpn_channel *c, uint64_t seq)
+{
+    if (seq > c->rxseq) {
+        if (seq - c->rxseq >= DATAGRAM_WINDOW)
+            c->rxwindow = 0;
+        else
+            c->rxwindow <<= seq - c->rxseq;
+        c->rxseq = seq;
+    }
+
+    c->rxwindow |= (uint64_t) 1 << (c->rxseq - seq);
+}
+
+/* Check a datagram and, with encryption enabled, authenticate and
+ * decrypt it in place. Returns the length of its payload, which
+ * follows the sequence number. Unencrypted datagrams cannot be
+ * authenticated, so they never advance the replay window. */
+static ssize_t open_datagram(struct cpn_channel *c, uint8_t *datagram, size_t len,
+        size_t maxlen)
+{
+    struct cpn_symmetric_key_nonce nonce;
+    uint64_t seq = 0;
+    int i;
+
+    if (len < DATAGRAM_SEQLEN + overhead(c) || len - DATAGRAM_SEQLEN > c->framelen) {
+        cpn_log(LOG_LEVEL_DEBUG, "Dropping datagram with invalid length");
+        return -1;
+    }
+    len -= DATAGRAM_SEQLEN;
+
+    for (i = 0; i < DATAGRAM_SEQLEN; i++)
+        seq = (seq << 8) | datagram[i];
+
+    if (seq == 0 || datagram_is_replayed(c, seq)) {
+        cpn_log(LOG_LEVEL_DEBUG, "Dropping replayed datagram %"PRIu64, seq);
+        return -1;
+    }
+
+    if (len - overhead(c) > maxlen) {
+        cpn_log(LOG_LEVEL_DEBUG, "Dropping datagram exceeding maxlen");
+        return -1;
+    }
+
+    if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC) {
+        memcpy(&nonce, &c->remote_nonce, sizeof(nonce));
+        cpn_symmetric_key_nonce_increment(&nonce, 2 * seq);
+
+        if (decrypt_unit(c, &nonce, datagram + DATAGRAM_SEQLEN,
+                    datagram + DATAGRAM_SEQLEN, len) < 0)
+        {
+            cpn_log(LOG_LEVEL_DEBUG, "Dropping unauthenticated datagram");
+            return -1;
         }
+
+        datagram_set_received(c, seq);
     }
 
-    return 0;
+    return len - overhead(c);
+}
+
+static ssize_t receive_datagram(struct cpn_channel *c, size_t maxlen,
+        const struct receiver *r)
+{
+    uint8_t datagram[DATAGRAM_SEQLEN + MAX_FRAMELEN + 1];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    ssize_t ret;
+
+    while (1) {
+        addrlen = sizeof(addr);
+        ret = recvfrom(c->fd, datagram, sizeof(datagram), c->nonblocking ? MSG_DONTWAIT : 0,
+                (struct sockaddr *) &addr, &addrlen);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (c->nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return CPN_CHANNEL_WOULD_BLOCK;
+            cpn_log(LOG_LEVEL_ERROR, "Could not receive datagram: %s", strerror(errno));
+            return -1;
+        }
+
+        /* Invalid, replayed or stale datagrams are dropped
+         * instead of failing the channel, as anybody can send
+         * them */
+        if ((ret = open_datagram(c, datagram, ret, maxlen)) >= 0)
+            break;
+    }
+
+    /* Replies go to wherever the last authenticated datagram came
+     * from, so that peers may change their address. Anybody could
+     * redirect them by forging unauthenticated datagrams. */
+    if (c->crypto == CPN_CHANNEL_CRYPTO_SYMMETRIC && addrlen <= sizeof(c->addr)) {
+        memcpy(&c->addr, &addr, addrlen);
+        c->addrlen = addrlen;
+    }
+
+    if (r->fn(datagram + DATAGRAM_SEQLEN, ret, ret, r->payload) < 0)
+        return -1;
+
+    return ret;
+}
+
+static int run_pending(struct cpn_channel *c)
+{
+    cpn_channel_pending_fn fn = c->pending_fn;
+    void *payload = c->pending_payload;
+
+    /* The callback may receive data itself */
+    c->pending_fn = NULL;
+    c->pending_free = NULL;
+    c->pending_payload = NULL;
+
+    return fn(c, payload);
+}
+
+int cpn_channel_run_pending(struct cpn_channel *c)
+{
+    if (c->pending_fn == NULL)
+        return 0;
+    return run_pending(c);
+}
+
+static ssize_t receive_message(struct cpn_channel *c, size_t maxlen,
+        const struct receiver *r)
+{
+    if (c->pending_fn && run_pending(c) < 0)
+        return -1;
+
+    if (c->framing == CPN_CHANNEL_FRAMING_DATAGRAMS)
+        return receive_datagram(c, maxlen, r);
+
+    if (c->compression != CPN_COMPRESSION_NONE)
+        return receive_compressed(c, maxlen, r);
+
+    return receive_units(c, maxlen, r);
+}
+
+ssize_t cpn_channel_receive_data(struct cpn_channel *c, uint8_t *out, size_t maxlen)
+{
+    struct receive_buffer buf;
+    struct receiver r;
+
+    buf.data = out;
+    buf.buf = NULL;
+    buf.len = 0;
+    init_receiver(&r, receive_into_buffer, buffer_destination, &buf);
+
+    return receive_message(c, maxlen, &r);
+}
+
+ssize_t cpn_channel_receive_stream(struct cpn_channel *c,
+        cpn_channel_receive_fn fn, void *payload)
+{
+    struct receiver r;
+
+    init_receiver(&r, fn, NULL, payload);
+
+    return receive_message(c, c->maxmsglen, &r);
+}
+
+ssize_t cpn_channel_receive_buf(struct cpn_channel *c, struct cpn_buf *buf)
+{
+    struct receive_buffer rbuf;
+    struct receiver r;
+
+    rbuf.data = NULL;
+    rbuf.buf = buf;
+    rbuf.len = 0;
+    init_receiver(&r, receive_into_cpn_buf, cpn_buf_destination, &rbuf);
+
+    return receive_message(c, c->maxmsglen, &r);
+}
+
+int cpn_channel_receive_protobuf(struct cpn_channel *c, const ProtobufCMessageDescriptor *descr, ProtobufCMessage **msg)
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+    ProtobufCMessage *result = NULL;
+    ssize_t len;
+    int ret = -1;
+
+    if ((len = cpn_channel_receive_buf(c, &buf)) < 0) {
+        if (len == CPN_CHANNEL_WOULD_BLOCK)
+            ret = CPN_CHANNEL_WOULD_BLOCK;
+        goto out;
+    }
+
+    cpn_log(LOG_LEVEL_TRACE, "Receiving protobuf %s:%s of length %"PRIuMAX,
+            descr->package_name, descr->name, len);
+
+    if ((result = protobuf_c_message_unpack(descr, NULL, len, (uint8_t *) buf.data)) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Protobuf message could not be unpacked");
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    cpn_buf_clear(&buf);
+    *msg = result;
+
+    return ret;
+}
+
+static void store_relay_result(int result, void *payload)
+{
+    *(int *) payload = result;
+}
+
+int cpn_channel_relay(struct cpn_channel *channel, int nfds, ...)
+{
+    struct cpn_relay relay;
+    int *fds = NULL, result = -1, i;
+    va_list ap;
+
+    if (nfds <= 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Relay called with nfds == 0");
+        return -1;
+    }
+
+    if ((fds = malloc(nfds * sizeof(*fds))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate relay file descriptors");
+        return -1;
+    }
+
+    va_start(ap, nfds);
+    for (i = 0; i < nfds; i++)
+        fds[i] = va_arg(ap, int);
+    va_end(ap);
+
+    if (cpn_relay_init(&relay) < 0)
+        goto out;
+
+    if (cpn_relay_add(&relay, channel, fds, nfds, store_relay_result, &result) < 0 ||
+            cpn_relay_run(&relay, true) < 0)
+        result = -1;
+
+    cpn_relay_free(&relay);
+
+out:
+    free(fds);
+
+    return result;
 }
@@ -16,6 +16,7 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "config.h"
@@ -24,6 +25,7 @@
 #include "capone/client.h"
 #include "capone/common.h"
 #include "capone/log.h"
+#include "capone/server.h"
 
 #include "capone/crypto/asymmetric.h"
 
@@ -31,26 +33,90 @@
 #include "capone/proto/discovery.pb-c.h"
 #include "capone/proto/encryption.pb-c.h"
 
+#include "lib/negotiation.pb-c.h"
+
 extern int send_key_acknowledgement(struct cpn_channel *channel,
         const struct cpn_sign_keys *sign_keys,
         const struct cpn_asymmetric_pk *local_emph_key,
         const struct cpn_sign_pk *remote_sign_key,
-        const struct cpn_asymmetric_pk *remote_emph_key);
+        const struct cpn_asymmetric_pk *remote_emph_key,
+        const NegotiationMessage *negotiation,
+        const struct cpn_symmetric_key *mac_key);
 extern int receive_key_acknowledgement(struct cpn_asymmetric_pk *out,
+        NegotiationMessage **negotiation,
         struct cpn_channel *c,
         const struct cpn_sign_pk *local_sign_pk,
         const struct cpn_asymmetric_pk *local_emph_key,
-        const struct cpn_sign_pk *remote_sign_pk);
+        const struct cpn_sign_pk *remote_sign_pk,
+        const struct cpn_symmetric_key *mac_key,
+        bool cookies);
+extern int derive_resumption_secret(struct cpn_symmetric_key *out,
+        const struct cpn_symmetric_key *shared_key,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        bool localfirst);
+extern int derive_resumed_key(struct cpn_symmetric_key *out,
+        const struct cpn_symmetric_key *secret,
+        const struct cpn_asymmetric_pk *client_nonce,
+        const struct cpn_asymmetric_pk *server_nonce);
+extern int derive_early_key(struct cpn_symmetric_key *out,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        const struct cpn_asymmetric_keys *client_emph_keys,
+        const struct cpn_asymmetric_pk *client_emph_key,
+        const NegotiationMessage *offer);
+extern int derive_final_key(struct cpn_symmetric_key *out,
+        const struct cpn_symmetric_key *early_key,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        const struct cpn_asymmetric_keys *local_emph_keys,
+        const struct cpn_asymmetric_pk *remote_emph_key,
+        bool client);
+extern bool negotiation_equals(const NegotiationMessage *a,
+        const NegotiationMessage *b);
+extern int write_negotiated_protobuf(struct cpn_channel *channel,
+        const ProtobufCMessage *msg, const NegotiationMessage *negotiation);
+extern int apply_negotiation(struct cpn_channel *channel,
+        const NegotiationMessage *negotiation);
 
 static int initiate_encryption(struct cpn_channel *channel,
+        const struct cpn_sign_keys *sign_keys,
+        const struct cpn_sign_pk *remote_sign_key,
+        bool multiplex,
+        struct cpn_ticket *ticket);
+static int initiate_ik_encryption(struct cpn_channel *channel,
         const struct cpn_sign_keys *sign_keys,
         const struct cpn_sign_pk *remote_sign_key);
 
+/* Ciphers offered to the server, most preferred first. Secretbox
+ * is always available and thus guaranteed to be offered. */
+static const enum cpn_symmetric_cipher preferred_ciphers[] = {
+    CPN_SYMMETRIC_CIPHER_AES256GCM,
+    CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305,
+    CPN_SYMMETRIC_CIPHER_SECRETBOX
+};
+
+/* Compression algorithms offered to the server, most preferred
+ * first */
+static const enum cpn_compression preferred_compressions[] = {
+    CPN_COMPRESSION_LZ4
+};
+
 static int initiate_connection_type(struct cpn_channel *channel,
         ConnectionInitiationMessage__Type type)
 {
     ConnectionInitiationMessage msg = CONNECTION_INITIATION_MESSAGE__INIT;
 
+    /* Servers only accept queries as early data of one-round-trip
+     * handshakes, as anything else could be replayed. Other
+     * commands have to wait for the handshake to complete. */
+    if (type != CONNECTION_INITIATION_MESSAGE__TYPE__QUERY &&
+            cpn_channel_run_pending(channel) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to complete handshake");
+        return -1;
+    }
+
     msg.type = type;
 
     if (cpn_channel_write_protobuf(channel, &msg.base) < 0) {
@@ -168,11 +234,56 @@ void cpn_discovery_results_clear(struct cpn_discovery_results *results)
     free(results->services);
 }
 
+static int connect_channel(struct cpn_channel *channel,
+        const char *host,
+        uint32_t port,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        bool multiplex,
+        struct cpn_ticket *ticket)
+{
+    if (cpn_channel_init_from_host(channel, host, port, CPN_CHANNEL_TYPE_TCP) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not initialize channel");
+        return -1;
+    }
+
+    if (cpn_channel_connect(channel) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not connect to server");
+        return -1;
+    }
+
+    if (initiate_encryption(channel, local_keys, remote_key, multiplex, ticket) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initiate encryption");
+        return -1;
+    }
+
+    return 0;
+}
+
 int cpn_client_connect(struct cpn_channel *channel,
         const char *host,
         uint32_t port,
         const struct cpn_sign_keys *local_keys,
         const struct cpn_sign_pk *remote_key)
+{
+    return connect_channel(channel, host, port, local_keys, remote_key, false, NULL);
+}
+
+int cpn_client_connect_resumable(struct cpn_channel *channel,
+        const char *host,
+        uint32_t port,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        struct cpn_ticket *ticket)
+{
+    return connect_channel(channel, host, port, local_keys, remote_key, false, ticket);
+}
+
+int cpn_client_connect_ik(struct cpn_channel *channel,
+        const char *host,
+        uint32_t port,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key)
 {
     if (cpn_channel_init_from_host(channel, host, port, CPN_CHANNEL_TYPE_TCP) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not initialize channel");
@@ -184,7 +295,7 @@ int cpn_client_connect(struct cpn_channel *channel,
         return -1;
     }
 
-    if (initiate_encryption(channel, local_keys, remote_key) < 0) {
+    if (initiate_ik_encryption(channel, local_keys, remote_key) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to initiate encryption");
         return -1;
     }
@@ -192,6 +303,29 @@ int cpn_client_connect(struct cpn_channel *channel,
     return 0;
 }
 
+int cpn_client_connect_mux(struct cpn_mux *mux,
+        struct cpn_channel *channel,
+        const char *host,
+        uint32_t port,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key)
+{
+    if (connect_channel(channel, host, port, local_keys, remote_key, true, NULL) < 0)
+        return -1;
+
+    if (!channel->multiplexed) {
+        cpn_log(LOG_LEVEL_ERROR, "Server does not support multiplexing");
+        return -1;
+    }
+
+    if (cpn_mux_init(mux, channel, CPN_MUX_ROLE_CLIENT) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to multiplex channel");
+        return -1;
+    }
+
+    return 0;
+}
+
 int cpn_client_start_session(struct cpn_session **out,
         struct cpn_channel *channel,
         uint32_t sessionid,
@@ -236,6 +370,11 @@ int cpn_client_start_session(struct cpn_session **out,
         goto out;
     }
 
+    if (cpn_service_plugin_setup_channel(plugin, channel) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not set up channel for service");
+        goto out;
+    }
+
     if (plugin->params_desc) {
         params = protobuf_c_message_unpack(plugin->params_desc, NULL,
                 result->result->parameters.len, result->result->parameters.data);
@@ -425,7 +564,8 @@ out:
 
 static int send_ephemeral_key(struct cpn_channel *channel,
         const struct cpn_sign_keys *sign_keys,
-        const struct cpn_asymmetric_pk *encrypt_key)
+        const struct cpn_asymmetric_pk *encrypt_key,
+        const NegotiationMessage *offer)
 {
     EncryptionInitiationMessage msg = ENCRYPTION_INITIATION_MESSAGE__INIT;
     IdentityMessage *identity = NULL;
@@ -445,7 +585,7 @@ static int send_ephemeral_key(struct cpn_channel *channel,
     msg.identity = identity;
     msg.ephemeral = ephemeral;
 
-    if (cpn_channel_write_protobuf(channel, &msg.base) < 0) {
+    if (write_negotiated_protobuf(channel, &msg.base, offer) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not send negotiation");
         goto out;
     }
@@ -461,50 +601,351 @@ out:
     return err;
 }
 
+static size_t offer_ciphers(uint32_t *ciphers)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < ARRAY_SIZE(preferred_ciphers); i++) {
+        if (cpn_symmetric_cipher_is_available(preferred_ciphers[i]))
+            ciphers[n++] = preferred_ciphers[i];
+    }
+
+    return n;
+}
+
+static bool is_offered_cipher(const NegotiationMessage *offer, uint32_t cipher)
+{
+    size_t i;
+
+    for (i = 0; i < offer->n_ciphers; i++) {
+        if (offer->ciphers[i] == cipher)
+            return true;
+    }
+
+    return false;
+}
+
+static size_t offer_compressions(const struct cpn_channel *channel, uint32_t *compressions)
+{
+    size_t i, n = 0;
+
+    if (!channel->compression_level)
+        return 0;
+
+    for (i = 0; i < ARRAY_SIZE(preferred_compressions); i++) {
+        if (cpn_compression_is_available(preferred_compressions[i]))
+            compressions[n++] = preferred_compressions[i];
+    }
+
+    return n;
+}
+
+static bool is_offered_compression(const NegotiationMessage *offer, uint32_t compression)
+{
+    size_t i;
+
+    for (i = 0; i < offer->n_compressions; i++) {
+        if (offer->compressions[i] == compression)
+            return true;
+    }
+
+    return false;
+}
+
 static int initiate_encryption(struct cpn_channel *channel,
         const struct cpn_sign_keys *sign_keys,
-        const struct cpn_sign_pk *remote_sign_key)
+        const struct cpn_sign_pk *remote_sign_key,
+        bool multiplex,
+        struct cpn_ticket *ticket)
 {
+    NegotiationMessage offer = NEGOTIATION_MESSAGE__INIT;
+    NegotiationMessage *selection = NULL;
     struct cpn_asymmetric_keys emph_keys;
     struct cpn_asymmetric_pk remote_emph_key;
-    struct cpn_symmetric_key shared_key;
+    struct cpn_symmetric_key shared_key, secret;
+    uint32_t ciphers[ARRAY_SIZE(preferred_ciphers)];
+    uint32_t compressions[ARRAY_SIZE(preferred_compressions)];
+    uint8_t cookie[CPN_SERVER_COOKIE_MAXLEN];
+    bool resumed;
+    int ret, err = -1;
 
     if (cpn_asymmetric_keys_generate(&emph_keys) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to generate key pair");
-        return -1;
+        goto out;
     }
 
-    if (send_ephemeral_key(channel, sign_keys, &emph_keys.pk) < 0) {
+    offer.has_framelen = 1;
+    offer.framelen = channel->framelen;
+    offer.ciphers = ciphers;
+    offer.n_ciphers = offer_ciphers(ciphers);
+    offer.compressions = compressions;
+    offer.n_compressions = offer_compressions(channel, compressions);
+    offer.has_multiplex = multiplex;
+    offer.multiplex = multiplex;
+    offer.has_cookies = 1;
+    offer.cookies = 1;
+
+    /* The ephemeral key is still sent along with the ticket such
+     * that the server is able to fall back to a full handshake
+     * in case it does not accept the ticket */
+    if (ticket) {
+        offer.has_resumption = 1;
+        offer.resumption = 1;
+        if (ticket->len && !memcmp(&ticket->identity, remote_sign_key, sizeof(ticket->identity))) {
+            offer.has_ticket = 1;
+            offer.ticket.data = ticket->data;
+            offer.ticket.len = ticket->len;
+        }
+    }
+
+    if (send_ephemeral_key(channel, sign_keys, &emph_keys.pk, &offer) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to send session key");
-        return -1;
+        goto out;
     }
 
-    if (receive_key_acknowledgement(&remote_emph_key, channel,
-                &sign_keys->pk, &emph_keys.pk, remote_sign_key) < 0)
-    {
+    ret = receive_key_acknowledgement(&remote_emph_key, &selection, channel,
+            &sign_keys->pk, &emph_keys.pk, remote_sign_key,
+            offer.has_ticket ? &ticket->secret : NULL, true);
+
+    /* Servers under load ask us to prove our reachability by
+     * sending our initiation again along with their cookie */
+    if (ret > 0) {
+        memcpy(cookie, selection->cookie.data, selection->cookie.len);
+        offer.has_cookie = 1;
+        offer.cookie.data = cookie;
+        offer.cookie.len = selection->cookie.len;
+        negotiation_message__free_unpacked(selection, NULL);
+        selection = NULL;
+
+        if (send_ephemeral_key(channel, sign_keys, &emph_keys.pk, &offer) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to answer cookie request");
+            goto out;
+        }
+
+        ret = receive_key_acknowledgement(&remote_emph_key, &selection, channel,
+                &sign_keys->pk, &emph_keys.pk, remote_sign_key,
+                offer.has_ticket ? &ticket->secret : NULL, false);
+    }
+
+    if (ret < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to receive ephemeral key signature");
-        return -1;
+        goto out;
+    }
+
+    if (selection->has_framelen && selection->framelen > offer.framelen) {
+        cpn_log(LOG_LEVEL_ERROR, "Server selected invalid frame length");
+        goto out;
+    }
+
+    if (selection->n_ciphers > 1 || (selection->n_ciphers == 1 &&
+                !is_offered_cipher(&offer, selection->ciphers[0])))
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Server selected invalid cipher");
+        goto out;
     }
 
+    if (selection->n_compressions > 1 || (selection->n_compressions == 1 &&
+                !is_offered_compression(&offer, selection->compressions[0])))
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Server selected invalid compression");
+        goto out;
+    }
+
+    if (selection->has_multiplex && selection->multiplex && !multiplex) {
+        cpn_log(LOG_LEVEL_ERROR, "Server selected multiplexing without offer");
+        goto out;
+    }
+
+    if (selection->has_ticket && (!ticket || selection->ticket.len > CPN_TICKET_MAXLEN)) {
+        cpn_log(LOG_LEVEL_ERROR, "Server issued invalid ticket");
+        goto out;
+    }
+
+    resumed = selection->has_resumed && selection->resumed;
+
     if (send_key_acknowledgement(channel,
                 sign_keys, &emph_keys.pk,
-                remote_sign_key, &remote_emph_key) < 0)
+                remote_sign_key, &remote_emph_key, selection,
+                resumed ? &ticket->secret : NULL) < 0)
     {
         cpn_log(LOG_LEVEL_ERROR, "Unable to send key verification");
-        return -1;
+        goto out;
     }
 
-    if (cpn_symmetric_key_from_scalarmult(&shared_key, &emph_keys, &remote_emph_key, true) < 0) {
+    if (resumed) {
+        if (derive_resumed_key(&shared_key, &ticket->secret, &emph_keys.pk, &remote_emph_key) < 0)
+            goto out;
+    } else if (cpn_symmetric_key_from_scalarmult(&shared_key, &emph_keys, &remote_emph_key, true) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to derive shared key");
-        return -1;
+        goto out;
     }
 
-    cpn_memzero(&emph_keys, sizeof(emph_keys));
+    if (!resumed && selection->has_ticket) {
+        if (derive_resumption_secret(&secret, &shared_key, sign_keys, remote_sign_key, true) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to derive resumption secret");
+            goto out;
+        }
+
+        memcpy(&ticket->identity, remote_sign_key, sizeof(ticket->identity));
+        memcpy(&ticket->secret, &secret, sizeof(ticket->secret));
+        memcpy(ticket->data, selection->ticket.data, selection->ticket.len);
+        ticket->len = selection->ticket.len;
+    }
 
     if (cpn_channel_enable_encryption(channel, &shared_key, 0) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not enable encryption");
+        goto out;
+    }
+
+    if (apply_negotiation(channel, selection) < 0)
+        goto out;
+
+    err = 0;
+
+out:
+    cpn_memzero(&emph_keys, sizeof(emph_keys));
+    cpn_memzero(&secret, sizeof(secret));
+    cpn_memzero(&shared_key, sizeof(shared_key));
+    if (selection)
+        negotiation_message__free_unpacked(selection, NULL);
+
+    return err;
+}
+
+struct ik_handshake {
+    struct cpn_sign_keys local_keys;
+    struct cpn_sign_pk remote_key;
+    struct cpn_asymmetric_keys emph_keys;
+    struct cpn_symmetric_key early_key;
+    enum cpn_channel_framing framing;
+    NegotiationMessage offer;
+    uint32_t cipher;
+};
+
+static void free_ik_handshake(void *payload)
+{
+    cpn_memzero(payload, sizeof(struct ik_handshake));
+    free(payload);
+}
+
+static int finish_ik_encryption(struct cpn_channel *channel, void *payload)
+{
+    struct ik_handshake *state = (struct ik_handshake *) payload;
+    NegotiationMessage *selection = NULL;
+    struct cpn_asymmetric_pk remote_emph_key;
+    struct cpn_symmetric_key key;
+    enum cpn_channel_framing framing = channel->framing;
+    enum cpn_channel_crypto crypto = channel->crypto;
+    enum cpn_compression compression = channel->compression;
+    int err = -1;
+
+    /* The server's acknowledgement is sent before it has applied
+     * the negotiated parameters, so we temporarily have to revert
+     * to the plain defaults to be able to receive it */
+    channel->framing = state->framing;
+    channel->crypto = CPN_CHANNEL_CRYPTO_NONE;
+    channel->compression = CPN_COMPRESSION_NONE;
+
+    err = receive_key_acknowledgement(&remote_emph_key, &selection, channel,
+                &state->local_keys.pk, &state->emph_keys.pk, &state->remote_key,
+                &state->early_key, false);
+
+    channel->framing = framing;
+    channel->crypto = crypto;
+    channel->compression = compression;
+
+    if (err < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to receive ephemeral key acknowledgement");
+        goto out;
+    }
+    err = -1;
+
+    if (!negotiation_equals(selection, &state->offer)) {
+        cpn_log(LOG_LEVEL_ERROR, "Server did not accept one-round-trip handshake");
+        goto out;
+    }
+
+    if (derive_final_key(&key, &state->early_key, &state->local_keys, &state->remote_key,
+                &state->emph_keys, &remote_emph_key, true) < 0 ||
+            cpn_channel_update_key(channel, &key) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to switch to final key");
+        goto out;
+    }
+
+    err = 0;
+
+out:
+    cpn_memzero(&key, sizeof(key));
+    free_ik_handshake(state);
+    if (selection)
+        negotiation_message__free_unpacked(selection, NULL);
+
+    return err;
+}
+
+static int initiate_ik_encryption(struct cpn_channel *channel,
+        const struct cpn_sign_keys *sign_keys,
+        const struct cpn_sign_pk *remote_sign_key)
+{
+    NegotiationMessage offer = NEGOTIATION_MESSAGE__INIT;
+    struct ik_handshake *state;
+    int err = -1;
+
+    if ((state = malloc(sizeof(*state))) == NULL)
         return -1;
+    memcpy(&state->local_keys, sign_keys, sizeof(state->local_keys));
+    memcpy(&state->remote_key, remote_sign_key, sizeof(state->remote_key));
+    state->framing = channel->framing;
+
+    if (cpn_asymmetric_keys_generate(&state->emph_keys) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to generate key pair");
+        goto out;
     }
 
-    return 0;
+    /* Data is sent before the server is able to select any
+     * parameters, so we only offer what every server accepts */
+    if (cpn_symmetric_cipher_is_available(CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305))
+        state->cipher = CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305;
+    else
+        state->cipher = CPN_SYMMETRIC_CIPHER_SECRETBOX;
+
+    offer.has_framelen = 1;
+    offer.framelen = channel->framelen;
+    offer.ciphers = &state->cipher;
+    offer.n_ciphers = 1;
+    offer.has_ik = 1;
+    offer.ik = 1;
+    memcpy(&state->offer, &offer, sizeof(offer));
+
+    if (derive_early_key(&state->early_key, sign_keys, remote_sign_key,
+                &state->emph_keys, &state->emph_keys.pk, &offer) < 0)
+        goto out;
+
+    if (send_ephemeral_key(channel, sign_keys, &state->emph_keys.pk, &offer) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to send session key");
+        goto out;
+    }
+
+    if (cpn_channel_enable_encryption(channel, &state->early_key, 0) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not enable encryption");
+        goto out;
+    }
+
+    if (apply_negotiation(channel, &offer) < 0)
+        goto out;
+
+    /* The server's acknowledgement is only received in front
+     * of its first reply, such that the first request can
+     * already be sent along with our initiation */
+    cpn_channel_set_pending(channel, finish_ik_encryption, free_ik_handshake, state);
+    state = NULL;
+
+    err = 0;
+
+out:
+    if (state)
+        free_ik_handshake(state);
+
+    return err;
 }
@@ -33,9 +33,24 @@
 
 int cpn_spawn(struct cpn_thread *t, thread_fn fn, void *payload)
 {
+    pthread_attr_t attr;
     pthread_t stub;
+    int err;
 
-    return pthread_create(t ? &t->t : &stub, NULL, fn, payload);
+    if (t)
+        return pthread_create(&t->t, NULL, fn, payload) == 0 ? 0 : -1;
+
+    /* Nobody is going to join threads without a handle, so they
+     * have to release their resources on their own */
+    if (pthread_attr_init(&attr) != 0)
+        return -1;
+
+    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+        pthread_create(&stub, &attr, fn, payload) != 0;
+
+    pthread_attr_destroy(&attr);
+
+    return err ? -1 : 0;
 }
 
 int cpn_kill(struct cpn_thread *t)
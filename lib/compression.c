@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+
+#ifdef HAVE_LZ4
+# include <lz4.h>
+# include <lz4hc.h>
+#endif
+
+#include "capone/common.h"
+#include "capone/compression.h"
+#include "capone/log.h"
+
+/* Messages below this length are not worth compressing */
+#define MIN_COMPRESSLEN 64
+
+bool cpn_compression_is_available(enum cpn_compression compression)
+{
+    switch (compression) {
+        case CPN_COMPRESSION_NONE:
+            return true;
+        case CPN_COMPRESSION_LZ4:
+#ifdef HAVE_LZ4
+            return true;
+#else
+            return false;
+#endif
+    }
+
+    return false;
+}
+
+const char *cpn_compression_to_string(enum cpn_compression compression)
+{
+    switch (compression) {
+        case CPN_COMPRESSION_NONE:
+            return "none";
+        case CPN_COMPRESSION_LZ4:
+            return "lz4";
+    }
+
+    return NULL;
+}
+
+static int store(struct cpn_buf *out, const uint8_t *data, size_t len)
+{
+    uint8_t method = CPN_COMPRESSION_NONE;
+
+    if (cpn_buf_reserve(out, out->length + sizeof(method) + len) < 0 ||
+            cpn_buf_append_data(out, &method, sizeof(method)) < 0 ||
+            cpn_buf_append_data(out, data, len) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate compression buffer");
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_LZ4
+static int compress_lz4(struct cpn_buf *out, int level, const uint8_t *data, size_t len)
+{
+    uint8_t method = CPN_COMPRESSION_LZ4;
+    uint32_t networklen;
+    size_t headerlen = sizeof(method) + sizeof(networklen);
+    char *dst;
+    int ret;
+
+    if (len > LZ4_MAX_INPUT_SIZE)
+        return store(out, data, len);
+
+    if (cpn_buf_reserve(out, out->length + len) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate compression buffer");
+        return -1;
+    }
+
+    /* The output is limited to less than the stored data would
+     * take, so that the compressor bails out early on data which
+     * does not compress */
+    dst = out->data + out->length + headerlen;
+    if (level <= CPN_COMPRESSION_LEVEL_DEFAULT)
+        ret = LZ4_compress_default((const char *) data, dst, len, len - headerlen);
+    else
+        ret = LZ4_compress_HC((const char *) data, dst, len, len - headerlen, level);
+
+    if (ret <= 0)
+        return store(out, data, len);
+
+    networklen = htonl(len);
+    out->data[out->length] = method;
+    memcpy(out->data + out->length + sizeof(method), &networklen, sizeof(networklen));
+    out->length += headerlen + ret;
+
+    return 0;
+}
+
+static int decompress_lz4(struct cpn_buf *out, const uint8_t *data, size_t len, size_t maxlen)
+{
+    uint32_t networklen, rawlen;
+    int ret;
+
+    if (len < sizeof(networklen)) {
+        cpn_log(LOG_LEVEL_ERROR, "Compressed data is truncated");
+        return -1;
+    }
+
+    memcpy(&networklen, data, sizeof(networklen));
+    rawlen = ntohl(networklen);
+
+    if (rawlen > maxlen || rawlen > LZ4_MAX_INPUT_SIZE) {
+        cpn_log(LOG_LEVEL_ERROR, "Decompressed data exceeds maxlen");
+        return -1;
+    }
+
+    if (cpn_buf_reserve(out, out->length + rawlen) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate decompression buffer");
+        return -1;
+    }
+
+    ret = LZ4_decompress_safe((const char *) data + sizeof(networklen),
+            out->data + out->length, len - sizeof(networklen), rawlen);
+    if (ret < 0 || (uint32_t) ret != rawlen) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to decompress data");
+        return -1;
+    }
+
+    out->length += rawlen;
+
+    return 0;
+}
+#endif
+
+int cpn_compress(struct cpn_buf *out, enum cpn_compression compression,
+        int level, const uint8_t *data, size_t len)
+{
+    if (len < MIN_COMPRESSLEN)
+        return store(out, data, len);
+
+    switch (compression) {
+        case CPN_COMPRESSION_NONE:
+            return store(out, data, len);
+        case CPN_COMPRESSION_LZ4:
+#ifdef HAVE_LZ4
+            return compress_lz4(out, level, data, len);
+#else
+            break;
+#endif
+    }
+
+    UNUSED(level);
+    cpn_log(LOG_LEVEL_ERROR, "Compression algorithm %d is not available", compression);
+
+    return -1;
+}
+
+int cpn_decompress(struct cpn_buf *out, const uint8_t *data, size_t len, size_t maxlen)
+{
+    if (len < 1) {
+        cpn_log(LOG_LEVEL_ERROR, "Compressed data is truncated");
+        return -1;
+    }
+
+    switch (data[0]) {
+        case CPN_COMPRESSION_NONE:
+            if (len - 1 > maxlen) {
+                cpn_log(LOG_LEVEL_ERROR, "Decompressed data exceeds maxlen");
+                return -1;
+            }
+            if (len > 1 && cpn_buf_append_data(out, data + 1, len - 1) < 0) {
+                cpn_log(LOG_LEVEL_ERROR, "Unable to allocate decompression buffer");
+                return -1;
+            }
+            return 0;
+#ifdef HAVE_LZ4
+        case CPN_COMPRESSION_LZ4:
+            return decompress_lz4(out, data + 1, len - 1, maxlen);
+#endif
+    }
+
+    cpn_log(LOG_LEVEL_ERROR, "Unable to decompress data with algorithm %d", data[0]);
+
+    return -1;
+}
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 
 #include <sodium/crypto_box.h>
+#include <sodium/crypto_sign.h>
 
 #include "capone/log.h"
 
@@ -67,3 +68,27 @@ int cpn_asymmetric_pk_to_proto(PublicKeyMessage **out,
 
     return 0;
 }
+
+int cpn_asymmetric_keys_from_sign_keys(struct cpn_asymmetric_keys *out,
+        const struct cpn_sign_keys *keys)
+{
+    if (crypto_sign_ed25519_sk_to_curve25519(out->sk.data, keys->sk.data) < 0 ||
+            crypto_sign_ed25519_pk_to_curve25519(out->pk.data, keys->pk.data) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to convert signature keys");
+        return -1;
+    }
+
+    return 0;
+}
+
+int cpn_asymmetric_pk_from_sign_pk(struct cpn_asymmetric_pk *out,
+        const struct cpn_sign_pk *pk)
+{
+    if (crypto_sign_ed25519_pk_to_curve25519(out->data, pk->data) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to convert public signature key");
+        return -1;
+    }
+
+    return 0;
+}
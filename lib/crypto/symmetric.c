@@ -17,6 +17,8 @@
 
 #include <string.h>
 
+#include <sodium/crypto_aead_aes256gcm.h>
+#include <sodium/crypto_aead_xchacha20poly1305.h>
 #include <sodium/crypto_scalarmult.h>
 #include <sodium/crypto_secretbox.h>
 #include <sodium/utils.h>
@@ -108,22 +110,86 @@ void cpn_symmetric_key_hex_from_key(struct cpn_symmetric_key_hex *out, const str
     sodium_bin2hex(out->data, sizeof(out->data), key->data, sizeof(key->data));
 }
 
+bool cpn_symmetric_cipher_is_available(enum cpn_symmetric_cipher cipher)
+{
+    switch (cipher) {
+        case CPN_SYMMETRIC_CIPHER_SECRETBOX:
+        case CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305:
+            return true;
+        case CPN_SYMMETRIC_CIPHER_AES256GCM:
+            return crypto_aead_aes256gcm_is_available();
+    }
+
+    return false;
+}
+
+const char *cpn_symmetric_cipher_to_string(enum cpn_symmetric_cipher cipher)
+{
+    switch (cipher) {
+        case CPN_SYMMETRIC_CIPHER_SECRETBOX:
+            return "xsalsa20poly1305";
+        case CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305:
+            return "xchacha20poly1305";
+        case CPN_SYMMETRIC_CIPHER_AES256GCM:
+            return "aes256gcm";
+    }
+
+    return NULL;
+}
+
 int cpn_symmetric_key_encrypt(uint8_t *out, const struct cpn_symmetric_key *key,
-        const struct cpn_symmetric_key_nonce *nonce, uint8_t *data, size_t datalen)
+        enum cpn_symmetric_cipher cipher, const struct cpn_symmetric_key_nonce *nonce,
+        uint8_t *data, size_t datalen)
 {
-    return crypto_secretbox_easy(out, data, datalen, nonce->data, key->data);
+    switch (cipher) {
+        case CPN_SYMMETRIC_CIPHER_SECRETBOX:
+            return crypto_secretbox_easy(out, data, datalen, nonce->data, key->data);
+        case CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305:
+            return crypto_aead_xchacha20poly1305_ietf_encrypt(out, NULL,
+                    data, datalen, NULL, 0, NULL, nonce->data, key->data);
+        case CPN_SYMMETRIC_CIPHER_AES256GCM:
+            /* AES-GCM only uses the first 12 bytes of our nonce.
+             * As nonces are incremented starting with the least
+             * significant byte, these bytes are still unique. */
+            if (!crypto_aead_aes256gcm_is_available())
+                return -1;
+            return crypto_aead_aes256gcm_encrypt(out, NULL,
+                    data, datalen, NULL, 0, NULL, nonce->data, key->data);
+    }
+
+    return -1;
 }
 
 int cpn_symmetric_key_decrypt(uint8_t *out, const struct cpn_symmetric_key *key,
-        const struct cpn_symmetric_key_nonce *nonce, uint8_t *data, size_t datalen)
+        enum cpn_symmetric_cipher cipher, const struct cpn_symmetric_key_nonce *nonce,
+        uint8_t *data, size_t datalen)
 {
-    return crypto_secretbox_open_easy(out, data, datalen, nonce->data, key->data);
+    switch (cipher) {
+        case CPN_SYMMETRIC_CIPHER_SECRETBOX:
+            return crypto_secretbox_open_easy(out, data, datalen, nonce->data, key->data);
+        case CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305:
+            return crypto_aead_xchacha20poly1305_ietf_decrypt(out, NULL, NULL,
+                    data, datalen, NULL, 0, nonce->data, key->data);
+        case CPN_SYMMETRIC_CIPHER_AES256GCM:
+            if (!crypto_aead_aes256gcm_is_available())
+                return -1;
+            return crypto_aead_aes256gcm_decrypt(out, NULL, NULL,
+                    data, datalen, NULL, 0, nonce->data, key->data);
+    }
+
+    return -1;
 }
 
 void cpn_symmetric_key_nonce_increment(struct cpn_symmetric_key_nonce *nonce, size_t count)
 {
+    uint8_t summand[sizeof(nonce->data)];
     size_t i;
 
-    for (i = 0; i < count; i++)
-        sodium_increment(nonce->data, sizeof(nonce->data));
+    /* Nonces are little-endian numbers, which allows skipping
+     * ahead by large counts in a single addition */
+    memset(summand, 0, sizeof(summand));
+    for (i = 0; i < sizeof(count) && i < sizeof(summand); i++)
+        summand[i] = (count >> (8 * i)) & 0xff;
+
+    sodium_add(nonce->data, summand, sizeof(nonce->data));
 }
@@ -0,0 +1,882 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "capone/buf.h"
+#include "capone/log.h"
+#include "capone/mux.h"
+
+/* Every frame starts with its type and the stream identifier */
+#define MUX_HEADERLEN 5
+#define MUX_CHUNKLEN (16 * 1024)
+
+/* Data either side may send on a stream before the receiving
+ * side has to grant more, and the amount of data consumed
+ * before we grant it */
+#define MUX_WINDOW (256 * 1024)
+#define MUX_WINDOW_UPDATE (MUX_WINDOW / 4)
+
+/* Data pending to be written to the channel before we stop
+ * reading from streams */
+#define MUX_HIGH_WATERMARK (256 * 1024)
+
+/* Streams the remote side may have open at the same time.
+ * Further streams are closed right away. */
+#define MUX_MAX_STREAMS 64
+
+/* Time spent flushing queued frames when stopping */
+#define MUX_LINGER_MS 1000
+
+enum mux_frame_type {
+    MUX_FRAME_DATA,
+    MUX_FRAME_WINDOW,
+    MUX_FRAME_CLOSE
+};
+
+struct mux_stream {
+    uint32_t id;
+    /* Multiplexer's end of the socket pair */
+    int fd;
+    /* Caller's end of the socket pair until it has been accepted */
+    int appfd;
+
+    /* Data received from the remote side, pending to be written
+     * to the stream */
+    struct cpn_buf out;
+    size_t outoff;
+    /* Data we may still send to the remote side */
+    uint32_t credit;
+    /* Data written to the stream but not yet granted to the
+     * remote side again */
+    uint32_t consumed;
+
+    /* No more data is read from the stream */
+    bool txclosed;
+    /* No more data is received from the remote side */
+    bool rxclosed;
+    /* The caller stopped reading, so received data is dropped */
+    bool broken;
+};
+
+static int set_flags(int fd, bool nonblocking)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFD)) < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0)
+        return -1;
+    if (!nonblocking)
+        return 0;
+    if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void drain_pipe(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+static int poke_pipe(int fd)
+{
+    ssize_t ret;
+
+    do {
+        ret = write(fd, "", 1);
+    } while (ret < 0 && errno == EINTR);
+
+    /* A full pipe is readable anyway */
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+
+    return 0;
+}
+
+/* Make the accept descriptor readable. The mutex has to be held
+ * by the caller, so that draining it cannot lose any signal. */
+static void signal_accept(struct cpn_mux *m)
+{
+    if (poke_pipe(m->acceptfds[1]) < 0)
+        cpn_log(LOG_LEVEL_ERROR, "Unable to signal accepted stream");
+}
+
+static void free_stream(struct mux_stream *s)
+{
+    if (s == NULL)
+        return;
+
+    if (s->fd >= 0)
+        close(s->fd);
+    if (s->appfd >= 0)
+        close(s->appfd);
+    cpn_buf_clear(&s->out);
+    free(s);
+}
+
+static struct mux_stream *create_stream(uint32_t id)
+{
+    struct mux_stream *s;
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to create stream: %s", strerror(errno));
+        return NULL;
+    }
+
+    if ((s = calloc(1, sizeof(*s))) == NULL) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+
+    s->id = id;
+    s->fd = fds[0];
+    s->appfd = fds[1];
+    s->credit = MUX_WINDOW;
+
+    if (set_flags(s->fd, true) < 0 || set_flags(s->appfd, false) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to set stream flags: %s", strerror(errno));
+        free_stream(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+static int init_stream_channel(struct cpn_mux *m, struct cpn_channel *c, int fd)
+{
+    /* Frames are only as long as the data they carry, which
+     * avoids padding small messages on every stream */
+    if (cpn_channel_init_from_fd(c, fd, (struct sockaddr *) &m->channel->addr,
+                m->channel->addrlen, CPN_CHANNEL_TYPE_TCP) < 0 ||
+            cpn_channel_set_framing(c, CPN_CHANNEL_FRAMING_FRAMES) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initialize stream channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool is_local(const struct cpn_mux *m, uint32_t id)
+{
+    return (id % 2 == 1) == (m->role == CPN_MUX_ROLE_CLIENT);
+}
+
+static struct mux_stream *find_stream(struct cpn_mux *m, uint32_t id)
+{
+    struct cpn_list_entry *it;
+    struct mux_stream *s;
+
+    cpn_list_foreach(&m->streams, it, s) {
+        if (s->id == id)
+            return s;
+    }
+
+    return NULL;
+}
+
+static size_t out_pending(const struct mux_stream *s)
+{
+    return s->out.length - s->outoff;
+}
+
+static size_t tx_pending(const struct cpn_mux *m)
+{
+    return m->channel->txbuf.length - m->channel->txoff;
+}
+
+static int write_frame(struct cpn_mux *m, enum mux_frame_type type,
+        uint32_t id, uint32_t len)
+{
+    int err;
+
+    /* The payload has already been put in place by the caller */
+    m->txframe[0] = type;
+    id = htonl(id);
+    memcpy(m->txframe + 1, &id, sizeof(id));
+
+    err = cpn_channel_write_data(m->channel, m->txframe, MUX_HEADERLEN + len);
+    if (err < 0 && err != CPN_CHANNEL_WOULD_BLOCK) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to write multiplexed frame");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int grant_window(struct cpn_mux *m, struct mux_stream *s)
+{
+    uint32_t increment;
+
+    if (s->consumed < MUX_WINDOW_UPDATE || s->rxclosed)
+        return 0;
+
+    increment = htonl(s->consumed);
+    memcpy(m->txframe + MUX_HEADERLEN, &increment, sizeof(increment));
+    s->consumed = 0;
+
+    return write_frame(m, MUX_FRAME_WINDOW, s->id, sizeof(increment));
+}
+
+static int flush_stream(struct cpn_mux *m, struct mux_stream *s)
+{
+    ssize_t ret;
+
+    while (out_pending(s)) {
+        ret = send(s->fd, s->out.data + s->outoff, out_pending(s), MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            /* The caller has closed the stream, so nobody is
+             * interested in its data anymore */
+            cpn_log(LOG_LEVEL_TRACE, "Dropping data of stream %"PRIu32, s->id);
+            s->broken = true;
+            ret = out_pending(s);
+        }
+
+        s->outoff += ret;
+        s->consumed += ret;
+    }
+
+    if (out_pending(s) == 0) {
+        cpn_buf_reset(&s->out);
+        s->outoff = 0;
+
+        if (s->rxclosed && !s->broken)
+            shutdown(s->fd, SHUT_WR);
+    } else if (s->outoff >= s->out.length / 2) {
+        memmove(s->out.data, s->out.data + s->outoff, out_pending(s));
+        s->out.length -= s->outoff;
+        s->outoff = 0;
+    }
+
+    return grant_window(m, s);
+}
+
+static int read_stream(struct cpn_mux *m, struct mux_stream *s)
+{
+    ssize_t ret;
+
+    ret = read(s->fd, m->txframe + MUX_HEADERLEN, MIN(s->credit, MUX_CHUNKLEN));
+    if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        cpn_log(LOG_LEVEL_TRACE, "Error reading stream %"PRIu32": %s",
+                s->id, strerror(errno));
+        ret = 0;
+    }
+
+    if (ret == 0) {
+        s->txclosed = true;
+        return write_frame(m, MUX_FRAME_CLOSE, s->id, 0);
+    }
+
+    s->credit -= ret;
+
+    return write_frame(m, MUX_FRAME_DATA, s->id, ret);
+}
+
+/* Streams exceeding the limit are tracked without a socket pair
+ * until the remote side has closed them as well, dropping all
+ * data received for them */
+static struct mux_stream *reject_stream(struct cpn_mux *m, uint32_t id)
+{
+    struct mux_stream *s;
+
+    cpn_log(LOG_LEVEL_WARNING, "Too many streams, rejecting stream %"PRIu32, id);
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        return NULL;
+
+    s->id = id;
+    s->fd = s->appfd = -1;
+    s->txclosed = true;
+    s->broken = true;
+
+    cpn_list_append(&m->streams, s);
+    m->nremote++;
+
+    if (write_frame(m, MUX_FRAME_CLOSE, id, 0) < 0)
+        return NULL;
+
+    return s;
+}
+
+static struct mux_stream *accept_stream(struct cpn_mux *m, uint32_t id)
+{
+    struct mux_stream *s;
+
+    if (m->nremote >= MUX_MAX_STREAMS)
+        return reject_stream(m, id);
+
+    if ((s = create_stream(id)) == NULL)
+        return NULL;
+
+    cpn_list_append(&m->streams, s);
+    m->nremote++;
+
+    pthread_mutex_lock(&m->mutex);
+    cpn_list_append(&m->accepted, s);
+    pthread_cond_broadcast(&m->cond);
+    signal_accept(m);
+    pthread_mutex_unlock(&m->mutex);
+
+    return s;
+}
+
+static int handle_data(struct cpn_mux *m, struct mux_stream *s,
+        const uint8_t *data, size_t len)
+{
+    if (len == 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Received empty data frame");
+        return -1;
+    }
+
+    if (s->rxclosed) {
+        cpn_log(LOG_LEVEL_ERROR, "Received data on closed stream %"PRIu32, s->id);
+        return -1;
+    }
+
+    if (out_pending(s) + len > MUX_WINDOW) {
+        cpn_log(LOG_LEVEL_ERROR, "Received data exceeding window of stream %"PRIu32, s->id);
+        return -1;
+    }
+
+    if (s->broken) {
+        s->consumed += len;
+        return grant_window(m, s);
+    }
+
+    if (cpn_buf_append_data(&s->out, data, len) < 0)
+        return -1;
+
+    return flush_stream(m, s);
+}
+
+static int handle_window(struct mux_stream *s, const uint8_t *data, size_t len)
+{
+    uint32_t increment;
+
+    if (len != sizeof(increment)) {
+        cpn_log(LOG_LEVEL_ERROR, "Received invalid window frame");
+        return -1;
+    }
+
+    memcpy(&increment, data, sizeof(increment));
+    increment = ntohl(increment);
+
+    if (increment > MUX_WINDOW - s->credit) {
+        cpn_log(LOG_LEVEL_ERROR, "Received window exceeding maximum window");
+        return -1;
+    }
+
+    s->credit += increment;
+
+    return 0;
+}
+
+static int handle_frame(struct cpn_mux *m, const uint8_t *data, size_t len)
+{
+    struct mux_stream *s;
+    uint32_t id;
+
+    if (len < MUX_HEADERLEN) {
+        cpn_log(LOG_LEVEL_ERROR, "Received truncated multiplexed frame");
+        return -1;
+    }
+
+    memcpy(&id, data + 1, sizeof(id));
+    id = ntohl(id);
+
+    if ((s = find_stream(m, id)) == NULL) {
+        /* Streams are kept until the remote side has closed
+         * them, so only window updates may still arrive for
+         * streams that are gone already */
+        if (is_local(m, id) || data[0] == MUX_FRAME_WINDOW)
+            return 0;
+        if ((s = accept_stream(m, id)) == NULL)
+            return -1;
+    }
+
+    switch (data[0]) {
+        case MUX_FRAME_DATA:
+            return handle_data(m, s, data + MUX_HEADERLEN, len - MUX_HEADERLEN);
+        case MUX_FRAME_WINDOW:
+            return handle_window(s, data + MUX_HEADERLEN, len - MUX_HEADERLEN);
+        case MUX_FRAME_CLOSE:
+            s->rxclosed = true;
+            return flush_stream(m, s);
+        default:
+            cpn_log(LOG_LEVEL_ERROR, "Received unknown multiplexed frame type %d", data[0]);
+            return -1;
+    }
+}
+
+static int receive_frames(struct cpn_mux *m)
+{
+    ssize_t ret;
+
+    while (1) {
+        cpn_buf_reset(&m->rxframe);
+
+        ret = cpn_channel_receive_buf(m->channel, &m->rxframe);
+        if (ret == CPN_CHANNEL_WOULD_BLOCK) {
+            return 0;
+        } else if (ret == 0) {
+            cpn_log(LOG_LEVEL_TRACE, "Multiplexed channel closed");
+            return -1;
+        } else if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Error receiving multiplexed frame");
+            return -1;
+        }
+
+        if (handle_frame(m, (uint8_t *) m->rxframe.data, ret) < 0)
+            return -1;
+    }
+}
+
+static int flush_channel(struct cpn_mux *m)
+{
+    int err = cpn_channel_flush(m->channel);
+    return err == CPN_CHANNEL_WOULD_BLOCK ? 0 : err;
+}
+
+static void linger(struct cpn_mux *m)
+{
+    struct pollfd pfd;
+
+    pfd.fd = m->channel->fd;
+    pfd.events = POLLOUT;
+
+    while (tx_pending(m) && poll(&pfd, 1, MUX_LINGER_MS) > 0) {
+        if (flush_channel(m) < 0)
+            break;
+    }
+}
+
+static int wakeup(struct cpn_mux *m)
+{
+    if (poke_pipe(m->wakefds[1]) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to wake up multiplexer");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Move newly opened streams into the set of serviced streams.
+ * The mutex has to be held by the caller. */
+static void take_pending(struct cpn_mux *m)
+{
+    struct cpn_list_entry *it;
+    struct mux_stream *s;
+
+    cpn_list_foreach(&m->pending, it, s)
+        cpn_list_append(&m->streams, s);
+    cpn_list_clear(&m->pending);
+}
+
+/* Pick up newly opened streams and return whether the
+ * multiplexer has been asked to stop */
+static bool activate_pending(struct cpn_mux *m)
+{
+    bool stopping;
+
+    pthread_mutex_lock(&m->mutex);
+    take_pending(m);
+    stopping = m->stopping;
+    pthread_mutex_unlock(&m->mutex);
+
+    return stopping;
+}
+
+static void reap_streams(struct cpn_mux *m)
+{
+    struct cpn_list_entry *it, *next;
+    struct mux_stream *s;
+
+    for (it = m->streams.head; it; it = next) {
+        next = it->next;
+        s = it->data;
+
+        if (!s->txclosed || !s->rxclosed || out_pending(s))
+            continue;
+
+        if (!is_local(m, s->id))
+            m->nremote--;
+        cpn_list_remove(&m->streams, it);
+        free_stream(s);
+    }
+}
+
+static int service_streams(struct cpn_mux *m, struct pollfd **pfds,
+        struct mux_stream ***streams, size_t *nalloc)
+{
+    struct cpn_list_entry *it;
+    struct mux_stream *s;
+    bool throttled, pending;
+    size_t i, n;
+
+    n = cpn_list_count(&m->streams) + 2;
+    if (n > *nalloc) {
+        struct pollfd *p;
+        struct mux_stream **ss;
+
+        if ((p = realloc(*pfds, n * sizeof(*p))) == NULL)
+            return -1;
+        *pfds = p;
+        if ((ss = realloc(*streams, n * sizeof(*ss))) == NULL)
+            return -1;
+        *streams = ss;
+        *nalloc = n;
+    }
+
+    (*pfds)[0].fd = m->wakefds[0];
+    (*pfds)[0].events = POLLIN;
+    (*pfds)[1].fd = m->channel->fd;
+    (*pfds)[1].events = POLLIN | (tx_pending(m) ? POLLOUT : 0);
+
+    /* Streams are only read while the channel is draining the
+     * data we have already queued */
+    throttled = tx_pending(m) >= MUX_HIGH_WATERMARK;
+
+    i = 2;
+    cpn_list_foreach(&m->streams, it, s) {
+        struct pollfd *pfd = &(*pfds)[i];
+
+        pfd->events = 0;
+        if (!s->txclosed && s->credit && !throttled)
+            pfd->events |= POLLIN;
+        if (out_pending(s))
+            pfd->events |= POLLOUT;
+
+        /* Streams without any interest are skipped, as we would
+         * otherwise keep on getting woken up by their hangups */
+        pfd->fd = pfd->events ? s->fd : -1;
+        pfd->revents = 0;
+        (*streams)[i++] = s;
+    }
+
+    /* Data buffered by the channel does not make its file
+     * descriptor readable, so we must not block waiting for it */
+    pending = cpn_channel_has_pending_input(m->channel);
+
+    if (poll(*pfds, n, pending ? 0 : -1) < 0) {
+        if (errno == EINTR)
+            return 0;
+        cpn_log(LOG_LEVEL_ERROR, "Unable to poll multiplexed streams: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((*pfds)[0].revents)
+        drain_pipe(m->wakefds[0]);
+
+    if (((*pfds)[1].revents & (POLLOUT | POLLERR | POLLHUP)) && tx_pending(m)) {
+        if (flush_channel(m) < 0)
+            return -1;
+    }
+    if (pending || ((*pfds)[1].revents & (POLLIN | POLLERR | POLLHUP))) {
+        if (receive_frames(m) < 0)
+            return -1;
+    }
+
+    for (i = 2; i < n; i++) {
+        unsigned revents = (*pfds)[i].revents;
+
+        s = (*streams)[i];
+
+        if ((revents & (POLLOUT | POLLERR | POLLHUP)) && out_pending(s)) {
+            if (flush_stream(m, s) < 0)
+                return -1;
+        }
+        if ((revents & (POLLIN | POLLERR | POLLHUP)) && !s->txclosed && s->credit) {
+            if (read_stream(m, s) < 0)
+                return -1;
+        }
+    }
+
+    /* Frames written while servicing events may be flushed right
+     * away */
+    if (tx_pending(m) && flush_channel(m) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void *run_mux(void *payload)
+{
+    struct cpn_mux *m = (struct cpn_mux *) payload;
+    struct mux_stream **streams = NULL;
+    struct pollfd *pfds = NULL;
+    struct cpn_list_entry *it;
+    struct mux_stream *s;
+    size_t nalloc = 0;
+
+    while (!activate_pending(m)) {
+        reap_streams(m);
+
+        if (service_streams(m, &pfds, &streams, &nalloc) < 0)
+            break;
+    }
+
+    linger(m);
+
+    /* No streams can be opened anymore once we are closed */
+    pthread_mutex_lock(&m->mutex);
+    take_pending(m);
+    m->closed = true;
+    pthread_cond_broadcast(&m->cond);
+    signal_accept(m);
+    pthread_mutex_unlock(&m->mutex);
+
+    /* Signal end of file to all streams which are still open */
+    cpn_list_foreach(&m->streams, it, s) {
+        if (s->fd >= 0)
+            shutdown(s->fd, SHUT_RDWR);
+    }
+
+    free(streams);
+    free(pfds);
+
+    return NULL;
+}
+
+int cpn_mux_init(struct cpn_mux *m, struct cpn_channel *channel,
+        enum cpn_mux_role role)
+{
+    bool mutex = false, cond = false;
+
+    memset(m, 0, sizeof(*m));
+    m->channel = channel;
+    m->role = role;
+    m->next_id = (role == CPN_MUX_ROLE_CLIENT) ? 1 : 2;
+    m->wakefds[0] = m->wakefds[1] = -1;
+    m->acceptfds[0] = m->acceptfds[1] = -1;
+
+    if (channel->type != CPN_CHANNEL_TYPE_TCP) {
+        cpn_log(LOG_LEVEL_ERROR, "Only TCP channels can be multiplexed");
+        goto out_err;
+    }
+
+    if ((m->txframe = malloc(MUX_HEADERLEN + MUX_CHUNKLEN)) == NULL)
+        goto out_err;
+
+    if (pipe(m->wakefds) < 0 ||
+            set_flags(m->wakefds[0], true) < 0 ||
+            set_flags(m->wakefds[1], true) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to create multiplexer wakeup pipe");
+        goto out_err;
+    }
+
+    if (pipe(m->acceptfds) < 0 ||
+            set_flags(m->acceptfds[0], true) < 0 ||
+            set_flags(m->acceptfds[1], true) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to create multiplexer accept pipe");
+        goto out_err;
+    }
+
+    if (pthread_mutex_init(&m->mutex, NULL) != 0)
+        goto out_err;
+    mutex = true;
+    if (pthread_cond_init(&m->cond, NULL) != 0)
+        goto out_err;
+    cond = true;
+
+    if (cpn_channel_set_nonblocking(channel, true) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to multiplex channel");
+        goto out_err;
+    }
+
+    if (cpn_spawn(&m->thread, run_mux, m) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to spawn multiplexer");
+        goto out_err;
+    }
+
+    return 0;
+
+out_err:
+    if (cond)
+        pthread_cond_destroy(&m->cond);
+    if (mutex)
+        pthread_mutex_destroy(&m->mutex);
+    if (m->wakefds[0] >= 0)
+        close(m->wakefds[0]);
+    if (m->wakefds[1] >= 0)
+        close(m->wakefds[1]);
+    if (m->acceptfds[0] >= 0)
+        close(m->acceptfds[0]);
+    if (m->acceptfds[1] >= 0)
+        close(m->acceptfds[1]);
+    free(m->txframe);
+
+    return -1;
+}
+
+void cpn_mux_free(struct cpn_mux *m)
+{
+    struct cpn_list_entry *it;
+    struct mux_stream *s;
+
+    pthread_mutex_lock(&m->mutex);
+    m->stopping = true;
+    pthread_mutex_unlock(&m->mutex);
+
+    wakeup(m);
+    cpn_join(&m->thread, NULL);
+
+    /* Streams waiting to be accepted are serviced by the thread
+     * as well, so freeing them is sufficient */
+    cpn_list_clear(&m->accepted);
+
+    cpn_list_foreach(&m->pending, it, s)
+        free_stream(s);
+    cpn_list_clear(&m->pending);
+
+    cpn_list_foreach(&m->streams, it, s)
+        free_stream(s);
+    cpn_list_clear(&m->streams);
+
+    close(m->wakefds[0]);
+    close(m->wakefds[1]);
+    close(m->acceptfds[0]);
+    close(m->acceptfds[1]);
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->mutex);
+
+    cpn_buf_clear(&m->rxframe);
+    free(m->txframe);
+}
+
+int cpn_mux_open(struct cpn_mux *m, struct cpn_channel *stream)
+{
+    struct mux_stream *s;
+    uint32_t id;
+    bool closed;
+
+    pthread_mutex_lock(&m->mutex);
+    id = m->next_id;
+    m->next_id += 2;
+    pthread_mutex_unlock(&m->mutex);
+
+    if ((s = create_stream(id)) == NULL)
+        return -1;
+
+    if (init_stream_channel(m, stream, s->appfd) < 0) {
+        free_stream(s);
+        return -1;
+    }
+    s->appfd = -1;
+
+    pthread_mutex_lock(&m->mutex);
+    if ((closed = m->closed) == false)
+        cpn_list_append(&m->pending, s);
+    pthread_mutex_unlock(&m->mutex);
+
+    if (closed) {
+        cpn_log(LOG_LEVEL_ERROR, "Cannot open stream on closed channel");
+        free_stream(s);
+        return -1;
+    }
+
+    /* The stream is queued already, so failing to wake up the
+     * multiplexer only delays it until the next event */
+    wakeup(m);
+
+    return 0;
+}
+
+/* Initialize a channel for the oldest accepted stream. The mutex
+ * has to be held by the caller. Returns 1 if there is none. */
+static int take_accepted(struct cpn_mux *m, struct cpn_channel *stream)
+{
+    struct mux_stream *s;
+
+    if (m->accepted.head == NULL)
+        return 1;
+
+    s = m->accepted.head->data;
+    cpn_list_remove(&m->accepted, m->accepted.head);
+
+    if (init_stream_channel(m, stream, s->appfd) < 0)
+        return -1;
+    s->appfd = -1;
+
+    return 0;
+}
+
+int cpn_mux_accept(struct cpn_mux *m, struct cpn_channel *stream)
+{
+    int err;
+
+    pthread_mutex_lock(&m->mutex);
+
+    while (m->accepted.head == NULL && !m->closed)
+        pthread_cond_wait(&m->cond, &m->mutex);
+
+    err = take_accepted(m, stream);
+
+    pthread_mutex_unlock(&m->mutex);
+
+    if (err > 0) {
+        cpn_log(LOG_LEVEL_TRACE, "Multiplexed channel closed");
+        err = -1;
+    }
+
+    return err;
+}
+
+int cpn_mux_accept_fd(const struct cpn_mux *m)
+{
+    return m->acceptfds[0];
+}
+
+int cpn_mux_try_accept(struct cpn_mux *m, struct cpn_channel *stream)
+{
+    int err;
+
+    pthread_mutex_lock(&m->mutex);
+
+    if ((err = take_accepted(m, stream)) > 0) {
+        if (m->closed) {
+            err = -1;
+        } else {
+            drain_pipe(m->acceptfds[0]);
+            err = CPN_CHANNEL_WOULD_BLOCK;
+        }
+    }
+
+    pthread_mutex_unlock(&m->mutex);
+
+    return err;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_CLOCK_GETTIME
+# include <time.h>
+#else
+# include <sys/time.h>
+#endif
+
+#include "capone/log.h"
+#include "capone/pool.h"
+
+struct job {
+    thread_fn fn;
+    void *payload;
+    struct cpn_pool_limit *limit;
+    uint64_t enqueued;
+};
+
+static uint64_t now_msecs(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+#else
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+
+    return (uint64_t) t.tv_sec * 1000 + t.tv_usec / 1000;
+#endif
+}
+
+static uint32_t priority_of(const struct cpn_pool_limit *limit)
+{
+    return limit ? limit->priority : 0;
+}
+
+static bool is_runnable(const struct job *job)
+{
+    return job->limit == NULL || job->limit->max == 0 ||
+        job->limit->active < job->limit->max;
+}
+
+/* Raise the priority required for admission for every interval
+ * the sojourn time stays above the target and reset it as soon
+ * as the queue drains below the target. The highest priority is
+ * always admitted. Needs to be called with the pool's lock held. */
+static void update_sojourn(struct cpn_pool *pool, uint64_t sojourn, uint64_t now)
+{
+    pool->stats.sojourn = sojourn;
+
+    if (pool->target == 0 || sojourn < pool->target) {
+        pool->deadline = 0;
+        pool->stats.min_priority = 0;
+    } else if (pool->deadline == 0) {
+        pool->deadline = now + pool->interval;
+    } else if (now >= pool->deadline) {
+        pool->deadline = now + pool->interval;
+        if (pool->stats.min_priority < pool->max_priority)
+            pool->stats.min_priority++;
+    }
+}
+
+/* Dequeue the runnable job with the highest priority, preferring
+ * older jobs among those of equal priority. Needs to be called
+ * with the pool's lock held. */
+static struct job *dequeue_job(struct cpn_pool *pool)
+{
+    struct cpn_list_entry *it, *best = NULL;
+    struct job *job;
+    uint64_t now;
+
+    cpn_list_foreach(&pool->queue, it, job) {
+        if (!is_runnable(job))
+            continue;
+        if (best == NULL || priority_of(job->limit) >
+                priority_of(((struct job *) best->data)->limit))
+            best = it;
+    }
+
+    if (best == NULL)
+        return NULL;
+
+    job = (struct job *) best->data;
+    cpn_list_remove(&pool->queue, best);
+    pool->stats.queued--;
+    pool->stats.active++;
+    if (job->limit)
+        job->limit->active++;
+
+    now = now_msecs();
+    update_sojourn(pool, now - MIN(now, job->enqueued), now);
+
+    return job;
+}
+
+static void *work(void *payload)
+{
+    struct cpn_pool *pool = (struct cpn_pool *) payload;
+    struct job *job;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (1) {
+        if ((job = dequeue_job(pool)) == NULL) {
+            if (pool->stopping && pool->stats.queued == 0)
+                break;
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+        job->fn(job->payload);
+        pthread_mutex_lock(&pool->mutex);
+
+        pool->stats.active--;
+        pool->stats.completed++;
+        if (job->limit) {
+            job->limit->active--;
+            /* Jobs held back by the limit may now be run */
+            pthread_cond_broadcast(&pool->cond);
+        }
+
+        free(job);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+int cpn_pool_init(struct cpn_pool *pool, size_t nthreads, size_t maxqueue)
+{
+    size_t i;
+
+    if (nthreads == 0 || maxqueue == 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Pool requires at least one thread and queue slot");
+        return -1;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initialize pool mutex");
+        return -1;
+    }
+
+    if (pthread_cond_init(&pool->cond, NULL) != 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initialize pool condition");
+        pthread_mutex_destroy(&pool->mutex);
+        return -1;
+    }
+
+    cpn_list_init(&pool->queue);
+    pool->maxqueue = maxqueue;
+
+    if ((pool->threads = malloc(sizeof(struct cpn_thread) * nthreads)) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate worker threads");
+        cpn_pool_free(pool);
+        return -1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (cpn_spawn(&pool->threads[i], work, pool) != 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to spawn worker thread");
+            pool->nthreads = i;
+            cpn_pool_free(pool);
+            return -1;
+        }
+    }
+
+    pool->nthreads = nthreads;
+
+    return 0;
+}
+
+void cpn_pool_free(struct cpn_pool *pool)
+{
+    size_t i;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->nthreads; i++)
+        cpn_join(&pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->nthreads = 0;
+}
+
+int cpn_pool_submit(struct cpn_pool *pool, struct cpn_pool_limit *limit,
+        thread_fn fn, void *payload)
+{
+    struct job *job;
+    int err = -1;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->stopping || pool->stats.queued >= pool->maxqueue) {
+        pool->stats.rejected++;
+        goto out;
+    }
+
+    if ((job = malloc(sizeof(*job))) == NULL) {
+        pool->stats.rejected++;
+        goto out;
+    }
+
+    job->fn = fn;
+    job->payload = payload;
+    job->limit = limit;
+    job->enqueued = now_msecs();
+
+    if (cpn_list_append(&pool->queue, job) < 0) {
+        free(job);
+        pool->stats.rejected++;
+        goto out;
+    }
+    pool->stats.queued++;
+    pool->stats.max_queued = MAX(pool->stats.max_queued, pool->stats.queued);
+
+    pthread_cond_signal(&pool->cond);
+
+    err = 0;
+
+out:
+    pthread_mutex_unlock(&pool->mutex);
+
+    return err;
+}
+
+void cpn_pool_set_target(struct cpn_pool *pool, uint64_t target, uint64_t interval,
+        uint32_t max_priority)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->target = target;
+    pool->interval = interval;
+    pool->max_priority = max_priority;
+    update_sojourn(pool, 0, now_msecs());
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+bool cpn_pool_admits(struct cpn_pool *pool, const struct cpn_pool_limit *limit)
+{
+    struct cpn_list_entry *it;
+    struct job *job;
+    uint64_t now, sojourn = 0;
+    bool admitted;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    /* Jobs are only dequeued when workers become available, so
+     * the oldest queued job additionally reflects a queue which
+     * is stuck behind long-running jobs. Jobs held back by their
+     * limit are skipped, as they would not run even with workers
+     * to spare. The queue is ordered by age, so the first
+     * runnable job is the oldest one. */
+    now = now_msecs();
+    cpn_list_foreach(&pool->queue, it, job) {
+        if (!is_runnable(job))
+            continue;
+        sojourn = now - MIN(now, job->enqueued);
+        break;
+    }
+    update_sojourn(pool, sojourn, now);
+
+    admitted = priority_of(limit) >= pool->stats.min_priority;
+    if (!admitted)
+        pool->stats.shed++;
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return admitted;
+}
+
+void cpn_pool_get_stats(struct cpn_pool_stats *out, struct cpn_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    memcpy(out, &pool->stats, sizeof(*out));
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,702 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_CLOCK_GETTIME
+# include <time.h>
+#else
+# include <sys/time.h>
+#endif
+
+#ifdef HAVE_EPOLL
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
+#ifdef HAVE_EVENTFD
+# include <sys/eventfd.h>
+#endif
+#ifdef HAVE_TIMERFD
+# include <sys/timerfd.h>
+#endif
+
+#include "capone/log.h"
+#include "capone/reactor.h"
+
+#define REACTOR_MAX_EVENTS 64
+
+#define REACTOR_READ (1 << 0)
+#define REACTOR_WRITE (1 << 1)
+#define REACTOR_EDGE (1 << 2)
+
+struct handler {
+    int fd;
+    unsigned events;
+    cpn_reactor_fn fn;
+    void *payload;
+    /* Removed handlers are only freed by the reactor's thread,
+     * as events for them may still be pending */
+    bool removed;
+};
+
+struct timeout {
+    uint64_t deadline;
+    cpn_reactor_timer_fn fn;
+    void *payload;
+};
+
+static uint64_t now_msecs(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+#else
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+
+    return (uint64_t) t.tv_sec * 1000 + t.tv_usec / 1000;
+#endif
+}
+
+static struct handler *find_handler(struct cpn_reactor *r, int fd)
+{
+    struct cpn_list_entry *it;
+    struct handler *h;
+
+    cpn_list_foreach(&r->handlers, it, h) {
+        if (h->fd == fd && !h->removed)
+            return h;
+    }
+
+    return NULL;
+}
+
+static void collect_removed(struct cpn_reactor *r)
+{
+    struct cpn_list_entry *it, *next;
+    struct handler *h;
+
+    pthread_mutex_lock(&r->mutex);
+    for (it = r->handlers.head; it; it = next) {
+        next = it->next;
+        h = it->data;
+        if (!h->removed)
+            continue;
+        cpn_list_remove(&r->handlers, it);
+        free(h);
+    }
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static void dispatch(struct cpn_reactor *r, struct handler *h)
+{
+    bool removed;
+
+    pthread_mutex_lock(&r->mutex);
+    removed = h->removed;
+    pthread_mutex_unlock(&r->mutex);
+
+    if (!removed)
+        h->fn(h->fd, h->payload);
+}
+
+static void expire_timer(struct cpn_reactor *r)
+{
+    cpn_reactor_timer_fn fn;
+    void *payload;
+
+#ifdef HAVE_TIMERFD
+    uint64_t expirations;
+
+    if (r->timerfd >= 0 && read(r->timerfd, &expirations, sizeof(expirations)) < 0)
+        return;
+#endif
+
+    pthread_mutex_lock(&r->mutex);
+    fn = r->timer_fn;
+    payload = r->timer_payload;
+    pthread_mutex_unlock(&r->mutex);
+
+    if (fn)
+        fn(payload);
+}
+
+/* Remove the first timeout which has expired. The mutex has to
+ * be held by the caller. */
+static struct timeout *take_expired(struct cpn_reactor *r, uint64_t now)
+{
+    struct cpn_list_entry *it;
+    struct timeout *t;
+
+    cpn_list_foreach(&r->timeouts, it, t) {
+        if (t->deadline <= now) {
+            cpn_list_remove(&r->timeouts, it);
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+/* Invoke callbacks of all expired timeouts and, if it cannot be
+ * driven by a timerfd, of the periodic timer. Callbacks are
+ * invoked without holding the mutex, so that they may add and
+ * remove timeouts themselves. */
+static void expire_timeouts(struct cpn_reactor *r)
+{
+    cpn_reactor_timer_fn fn = NULL;
+    void *payload = NULL;
+    uint64_t now = now_msecs();
+    struct timeout *t;
+
+    while (1) {
+        pthread_mutex_lock(&r->mutex);
+        t = take_expired(r, now);
+        pthread_mutex_unlock(&r->mutex);
+
+        if (t == NULL)
+            break;
+
+        t->fn(t->payload);
+        free(t);
+    }
+
+    pthread_mutex_lock(&r->mutex);
+    if (r->timerfd < 0 && r->timer_fn && r->interval && r->next_tick <= now) {
+        r->next_tick = now + r->interval;
+        fn = r->timer_fn;
+        payload = r->timer_payload;
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    if (fn)
+        fn(payload);
+}
+
+/* Time to wait for events until the next timeout expires. The
+ * periodic timer is only taken into account if it cannot be
+ * driven by a timerfd. */
+static int get_timeout(struct cpn_reactor *r)
+{
+    struct cpn_list_entry *it;
+    struct timeout *t;
+    uint64_t now, deadline = 0;
+    bool expires = false;
+
+    pthread_mutex_lock(&r->mutex);
+    if (r->timerfd < 0 && r->timer_fn && r->interval) {
+        deadline = r->next_tick;
+        expires = true;
+    }
+    cpn_list_foreach(&r->timeouts, it, t) {
+        if (!expires || t->deadline < deadline) {
+            deadline = t->deadline;
+            expires = true;
+        }
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    if (!expires)
+        return -1;
+
+    now = now_msecs();
+
+    return deadline > now ? (int) MIN(deadline - now, (uint64_t) INT_MAX) : 0;
+}
+
+static void drain_wakeup(struct cpn_reactor *r)
+{
+    char buf[64];
+
+    while (read(r->wakefds[0], buf, sizeof(buf)) > 0);
+}
+
+static int wakeup(struct cpn_reactor *r)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t value = 1;
+#else
+    char value = 0;
+#endif
+    ssize_t ret;
+
+    do {
+        ret = write(r->wakefds[1], &value, sizeof(value));
+    } while (ret < 0 && errno == EINTR);
+
+    /* A full pipe or counter will wake up the reactor anyway */
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to wake up reactor");
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_EPOLL
+static int watch_fd(struct cpn_reactor *r, int fd, unsigned events, void *ptr)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & REACTOR_READ ? EPOLLIN : 0) |
+        (events & REACTOR_WRITE ? EPOLLOUT : 0) |
+        (events & REACTOR_EDGE ? EPOLLET : 0);
+    ev.data.ptr = ptr;
+
+    if (epoll_ctl(r->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to watch file descriptor: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int unwatch_fd(struct cpn_reactor *r, int fd)
+{
+    struct epoll_event ev;
+
+    /* Kernels before 2.6.9 require a non-NULL event */
+    if (epoll_ctl(r->fd, EPOLL_CTL_DEL, fd, &ev) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to unwatch file descriptor: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int wait_events(struct cpn_reactor *r)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int i, n;
+
+    if ((n = epoll_wait(r->fd, events, ARRAY_SIZE(events), get_timeout(r))) < 0) {
+        if (errno == EINTR)
+            return 0;
+        cpn_log(LOG_LEVEL_ERROR, "Error waiting for reactor events: %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL)
+            drain_wakeup(r);
+        else if (events[i].data.ptr == &r->timerfd)
+            expire_timer(r);
+        else
+            dispatch(r, events[i].data.ptr);
+    }
+
+    return 0;
+}
+#else
+static int watch_fd(struct cpn_reactor *r, int fd, unsigned events, void *ptr)
+{
+    UNUSED(r);
+    UNUSED(fd);
+    UNUSED(events);
+    UNUSED(ptr);
+    return 0;
+}
+
+static int unwatch_fd(struct cpn_reactor *r, int fd)
+{
+    UNUSED(r);
+    UNUSED(fd);
+    return 0;
+}
+
+static int wait_events(struct cpn_reactor *r)
+{
+    struct handler **handlers = NULL;
+    struct pollfd *pfds = NULL;
+    struct cpn_list_entry *it;
+    struct handler *h;
+    size_t n, i;
+    int ret, err = -1;
+
+    /* Without epoll, all handlers are level-triggered. Callbacks
+     * of edge-triggered handlers consume all data anyway. */
+    pthread_mutex_lock(&r->mutex);
+
+    n = cpn_list_count(&r->handlers) + 2;
+    if ((pfds = malloc(n * sizeof(*pfds))) == NULL ||
+            (handlers = malloc(n * sizeof(*handlers))) == NULL)
+    {
+        pthread_mutex_unlock(&r->mutex);
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate reactor events");
+        goto out;
+    }
+
+    pfds[0].fd = r->wakefds[0];
+    pfds[0].events = POLLIN;
+    handlers[0] = NULL;
+    n = 1;
+
+    if (r->timerfd >= 0) {
+        pfds[n].fd = r->timerfd;
+        pfds[n].events = POLLIN;
+        handlers[n] = (struct handler *) &r->timerfd;
+        n++;
+    }
+
+    cpn_list_foreach(&r->handlers, it, h) {
+        if (h->removed)
+            continue;
+        pfds[n].fd = h->fd;
+        pfds[n].events = (h->events & REACTOR_READ ? POLLIN : 0) |
+            (h->events & REACTOR_WRITE ? POLLOUT : 0);
+        handlers[n] = h;
+        n++;
+    }
+
+    pthread_mutex_unlock(&r->mutex);
+
+    if ((ret = poll(pfds, n, get_timeout(r))) < 0) {
+        if (errno == EINTR)
+            err = 0;
+        else
+            cpn_log(LOG_LEVEL_ERROR, "Error waiting for reactor events: %s", strerror(errno));
+        goto out;
+    }
+
+    for (i = 0; ret > 0 && i < n; i++) {
+        if (!pfds[i].revents)
+            continue;
+
+        if (handlers[i] == NULL)
+            drain_wakeup(r);
+        else if (handlers[i] == (struct handler *) &r->timerfd)
+            expire_timer(r);
+        else
+            dispatch(r, handlers[i]);
+    }
+
+    err = 0;
+
+out:
+    free(handlers);
+    free(pfds);
+
+    return err;
+}
+#endif
+
+#ifndef HAVE_EVENTFD
+static int set_cloexec_nonblock(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFD)) < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0)
+        return -1;
+    if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    return 0;
+}
+#endif
+
+int cpn_reactor_init(struct cpn_reactor *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->timerfd = -1;
+    r->wakefds[0] = r->wakefds[1] = -1;
+
+#ifdef HAVE_EVENTFD
+    if ((r->wakefds[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to create reactor eventfd");
+        goto out_err;
+    }
+    r->wakefds[1] = r->wakefds[0];
+#else
+    if (pipe(r->wakefds) < 0 ||
+            set_cloexec_nonblock(r->wakefds[0]) < 0 ||
+            set_cloexec_nonblock(r->wakefds[1]) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to create reactor wakeup pipe");
+        goto out_err;
+    }
+#endif
+
+#ifdef HAVE_TIMERFD
+    if ((r->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to create reactor timerfd");
+        goto out_err;
+    }
+#endif
+
+#ifdef HAVE_EPOLL
+    if ((r->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to create epoll instance: %s", strerror(errno));
+        goto out_err;
+    }
+
+    if (watch_fd(r, r->wakefds[0], REACTOR_READ, NULL) < 0 ||
+            (r->timerfd >= 0 && watch_fd(r, r->timerfd, REACTOR_READ, &r->timerfd) < 0))
+        goto out_err;
+#endif
+
+    if (pthread_mutex_init(&r->mutex, NULL) != 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initialize reactor mutex");
+        goto out_err;
+    }
+
+    return 0;
+
+out_err:
+    if (r->fd >= 0)
+        close(r->fd);
+    if (r->timerfd >= 0)
+        close(r->timerfd);
+    if (r->wakefds[0] >= 0)
+        close(r->wakefds[0]);
+    if (r->wakefds[1] >= 0 && r->wakefds[1] != r->wakefds[0])
+        close(r->wakefds[1]);
+
+    return -1;
+}
+
+void cpn_reactor_free(struct cpn_reactor *r)
+{
+    struct cpn_list_entry *it;
+    struct timeout *t;
+    struct handler *h;
+
+    cpn_list_foreach(&r->handlers, it, h)
+        free(h);
+    cpn_list_clear(&r->handlers);
+
+    cpn_list_foreach(&r->timeouts, it, t)
+        free(t);
+    cpn_list_clear(&r->timeouts);
+
+    if (r->fd >= 0)
+        close(r->fd);
+    if (r->timerfd >= 0)
+        close(r->timerfd);
+    if (r->wakefds[0] >= 0)
+        close(r->wakefds[0]);
+    if (r->wakefds[1] >= 0 && r->wakefds[1] != r->wakefds[0])
+        close(r->wakefds[1]);
+
+    pthread_mutex_destroy(&r->mutex);
+}
+
+static int add_handler(struct cpn_reactor *r, int fd, unsigned events,
+        cpn_reactor_fn fn, void *payload)
+{
+    struct handler *h;
+    int err = -1;
+
+    pthread_mutex_lock(&r->mutex);
+
+    if (find_handler(r, fd) != NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "File descriptor is already registered");
+        goto out;
+    }
+
+    if ((h = malloc(sizeof(*h))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate reactor handler");
+        goto out;
+    }
+
+    h->fd = fd;
+    h->events = events;
+    h->fn = fn;
+    h->payload = payload;
+    h->removed = false;
+
+    if (watch_fd(r, fd, events, h) < 0) {
+        free(h);
+        goto out;
+    }
+
+    cpn_list_append(&r->handlers, h);
+
+    err = 0;
+
+out:
+    pthread_mutex_unlock(&r->mutex);
+
+    /* Without epoll, the reactor has to pick up the handler */
+    if (!err)
+        err = wakeup(r);
+
+    return err;
+}
+
+int cpn_reactor_add(struct cpn_reactor *r, int fd, bool edge,
+        cpn_reactor_fn fn, void *payload)
+{
+    return add_handler(r, fd, REACTOR_READ | (edge ? REACTOR_EDGE : 0), fn, payload);
+}
+
+int cpn_reactor_add_writable(struct cpn_reactor *r, int fd,
+        cpn_reactor_fn fn, void *payload)
+{
+    return add_handler(r, fd, REACTOR_WRITE, fn, payload);
+}
+
+int cpn_reactor_remove(struct cpn_reactor *r, int fd)
+{
+    struct handler *h;
+    int err = -1;
+
+    pthread_mutex_lock(&r->mutex);
+
+    if ((h = find_handler(r, fd)) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "File descriptor is not registered");
+        goto out;
+    }
+
+    h->removed = true;
+    err = unwatch_fd(r, fd);
+
+out:
+    pthread_mutex_unlock(&r->mutex);
+
+    if (!err)
+        err = wakeup(r);
+
+    return err;
+}
+
+int cpn_reactor_set_timer(struct cpn_reactor *r, unsigned interval,
+        cpn_reactor_timer_fn fn, void *payload)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&r->mutex);
+
+    r->interval = interval;
+    r->timer_fn = fn;
+    r->timer_payload = payload;
+    r->next_tick = now_msecs() + interval;
+
+#ifdef HAVE_TIMERFD
+    {
+        struct itimerspec spec;
+
+        spec.it_interval.tv_sec = interval / 1000;
+        spec.it_interval.tv_nsec = (interval % 1000) * 1000000;
+        spec.it_value = spec.it_interval;
+
+        if (timerfd_settime(r->timerfd, 0, &spec, NULL) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to set reactor timer: %s", strerror(errno));
+            err = -1;
+        }
+    }
+#endif
+
+    pthread_mutex_unlock(&r->mutex);
+
+    if (!err)
+        err = wakeup(r);
+
+    return err;
+}
+
+int cpn_reactor_add_timeout(struct cpn_reactor *r, unsigned timeout,
+        cpn_reactor_timer_fn fn, void *payload)
+{
+    struct timeout *t;
+
+    if ((t = malloc(sizeof(*t))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate reactor timeout");
+        return -1;
+    }
+
+    t->deadline = now_msecs() + timeout;
+    t->fn = fn;
+    t->payload = payload;
+
+    pthread_mutex_lock(&r->mutex);
+    cpn_list_append(&r->timeouts, t);
+    pthread_mutex_unlock(&r->mutex);
+
+    /* The reactor may be waiting for a later deadline */
+    return wakeup(r);
+}
+
+int cpn_reactor_remove_timeout(struct cpn_reactor *r,
+        cpn_reactor_timer_fn fn, void *payload)
+{
+    struct cpn_list_entry *it;
+    struct timeout *t, *found = NULL;
+
+    pthread_mutex_lock(&r->mutex);
+    cpn_list_foreach(&r->timeouts, it, t) {
+        if (t->fn == fn && t->payload == payload) {
+            cpn_list_remove(&r->timeouts, it);
+            found = t;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    if (found == NULL)
+        return -1;
+
+    free(found);
+
+    return 0;
+}
+
+int cpn_reactor_run(struct cpn_reactor *r)
+{
+    bool stopping;
+
+    while (1) {
+        pthread_mutex_lock(&r->mutex);
+        stopping = r->stopping;
+        r->stopping = false;
+        pthread_mutex_unlock(&r->mutex);
+
+        if (stopping)
+            break;
+
+        if (wait_events(r) < 0)
+            return -1;
+
+        expire_timeouts(r);
+        collect_removed(r);
+    }
+
+    return 0;
+}
+
+int cpn_reactor_stop(struct cpn_reactor *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->stopping = true;
+    pthread_mutex_unlock(&r->mutex);
+
+    return wakeup(r);
+}
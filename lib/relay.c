@@ -0,0 +1,1303 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Required for splice(2) and pipe2(2) */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+
+#ifdef HAVE_EPOLL
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
+
+#include "capone/buf.h"
+#include "capone/global.h"
+#include "capone/log.h"
+#include "capone/relay.h"
+
+#define RELAY_BUFLEN (64 * 1024)
+#define RELAY_MAX_EVENTS 64
+#define RELAY_PADLEN 4096
+
+/* Data buffered per direction before we stop reading from the
+ * producing side, and the level it has to drain to before we
+ * resume reading */
+#define RELAY_HIGH_WATERMARK (256 * 1024)
+#define RELAY_LOW_WATERMARK (64 * 1024)
+
+#define RELAY_READ  (1 << 0)
+#define RELAY_WRITE (1 << 1)
+
+struct relay_session;
+struct relay_splice;
+
+struct relay_handle {
+    struct relay_session *session;
+    int fd;
+    /* File status flags to restore when the relay finishes */
+    int flags;
+    /* Events currently registered with the engine */
+    unsigned events;
+    /* Regular files cannot be waited on and are always ready */
+    bool pollable;
+    /* No more data can be read from the handle */
+    bool closed;
+};
+
+struct relay_session {
+    struct cpn_channel *channel;
+    bool nonblocking;
+    struct relay_handle chandle;
+
+    struct relay_handle *handles;
+    int nhandles;
+    int open;
+
+    /* Data received from the channel, pending to be written to
+     * the first file descriptor */
+    struct cpn_buf out;
+    size_t outoff;
+    /* Whether reading is paused until the buffer of the
+     * respective direction has drained */
+    bool rxthrottled;
+    bool txthrottled;
+    /* Buffer for data read from file descriptors */
+    uint8_t *in;
+    /* Splicing state, if data is moved without copying it */
+    struct relay_splice *splice;
+
+    cpn_relay_done_fn fn;
+    void *payload;
+    bool done;
+    int result;
+};
+
+static int update_events(struct cpn_relay *r, struct relay_handle *h, unsigned events)
+{
+#ifdef HAVE_EPOLL
+    struct epoll_event ev;
+    int op;
+
+    if (!h->pollable || h->events == events)
+        return 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & RELAY_READ) ? EPOLLIN : 0) |
+        ((events & RELAY_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = h;
+
+    /* Handles without any interest are removed completely, as
+     * epoll would otherwise keep on reporting hangups for them */
+    if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else if (h->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(r->fd, op, h->fd, &ev) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to update relay events: %s", strerror(errno));
+        return -1;
+    }
+#else
+    UNUSED(r);
+#endif
+
+    h->events = events;
+
+    return 0;
+}
+
+static void init_handle(struct relay_handle *h, struct relay_session *s, int fd)
+{
+    struct stat st;
+
+    memset(h, 0, sizeof(*h));
+    h->session = s;
+    h->fd = fd;
+    h->flags = -1;
+    h->pollable = !(fstat(fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)));
+}
+
+static void close_handle(struct relay_session *s, struct relay_handle *h)
+{
+    h->closed = true;
+    s->open--;
+    cpn_log(LOG_LEVEL_TRACE, "Relay file descriptor %d/%d closed",
+            s->nhandles - s->open, s->nhandles);
+}
+
+static bool would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+#ifdef HAVE_SPLICE
+/* Without encryption, a channel carries the plain message data
+ * framed by length fields and, for blocks, zero padding. So
+ * instead of receiving and re-sending whole messages we only
+ * handle the framing ourselves and let the kernel move the
+ * payload between the sockets through a pipe.
+ *
+ * With blocks, a message is its length followed by the payload
+ * and padding up to the next block boundary. With frames, each
+ * frame is prefixed by its length and the first frame
+ * additionally carries the message length. Messages we send
+ * always fit into a single frame. */
+struct relay_splice {
+    /* Pipe moving data from the channel to the first fd */
+    int rxpipe[2];
+    uint8_t rxhdr[2 * sizeof(uint32_t)];
+    size_t rxhdrlen;
+    bool rxstarted;
+    /* Payload left of the current message and unit */
+    uint32_t rxleft;
+    uint32_t rxunit;
+    size_t rxpad;
+    size_t rxpiped;
+
+    /* Pipe moving data from the fds to the channel */
+    int txpipe[2];
+    uint8_t txhdr[2 * sizeof(uint32_t)];
+    size_t txhdrlen;
+    size_t txhdroff;
+    size_t txpiped;
+    size_t txpad;
+};
+
+static const uint8_t padding[RELAY_PADLEN];
+
+static bool is_spliceable(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && (S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode));
+}
+
+static void free_splice(struct relay_splice *sp)
+{
+    if (sp == NULL)
+        return;
+
+    close(sp->rxpipe[0]);
+    close(sp->rxpipe[1]);
+    close(sp->txpipe[0]);
+    close(sp->txpipe[1]);
+    free(sp);
+}
+
+static struct relay_splice *init_splice(const struct relay_session *s)
+{
+    const struct cpn_channel *c = s->channel;
+    struct relay_splice *sp;
+    int i;
+
+    /* Encrypted or compressed data has to pass through user
+     * space anyway, and so does data already buffered by the
+     * channel */
+    if (c->crypto != CPN_CHANNEL_CRYPTO_NONE ||
+            c->compression != CPN_COMPRESSION_NONE ||
+            c->txbuf.length || c->rxbuf.length || c->rxstarted ||
+            cpn_channel_has_pending_input(c) || !is_spliceable(c->fd))
+        return NULL;
+
+    for (i = 0; i < s->nhandles; i++)
+        if (!is_spliceable(s->handles[i].fd))
+            return NULL;
+
+    if ((sp = calloc(1, sizeof(*sp))) == NULL)
+        return NULL;
+
+    if (pipe2(sp->rxpipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        free(sp);
+        return NULL;
+    }
+    if (pipe2(sp->txpipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        close(sp->rxpipe[0]);
+        close(sp->rxpipe[1]);
+        free(sp);
+        return NULL;
+    }
+
+    return sp;
+}
+
+static bool splice_rx_pending(const struct relay_splice *sp)
+{
+    return sp->rxpiped > 0;
+}
+
+static bool splice_tx_pending(const struct relay_splice *sp)
+{
+    return sp->txhdroff < sp->txhdrlen || sp->txpiped || sp->txpad;
+}
+
+static ssize_t splice_fds(int in, int out, size_t len, unsigned flags)
+{
+    ssize_t ret;
+
+    do {
+        ret = splice(in, NULL, out, NULL, len, flags | SPLICE_F_NONBLOCK);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+static int splice_drain(struct relay_session *s)
+{
+    struct relay_splice *sp = s->splice;
+    ssize_t ret;
+
+    while (sp->rxpiped) {
+        ret = splice_fds(sp->rxpipe[0], s->handles[0].fd, sp->rxpiped, 0);
+        if (ret < 0 && would_block())
+            return 0;
+        if (ret <= 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Error relaying data to fd: %s", strerror(errno));
+            return -1;
+        }
+
+        sp->rxpiped -= ret;
+    }
+
+    return 0;
+}
+
+static int splice_parse_header(struct relay_session *s)
+{
+    struct relay_splice *sp = s->splice;
+    struct cpn_channel *c = s->channel;
+    uint32_t networklen, unitlen;
+    size_t remainder;
+
+    memcpy(&networklen, sp->rxhdr, sizeof(networklen));
+    unitlen = ntohl(networklen);
+
+    if (c->framing == CPN_CHANNEL_FRAMING_BLOCKS) {
+        remainder = (sizeof(networklen) + unitlen) % c->blocklen;
+        sp->rxleft = sp->rxunit = unitlen;
+        sp->rxpad = remainder ? c->blocklen - remainder : 0;
+    } else if (!sp->rxstarted) {
+        if (unitlen < sizeof(networklen) || unitlen > c->framelen) {
+            cpn_log(LOG_LEVEL_ERROR, "Received invalid frame length");
+            return -1;
+        }
+        memcpy(&networklen, sp->rxhdr + sizeof(networklen), sizeof(networklen));
+        sp->rxleft = ntohl(networklen);
+        sp->rxunit = unitlen - sizeof(networklen);
+    } else {
+        if (unitlen < 1 || unitlen > c->framelen) {
+            cpn_log(LOG_LEVEL_ERROR, "Received invalid frame length");
+            return -1;
+        }
+        sp->rxunit = unitlen;
+    }
+
+    if (sp->rxunit > sp->rxleft) {
+        cpn_log(LOG_LEVEL_ERROR, "Received frame exceeds package length");
+        return -1;
+    }
+
+    sp->rxstarted = sp->rxleft > 0;
+    sp->rxhdrlen = 0;
+
+    return 0;
+}
+
+static int splice_receive(struct relay_session *s)
+{
+    struct relay_splice *sp = s->splice;
+    struct cpn_channel *c = s->channel;
+    uint8_t discard[RELAY_PADLEN];
+    size_t hdrlen;
+    ssize_t ret;
+
+    while (!sp->rxpiped) {
+        if (sp->rxunit) {
+            ret = splice_fds(c->fd, sp->rxpipe[1], sp->rxunit, 0);
+        } else if (sp->rxpad) {
+            ret = recv(c->fd, discard, MIN(sp->rxpad, sizeof(discard)), 0);
+        } else {
+            hdrlen = sizeof(uint32_t);
+            if (c->framing == CPN_CHANNEL_FRAMING_FRAMES && !sp->rxstarted)
+                hdrlen += sizeof(uint32_t);
+            ret = recv(c->fd, sp->rxhdr + sp->rxhdrlen, hdrlen - sp->rxhdrlen, 0);
+        }
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (would_block())
+                return 0;
+            cpn_log(LOG_LEVEL_ERROR, "Error relaying data from channel: %s", strerror(errno));
+            return -1;
+        } else if (ret == 0) {
+            cpn_log(LOG_LEVEL_TRACE, "Channel closed, stopping relay");
+            return -1;
+        }
+
+        if (sp->rxunit) {
+            sp->rxunit -= ret;
+            sp->rxleft -= ret;
+            sp->rxpiped += ret;
+            if (sp->rxleft == 0)
+                sp->rxstarted = false;
+        } else if (sp->rxpad) {
+            sp->rxpad -= ret;
+        } else if ((sp->rxhdrlen += ret) == hdrlen) {
+            if (splice_parse_header(s) < 0)
+                return -1;
+        }
+    }
+
+    return splice_drain(s);
+}
+
+static int splice_send(struct relay_session *s)
+{
+    struct relay_splice *sp = s->splice;
+    int fd = s->channel->fd;
+    ssize_t ret;
+
+    while (splice_tx_pending(sp)) {
+        if (sp->txhdroff < sp->txhdrlen)
+            ret = send(fd, sp->txhdr + sp->txhdroff, sp->txhdrlen - sp->txhdroff, MSG_MORE);
+        else if (sp->txpiped)
+            ret = splice_fds(sp->txpipe[0], fd, sp->txpiped, sp->txpad ? SPLICE_F_MORE : 0);
+        else
+            ret = send(fd, padding, MIN(sp->txpad, sizeof(padding)), 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (would_block())
+                return 0;
+            cpn_log(LOG_LEVEL_ERROR, "Error relaying data to channel: %s", strerror(errno));
+            return -1;
+        } else if (ret == 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to relay data: channel closed");
+            return -1;
+        }
+
+        if (sp->txhdroff < sp->txhdrlen)
+            sp->txhdroff += ret;
+        else if (sp->txpiped)
+            sp->txpiped -= ret;
+        else
+            sp->txpad -= ret;
+    }
+
+    return 0;
+}
+
+static int splice_read(struct relay_session *s, struct relay_handle *h)
+{
+    struct relay_splice *sp = s->splice;
+    struct cpn_channel *c = s->channel;
+    uint32_t networklen;
+    size_t maxlen, remainder;
+    ssize_t ret;
+
+    /* Each chunk is sent as a message of its own, which has to
+     * fit into a single frame */
+    if (c->framing == CPN_CHANNEL_FRAMING_FRAMES)
+        maxlen = c->framelen - sizeof(networklen);
+    else
+        maxlen = RELAY_BUFLEN;
+
+    ret = splice_fds(h->fd, sp->txpipe[1], maxlen, 0);
+    if (ret == 0) {
+        close_handle(s, h);
+        return 0;
+    } else if (ret < 0) {
+        if (would_block())
+            return 0;
+        cpn_log(LOG_LEVEL_ERROR, "Error relaying data from fd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (c->framing == CPN_CHANNEL_FRAMING_FRAMES) {
+        networklen = htonl(sizeof(networklen) + ret);
+        memcpy(sp->txhdr, &networklen, sizeof(networklen));
+        networklen = htonl(ret);
+        memcpy(sp->txhdr + sizeof(networklen), &networklen, sizeof(networklen));
+        sp->txhdrlen = 2 * sizeof(networklen);
+        sp->txpad = 0;
+    } else {
+        networklen = htonl(ret);
+        memcpy(sp->txhdr, &networklen, sizeof(networklen));
+        sp->txhdrlen = sizeof(networklen);
+        remainder = (sizeof(networklen) + ret) % c->blocklen;
+        sp->txpad = remainder ? c->blocklen - remainder : 0;
+    }
+    sp->txhdroff = 0;
+    sp->txpiped = ret;
+
+    return splice_send(s);
+}
+
+static int handle_splice_event(struct relay_session *s, struct relay_handle *h, unsigned events)
+{
+    struct relay_splice *sp = s->splice;
+    int err = 0;
+
+    if (h == &s->chandle) {
+        if ((events & RELAY_WRITE) && splice_tx_pending(sp))
+            err = splice_send(s);
+        if (!err && (events & RELAY_READ) && !splice_rx_pending(sp))
+            err = splice_receive(s);
+    } else {
+        if ((events & RELAY_WRITE) && splice_rx_pending(sp))
+            err = splice_drain(s);
+        if (!err && (events & RELAY_READ) && !h->closed && !splice_tx_pending(sp))
+            err = splice_read(s, h);
+    }
+
+    return err;
+}
+#else
+static void free_splice(struct relay_splice *sp)
+{
+    UNUSED(sp);
+}
+
+static struct relay_splice *init_splice(const struct relay_session *s)
+{
+    UNUSED(s);
+    return NULL;
+}
+
+static bool splice_rx_pending(const struct relay_splice *sp)
+{
+    UNUSED(sp);
+    return false;
+}
+
+static bool splice_tx_pending(const struct relay_splice *sp)
+{
+    UNUSED(sp);
+    return false;
+}
+
+static int handle_splice_event(struct relay_session *s, struct relay_handle *h, unsigned events)
+{
+    UNUSED(s);
+    UNUSED(h);
+    UNUSED(events);
+    return -1;
+}
+#endif
+
+static void free_session(struct relay_session *s)
+{
+    if (s == NULL)
+        return;
+
+    free_splice(s->splice);
+    cpn_buf_clear(&s->out);
+    free(s->handles);
+    free(s->in);
+    free(s);
+}
+
+static void finish(struct relay_session *s, int result)
+{
+    if (s->done)
+        return;
+
+    s->done = true;
+    s->result = result;
+}
+
+static void teardown_session(struct cpn_relay *r, struct relay_session *s)
+{
+    int i;
+
+    update_events(r, &s->chandle, 0);
+    for (i = 0; i < s->nhandles; i++) {
+        update_events(r, &s->handles[i], 0);
+        if (s->handles[i].flags >= 0)
+            fcntl(s->handles[i].fd, F_SETFL, s->handles[i].flags);
+    }
+
+    if (!s->nonblocking)
+        cpn_channel_set_nonblocking(s->channel, false);
+}
+
+static size_t out_pending(const struct relay_session *s)
+{
+    return s->out.length - s->outoff;
+}
+
+static size_t tx_pending(const struct relay_session *s)
+{
+    return s->channel->txbuf.length - s->channel->txoff;
+}
+
+static int flush_out(struct relay_session *s)
+{
+    struct relay_handle *h = &s->handles[0];
+    ssize_t ret;
+
+    while (s->outoff < s->out.length) {
+        ret = write(h->fd, s->out.data + s->outoff, s->out.length - s->outoff);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (would_block()) {
+                /* Move pending data to the front so that the
+                 * buffer does not grow while it is being drained */
+                if (s->outoff >= s->out.length / 2) {
+                    memmove(s->out.data, s->out.data + s->outoff, out_pending(s));
+                    s->out.length -= s->outoff;
+                    s->outoff = 0;
+                }
+                return 0;
+            }
+            cpn_log(LOG_LEVEL_ERROR, "Error relaying data to fd: %s", strerror(errno));
+            return -1;
+        }
+
+        s->outoff += ret;
+    }
+
+    cpn_buf_reset(&s->out);
+    s->outoff = 0;
+
+    return 0;
+}
+
+static int receive_channel(struct relay_session *s)
+{
+    ssize_t ret;
+
+    /* Keep on receiving messages while they fit below the high
+     * watermark, even if the file descriptor is not draining
+     * them right now */
+    while (out_pending(s) < RELAY_HIGH_WATERMARK) {
+        ret = cpn_channel_receive_buf(s->channel, &s->out);
+        if (ret == CPN_CHANNEL_WOULD_BLOCK) {
+            break;
+        } else if (ret == 0) {
+            cpn_log(LOG_LEVEL_TRACE, "Channel closed, stopping relay");
+            return -1;
+        } else if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Error relaying data from channel");
+            return -1;
+        }
+
+        if (flush_out(s) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int read_handle(struct relay_session *s, struct relay_handle *h)
+{
+    ssize_t ret;
+    int err;
+
+    ret = read(h->fd, s->in, RELAY_BUFLEN);
+    if (ret == 0) {
+        close_handle(s, h);
+        return 0;
+    } else if (ret < 0) {
+        if (errno == EINTR || would_block())
+            return 0;
+        cpn_log(LOG_LEVEL_ERROR, "Error relaying data from fd: %s", strerror(errno));
+        return -1;
+    }
+
+    err = cpn_channel_write_data(s->channel, s->in, ret);
+    if (err < 0 && err != CPN_CHANNEL_WOULD_BLOCK) {
+        cpn_log(LOG_LEVEL_ERROR, "Error relaying data to channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int update_session(struct cpn_relay *r, struct relay_session *s)
+{
+    bool txpending, outpending;
+    unsigned events;
+    int i;
+
+    if (s->splice) {
+        /* Pipes are only refilled once they have been drained */
+        txpending = s->txthrottled = splice_tx_pending(s->splice);
+        outpending = s->rxthrottled = splice_rx_pending(s->splice);
+    } else {
+        txpending = tx_pending(s) > 0;
+        outpending = out_pending(s) > 0;
+
+        /* Each direction is throttled on its own as soon as its
+         * buffer exceeds the high watermark, and only resumes
+         * when it has drained below the low watermark */
+        if (out_pending(s) >= RELAY_HIGH_WATERMARK)
+            s->rxthrottled = true;
+        else if (out_pending(s) <= RELAY_LOW_WATERMARK)
+            s->rxthrottled = false;
+
+        if (tx_pending(s) >= RELAY_HIGH_WATERMARK)
+            s->txthrottled = true;
+        else if (tx_pending(s) <= RELAY_LOW_WATERMARK)
+            s->txthrottled = false;
+    }
+
+    if (s->open == 0 && !txpending && !outpending) {
+        cpn_log(LOG_LEVEL_TRACE, "All relay file descriptors closed");
+        finish(s, 0);
+        return 0;
+    }
+
+    events = (s->rxthrottled ? 0 : RELAY_READ) | (txpending ? RELAY_WRITE : 0);
+    if (update_events(r, &s->chandle, events) < 0)
+        return -1;
+
+    for (i = 0; i < s->nhandles; i++) {
+        struct relay_handle *h = &s->handles[i];
+
+        events = 0;
+        if (!h->closed && !s->txthrottled)
+            events |= RELAY_READ;
+        if (i == 0 && outpending)
+            events |= RELAY_WRITE;
+
+        if (update_events(r, h, events) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int handle_copy_event(struct relay_session *s, struct relay_handle *h, unsigned events)
+{
+    int err = 0;
+
+    if (h == &s->chandle) {
+        if ((events & RELAY_WRITE) && tx_pending(s)) {
+            err = cpn_channel_flush(s->channel);
+            if (err == CPN_CHANNEL_WOULD_BLOCK)
+                err = 0;
+        }
+        if (!err && (events & RELAY_READ) && !s->rxthrottled)
+            err = receive_channel(s);
+    } else {
+        if ((events & RELAY_WRITE) && out_pending(s))
+            err = flush_out(s);
+        if (!err && (events & RELAY_READ) && !h->closed && !s->txthrottled)
+            err = read_handle(s, h);
+    }
+
+    return err;
+}
+
+/* Data buffered by the channel does not make its file
+ * descriptor readable, so it has to be received as soon as we
+ * are not throttled anymore */
+static void receive_buffered(struct cpn_relay *r, struct relay_session *s)
+{
+    if (s->done || s->splice || s->rxthrottled ||
+            !cpn_channel_has_pending_input(s->channel))
+        return;
+
+    if (receive_channel(s) < 0 || update_session(r, s) < 0)
+        finish(s, -1);
+}
+
+static void handle_event(struct cpn_relay *r, struct relay_handle *h, unsigned events)
+{
+    struct relay_session *s = h->session;
+    int err;
+
+    if (s->done)
+        return;
+
+    if (s->splice)
+        err = handle_splice_event(s, h, events);
+    else
+        err = handle_copy_event(s, h, events);
+
+    if (err || update_session(r, s) < 0)
+        finish(s, -1);
+
+    receive_buffered(r, s);
+}
+
+static void drain_wakeup(struct cpn_relay *r)
+{
+    char buf[64];
+
+    while (read(r->wakefds[0], buf, sizeof(buf)) > 0);
+}
+
+static int wakeup(struct cpn_relay *r)
+{
+    ssize_t ret;
+
+    do {
+        ret = write(r->wakefds[1], "", 1);
+    } while (ret < 0 && errno == EINTR);
+
+    /* A full pipe will wake up the engine anyway */
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to wake up relay engine");
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_EPOLL
+static unsigned to_relay_events(uint32_t events)
+{
+    unsigned ret = 0;
+
+    /* Errors and hangups are reported by the subsequent read
+     * or write */
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        ret |= RELAY_READ;
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        ret |= RELAY_WRITE;
+
+    return ret;
+}
+
+static int wait_events(struct cpn_relay *r)
+{
+    struct epoll_event events[RELAY_MAX_EVENTS];
+    int i, n;
+
+    if ((n = epoll_wait(r->fd, events, ARRAY_SIZE(events), -1)) < 0) {
+        if (errno == EINTR)
+            return 0;
+        cpn_log(LOG_LEVEL_ERROR, "Error waiting for relay events: %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL)
+            drain_wakeup(r);
+        else
+            handle_event(r, events[i].data.ptr, to_relay_events(events[i].events));
+    }
+
+    return 0;
+}
+#else
+static unsigned to_relay_events(short events)
+{
+    unsigned ret = 0;
+
+    if (events & (POLLIN | POLLHUP | POLLERR))
+        ret |= RELAY_READ;
+    if (events & (POLLOUT | POLLHUP | POLLERR))
+        ret |= RELAY_WRITE;
+
+    return ret;
+}
+
+static int wait_events(struct cpn_relay *r)
+{
+    struct relay_handle **handles = NULL;
+    struct pollfd *pfds = NULL;
+    struct cpn_list_entry *it;
+    struct relay_session *s;
+    size_t n = 1, i;
+    int err = -1;
+
+    cpn_list_foreach(&r->active, it, s)
+        n += s->nhandles + 1;
+
+    if ((pfds = malloc(n * sizeof(*pfds))) == NULL ||
+            (handles = malloc(n * sizeof(*handles))) == NULL)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate relay events");
+        goto out;
+    }
+
+    pfds[0].fd = r->wakefds[0];
+    pfds[0].events = POLLIN;
+    handles[0] = NULL;
+    n = 1;
+
+    cpn_list_foreach(&r->active, it, s) {
+        int j;
+
+        for (j = -1; j < s->nhandles; j++) {
+            struct relay_handle *h = j < 0 ? &s->chandle : &s->handles[j];
+
+            if (!h->pollable || !h->events)
+                continue;
+
+            pfds[n].fd = h->fd;
+            pfds[n].events = ((h->events & RELAY_READ) ? POLLIN : 0) |
+                ((h->events & RELAY_WRITE) ? POLLOUT : 0);
+            handles[n] = h;
+            n++;
+        }
+    }
+
+    if (poll(pfds, n, -1) < 0) {
+        if (errno == EINTR)
+            err = 0;
+        else
+            cpn_log(LOG_LEVEL_ERROR, "Error waiting for relay events: %s", strerror(errno));
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!pfds[i].revents)
+            continue;
+
+        if (handles[i] == NULL)
+            drain_wakeup(r);
+        else
+            handle_event(r, handles[i], to_relay_events(pfds[i].revents));
+    }
+
+    err = 0;
+
+out:
+    free(handles);
+    free(pfds);
+
+    return err;
+}
+#endif
+
+static int set_cloexec_nonblock(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFD)) < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0)
+        return -1;
+    if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    return 0;
+}
+
+int cpn_relay_init(struct cpn_relay *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->wakefds[0] = r->wakefds[1] = -1;
+
+    if (pipe(r->wakefds) < 0 ||
+            set_cloexec_nonblock(r->wakefds[0]) < 0 ||
+            set_cloexec_nonblock(r->wakefds[1]) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to create relay wakeup pipe");
+        goto out_err;
+    }
+
+#ifdef HAVE_EPOLL
+    {
+        struct epoll_event ev;
+
+        if ((r->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to create epoll instance: %s", strerror(errno));
+            goto out_err;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+
+        if (epoll_ctl(r->fd, EPOLL_CTL_ADD, r->wakefds[0], &ev) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to watch relay wakeup pipe");
+            goto out_err;
+        }
+    }
+#endif
+
+    if (pthread_mutex_init(&r->mutex, NULL) != 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initialize relay mutex");
+        goto out_err;
+    }
+
+    return 0;
+
+out_err:
+    if (r->fd >= 0)
+        close(r->fd);
+    if (r->wakefds[0] >= 0)
+        close(r->wakefds[0]);
+    if (r->wakefds[1] >= 0)
+        close(r->wakefds[1]);
+
+    return -1;
+}
+
+void cpn_relay_free(struct cpn_relay *r)
+{
+    struct cpn_list_entry *it;
+    struct relay_session *s;
+
+    cpn_list_foreach(&r->active, it, s) {
+        teardown_session(r, s);
+        free_session(s);
+    }
+    cpn_list_clear(&r->active);
+
+    cpn_list_foreach(&r->pending, it, s) {
+        teardown_session(r, s);
+        free_session(s);
+    }
+    cpn_list_clear(&r->pending);
+
+    if (r->fd >= 0)
+        close(r->fd);
+    close(r->wakefds[0]);
+    close(r->wakefds[1]);
+
+    pthread_mutex_destroy(&r->mutex);
+}
+
+int cpn_relay_add(struct cpn_relay *r, struct cpn_channel *channel,
+        const int *fds, int nfds, cpn_relay_done_fn fn, void *payload)
+{
+    struct relay_session *s = NULL;
+    int i, sinkflags = -1;
+
+    if (nfds <= 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Relay called with nfds == 0");
+        return -1;
+    }
+
+    if ((s = calloc(1, sizeof(*s))) == NULL ||
+            (s->handles = calloc(nfds, sizeof(*s->handles))) == NULL ||
+            (s->in = malloc(RELAY_BUFLEN)) == NULL)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate relay");
+        goto out_err;
+    }
+
+    s->channel = channel;
+    s->nonblocking = channel->nonblocking;
+    s->fn = fn;
+    s->payload = payload;
+
+    init_handle(&s->chandle, s, channel->fd);
+    for (i = 0; i < nfds; i++)
+        init_handle(&s->handles[i], s, fds[i]);
+    s->nhandles = nfds;
+    s->open = nfds;
+
+    /* Unencrypted channels are relayed without copying data
+     * into user space where possible */
+    if ((s->splice = init_splice(s)) != NULL)
+        cpn_log(LOG_LEVEL_TRACE, "Splicing relay data");
+
+    /* We cannot wait for data on regular files, so they are only
+     * ever written to */
+    for (i = 0; i < nfds; i++) {
+        if (!s->handles[i].pollable) {
+            s->handles[i].closed = true;
+            s->open--;
+        }
+    }
+
+    if (cpn_channel_set_nonblocking(channel, true) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to relay channel");
+        goto out_err;
+    }
+
+    /* Writes to the first file descriptor must not block the
+     * engine when its consumer is slow */
+    if ((sinkflags = fcntl(fds[0], F_GETFL)) < 0 ||
+            fcntl(fds[0], F_SETFL, sinkflags | O_NONBLOCK) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to set relay file descriptor flags: %s",
+                strerror(errno));
+        sinkflags = -1;
+        goto out_err;
+    }
+    s->handles[0].flags = sinkflags;
+
+    pthread_mutex_lock(&r->mutex);
+    cpn_list_append(&r->pending, s);
+    pthread_mutex_unlock(&r->mutex);
+
+    /* The relay is queued already, so failing to wake up the
+     * engine only delays it until the next event */
+    wakeup(r);
+
+    return 0;
+
+out_err:
+    if (sinkflags >= 0)
+        fcntl(fds[0], F_SETFL, sinkflags);
+    if (s && !s->nonblocking && channel->nonblocking)
+        cpn_channel_set_nonblocking(channel, false);
+    free_session(s);
+
+    return -1;
+}
+
+/* Move newly added relays into the set of active relays and
+ * return whether the engine has been asked to stop */
+static bool activate_pending(struct cpn_relay *r)
+{
+    struct cpn_list pending;
+    struct cpn_list_entry *it;
+    struct relay_session *s;
+    bool stopping;
+
+    pthread_mutex_lock(&r->mutex);
+    pending = r->pending;
+    cpn_list_init(&r->pending);
+    stopping = r->stopping;
+    r->stopping = false;
+    pthread_mutex_unlock(&r->mutex);
+
+    cpn_list_foreach(&pending, it, s) {
+        cpn_list_append(&r->active, s);
+        if (update_session(r, s) < 0)
+            finish(s, -1);
+        receive_buffered(r, s);
+    }
+    cpn_list_clear(&pending);
+
+    return stopping;
+}
+
+static void reap_sessions(struct cpn_relay *r)
+{
+    struct cpn_list_entry *it, *next;
+    struct relay_session *s;
+
+    for (it = r->active.head; it; it = next) {
+        next = it->next;
+        s = it->data;
+
+        if (!s->done)
+            continue;
+
+        cpn_list_remove(&r->active, it);
+        teardown_session(r, s);
+
+        if (s->fn)
+            s->fn(s->result, s->payload);
+
+        free_session(s);
+    }
+}
+
+int cpn_relay_run(struct cpn_relay *r, bool until_idle)
+{
+    while (1) {
+        if (activate_pending(r))
+            break;
+
+        reap_sessions(r);
+
+        if (until_idle && r->active.head == NULL)
+            break;
+
+        if (wait_events(r) < 0)
+            return -1;
+
+        reap_sessions(r);
+    }
+
+    return 0;
+}
+
+int cpn_relay_stop(struct cpn_relay *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->stopping = true;
+    pthread_mutex_unlock(&r->mutex);
+
+    return wakeup(r);
+}
+
+struct relay_waiter {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    int result;
+};
+
+static struct cpn_relay shared_relay;
+static pthread_once_t shared_relay_once = PTHREAD_ONCE_INIT;
+static int shared_relay_err;
+
+static void *run_shared_relay(void *payload)
+{
+    if (cpn_relay_run((struct cpn_relay *) payload, false) < 0)
+        cpn_log(LOG_LEVEL_ERROR, "Shared relay engine failed");
+
+    return NULL;
+}
+
+static int stop_shared_relay(void)
+{
+    return cpn_relay_stop(&shared_relay);
+}
+
+static void init_shared_relay(void)
+{
+    if (cpn_relay_init(&shared_relay) < 0 ||
+            cpn_spawn(NULL, run_shared_relay, &shared_relay) < 0)
+    {
+        shared_relay_err = -1;
+        return;
+    }
+
+    cpn_global_on_shutdown(stop_shared_relay);
+}
+
+static int start_shared_relay(void)
+{
+    pthread_once(&shared_relay_once, init_shared_relay);
+    if (shared_relay_err) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to start shared relay engine");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void notify_waiter(int result, void *payload)
+{
+    struct relay_waiter *w = (struct relay_waiter *) payload;
+
+    pthread_mutex_lock(&w->mutex);
+    w->result = result;
+    w->done = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+int cpn_relay_await(struct cpn_channel *channel, const int *fds, int nfds)
+{
+    struct relay_waiter w;
+    int err = -1;
+
+    if (start_shared_relay() < 0)
+        return -1;
+
+    w.done = false;
+    w.result = -1;
+
+    if (pthread_mutex_init(&w.mutex, NULL) != 0)
+        return -1;
+    if (pthread_cond_init(&w.cond, NULL) != 0) {
+        pthread_mutex_destroy(&w.mutex);
+        return -1;
+    }
+
+    if (cpn_relay_add(&shared_relay, channel, fds, nfds, notify_waiter, &w) < 0)
+        goto out;
+
+    pthread_mutex_lock(&w.mutex);
+    while (!w.done)
+        pthread_cond_wait(&w.cond, &w.mutex);
+    pthread_mutex_unlock(&w.mutex);
+
+    err = w.result;
+
+out:
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.mutex);
+
+    return err;
+}
+
+/* Relay owning its channel and file descriptors, which are
+ * closed as soon as it has finished */
+struct detached_relay {
+    struct cpn_channel channel;
+    int *fds;
+    int nfds;
+    cpn_relay_done_fn fn;
+    void *payload;
+};
+
+static void free_detached(struct detached_relay *d)
+{
+    free(d->fds);
+    free(d);
+}
+
+static void finish_detached(int result, void *payload)
+{
+    struct detached_relay *d = (struct detached_relay *) payload;
+    int i;
+
+    cpn_channel_close(&d->channel);
+    for (i = 0; i < d->nfds; i++)
+        close(d->fds[i]);
+
+    if (d->fn)
+        d->fn(result, d->payload);
+
+    free_detached(d);
+}
+
+int cpn_relay_detach(struct cpn_channel *channel, const int *fds, int nfds,
+        cpn_relay_done_fn fn, void *payload)
+{
+    struct detached_relay *d;
+
+    if (nfds <= 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Relay called with nfds == 0");
+        return -1;
+    }
+
+    if (start_shared_relay() < 0)
+        return -1;
+
+    if ((d = calloc(1, sizeof(*d))) == NULL ||
+            (d->fds = malloc(nfds * sizeof(*d->fds))) == NULL)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate relay");
+        free(d);
+        return -1;
+    }
+
+    memcpy(d->fds, fds, nfds * sizeof(*d->fds));
+    d->nfds = nfds;
+    d->fn = fn;
+    d->payload = payload;
+
+    cpn_channel_move(&d->channel, channel);
+
+    if (cpn_relay_add(&shared_relay, &d->channel, d->fds, nfds, finish_detached, d) < 0) {
+        /* Ownership only passes on when the relay has started */
+        cpn_channel_move(channel, &d->channel);
+        free_detached(d);
+        return -1;
+    }
+
+    return 0;
+}
@@ -15,23 +15,64 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <sodium/utils.h>
 
 #include "config.h"
 
+#ifndef HAVE_CLOCK_GETTIME
+# include <sys/time.h>
+#endif
+
 #include "capone/buf.h"
 #include "capone/channel.h"
 #include "capone/common.h"
 #include "capone/log.h"
 #include "capone/session.h"
 #include "capone/server.h"
+#include "capone/ticket.h"
 
 #include "capone/crypto/asymmetric.h"
+#include "capone/crypto/hash.h"
 
 #include "capone/proto/capone.pb-c.h"
 #include "capone/proto/discovery.pb-c.h"
 #include "capone/proto/encryption.pb-c.h"
 
+#include "lib/negotiation.pb-c.h"
+
+/* Cookies are made up of the time slot they have been issued in,
+ * followed by a keyed hash over the slot, the client's address
+ * and the keys of its initiation */
+#define COOKIE_INTERVAL 30
+#define COOKIE_MACLEN 16
+#define COOKIE_LEN (4 + COOKIE_MACLEN)
+
+/* Handshake messages are received before the peer has been
+ * authenticated, so they are limited to a size well above the
+ * largest message any peer sends */
+#define HANDSHAKE_MAXMSGLEN 4096
+
+/* Time clients may take to finish an asynchronous handshake */
+#define DEFAULT_HANDSHAKE_TIMEOUT (10 * 1000)
+
+static pthread_once_t cookie_key_once = PTHREAD_ONCE_INIT;
+static struct cpn_symmetric_key cookie_key;
+static size_t cookie_threshold;
+
+static pthread_mutex_t handshakes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned handshake_timeout = DEFAULT_HANDSHAKE_TIMEOUT;
+static size_t max_handshakes;
+static size_t pending_handshakes;
+
 int cpn_server_await_command(enum cpn_command *out,
         struct cpn_channel *channel)
 {
@@ -64,11 +105,57 @@ int cpn_server_await_command(enum cpn_command *out,
             break;
     }
 
+    /* A command still using the early key of a one-round-trip
+     * handshake may have been replayed by an attacker, so only
+     * queries are safe to execute. Clients complete the handshake
+     * before sending any other command. */
+    if (ret == 0 && channel->rekeying && *out != CPN_COMMAND_QUERY) {
+        cpn_log(LOG_LEVEL_ERROR, "Refusing command sent as early data");
+        ret = -1;
+    }
+
     connection_initiation_message__free_unpacked(initiation, NULL);
 
     return ret;
 }
 
+int cpn_server_await_next_command(enum cpn_command *out,
+        struct cpn_channel *channel, int timeout)
+{
+    struct pollfd pfd;
+    char c;
+    int ret;
+
+    /* Commands pipelined by the client may already have been read
+     * ahead by the channel */
+    if (cpn_channel_has_pending_input(channel))
+        return cpn_server_await_command(out, channel);
+
+    pfd.fd = channel->fd;
+    pfd.events = POLLIN;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to wait for command: %s", strerror(errno));
+        return -1;
+    } else if (ret == 0) {
+        cpn_log(LOG_LEVEL_DEBUG, "Connection idle for too long");
+        return -1;
+    }
+
+    /* Clients simply close the connection after their last
+     * command, which is not an error */
+    if (recv(channel->fd, &c, sizeof(c), MSG_PEEK) == 0) {
+        cpn_log(LOG_LEVEL_DEBUG, "Connection closed by client");
+        return -1;
+    }
+
+    return cpn_server_await_command(out, channel);
+}
+
 int cpn_server_handle_discovery(struct cpn_channel *channel,
         const char *name,
         uint32_t nservices,
@@ -231,6 +318,11 @@ out_notify:
     if (err)
         goto out;
 
+    if ((err = cpn_service_plugin_setup_channel(service->plugin, channel)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not set up channel for service");
+        goto out;
+    }
+
     if ((err = service->plugin->server_fn(channel, remote_key, session, cfg)) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Service could not handle connection");
         goto out;
@@ -466,29 +558,495 @@ out:
     return err;
 }
 
+int write_negotiated_protobuf(struct cpn_channel *channel,
+        const ProtobufCMessage *msg, const NegotiationMessage *negotiation)
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+    size_t msglen, negotiationlen;
+    int err = -1;
+
+    msglen = protobuf_c_message_get_packed_size(msg);
+    negotiationlen = negotiation_message__get_packed_size(negotiation);
+
+    if (cpn_buf_reserve(&buf, msglen + negotiationlen) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate negotiated message");
+        goto out;
+    }
+
+    /* Concatenated protobufs are parsed as a single merged
+     * message, so the negotiation's fields simply end up as
+     * unknown fields for peers unaware of them */
+    protobuf_c_message_pack(msg, (uint8_t *) buf.data);
+    negotiation_message__pack(negotiation, (uint8_t *) buf.data + msglen);
+
+    err = cpn_channel_write_data(channel, (uint8_t *) buf.data, msglen + negotiationlen);
+
+out:
+    cpn_buf_clear(&buf);
+
+    return err;
+}
+
+int receive_negotiated_protobuf(ProtobufCMessage **msg,
+        NegotiationMessage **negotiation,
+        struct cpn_channel *channel,
+        const ProtobufCMessageDescriptor *descr,
+        bool cookies)
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+    uint32_t maxmsglen = channel->maxmsglen;
+    ssize_t len;
+    int err = -1;
+
+    *msg = NULL;
+    *negotiation = NULL;
+
+    channel->maxmsglen = MIN(maxmsglen, HANDSHAKE_MAXMSGLEN);
+    len = cpn_channel_receive_buf(channel, &buf);
+    channel->maxmsglen = maxmsglen;
+
+    if (len < 0) {
+        err = len == CPN_CHANNEL_WOULD_BLOCK ? CPN_CHANNEL_WOULD_BLOCK : -1;
+        goto out;
+    }
+
+    if ((*negotiation = negotiation_message__unpack(NULL, len, (uint8_t *) buf.data)) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Negotiation could not be unpacked");
+        goto out;
+    }
+
+    /* Cookie requests consist of the negotiation only */
+    if (cookies && (*negotiation)->has_cookie) {
+        err = 0;
+        goto out;
+    }
+
+    if ((*msg = protobuf_c_message_unpack(descr, NULL, len, (uint8_t *) buf.data)) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Protobuf message could not be unpacked");
+        negotiation_message__free_unpacked(*negotiation, NULL);
+        *negotiation = NULL;
+        goto out;
+    }
+
+    err = 0;
+
+out:
+    cpn_buf_clear(&buf);
+
+    return err;
+}
+
+int apply_negotiation(struct cpn_channel *channel,
+        const NegotiationMessage *negotiation)
+{
+    if (negotiation->has_framelen) {
+        if (cpn_channel_set_framelen(channel, negotiation->framelen) < 0 ||
+                cpn_channel_set_framing(channel, CPN_CHANNEL_FRAMING_FRAMES) < 0)
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to use negotiated frame length");
+            return -1;
+        }
+    }
+
+    if (negotiation->n_ciphers > 1) {
+        cpn_log(LOG_LEVEL_ERROR, "Negotiated more than one cipher");
+        return -1;
+    } else if (negotiation->n_ciphers == 1) {
+        if (cpn_channel_set_cipher(channel, negotiation->ciphers[0]) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to use negotiated cipher");
+            return -1;
+        }
+    }
+
+    if (negotiation->n_compressions > 1) {
+        cpn_log(LOG_LEVEL_ERROR, "Negotiated more than one compression");
+        return -1;
+    } else if (negotiation->n_compressions == 1) {
+        if (cpn_channel_set_compression(channel, negotiation->compressions[0]) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to use negotiated compression");
+            return -1;
+        }
+    }
+
+    channel->multiplexed = negotiation->has_multiplex && negotiation->multiplex;
+
+    return 0;
+}
+
+static void append_negotiation(struct cpn_buf *buf,
+        const NegotiationMessage *negotiation)
+{
+    uint32_t field, value;
+    size_t i;
+
+    /* Every negotiated field is prefixed with its field number
+     * to avoid ambiguities between different sets of fields */
+    if (negotiation->has_framelen) {
+        field = htonl(100);
+        value = htonl(negotiation->framelen);
+        cpn_buf_append_data(buf, (unsigned char *) &field, sizeof(field));
+        cpn_buf_append_data(buf, (unsigned char *) &value, sizeof(value));
+    }
+
+    for (i = 0; i < negotiation->n_ciphers; i++) {
+        field = htonl(101);
+        value = htonl(negotiation->ciphers[i]);
+        cpn_buf_append_data(buf, (unsigned char *) &field, sizeof(field));
+        cpn_buf_append_data(buf, (unsigned char *) &value, sizeof(value));
+    }
+
+    for (i = 0; i < negotiation->n_compressions; i++) {
+        field = htonl(102);
+        value = htonl(negotiation->compressions[i]);
+        cpn_buf_append_data(buf, (unsigned char *) &field, sizeof(field));
+        cpn_buf_append_data(buf, (unsigned char *) &value, sizeof(value));
+    }
+
+    if (negotiation->has_multiplex) {
+        field = htonl(103);
+        value = htonl(negotiation->multiplex);
+        cpn_buf_append_data(buf, (unsigned char *) &field, sizeof(field));
+        cpn_buf_append_data(buf, (unsigned char *) &value, sizeof(value));
+    }
+
+    if (negotiation->has_resumption) {
+        field = htonl(104);
+        value = htonl(negotiation->resumption);
+        cpn_buf_append_data(buf, (unsigned char *) &field, sizeof(field));
+        cpn_buf_append_data(buf, (unsigned char *) &value, sizeof(value));
+    }
+
+    if (negotiation->has_ticket) {
+        field = htonl(105);
+        value = htonl(negotiation->ticket.len);
+        cpn_buf_append_data(buf, (unsigned char *) &field, sizeof(field));
+        cpn_buf_append_data(buf, (unsigned char *) &value, sizeof(value));
+        cpn_buf_append_data(buf, negotiation->ticket.data, negotiation->ticket.len);
+    }
+
+    if (negotiation->has_resumed) {
+        field = htonl(106);
+        value = htonl(negotiation->resumed);
+        cpn_buf_append_data(buf, (unsigned char *) &field, sizeof(field));
+        cpn_buf_append_data(buf, (unsigned char *) &value, sizeof(value));
+    }
+
+    if (negotiation->has_ik) {
+        field = htonl(107);
+        value = htonl(negotiation->ik);
+        cpn_buf_append_data(buf, (unsigned char *) &field, sizeof(field));
+        cpn_buf_append_data(buf, (unsigned char *) &value, sizeof(value));
+    }
+}
+
+bool negotiation_equals(const NegotiationMessage *a,
+        const NegotiationMessage *b)
+{
+    if (a->has_framelen != b->has_framelen || a->framelen != b->framelen)
+        return false;
+    if (a->n_ciphers != b->n_ciphers)
+        return false;
+    if (a->n_ciphers &&
+            memcmp(a->ciphers, b->ciphers, a->n_ciphers * sizeof(*a->ciphers)))
+        return false;
+    if (a->n_compressions != b->n_compressions)
+        return false;
+    if (a->n_compressions && memcmp(a->compressions, b->compressions,
+                a->n_compressions * sizeof(*a->compressions)))
+        return false;
+    if (a->has_multiplex != b->has_multiplex || a->multiplex != b->multiplex)
+        return false;
+    if (a->has_resumption != b->has_resumption || a->resumption != b->resumption)
+        return false;
+    if (a->has_ticket != b->has_ticket || a->ticket.len != b->ticket.len)
+        return false;
+    if (a->ticket.len && memcmp(a->ticket.data, b->ticket.data, a->ticket.len))
+        return false;
+    if (a->has_resumed != b->has_resumed || a->resumed != b->resumed)
+        return false;
+    if (a->has_ik != b->has_ik || a->ik != b->ik)
+        return false;
+    return true;
+}
+
+static void select_negotiation(NegotiationMessage *selection,
+        uint32_t *cipher, uint32_t *compression,
+        const NegotiationMessage *offer,
+        const struct cpn_channel *channel)
+{
+    size_t i;
+
+    if (offer->has_framelen) {
+        selection->has_framelen = 1;
+        selection->framelen = MIN(offer->framelen, channel->framelen);
+    }
+
+    /* Ciphers are offered in order of the client's preference,
+     * so we pick the first one that is available locally */
+    for (i = 0; i < offer->n_ciphers; i++) {
+        if (!cpn_symmetric_cipher_is_available(offer->ciphers[i]))
+            continue;
+        *cipher = offer->ciphers[i];
+        selection->ciphers = cipher;
+        selection->n_ciphers = 1;
+        break;
+    }
+
+    /* Compression is only accepted if not disabled locally */
+    for (i = 0; channel->compression_level && i < offer->n_compressions; i++) {
+        if (offer->compressions[i] == CPN_COMPRESSION_NONE ||
+                !cpn_compression_is_available(offer->compressions[i]))
+            continue;
+        *compression = offer->compressions[i];
+        selection->compressions = compression;
+        selection->n_compressions = 1;
+        break;
+    }
+
+    if (offer->has_multiplex && offer->multiplex) {
+        selection->has_multiplex = 1;
+        selection->multiplex = 1;
+    }
+
+    if (offer->has_ik && offer->ik) {
+        selection->has_ik = 1;
+        selection->ik = 1;
+    }
+}
+
+int derive_resumption_secret(struct cpn_symmetric_key *out,
+        const struct cpn_symmetric_key *shared_key,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        bool localfirst)
+{
+    struct cpn_asymmetric_keys static_keys;
+    struct cpn_asymmetric_pk remote_static_key;
+    struct cpn_symmetric_key static_key;
+    struct cpn_hash_state hash;
+    int err = -1;
+
+    /* The secret is bound to both identities by Diffie-Hellman of
+     * the long-term keys. Otherwise, anybody claiming another
+     * client's identity would be able to obtain a usable ticket
+     * for it, as the ticket is issued before the client has
+     * proven its identity. */
+    if (cpn_asymmetric_keys_from_sign_keys(&static_keys, local_keys) < 0 ||
+            cpn_asymmetric_pk_from_sign_pk(&remote_static_key, remote_key) < 0 ||
+            cpn_symmetric_key_from_scalarmult(&static_key, &static_keys,
+                &remote_static_key, localfirst) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to derive static shared key");
+        goto out;
+    }
+
+    if (cpn_hash_init(&hash, sizeof(out->data)) < 0 ||
+            cpn_hash_update(&hash, static_key.data, sizeof(static_key.data)) < 0 ||
+            cpn_hash_update(&hash, shared_key->data, sizeof(shared_key->data)) < 0 ||
+            cpn_hash_final(out->data, &hash) < 0)
+        goto out;
+
+    err = 0;
+
+out:
+    cpn_memzero(&static_keys, sizeof(static_keys));
+    cpn_memzero(&static_key, sizeof(static_key));
+
+    return err;
+}
+
+int derive_resumed_key(struct cpn_symmetric_key *out,
+        const struct cpn_symmetric_key *secret,
+        const struct cpn_asymmetric_pk *client_nonce,
+        const struct cpn_asymmetric_pk *server_nonce)
+{
+    struct cpn_hash_state hash;
+
+    if (cpn_hash_init(&hash, sizeof(out->data)) < 0 ||
+            cpn_hash_update(&hash, secret->data, sizeof(secret->data)) < 0 ||
+            cpn_hash_update(&hash, client_nonce->data, sizeof(client_nonce->data)) < 0 ||
+            cpn_hash_update(&hash, server_nonce->data, sizeof(server_nonce->data)) < 0 ||
+            cpn_hash_final(out->data, &hash) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to derive resumed key");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int mix_key(struct cpn_symmetric_key *out,
+        const struct cpn_symmetric_key *key,
+        const struct cpn_asymmetric_keys *keys,
+        const struct cpn_asymmetric_pk *pk,
+        bool localfirst)
+{
+    struct cpn_symmetric_key dh;
+    struct cpn_hash_state hash;
+    int err = -1;
+
+    if (cpn_symmetric_key_from_scalarmult(&dh, keys, pk, localfirst) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to derive shared key");
+        goto out;
+    }
+
+    if (cpn_hash_init(&hash, sizeof(out->data)) < 0 ||
+            (key && cpn_hash_update(&hash, key->data, sizeof(key->data)) < 0) ||
+            cpn_hash_update(&hash, dh.data, sizeof(dh.data)) < 0 ||
+            cpn_hash_final(out->data, &hash) < 0)
+        goto out;
+
+    err = 0;
+
+out:
+    cpn_memzero(&dh, sizeof(dh));
+
+    return err;
+}
+
+int derive_early_key(struct cpn_symmetric_key *out,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        const struct cpn_asymmetric_keys *client_emph_keys,
+        const struct cpn_asymmetric_pk *client_emph_key,
+        const NegotiationMessage *offer)
+{
+    struct cpn_asymmetric_keys static_keys;
+    struct cpn_asymmetric_pk remote_static_key;
+    struct cpn_symmetric_key key;
+    struct cpn_buf transcript = CPN_BUF_INIT;
+    struct cpn_hash_state hash;
+    bool client = (client_emph_keys != NULL);
+    int err = -1;
+
+    if (cpn_asymmetric_keys_from_sign_keys(&static_keys, local_keys) < 0 ||
+            cpn_asymmetric_pk_from_sign_pk(&remote_static_key, remote_key) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to convert long-term keys");
+        goto out;
+    }
+
+    /* The early key mixes in Diffie-Hellman of both long-term
+     * keys as well as of the client's ephemeral key with the
+     * server's long-term key, such that only the server is able
+     * to derive it, and only for the claimed client */
+    if (mix_key(&key, NULL, &static_keys, &remote_static_key, client) < 0)
+        goto out;
+    if (client) {
+        if (mix_key(&key, &key, client_emph_keys, &remote_static_key, true) < 0)
+            goto out;
+    } else if (mix_key(&key, &key, &static_keys, client_emph_key, false) < 0) {
+        goto out;
+    }
+
+    cpn_buf_append_data(&transcript, client ? local_keys->pk.data : remote_key->data, CPN_CRYPTO_SIGN_PKBYTES);
+    cpn_buf_append_data(&transcript, client_emph_key->data, CPN_CRYPTO_ASYMMETRIC_PKBYTES);
+    cpn_buf_append_data(&transcript, client ? remote_key->data : local_keys->pk.data, CPN_CRYPTO_SIGN_PKBYTES);
+    append_negotiation(&transcript, offer);
+
+    if (cpn_hash_init(&hash, sizeof(out->data)) < 0 ||
+            cpn_hash_update(&hash, key.data, sizeof(key.data)) < 0 ||
+            cpn_hash_update(&hash, (uint8_t *) transcript.data, transcript.length) < 0 ||
+            cpn_hash_final(out->data, &hash) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to derive early key");
+        goto out;
+    }
+
+    err = 0;
+
+out:
+    cpn_buf_clear(&transcript);
+    cpn_memzero(&static_keys, sizeof(static_keys));
+    cpn_memzero(&key, sizeof(key));
+
+    return err;
+}
+
+int derive_final_key(struct cpn_symmetric_key *out,
+        const struct cpn_symmetric_key *early_key,
+        const struct cpn_sign_keys *local_keys,
+        const struct cpn_sign_pk *remote_key,
+        const struct cpn_asymmetric_keys *local_emph_keys,
+        const struct cpn_asymmetric_pk *remote_emph_key,
+        bool client)
+{
+    struct cpn_asymmetric_keys static_keys;
+    struct cpn_asymmetric_pk remote_static_key;
+    struct cpn_symmetric_key key;
+    int err = -1;
+
+    /* Mixing in both ephemeral keys provides forward secrecy
+     * for everything sent after the server's response */
+    if (mix_key(&key, early_key, local_emph_keys, remote_emph_key, client) < 0)
+        goto out;
+
+    if (client) {
+        if (cpn_asymmetric_keys_from_sign_keys(&static_keys, local_keys) < 0 ||
+                mix_key(out, &key, &static_keys, remote_emph_key, true) < 0)
+            goto out;
+    } else {
+        if (cpn_asymmetric_pk_from_sign_pk(&remote_static_key, remote_key) < 0 ||
+                mix_key(out, &key, local_emph_keys, &remote_static_key, false) < 0)
+            goto out;
+    }
+
+    err = 0;
+
+out:
+    cpn_memzero(&static_keys, sizeof(static_keys));
+    cpn_memzero(&key, sizeof(key));
+
+    return err;
+}
+
+static int compute_mac(struct cpn_sign_sig *out,
+        const struct cpn_symmetric_key *secret,
+        const struct cpn_buf *buf)
+{
+    struct cpn_hash_state hash;
+
+    /* Resumed and one-round-trip handshakes are authenticated
+     * by proving knowledge of a shared secret instead of signing */
+    if (cpn_hash_init(&hash, sizeof(out->data)) < 0 ||
+            cpn_hash_update(&hash, secret->data, sizeof(secret->data)) < 0 ||
+            cpn_hash_update(&hash, (uint8_t *) buf->data, buf->length) < 0 ||
+            cpn_hash_final(out->data, &hash) < 0)
+        return -1;
+
+    return 0;
+}
+
 int send_key_acknowledgement(struct cpn_channel *channel,
         const struct cpn_sign_keys *sign_keys,
         const struct cpn_asymmetric_pk *local_emph_key,
         const struct cpn_sign_pk *remote_sign_key,
-        const struct cpn_asymmetric_pk *remote_emph_key)
+        const struct cpn_asymmetric_pk *remote_emph_key,
+        const NegotiationMessage *negotiation,
+        const struct cpn_symmetric_key *mac_key)
 {
     EncryptionAcknowledgementMessage msg = ENCRYPTION_ACKNOWLEDGEMENT_MESSAGE__INIT;
     IdentityMessage *identity = NULL;
     PublicKeyMessage *ephemeral = NULL;
     struct cpn_buf sign_buf = CPN_BUF_INIT;
     struct cpn_sign_sig sig;
-    int err = -1;
+    int ret, err = -1;
 
     cpn_buf_append_data(&sign_buf, sign_keys->pk.data, CPN_CRYPTO_SIGN_PKBYTES);
     cpn_buf_append_data(&sign_buf, local_emph_key->data, CPN_CRYPTO_ASYMMETRIC_PKBYTES);
     cpn_buf_append_data(&sign_buf, remote_emph_key->data, CPN_CRYPTO_ASYMMETRIC_PKBYTES);
     cpn_buf_append_data(&sign_buf, remote_sign_key->data, CPN_CRYPTO_ASYMMETRIC_PKBYTES);
+    append_negotiation(&sign_buf, negotiation);
 
-    if (cpn_sign_sig(&sig, &sign_keys->sk, (uint8_t *) sign_buf.data, sign_buf.length) < 0) {
+    if (mac_key) {
+        if (compute_mac(&sig, mac_key, &sign_buf) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to authenticate handshake");
+            goto out;
+        }
+    } else if (cpn_sign_sig(&sig, &sign_keys->sk, (uint8_t *) sign_buf.data, sign_buf.length) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to sign ephemeral key");
         goto out;
     }
-
     if (cpn_sign_pk_to_proto(&identity, &sign_keys->pk) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to generate identity message");
         goto out;
@@ -504,7 +1062,10 @@ int send_key_acknowledgement(struct cpn_channel *channel,
     msg.signature.data = sig.data;
     msg.signature.len = sizeof(sig.data);
 
-    if (cpn_channel_write_protobuf(channel, &msg.base) < 0) {
+    /* Non-blocking channels queue the acknowledgement, which is
+     * flushed by the caller */
+    ret = write_negotiated_protobuf(channel, &msg.base, negotiation);
+    if (ret < 0 && ret != CPN_CHANNEL_WOULD_BLOCK) {
         cpn_log(LOG_LEVEL_ERROR, "Received invalid ephemeral key signature");
         goto out;
     }
@@ -524,19 +1085,23 @@ out:
 static int receive_ephemeral_key(
         struct cpn_channel *channel,
         struct cpn_sign_pk *remote_sign_key,
-        struct cpn_asymmetric_pk *remote_encrypt_key)
+        struct cpn_asymmetric_pk *remote_encrypt_key,
+        NegotiationMessage **offer)
 {
     EncryptionInitiationMessage *msg = NULL;
-    int err = -1;
+    int err;
 
-    if (cpn_channel_receive_protobuf(channel,
-                &encryption_initiation_message__descriptor,
-                (ProtobufCMessage **) &msg) < 0)
-    {
+    err = receive_negotiated_protobuf((ProtobufCMessage **) &msg, offer,
+                channel, &encryption_initiation_message__descriptor, false);
+    if (err == CPN_CHANNEL_WOULD_BLOCK) {
+        return err;
+    } else if (err < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Failed receiving negotiation response");
         goto out;
     }
 
+    err = -1;
+
     if (cpn_sign_pk_from_proto(remote_sign_key, msg->identity) < 0 ||
             cpn_asymmetric_pk_from_proto(remote_encrypt_key, msg->ephemeral) < 0)
     {
@@ -553,26 +1118,19 @@ out:
     return err;
 }
 
-int receive_key_acknowledgement(struct cpn_asymmetric_pk *out,
-        struct cpn_channel *c,
+static int verify_key_acknowledgement(struct cpn_asymmetric_pk *out,
+        const EncryptionAcknowledgementMessage *msg,
+        const NegotiationMessage *negotiation,
         const struct cpn_sign_pk *local_sign_pk,
         const struct cpn_asymmetric_pk *local_emph_key,
-        const struct cpn_sign_pk *remote_sign_pk)
+        const struct cpn_sign_pk *remote_sign_pk,
+        const struct cpn_symmetric_key *mac_key)
 {
-    EncryptionAcknowledgementMessage *msg = NULL;
     struct cpn_buf sign_buf = CPN_BUF_INIT;
     struct cpn_sign_pk msg_sign_pk;
-    struct cpn_sign_sig sig;
+    struct cpn_sign_sig sig, mac;
     int err = -1;
 
-    if (cpn_channel_receive_protobuf(c,
-            &encryption_acknowledgement_message__descriptor,
-            (ProtobufCMessage **) &msg) < 0)
-    {
-        cpn_log(LOG_LEVEL_ERROR, "Unable to receive acknowledge message");
-        goto out;
-    }
-
     if (cpn_sign_pk_from_proto(&msg_sign_pk, msg->identity) < 0 ||
             memcmp(&msg_sign_pk, remote_sign_pk, sizeof(msg_sign_pk))) {
         cpn_log(LOG_LEVEL_ERROR, "Verification key does not match");
@@ -589,8 +1147,23 @@ int receive_key_acknowledgement(struct cpn_asymmetric_pk *out,
     cpn_buf_append_data(&sign_buf, out->data, CPN_CRYPTO_ASYMMETRIC_PKBYTES);
     cpn_buf_append_data(&sign_buf, local_emph_key->data, CPN_CRYPTO_ASYMMETRIC_PKBYTES);
     cpn_buf_append_data(&sign_buf, local_sign_pk->data, CPN_CRYPTO_ASYMMETRIC_PKBYTES);
+    append_negotiation(&sign_buf, negotiation);
+
+    if ((negotiation->has_resumed && negotiation->resumed) ||
+            (negotiation->has_ik && negotiation->ik))
+    {
+        if (mac_key == NULL) {
+            cpn_log(LOG_LEVEL_ERROR, "Unexpected handshake without signature");
+            goto out;
+        }
 
-    if (cpn_sign_sig_verify(remote_sign_pk, &sig, (uint8_t *) sign_buf.data, sign_buf.length) < 0) {
+        if (compute_mac(&mac, mac_key, &sign_buf) < 0 ||
+                sodium_memcmp(mac.data, sig.data, sizeof(mac.data)))
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to verify handshake");
+            goto out;
+        }
+    } else if (cpn_sign_sig_verify(remote_sign_pk, &sig, (uint8_t *) sign_buf.data, sign_buf.length) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to verify signature");
         goto out;
     }
@@ -599,61 +1172,760 @@ int receive_key_acknowledgement(struct cpn_asymmetric_pk *out,
 
 out:
     cpn_buf_clear(&sign_buf);
-    if (msg)
-        encryption_acknowledgement_message__free_unpacked(msg, NULL);
 
     return err;
 }
 
-int cpn_server_await_encryption(struct cpn_channel *channel,
-        const struct cpn_sign_keys *sign_keys,
-        struct cpn_sign_pk *remote_sign_key)
+/* Returns 1 if the server requested a cookie instead, which is
+ * then stored in the negotiation */
+int receive_key_acknowledgement(struct cpn_asymmetric_pk *out,
+        NegotiationMessage **negotiation,
+        struct cpn_channel *c,
+        const struct cpn_sign_pk *local_sign_pk,
+        const struct cpn_asymmetric_pk *local_emph_key,
+        const struct cpn_sign_pk *remote_sign_pk,
+        const struct cpn_symmetric_key *mac_key,
+        bool cookies)
 {
-    struct cpn_asymmetric_keys emph_keys;
-    struct cpn_asymmetric_pk remote_emph_key, received_emph_key;
-    struct cpn_symmetric_key shared_key;
+    EncryptionAcknowledgementMessage *msg = NULL;
+    int err = -1;
 
-    if (receive_ephemeral_key(channel, remote_sign_key, &remote_emph_key) < 0) {
-        cpn_log(LOG_LEVEL_ERROR, "Unable to receive session key");
-        return -1;
+    if (receive_negotiated_protobuf((ProtobufCMessage **) &msg, negotiation,
+                c, &encryption_acknowledgement_message__descriptor, cookies) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to receive acknowledge message");
+        goto out;
     }
 
-    if (cpn_asymmetric_keys_generate(&emph_keys) < 0) {
-        cpn_log(LOG_LEVEL_ERROR, "Unable to generate key pair");
-        return -1;
+    if (msg == NULL) {
+        if ((*negotiation)->cookie.len > CPN_SERVER_COOKIE_MAXLEN) {
+            cpn_log(LOG_LEVEL_ERROR, "Server requested invalid cookie");
+            goto out;
+        }
+        err = 1;
+        goto out;
     }
 
-    if (send_key_acknowledgement(channel,
-                sign_keys, &emph_keys.pk,
-                remote_sign_key, &remote_emph_key) < 0)
-    {
+    if (verify_key_acknowledgement(out, msg, *negotiation,
+                local_sign_pk, local_emph_key, remote_sign_pk, mac_key) < 0)
+        goto out;
+
+    err = 0;
+
+out:
+    if (msg)
+        encryption_acknowledgement_message__free_unpacked(msg, NULL);
+    if (err < 0 && *negotiation) {
+        negotiation_message__free_unpacked(*negotiation, NULL);
+        *negotiation = NULL;
+    }
+
+    return err;
+}
+
+static void issue_ticket(NegotiationMessage *selection,
+        uint8_t *ticket,
+        const struct cpn_symmetric_key *shared_key,
+        const struct cpn_sign_keys *sign_keys,
+        const struct cpn_sign_pk *remote_sign_key)
+{
+    struct cpn_symmetric_key secret;
+    size_t len;
+
+    if (derive_resumption_secret(&secret, shared_key, sign_keys, remote_sign_key, false) < 0 ||
+            cpn_ticket_seal(ticket, &len, remote_sign_key, &secret, CPN_TICKET_LIFETIME) < 0)
+    {
+        /* Clients simply perform a full handshake next time */
+        cpn_log(LOG_LEVEL_WARNING, "Unable to issue ticket");
+        goto out;
+    }
+
+    selection->has_resumption = 1;
+    selection->resumption = 1;
+    selection->has_ticket = 1;
+    selection->ticket.data = ticket;
+    selection->ticket.len = len;
+
+out:
+    cpn_memzero(&secret, sizeof(secret));
+}
+
+static int accept_ik(struct cpn_channel *channel,
+        const struct cpn_sign_keys *sign_keys,
+        const struct cpn_sign_pk *remote_sign_key,
+        const struct cpn_asymmetric_pk *remote_emph_key,
+        const NegotiationMessage *offer)
+{
+    NegotiationMessage selection = NEGOTIATION_MESSAGE__INIT;
+    struct cpn_asymmetric_keys emph_keys;
+    struct cpn_symmetric_key early_key, key;
+    uint32_t cipher, compression;
+    int err = -1;
+
+    select_negotiation(&selection, &cipher, &compression, offer, channel);
+
+    /* Frames are already being sent with the client's length, so
+     * we accept any length we are able to receive instead of
+     * choosing a shorter one */
+    if (offer->has_framelen && offer->framelen <= CPN_CHANNEL_MAX_FRAMELEN)
+        selection.framelen = offer->framelen;
+
+    /* The client is already sending data with its offered
+     * parameters, so we cannot choose any others */
+    if (!negotiation_equals(&selection, offer)) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to accept parameters of one-round-trip handshake");
+        goto out;
+    }
+
+    if (derive_early_key(&early_key, sign_keys, remote_sign_key, NULL, remote_emph_key, offer) < 0)
+        goto out;
+
+    if (cpn_asymmetric_keys_generate(&emph_keys) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to generate key pair");
+        goto out;
+    }
+
+    if (send_key_acknowledgement(channel,
+                sign_keys, &emph_keys.pk,
+                remote_sign_key, remote_emph_key, &selection, &early_key) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to send ephemeral key acknowledgement");
+        goto out;
+    }
+
+    if (derive_final_key(&key, &early_key, sign_keys, remote_sign_key,
+                &emph_keys, remote_emph_key, false) < 0)
+        goto out;
+
+    /* Data sent by the client before it has received our
+     * acknowledgement uses the early key. The channel switches
+     * to the final key as soon as the client does so. Note that
+     * the client has not proven its identity until the first
+     * message decrypts correctly. */
+    if (cpn_channel_enable_encryption(channel, &early_key, 1) < 0 ||
+            cpn_channel_update_key(channel, &key) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Could not enable encryption");
+        goto out;
+    }
+
+    if (apply_negotiation(channel, &selection) < 0)
+        goto out;
+
+    err = 0;
+
+out:
+    cpn_memzero(&emph_keys, sizeof(emph_keys));
+    cpn_memzero(&early_key, sizeof(early_key));
+    cpn_memzero(&key, sizeof(key));
+
+    return err;
+}
+
+/* State of the server side of a handshake, which is shared by
+ * the blocking and asynchronous variants */
+struct handshake {
+    struct cpn_channel *channel;
+    const struct cpn_sign_keys *sign_keys;
+
+    struct cpn_sign_pk remote_sign_key;
+    struct cpn_asymmetric_pk remote_emph_key;
+    struct cpn_asymmetric_keys emph_keys;
+    struct cpn_symmetric_key shared_key;
+    struct cpn_symmetric_key secret;
+    bool resumed;
+
+    NegotiationMessage *offer;
+    NegotiationMessage selection;
+    uint8_t ticket[CPN_TICKET_MAXLEN];
+    uint32_t cipher;
+    uint32_t compression;
+
+    EncryptionAcknowledgementMessage *ack;
+    NegotiationMessage *echo;
+};
+
+static void handshake_init(struct handshake *hs, struct cpn_channel *channel,
+        const struct cpn_sign_keys *sign_keys)
+{
+    NegotiationMessage selection = NEGOTIATION_MESSAGE__INIT;
+
+    memset(hs, 0, sizeof(*hs));
+    memcpy(&hs->selection, &selection, sizeof(selection));
+    hs->channel = channel;
+    hs->sign_keys = sign_keys;
+}
+
+static void handshake_clear(struct handshake *hs)
+{
+    if (hs->offer)
+        negotiation_message__free_unpacked(hs->offer, NULL);
+    if (hs->ack)
+        encryption_acknowledgement_message__free_unpacked(hs->ack, NULL);
+    if (hs->echo)
+        negotiation_message__free_unpacked(hs->echo, NULL);
+
+    cpn_memzero(&hs->emph_keys, sizeof(hs->emph_keys));
+    cpn_memzero(&hs->secret, sizeof(hs->secret));
+    cpn_memzero(&hs->shared_key, sizeof(hs->shared_key));
+}
+
+static bool handshake_is_ik(const struct handshake *hs)
+{
+    return hs->offer->has_ik && hs->offer->ik;
+}
+
+static int handshake_receive_offer(struct handshake *hs)
+{
+    return receive_ephemeral_key(hs->channel, &hs->remote_sign_key,
+            &hs->remote_emph_key, &hs->offer);
+}
+
+static int handshake_receive_ack(struct handshake *hs)
+{
+    return receive_negotiated_protobuf((ProtobufCMessage **) &hs->ack, &hs->echo,
+            hs->channel, &encryption_acknowledgement_message__descriptor, false);
+}
+
+/* Derive keys for the client's offer and send our acknowledgement.
+ * One-round-trip handshakes are complete afterwards. */
+static int handshake_respond(struct handshake *hs)
+{
+    if (handshake_is_ik(hs))
+        return accept_ik(hs->channel, hs->sign_keys, &hs->remote_sign_key,
+                &hs->remote_emph_key, hs->offer);
+
+    select_negotiation(&hs->selection, &hs->cipher, &hs->compression,
+            hs->offer, hs->channel);
+
+    if (hs->offer->has_ticket && cpn_ticket_open(&hs->secret,
+                hs->offer->ticket.data, hs->offer->ticket.len, &hs->remote_sign_key) == 0)
+    {
+        /* Keys of resumed connections are derived from the
+         * ticket's secret and both sides' ephemeral keys, which
+         * only serve as nonces. We thus send a random nonce
+         * instead of generating a key pair. */
+        cpn_randombytes(hs->emph_keys.pk.data, sizeof(hs->emph_keys.pk.data));
+
+        if (derive_resumed_key(&hs->shared_key, &hs->secret,
+                    &hs->remote_emph_key, &hs->emph_keys.pk) < 0)
+            return -1;
+
+        hs->selection.has_resumed = 1;
+        hs->selection.resumed = 1;
+        hs->resumed = true;
+    } else {
+        if (cpn_asymmetric_keys_generate(&hs->emph_keys) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to generate key pair");
+            return -1;
+        }
+
+        if (cpn_symmetric_key_from_scalarmult(&hs->shared_key, &hs->emph_keys,
+                    &hs->remote_emph_key, false) < 0)
+        {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to derive shared secret");
+            return -1;
+        }
+
+        if (hs->offer->has_resumption && hs->offer->resumption)
+            issue_ticket(&hs->selection, hs->ticket, &hs->shared_key,
+                    hs->sign_keys, &hs->remote_sign_key);
+    }
+
+    if (send_key_acknowledgement(hs->channel,
+                hs->sign_keys, &hs->emph_keys.pk,
+                &hs->remote_sign_key, &hs->remote_emph_key, &hs->selection,
+                hs->resumed ? &hs->secret : NULL) < 0)
+    {
         cpn_log(LOG_LEVEL_ERROR, "Unable to send ephemeral key signature");
         return -1;
     }
 
-    if (receive_key_acknowledgement(&received_emph_key,
-                channel, &sign_keys->pk, &emph_keys.pk, remote_sign_key) < 0)
+    return 0;
+}
+
+/* Verify the client's acknowledgement and enable encryption */
+static int handshake_finish(struct handshake *hs)
+{
+    struct cpn_asymmetric_pk received_emph_key;
+
+    if (verify_key_acknowledgement(&received_emph_key, hs->ack, hs->echo,
+                &hs->sign_keys->pk, &hs->emph_keys.pk, &hs->remote_sign_key,
+                hs->resumed ? &hs->secret : NULL) < 0)
     {
         cpn_log(LOG_LEVEL_ERROR, "Unable to receive verification");
         return -1;
     }
 
-    if (memcmp(&received_emph_key, &remote_emph_key, sizeof(received_emph_key))) {
+    if (memcmp(&received_emph_key, &hs->remote_emph_key, sizeof(received_emph_key))) {
         cpn_log(LOG_LEVEL_ERROR, "Received invalid ephemeral key");
         return -1;
     }
 
-    if (cpn_symmetric_key_from_scalarmult(&shared_key, &emph_keys, &remote_emph_key, false) < 0) {
-        cpn_log(LOG_LEVEL_ERROR, "Unable to derive shared secret");
+    if (!negotiation_equals(hs->echo, &hs->selection)) {
+        cpn_log(LOG_LEVEL_ERROR, "Received invalid negotiation acknowledgement");
         return -1;
     }
 
-    cpn_memzero(&emph_keys, sizeof(emph_keys));
-
-    if (cpn_channel_enable_encryption(channel, &shared_key, 1) < 0) {
+    if (cpn_channel_enable_encryption(hs->channel, &hs->shared_key, 1) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not enable encryption");
         return -1;
     }
 
+    if (apply_negotiation(hs->channel, &hs->selection) < 0)
+        return -1;
+
+    return 0;
+}
+
+int cpn_server_await_encryption(struct cpn_channel *channel,
+        const struct cpn_sign_keys *sign_keys,
+        struct cpn_sign_pk *remote_sign_key)
+{
+    struct handshake hs;
+    int err = -1;
+
+    handshake_init(&hs, channel, sign_keys);
+
+    if (handshake_receive_offer(&hs) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to receive session key");
+        goto out;
+    }
+
+    memcpy(remote_sign_key, &hs.remote_sign_key, sizeof(*remote_sign_key));
+
+    if (handshake_respond(&hs) < 0)
+        goto out;
+
+    if (!handshake_is_ik(&hs)) {
+        if (handshake_receive_ack(&hs) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to receive verification");
+            goto out;
+        }
+
+        if (handshake_finish(&hs) < 0)
+            goto out;
+    }
+
+    err = 0;
+
+out:
+    handshake_clear(&hs);
+
+    return err;
+}
+
+enum handshake_state {
+    HANDSHAKE_RECEIVE_OFFER,
+    HANDSHAKE_FLUSH_RESPONSE,
+    HANDSHAKE_RECEIVE_ACK
+};
+
+struct async_handshake {
+    struct handshake hs;
+    enum handshake_state state;
+    struct cpn_reactor *reactor;
+    struct cpn_pool *pool;
+    cpn_server_handshake_fn fn;
+    void *payload;
+    bool cookie_sent;
+
+    /* Held while registering with the reactor */
+    pthread_mutex_t mutex;
+    uint64_t deadline;
+};
+
+static void handle_handshake_io(int fd, void *payload);
+static void expire_handshake(void *payload);
+
+static uint64_t now_msecs(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+#else
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+
+    return (uint64_t) t.tv_sec * 1000 + t.tv_usec / 1000;
+#endif
+}
+
+void cpn_server_set_handshake_timeout(unsigned timeout)
+{
+    handshake_timeout = timeout;
+}
+
+void cpn_server_set_max_handshakes(size_t max)
+{
+    max_handshakes = max;
+}
+
+static int acquire_handshake(void)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&handshakes_mutex);
+    if (max_handshakes && pending_handshakes >= max_handshakes)
+        err = -1;
+    else
+        pending_handshakes++;
+    pthread_mutex_unlock(&handshakes_mutex);
+
+    return err;
+}
+
+static void release_handshake(void)
+{
+    pthread_mutex_lock(&handshakes_mutex);
+    pending_handshakes--;
+    pthread_mutex_unlock(&handshakes_mutex);
+}
+
+static void init_cookie_key(void)
+{
+    cpn_symmetric_key_generate(&cookie_key);
+}
+
+void cpn_server_set_cookie_threshold(size_t queued)
+{
+    cookie_threshold = queued;
+}
+
+static int compute_cookie(uint8_t *out, uint32_t slot, const struct handshake *hs)
+{
+    struct cpn_hash_state hash;
+    int i;
+
+    pthread_once(&cookie_key_once, init_cookie_key);
+
+    for (i = 0; i < 4; i++)
+        out[i] = (slot >> (24 - 8 * i)) & 0xff;
+
+    if (cpn_hash_init(&hash, COOKIE_MACLEN) < 0 ||
+            cpn_hash_update(&hash, cookie_key.data, sizeof(cookie_key.data)) < 0 ||
+            cpn_hash_update(&hash, out, 4) < 0 ||
+            cpn_hash_update(&hash, (uint8_t *) &hs->channel->addr, hs->channel->addrlen) < 0 ||
+            cpn_hash_update(&hash, hs->remote_sign_key.data, sizeof(hs->remote_sign_key.data)) < 0 ||
+            cpn_hash_update(&hash, hs->remote_emph_key.data, sizeof(hs->remote_emph_key.data)) < 0 ||
+            cpn_hash_final(out + 4, &hash) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Cookies are accepted during the slot they have been issued in
+ * and the following one */
+static bool verify_cookie(const struct handshake *hs)
+{
+    const ProtobufCBinaryData *cookie = &hs->offer->cookie;
+    uint8_t expected[COOKIE_LEN];
+    uint32_t slot, now;
+    int i;
+
+    if (cookie->len != COOKIE_LEN)
+        return false;
+
+    for (i = 0, slot = 0; i < 4; i++)
+        slot = (slot << 8) | cookie->data[i];
+    now = time(NULL) / COOKIE_INTERVAL;
+
+    if (slot != now && slot + 1 != now)
+        return false;
+
+    if (compute_cookie(expected, slot, hs) < 0)
+        return false;
+
+    return sodium_memcmp(expected, cookie->data, COOKIE_LEN) == 0;
+}
+
+static bool requires_cookie(struct async_handshake *ah)
+{
+    struct cpn_pool_stats stats;
+
+    if (!cookie_threshold)
+        return false;
+
+    cpn_pool_get_stats(&stats, ah->pool);
+
+    return stats.queued >= cookie_threshold;
+}
+
+/* One-round-trip handshakes cannot answer cookie requests, as
+ * their early data depends on the first initiation */
+static bool supports_cookies(const struct handshake *hs)
+{
+    return hs->offer->has_cookies && hs->offer->cookies && !handshake_is_ik(hs);
+}
+
+/* Check the client's cookie before any asymmetric operation is
+ * performed. Returns 1 if a cookie has been requested instead. */
+static int check_cookie(struct async_handshake *ah)
+{
+    NegotiationMessage request = NEGOTIATION_MESSAGE__INIT;
+    uint8_t cookie[COOKIE_LEN], buf[COOKIE_LEN + 8];
+    size_t len;
+    int ret;
+
+    if (ah->hs.offer->has_cookie) {
+        if (!verify_cookie(&ah->hs)) {
+            cpn_log(LOG_LEVEL_ERROR, "Received invalid cookie");
+            return -1;
+        }
+        return 0;
+    } else if (!requires_cookie(ah)) {
+        return 0;
+    } else if (!supports_cookies(&ah->hs)) {
+        /* Clients unable to prove their reachability would
+         * otherwise cause asymmetric operations regardless of
+         * the load */
+        cpn_log(LOG_LEVEL_WARNING, "Server is overloaded, refusing handshake without cookie");
+        return -1;
+    } else if (ah->cookie_sent) {
+        cpn_log(LOG_LEVEL_ERROR, "Client did not answer cookie request");
+        return -1;
+    }
+
+    if (compute_cookie(cookie, time(NULL) / COOKIE_INTERVAL, &ah->hs) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to compute cookie");
+        return -1;
+    }
+
+    request.has_cookie = 1;
+    request.cookie.data = cookie;
+    request.cookie.len = sizeof(cookie);
+    len = negotiation_message__pack(&request, buf);
+
+    ret = cpn_channel_write_data(ah->hs.channel, buf, len);
+    if (ret < 0 && ret != CPN_CHANNEL_WOULD_BLOCK) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to send cookie request");
+        return -1;
+    }
+
+    /* The client answers with a new initiation carrying the
+     * cookie, which replaces the current offer */
+    negotiation_message__free_unpacked(ah->hs.offer, NULL);
+    ah->hs.offer = NULL;
+    ah->cookie_sent = true;
+
+    return 1;
+}
+
+static void complete_handshake(struct async_handshake *ah, int result)
+{
+    /* Handshakes are driven in non-blocking mode, while the
+     * connection is handled in blocking mode afterwards */
+    if (!result && cpn_channel_set_nonblocking(ah->hs.channel, false) < 0)
+        result = -1;
+
+    release_handshake();
+
+    ah->fn(ah->hs.channel, result ? NULL : &ah->hs.remote_sign_key, result, ah->payload);
+
+    handshake_clear(&ah->hs);
+    pthread_mutex_destroy(&ah->mutex);
+    free(ah);
+}
+
+/* Callbacks may fire while another thread is still registering
+ * the handshake, so they have to wait for it to finish */
+static void await_registration(struct async_handshake *ah)
+{
+    pthread_mutex_lock(&ah->mutex);
+    pthread_mutex_unlock(&ah->mutex);
+}
+
+/* The handshake must not be touched after having been handed to
+ * the reactor, as it may already be running in another thread.
+ * The timeout is only armed while waiting for the client, so that
+ * it never fires while a job of the pool is using the handshake. */
+static int await_handshake_io(struct async_handshake *ah, enum handshake_state state)
+{
+    int fd = ah->hs.channel->fd;
+    uint64_t now = now_msecs();
+    int err = 0;
+
+    if (ah->deadline && now >= ah->deadline) {
+        cpn_log(LOG_LEVEL_ERROR, "Client did not finish handshake in time");
+        return -1;
+    }
+
+    pthread_mutex_lock(&ah->mutex);
+
+    ah->state = state;
+
+    if (ah->deadline && cpn_reactor_add_timeout(ah->reactor, ah->deadline - now,
+                expire_handshake, ah) < 0)
+    {
+        err = -1;
+        goto out;
+    }
+
+    if (state == HANDSHAKE_FLUSH_RESPONSE)
+        err = cpn_reactor_add_writable(ah->reactor, fd, handle_handshake_io, ah);
+    else
+        err = cpn_reactor_add(ah->reactor, fd, false, handle_handshake_io, ah);
+
+    /* A timeout which cannot be removed anymore is about to fire
+     * and completes the handshake by itself */
+    if (err < 0 && ah->deadline &&
+            cpn_reactor_remove_timeout(ah->reactor, expire_handshake, ah) < 0)
+        err = 0;
+
+out:
+    pthread_mutex_unlock(&ah->mutex);
+    return err;
+}
+
+static void expire_handshake(void *payload)
+{
+    struct async_handshake *ah = (struct async_handshake *) payload;
+
+    await_registration(ah);
+
+    cpn_log(LOG_LEVEL_ERROR, "Client did not finish handshake in time");
+    cpn_reactor_remove(ah->reactor, ah->hs.channel->fd);
+    complete_handshake(ah, -1);
+}
+
+static void continue_handshake(struct async_handshake *ah)
+{
+    const struct cpn_channel *c = ah->hs.channel;
+    int err;
+
+    if (c->txoff < c->txbuf.length) {
+        err = await_handshake_io(ah, HANDSHAKE_FLUSH_RESPONSE);
+    } else if (ah->hs.offer == NULL) {
+        err = await_handshake_io(ah, HANDSHAKE_RECEIVE_OFFER);
+    } else if (handshake_is_ik(&ah->hs)) {
+        complete_handshake(ah, 0);
+        return;
+    } else {
+        err = await_handshake_io(ah, HANDSHAKE_RECEIVE_ACK);
+    }
+
+    if (err < 0)
+        complete_handshake(ah, -1);
+}
+
+static void *respond_handshake(void *payload)
+{
+    struct async_handshake *ah = (struct async_handshake *) payload;
+
+    if (handshake_respond(&ah->hs) < 0)
+        complete_handshake(ah, -1);
+    else
+        continue_handshake(ah);
+
+    return NULL;
+}
+
+static void *finish_handshake(void *payload)
+{
+    struct async_handshake *ah = (struct async_handshake *) payload;
+
+    complete_handshake(ah, handshake_finish(&ah->hs));
+
+    return NULL;
+}
+
+static void handle_handshake_io(int fd, void *payload)
+{
+    struct async_handshake *ah = (struct async_handshake *) payload;
+    thread_fn job = NULL;
+    int ret = -1;
+
+    await_registration(ah);
+
+    switch (ah->state) {
+        case HANDSHAKE_RECEIVE_OFFER:
+            ret = handshake_receive_offer(&ah->hs);
+            if (ret == 0 && (ret = check_cookie(ah)) == 0)
+                job = respond_handshake;
+            break;
+        case HANDSHAKE_FLUSH_RESPONSE:
+            ret = cpn_channel_flush(ah->hs.channel);
+            break;
+        case HANDSHAKE_RECEIVE_ACK:
+            ret = handshake_receive_ack(&ah->hs);
+            job = finish_handshake;
+            break;
+    }
+
+    if (ret == CPN_CHANNEL_WOULD_BLOCK)
+        return;
+
+    cpn_reactor_remove(ah->reactor, fd);
+    if (ah->deadline)
+        cpn_reactor_remove_timeout(ah->reactor, expire_handshake, ah);
+
+    if (ret < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to receive handshake");
+        complete_handshake(ah, -1);
+    } else if (job == NULL) {
+        continue_handshake(ah);
+    } else if (cpn_pool_submit(ah->pool, NULL, job, ah) < 0) {
+        /* Key exchanges and signatures are computed by the pool,
+         * so that the reactor keeps on serving other connections */
+        cpn_log(LOG_LEVEL_WARNING, "Crypto queue is full, dropping handshake");
+        complete_handshake(ah, -1);
+    }
+}
+
+int cpn_server_await_encryption_async(struct cpn_reactor *reactor,
+        struct cpn_pool *pool,
+        struct cpn_channel *channel,
+        const struct cpn_sign_keys *sign_keys,
+        cpn_server_handshake_fn fn,
+        void *payload)
+{
+    struct async_handshake *ah;
+
+    if (acquire_handshake() < 0) {
+        cpn_log(LOG_LEVEL_WARNING, "Too many pending handshakes");
+        return -1;
+    }
+
+    if ((ah = malloc(sizeof(*ah))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate handshake");
+        goto out_release;
+    }
+
+    if (pthread_mutex_init(&ah->mutex, NULL) != 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to initialize handshake");
+        goto out_free;
+    }
+
+    if (cpn_channel_set_nonblocking(channel, true) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to drive handshake asynchronously");
+        goto out_destroy;
+    }
+
+    handshake_init(&ah->hs, channel, sign_keys);
+    ah->reactor = reactor;
+    ah->pool = pool;
+    ah->fn = fn;
+    ah->payload = payload;
+    ah->cookie_sent = false;
+    ah->deadline = handshake_timeout ? now_msecs() + handshake_timeout : 0;
+
+    if (await_handshake_io(ah, HANDSHAKE_RECEIVE_OFFER) < 0) {
+        handshake_clear(&ah->hs);
+        cpn_channel_set_nonblocking(channel, false);
+        goto out_destroy;
+    }
+
     return 0;
+
+out_destroy:
+    pthread_mutex_destroy(&ah->mutex);
+out_free:
+    free(ah);
+out_release:
+    release_handshake();
+    return -1;
 }
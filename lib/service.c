@@ -21,6 +21,7 @@
 #include <string.h>
 #include <pthread.h>
 
+#include "capone/channel.h"
 #include "capone/common.h"
 #include "capone/list.h"
 #include "capone/log.h"
@@ -98,6 +99,15 @@ int cpn_service_plugin_for_type(const struct cpn_service_plugin **out, const cha
     return -1;
 }
 
+int cpn_service_plugin_setup_channel(const struct cpn_service_plugin *plugin,
+        struct cpn_channel *channel)
+{
+    if (!plugin->framelen || plugin->framelen >= channel->framelen)
+        return 0;
+
+    return cpn_channel_set_framelen(channel, plugin->framelen);
+}
+
 int cpn_services_from_config_file(struct cpn_service **out, const char *file)
 {
     struct cpn_cfg cfg;
@@ -185,6 +195,7 @@ int cpn_service_from_section(struct cpn_service *out, const struct cpn_cfg_secti
 {
     struct cpn_service service;
     char *type = NULL;
+    bool has_priority = false;
     unsigned i;
 
     memset(&service, 0, sizeof(service));
@@ -219,6 +230,23 @@ int cpn_service_from_section(struct cpn_service *out, const struct cpn_cfg_secti
             continue;
         }
 
+        if (!strcmp("concurrency", entry)) {
+            if (parse_uint32t(&service.concurrency, value)) {
+                cpn_log(LOG_LEVEL_ERROR, "Service config has invalid concurrency");
+                goto out_err;
+            }
+            continue;
+        }
+
+        if (!strcmp("priority", entry)) {
+            if (parse_uint32t(&service.priority, value)) {
+                cpn_log(LOG_LEVEL_ERROR, "Service config has invalid priority");
+                goto out_err;
+            }
+            has_priority = true;
+            continue;
+        }
+
         cpn_log(LOG_LEVEL_ERROR, "Unknown service config '%s'", entry);
         goto out_err;
     }
@@ -239,6 +267,9 @@ int cpn_service_from_section(struct cpn_service *out, const struct cpn_cfg_secti
         goto out_err;
     }
 
+    if (!has_priority)
+        service.priority = service.plugin->priority;
+
     free(type);
     memcpy(out, &service, sizeof(service));
 
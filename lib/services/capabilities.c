@@ -125,12 +125,15 @@ static void *relay_capabilities()
 {
     struct cpn_list_entry *it;
     struct registrant *r;
+    struct timeval immediate;
     fd_set fds;
+    bool pending;
     int maxfd;
 
     while (true) {
         FD_ZERO(&fds);
         maxfd = -1;
+        pending = false;
 
         if (clients.head == NULL)
             break;
@@ -139,15 +142,22 @@ static void *relay_capabilities()
         cpn_list_foreach(&registrants, it, r) {
             FD_SET(r->channel.fd, &fds);
             maxfd = MAX(maxfd, r->channel.fd);
+            pending |= cpn_channel_has_pending_input(&r->channel);
         }
         pthread_mutex_unlock(&registrants_mutex);
 
-        if (select(maxfd + 1, &fds, NULL, NULL, NULL) == -1)
+        /* Data already buffered by a channel does not make its
+         * file descriptor readable, so we must not block */
+        immediate.tv_sec = 0;
+        immediate.tv_usec = 0;
+
+        if (select(maxfd + 1, &fds, NULL, NULL, pending ? &immediate : NULL) == -1)
             continue;
 
         pthread_mutex_lock(&registrants_mutex);
         cpn_list_foreach(&registrants, it, r) {
-            if (FD_ISSET(r->channel.fd, &fds))
+            if (FD_ISSET(r->channel.fd, &fds) ||
+                    cpn_channel_has_pending_input(&r->channel))
                 relay_capability_for_registrant((struct registrant *) it->data);
         }
         pthread_mutex_unlock(&registrants_mutex);
@@ -592,7 +602,9 @@ int cpn_capabilities_init_service(const struct cpn_service_plugin **service)
         handle,
         invoke,
         parse,
-        &capabilities_params__descriptor
+        &capabilities_params__descriptor,
+        CPN_SERVICE_PRIORITY_CONTROL,
+        0
     };
 
     *service = &plugin;
@@ -23,6 +23,7 @@
 #include "capone/channel.h"
 #include "capone/log.h"
 #include "capone/opts.h"
+#include "capone/relay.h"
 #include "capone/service.h"
 
 #include "capone/services/exec.h"
@@ -32,10 +33,12 @@ static int invoke(struct cpn_channel *channel,
         const struct cpn_session *session,
         const struct cpn_cfg *cfg)
 {
+    const int fds[] = { STDOUT_FILENO };
+
     UNUSED(session);
     UNUSED(cfg);
 
-    if (cpn_channel_relay(channel, 1, STDOUT_FILENO) < 0) {
+    if (cpn_relay_await(channel, fds, ARRAY_SIZE(fds)) < 0) {
         return -1;
     }
 
@@ -123,12 +126,16 @@ static int handle(struct cpn_channel *channel,
         _exit(0);
     } else {
         close(fds[1]);
+        fds[1] = -1;
 
-        if (cpn_channel_relay(channel, 1, fds[0]) < 0) {
+        /* The relay takes over the channel and the pipe, so that
+         * we do not block a thread for the command's lifetime */
+        if (cpn_relay_detach(channel, &fds[0], 1, NULL, NULL) < 0) {
             cpn_log(LOG_LEVEL_ERROR, "Unable to relay exec output");
             error = -1;
             goto out;
         }
+        fds[0] = -1;
     }
 
 out:
@@ -181,7 +188,9 @@ int cpn_exec_init_service(const struct cpn_service_plugin **out)
         handle,
         invoke,
         parse,
-        &exec_params__descriptor
+        &exec_params__descriptor,
+        CPN_SERVICE_PRIORITY_BULK,
+        0
     };
 
     *out = &plugin;
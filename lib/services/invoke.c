@@ -155,7 +155,9 @@ int cpn_invoke_init_service(const struct cpn_service_plugin **out)
         handle,
         invoke,
         parse,
-        &invoke_params__descriptor
+        &invoke_params__descriptor,
+        CPN_SERVICE_PRIORITY_CONTROL,
+        0
     };
 
     *out = &plugin;
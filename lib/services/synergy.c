@@ -15,23 +15,571 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <stdio.h>
+#include <netdb.h>
 
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "capone/buf.h"
+#include "capone/channel.h"
 #include "capone/common.h"
+#include "capone/global.h"
 #include "capone/log.h"
+#include "capone/reactor.h"
+#include "capone/relay.h"
 #include "capone/service.h"
 #include "capone/socket.h"
 
 #include "capone/services/synergy.h"
 
+/* Synergy packets are prefixed with their length. Pointer motion
+ * is forwarded via datagrams, as only the most recent position
+ * is of interest and a lost packet must not delay the following
+ * ones. All other packets are forwarded via the session's
+ * channel, as e.g. a lost key release would leave keys stuck. */
+#define SYNERGY_HEADERLEN 4
+#define SYNERGY_CODELEN 4
+#define SYNERGY_MAXPACKETLEN (4 * 1024 * 1024)
+#define SYNERGY_READLEN 4096
+/* Small frames let the receiver authenticate large packets like
+ * clipboard contents while their remainder is still in flight */
+#define SYNERGY_FRAMELEN 1024
+
+#define SYNERGY_READ (1 << 0)
+#define SYNERGY_WRITE (1 << 1)
+
+/* All synergy sessions of the process are driven by a single
+ * reactor. Its callbacks are the only ones to touch a session
+ * once it has been started, so sessions need no locking. */
+struct event_relay {
+    /* Session channel, which is owned by the relay on the server
+     * side only */
+    struct cpn_channel *stream;
+    struct cpn_channel owned_stream;
+    struct cpn_channel datagrams;
+    struct cpn_channel local;
+    int pid;
+    /* Whether the remote side's datagram address is known */
+    bool connected;
+    bool datagrams_registered;
+    /* Events the session and the local connection are registered
+     * for */
+    unsigned stream_events;
+    unsigned local_events;
+    /* Whether the session has queued data which could not be
+     * written without blocking */
+    bool stream_blocked;
+    struct cpn_buf packets;
+    struct cpn_buf received;
+    /* Data not yet written to synergy */
+    struct cpn_buf pending;
+    cpn_relay_done_fn fn;
+    void *payload;
+};
+
+struct relay_waiter {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    int result;
+};
+
+static struct cpn_reactor reactor;
+static pthread_once_t reactor_once = PTHREAD_ONCE_INIT;
+static int reactor_err;
+
+static int get_host(char *host, size_t hostlen, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int err;
+
+    if ((err = getnameinfo(addr, addrlen, host, hostlen, NULL, 0, NI_NUMERICHOST)) != 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not resolve name info: %s", gai_strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int setup_datagrams(struct cpn_channel *datagrams, const struct cpn_channel *stream)
+{
+    if (cpn_channel_set_framing(datagrams, CPN_CHANNEL_FRAMING_DATAGRAMS) < 0 ||
+            cpn_channel_enable_datagram_encryption(datagrams, stream) < 0 ||
+            cpn_channel_set_nonblocking(datagrams, true) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Could not set up synergy datagram channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The server binds a datagram socket to the address the client
+ * is connected to and announces its port via the session */
+static int accept_datagrams(struct cpn_channel *datagrams, struct cpn_channel *stream)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    struct cpn_socket socket;
+    char host[NI_MAXHOST];
+    uint32_t port, networkport;
+
+    if (getsockname(stream->fd, (struct sockaddr *) &addr, &addrlen) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not get session address: %s", strerror(errno));
+        return -1;
+    }
+
+    if (get_host(host, sizeof(host), (struct sockaddr *) &addr, addrlen) < 0 ||
+            cpn_socket_init(&socket, host, 0, CPN_CHANNEL_TYPE_UDP) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Could not initialize synergy datagram socket");
+        return -1;
+    }
+
+    /* The client's address is only known once its first
+     * datagram has arrived */
+    if (cpn_socket_get_address(&socket, NULL, 0, &port) < 0 ||
+            cpn_channel_init_from_fd(datagrams, socket.fd,
+                (struct sockaddr *) &stream->addr, stream->addrlen, CPN_CHANNEL_TYPE_UDP) < 0)
+    {
+        cpn_socket_close(&socket);
+        return -1;
+    }
+
+    networkport = htonl(port);
+
+    if (setup_datagrams(datagrams, stream) < 0 ||
+            cpn_channel_write_data(stream, (uint8_t *) &networkport, sizeof(networkport)) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Could not announce synergy datagram port");
+        cpn_channel_close(datagrams);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int connect_datagrams(struct cpn_channel *datagrams, struct cpn_channel *stream)
+{
+    char host[NI_MAXHOST];
+    uint32_t networkport;
+    uint8_t hello;
+
+    if (cpn_channel_receive_data(stream, (uint8_t *) &networkport,
+                sizeof(networkport)) != sizeof(networkport))
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Could not receive synergy datagram port");
+        return -1;
+    }
+
+    if (get_host(host, sizeof(host), (struct sockaddr *) &stream->addr, stream->addrlen) < 0 ||
+            cpn_channel_init_from_host(datagrams, host, ntohl(networkport),
+                CPN_CHANNEL_TYPE_UDP) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Could not initialize synergy datagram channel");
+        return -1;
+    }
+
+    /* An empty datagram tells the server where to send its
+     * datagrams to. If it is lost, the server keeps on using
+     * the session until our first pointer motion arrives. */
+    if (setup_datagrams(datagrams, stream) < 0 ||
+            cpn_channel_write_data(datagrams, &hello, 0) < 0)
+    {
+        cpn_channel_close(datagrams);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *run_reactor(void *payload)
+{
+    if (cpn_reactor_run((struct cpn_reactor *) payload) < 0)
+        cpn_log(LOG_LEVEL_ERROR, "Synergy reactor failed");
+
+    return NULL;
+}
+
+static int stop_reactor(void)
+{
+    return cpn_reactor_stop(&reactor);
+}
+
+static void init_reactor(void)
+{
+    if (cpn_reactor_init(&reactor) < 0 ||
+            cpn_spawn(NULL, run_reactor, &reactor) < 0)
+    {
+        reactor_err = -1;
+        return;
+    }
+
+    cpn_global_on_shutdown(stop_reactor);
+}
+
+static struct event_relay *alloc_relay(void)
+{
+    struct event_relay *r;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate synergy relay");
+        return NULL;
+    }
+
+    r->owned_stream.fd = -1;
+    r->datagrams.fd = -1;
+    r->local.fd = -1;
+    r->pid = -1;
+
+    return r;
+}
+
+static void finish(struct event_relay *r, int result)
+{
+    if (r->datagrams_registered)
+        cpn_reactor_remove(&reactor, r->datagrams.fd);
+    if (r->stream_events)
+        cpn_reactor_remove(&reactor, r->stream->fd);
+    if (r->local_events)
+        cpn_reactor_remove(&reactor, r->local.fd);
+
+    if (r->stream == &r->owned_stream)
+        cpn_channel_close(&r->owned_stream);
+    if (r->datagrams.fd >= 0)
+        cpn_channel_close(&r->datagrams);
+    if (r->local.fd >= 0)
+        cpn_channel_close(&r->local);
+
+    if (r->pid > 0) {
+        kill(r->pid, SIGKILL);
+        cpn_log(LOG_LEVEL_VERBOSE, "Terminated synergy");
+    }
+
+    cpn_buf_clear(&r->packets);
+    cpn_buf_clear(&r->received);
+    cpn_buf_clear(&r->pending);
+
+    if (r->fn)
+        r->fn(result, r->payload);
+
+    free(r);
+}
+
+/* Data which synergy cannot take right away is kept pending
+ * until its connection becomes writable again */
+static int flush_local(struct event_relay *r)
+{
+    ssize_t ret;
+
+    while (r->pending.length) {
+        if ((ret = write(r->local.fd, r->pending.data, r->pending.length)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            cpn_log(LOG_LEVEL_ERROR, "Could not write to synergy: %s", strerror(errno));
+            return -1;
+        }
+
+        memmove(r->pending.data, r->pending.data + ret, r->pending.length - ret);
+        r->pending.length -= ret;
+    }
+
+    return 0;
+}
+
+static int write_local(struct event_relay *r, const uint8_t *data, size_t len)
+{
+    if (cpn_buf_append_data(&r->pending, data, len) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate synergy buffer");
+        return -1;
+    }
+
+    return flush_local(r);
+}
+
+static bool is_pointer_motion(const uint8_t *packet, size_t len)
+{
+    const uint8_t *code = packet + SYNERGY_HEADERLEN;
+
+    return len >= SYNERGY_HEADERLEN + SYNERGY_CODELEN &&
+        (!memcmp(code, "DMMV", SYNERGY_CODELEN) || !memcmp(code, "DMRM", SYNERGY_CODELEN));
+}
+
+static int forward_packet(struct event_relay *r, uint8_t *packet, size_t len)
+{
+    int err;
+
+    if (r->connected && is_pointer_motion(packet, len))
+        return cpn_channel_write_data(&r->datagrams, packet, len);
+
+    /* The packet has been queued with the session nonetheless */
+    if ((err = cpn_channel_write_data(r->stream, packet, len)) == CPN_CHANNEL_WOULD_BLOCK) {
+        r->stream_blocked = true;
+        return 0;
+    }
+
+    return err;
+}
+
+/* Returns 1 if synergy has closed its connection */
+static int read_local(struct event_relay *r)
+{
+    struct cpn_buf *buf = &r->packets;
+    size_t offset = 0;
+    ssize_t ret;
+
+    if (cpn_buf_reserve(buf, buf->length + SYNERGY_READLEN) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate synergy buffer");
+        return -1;
+    }
+
+    if ((ret = read(r->local.fd, buf->data + buf->length, SYNERGY_READLEN)) == 0) {
+        return 1;
+    } else if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        cpn_log(LOG_LEVEL_ERROR, "Could not read from synergy: %s", strerror(errno));
+        return -1;
+    }
+    buf->length += ret;
+
+    while (buf->length - offset >= SYNERGY_HEADERLEN) {
+        uint32_t networklen;
+        size_t len;
+
+        memcpy(&networklen, buf->data + offset, sizeof(networklen));
+        len = ntohl(networklen);
+
+        if (len > SYNERGY_MAXPACKETLEN) {
+            cpn_log(LOG_LEVEL_ERROR, "Synergy packet exceeds maximum length");
+            return -1;
+        }
+
+        if (buf->length - offset < SYNERGY_HEADERLEN + len)
+            break;
+
+        if (forward_packet(r, (uint8_t *) buf->data + offset, SYNERGY_HEADERLEN + len) < 0)
+            return -1;
+
+        offset += SYNERGY_HEADERLEN + len;
+    }
+
+    memmove(buf->data, buf->data + offset, buf->length - offset);
+    buf->length -= offset;
+
+    return 0;
+}
+
+static int receive_datagrams(struct event_relay *r)
+{
+    ssize_t ret;
+
+    while (1) {
+        cpn_buf_reset(&r->received);
+
+        if ((ret = cpn_channel_receive_buf(&r->datagrams, &r->received)) == CPN_CHANNEL_WOULD_BLOCK)
+            return 0;
+        else if (ret < 0)
+            return -1;
+
+        r->connected = true;
+
+        /* Pointer motion is superseded by the next one anyway, so
+         * it is dropped while synergy does not keep up */
+        if (!r->pending.length &&
+                write_local(r, (uint8_t *) r->received.data, r->received.length) < 0)
+            return -1;
+    }
+}
+
+/* Returns 1 if the session has been closed */
+static int receive_stream(struct event_relay *r)
+{
+    ssize_t ret;
+
+    /* Receiving is paused while synergy does not keep up, which
+     * bounds the data kept pending for it */
+    while (!r->pending.length) {
+        cpn_buf_reset(&r->received);
+
+        if ((ret = cpn_channel_receive_buf(r->stream, &r->received)) == CPN_CHANNEL_WOULD_BLOCK)
+            return 0;
+        else if (ret == 0)
+            return 1;
+        else if (ret < 0)
+            return -1;
+
+        if (write_local(r, (uint8_t *) r->received.data, r->received.length) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void handle_stream(int fd, void *payload);
+static void handle_local(int fd, void *payload);
+
+static int set_events(struct event_relay *r, int fd, unsigned *events, unsigned want,
+        cpn_reactor_fn fn)
+{
+    if (*events == want)
+        return 0;
+
+    if (*events && cpn_reactor_remove(&reactor, fd) < 0)
+        return -1;
+    *events = 0;
+
+    if (want == SYNERGY_READ && cpn_reactor_add(&reactor, fd, false, fn, r) < 0)
+        return -1;
+    else if (want == SYNERGY_WRITE && cpn_reactor_add_writable(&reactor, fd, fn, r) < 0)
+        return -1;
+    *events = want;
+
+    return 0;
+}
+
+/* Each file descriptor can only wait for either readability or
+ * writability. A session which cannot be written to stops us
+ * from reading synergy's packets, and synergy not keeping up
+ * stops us from receiving the session's. */
+static int update_events(struct event_relay *r)
+{
+    unsigned stream, local;
+
+    stream = r->stream_blocked ? SYNERGY_WRITE : (r->pending.length ? 0 : SYNERGY_READ);
+    local = r->pending.length ? SYNERGY_WRITE : (r->stream_blocked ? 0 : SYNERGY_READ);
+
+    if (set_events(r, r->stream->fd, &r->stream_events, stream, handle_stream) < 0 ||
+            set_events(r, r->local.fd, &r->local_events, local, handle_local) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void handle_datagrams(int fd, void *payload)
+{
+    struct event_relay *r = (struct event_relay *) payload;
+
+    UNUSED(fd);
+
+    if (receive_datagrams(r) < 0 || update_events(r) < 0)
+        finish(r, -1);
+}
+
+static void handle_stream(int fd, void *payload)
+{
+    struct event_relay *r = (struct event_relay *) payload;
+    int err;
+
+    UNUSED(fd);
+
+    if (r->stream_blocked) {
+        if ((err = cpn_channel_flush(r->stream)) == 0)
+            r->stream_blocked = false;
+        else if (err == CPN_CHANNEL_WOULD_BLOCK)
+            err = 0;
+    } else {
+        err = receive_stream(r);
+    }
+
+    if (!err)
+        err = update_events(r);
+    if (err)
+        finish(r, err < 0 ? -1 : 0);
+}
+
+static void handle_local(int fd, void *payload)
+{
+    struct event_relay *r = (struct event_relay *) payload;
+    int err;
+
+    UNUSED(fd);
+
+    if (r->pending.length) {
+        /* Messages buffered by the session's channel do not make
+         * its file descriptor readable, so they are received as
+         * soon as synergy has caught up */
+        if ((err = flush_local(r)) == 0 && !r->pending.length)
+            err = receive_stream(r);
+    } else {
+        err = read_local(r);
+    }
+
+    if (!err)
+        err = update_events(r);
+    if (err)
+        finish(r, err < 0 ? -1 : 0);
+}
+
+/* Invoked as soon as the local connection is writable, which
+ * hands the relay over to the reactor's thread */
+static void start_relay(int fd, void *payload)
+{
+    struct event_relay *r = (struct event_relay *) payload;
+    int err = -1;
+
+    if (cpn_reactor_remove(&reactor, fd) < 0)
+        goto out;
+    r->local_events = 0;
+
+    if (cpn_reactor_add(&reactor, r->datagrams.fd, false, handle_datagrams, r) < 0)
+        goto out;
+    r->datagrams_registered = true;
+
+    /* Data read ahead while setting up the session does not make
+     * its file descriptor readable */
+    if ((err = receive_stream(r)) == 0)
+        err = update_events(r);
+
+out:
+    if (err)
+        finish(r, err < 0 ? -1 : 0);
+}
+
+/* Hand the relay over to the shared reactor. On success, the
+ * relay is owned by the reactor and its callback is invoked as
+ * soon as either side has closed the connection. */
+static int relay_events(struct event_relay *r)
+{
+    pthread_once(&reactor_once, init_reactor);
+    if (reactor_err) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to start synergy reactor");
+        return -1;
+    }
+
+    if (cpn_channel_set_nonblocking(r->stream, true) < 0 ||
+            cpn_channel_set_nonblocking(&r->local, true) < 0)
+        return -1;
+
+    if (cpn_reactor_add_writable(&reactor, r->local.fd, start_relay, r) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void notify_waiter(int result, void *payload)
+{
+    struct relay_waiter *w = (struct relay_waiter *) payload;
+
+    pthread_mutex_lock(&w->mutex);
+    w->result = result;
+    w->done = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
 static int invoke(struct cpn_channel *channel,
         const struct cpn_session *session,
         const struct cpn_cfg *cfg)
 {
-    struct cpn_channel synergy_channel;
+    struct relay_waiter w;
+    struct event_relay *r;
     char *args[] = {
         "synergys",
         "--address",
@@ -42,14 +590,22 @@ static int invoke(struct cpn_channel *channel,
         "server",
         NULL
     };
-    int pid, err;
+    int pid;
 
     UNUSED(session);
     UNUSED(cfg);
 
-    if (cpn_channel_init_from_host(&synergy_channel, "127.0.0.1", 34589, CPN_CHANNEL_TYPE_TCP) < 0) {
-        cpn_log(LOG_LEVEL_ERROR, "Could not initialize local synergy channel");
+    if ((r = alloc_relay()) == NULL)
         return -1;
+    r->stream = channel;
+    r->connected = true;
+
+    if (connect_datagrams(&r->datagrams, channel) < 0)
+        goto out_err;
+
+    if (cpn_channel_init_from_host(&r->local, "127.0.0.1", 34589, CPN_CHANNEL_TYPE_TCP) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not initialize local synergy channel");
+        goto out_err;
     }
 
     pid = fork();
@@ -60,29 +616,53 @@ static int invoke(struct cpn_channel *channel,
         }
 
         _exit(0);
-    } else if (pid > 0) {
-        /* TODO: get better workaround to know synergys has * started */
-        sleep(1);
+    } else if (pid < 0) {
+        goto out_err;
+    }
+    r->pid = pid;
 
-        if ((err = cpn_channel_connect(&synergy_channel)) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Could not connect to local synergy socket");
-            goto out;
-        }
+    /* TODO: get better workaround to know synergys has * started */
+    sleep(1);
 
-        if ((err = cpn_channel_relay(channel, 1, synergy_channel.fd)) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Could not relay synergy socket");
-            goto out;
-        }
-    } else {
-        return -1;
+    if (cpn_channel_connect(&r->local) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not connect to local synergy socket");
+        goto out_err;
     }
 
-out:
-    cpn_channel_close(&synergy_channel);
-    kill(pid, SIGKILL);
-    cpn_log(LOG_LEVEL_VERBOSE, "Terminated synergy");
+    w.done = false;
+    w.result = -1;
 
-    return err;
+    if (pthread_mutex_init(&w.mutex, NULL) != 0)
+        goto out_err;
+    if (pthread_cond_init(&w.cond, NULL) != 0) {
+        pthread_mutex_destroy(&w.mutex);
+        goto out_err;
+    }
+
+    r->fn = notify_waiter;
+    r->payload = &w;
+
+    if (relay_events(r) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not relay synergy socket");
+        pthread_cond_destroy(&w.cond);
+        pthread_mutex_destroy(&w.mutex);
+        r->fn = NULL;
+        goto out_err;
+    }
+
+    pthread_mutex_lock(&w.mutex);
+    while (!w.done)
+        pthread_cond_wait(&w.cond, &w.mutex);
+    pthread_mutex_unlock(&w.mutex);
+
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.mutex);
+
+    return w.result;
+
+out_err:
+    finish(r, -1);
+    return -1;
 }
 
 static int handle(struct cpn_channel *channel,
@@ -91,7 +671,7 @@ static int handle(struct cpn_channel *channel,
         const struct cpn_cfg *cfg)
 {
     struct cpn_socket socket;
-    struct cpn_channel synergy_channel;
+    struct event_relay *r;
     char *args[] = {
         "synergyc",
         "--no-daemon",
@@ -102,29 +682,40 @@ static int handle(struct cpn_channel *channel,
         NULL
     };
     uint32_t port;
-    int len, pid;
+    int len, pid, err = -1;
 
     UNUSED(cfg);
     UNUSED(session);
     UNUSED(invoker);
 
+    if ((r = alloc_relay()) == NULL)
+        return -1;
+    r->stream = channel;
+
+    if (accept_datagrams(&r->datagrams, channel) < 0) {
+        finish(r, -1);
+        return -1;
+    }
+
     if (cpn_socket_init(&socket, "127.0.0.1", 0, CPN_CHANNEL_TYPE_TCP) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not initialize synergy relay socket");
+        finish(r, -1);
         return -1;
     }
 
     if (cpn_socket_listen(&socket) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not listen on synergy relay socket");
-        return -1;
+        goto out;
     }
 
     if (cpn_socket_get_address(&socket, NULL, 0, &port) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not retrieve address of synergy relay socket");
-        return -1;
+        goto out;
     }
 
     len = snprintf(NULL, 0, "127.0.0.1:%"PRIu32, port) + 1;
-    args[5] = malloc(len);
+    if ((args[5] = malloc(len)) == NULL)
+        goto out;
     len = snprintf(args[5], len, "127.0.0.1:%"PRIu32, port);
 
     pid = fork();
@@ -135,28 +726,39 @@ static int handle(struct cpn_channel *channel,
         }
 
         _exit(0);
-    } else if (pid > 0) {
-        if (cpn_socket_accept(&socket, &synergy_channel) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Could not accept synergy relay socket connection");
-            return -1;
-        }
+    } else if (pid < 0) {
+        goto out;
+    }
+    r->pid = pid;
 
-        if (cpn_channel_relay(channel, 1, synergy_channel.fd) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Could not relay synergy socket");
-            return -1;
-        }
-    } else {
-        return -1;
+    if (cpn_socket_accept(&socket, &r->local) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not accept synergy relay socket connection");
+        r->local.fd = -1;
+        goto out;
     }
 
-    cpn_socket_close(&socket);
-    cpn_channel_close(&synergy_channel);
+    /* The relay takes over the session, so that we do not block
+     * a thread for as long as synergy is running */
+    cpn_channel_move(&r->owned_stream, channel);
+    r->stream = &r->owned_stream;
+
+    if (relay_events(r) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not relay synergy socket");
+        cpn_channel_move(channel, &r->owned_stream);
+        r->stream = channel;
+        goto out;
+    }
+    r = NULL;
 
-    kill(pid, SIGKILL);
-    cpn_log(LOG_LEVEL_VERBOSE, "Terminated synergy");
+    err = 0;
+
+out:
+    if (r)
+        finish(r, -1);
+    cpn_socket_close(&socket);
     free(args[5]);
 
-    return 0;
+    return err;
 }
 
 int cpn_synergy_init_service(const struct cpn_service_plugin **out)
@@ -164,15 +766,16 @@ int cpn_synergy_init_service(const struct cpn_service_plugin **out)
     static struct cpn_service_plugin plugin = {
         "Input",
         "synergy",
-        1,
+        2,
         handle,
         invoke,
         NULL,
-        NULL
+        NULL,
+        CPN_SERVICE_PRIORITY_INTERACTIVE,
+        SYNERGY_FRAMELEN
     };
 
     *out = &plugin;
 
     return 0;
 }
-
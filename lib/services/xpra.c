@@ -23,6 +23,7 @@
 #include "capone/log.h"
 #include "capone/opts.h"
 #include "capone/socket.h"
+#include "capone/relay.h"
 #include "capone/service.h"
 
 #include "capone/services/xpra.h"
@@ -58,7 +59,8 @@ static int invoke(struct cpn_channel *channel,
      * and when it does, we do the actual connection to the xpra
      * socket.
      */
-    if (recv(channel->fd, buf, sizeof(buf), MSG_PEEK) < 0) {
+    if (!cpn_channel_has_pending_input(channel) &&
+            recv(channel->fd, buf, sizeof(buf), MSG_PEEK) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not await xpra connection");
         goto out;
     }
@@ -68,7 +70,7 @@ static int invoke(struct cpn_channel *channel,
         goto out;
     }
 
-    if (cpn_channel_relay(channel, 1, xpra_channel.fd) < 0) {
+    if (cpn_relay_await(channel, &xpra_channel.fd, 1) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not relay data from xpra connection");
         goto out;
     }
@@ -79,6 +81,17 @@ out:
     return 0;
 }
 
+static void terminate_xpra(int result, void *payload)
+{
+    int *pid = (int *) payload;
+
+    UNUSED(result);
+
+    kill(*pid, SIGKILL);
+    cpn_log(LOG_LEVEL_VERBOSE, "Terminated xpra");
+    free(pid);
+}
+
 static int handle(struct cpn_channel *channel,
         const struct cpn_sign_pk *invoker,
         const struct cpn_session *session,
@@ -94,12 +107,15 @@ static int handle(struct cpn_channel *channel,
         NULL
     };
     uint32_t port;
-    int len, pid;
+    int *xpra_pid = NULL;
+    int len, pid = -1, err = -1;
 
     UNUSED(cfg);
     UNUSED(invoker);
     UNUSED(session);
 
+    xpra_channel.fd = -1;
+
     if (cpn_socket_init(&socket, "127.0.0.1", 0, CPN_CHANNEL_TYPE_TCP) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not initialize xpra relay socket");
         return -1;
@@ -107,16 +123,17 @@ static int handle(struct cpn_channel *channel,
 
     if (cpn_socket_listen(&socket) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not listen on xpra relay socket");
-        return -1;
+        goto out;
     }
 
     if (cpn_socket_get_address(&socket, NULL, 0, &port) < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not retrieve address of xpra relay socket");
-        return -1;
+        goto out;
     }
 
     len = snprintf(NULL, 0, "tcp:localhost:%"PRIu32":100", port) + 1;
-    args[2] = malloc(len);
+    if ((args[2] = malloc(len)) == NULL)
+        goto out;
     len = snprintf(args[2], len, "tcp:localhost:%"PRIu32":100", port);
 
     pid = fork();
@@ -127,25 +144,46 @@ static int handle(struct cpn_channel *channel,
         }
 
         _exit(0);
-    } else if (pid > 0) {
-        if (cpn_socket_accept(&socket, &xpra_channel) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Could not accept xpra relay socket connection");
-            return -1;
-        }
+    } else if (pid < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to fork xpra client");
+        goto out;
+    }
 
-        if (cpn_channel_relay(channel, 1, xpra_channel.fd) < 0) {
-            cpn_log(LOG_LEVEL_ERROR, "Could not relay xpra socket");
-            return -1;
-        }
-    } else {
-        return -1;
+    if (cpn_socket_accept(&socket, &xpra_channel) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not accept xpra relay socket connection");
+        goto out;
     }
 
-    kill(pid, SIGKILL);
-    cpn_log(LOG_LEVEL_VERBOSE, "Terminated xpra");
+    if ((xpra_pid = malloc(sizeof(*xpra_pid))) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to allocate xpra relay");
+        goto out;
+    }
+    *xpra_pid = pid;
+
+    /* The relay owns the channel and the xpra connection from now
+     * on and terminates xpra when done, so we can return */
+    if (cpn_relay_detach(channel, &xpra_channel.fd, 1, terminate_xpra, xpra_pid) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not relay xpra socket");
+        goto out;
+    }
+    xpra_channel.fd = -1;
+    xpra_pid = NULL;
+    pid = -1;
+
+    err = 0;
+
+out:
+    if (xpra_channel.fd >= 0)
+        close(xpra_channel.fd);
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        cpn_log(LOG_LEVEL_VERBOSE, "Terminated xpra");
+    }
+    cpn_socket_close(&socket);
+    free(xpra_pid);
     free(args[2]);
 
-    return 0;
+    return err;
 }
 
 int cpn_xpra_init_service(const struct cpn_service_plugin **out)
@@ -157,7 +195,9 @@ int cpn_xpra_init_service(const struct cpn_service_plugin **out)
         handle,
         invoke,
         NULL,
-        NULL
+        NULL,
+        CPN_SERVICE_PRIORITY_INTERACTIVE,
+        0
     };
 
     *out = &plugin;
@@ -17,6 +17,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
@@ -30,10 +31,10 @@
 #include "capone/log.h"
 #include "capone/socket.h"
 
-int get_socket(struct sockaddr_storage *addr, socklen_t *addrlen,
+static int open_socket(struct sockaddr_storage *addr, socklen_t *addrlen,
         const char *host, uint32_t port,
         enum cpn_channel_type type,
-        bool serverside)
+        bool serverside, bool shared)
 {
     struct addrinfo hints, *servinfo, *hint;
     char cport[16];
@@ -82,6 +83,21 @@ int get_socket(struct sockaddr_storage *addr, socklen_t *addrlen,
                 continue;
             }
 
+            if (shared) {
+#ifdef SO_REUSEPORT
+                opt = 1;
+                if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+                    cpn_log(LOG_LEVEL_DEBUG, "Unable to enable port reuse: %s", strerror(errno));
+                    close(fd);
+                    continue;
+                }
+#else
+                cpn_log(LOG_LEVEL_ERROR, "Port reuse is not supported");
+                close(fd);
+                continue;
+#endif
+            }
+
             if (bind(fd, hint->ai_addr, hint->ai_addrlen) < 0) {
                 cpn_log(LOG_LEVEL_DEBUG, "Unable to bind socket: %s", strerror(errno));
                 close(fd);
@@ -119,14 +135,23 @@ int get_socket(struct sockaddr_storage *addr, socklen_t *addrlen,
     return fd;
 }
 
-int cpn_socket_init(struct cpn_socket *socket,
-        const char *host, uint32_t port, enum cpn_channel_type type)
+int get_socket(struct sockaddr_storage *addr, socklen_t *addrlen,
+        const char *host, uint32_t port,
+        enum cpn_channel_type type,
+        bool serverside)
+{
+    return open_socket(addr, addrlen, host, port, type, serverside, false);
+}
+
+static int init_socket(struct cpn_socket *socket,
+        const char *host, uint32_t port, enum cpn_channel_type type,
+        bool shared)
 {
     int fd;
     struct sockaddr_storage addr;
     socklen_t addrlen;
 
-    fd = get_socket(&addr, &addrlen, host, port, type, true);
+    fd = open_socket(&addr, &addrlen, host, port, type, true, shared);
     if (fd < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Unable to get socket: %s", strerror(errno));
         return -1;
@@ -136,10 +161,24 @@ int cpn_socket_init(struct cpn_socket *socket,
     socket->type = type;
     socket->addr = addr;
     socket->addrlen = addrlen;
+    socket->backlog = CPN_SOCKET_BACKLOG;
+    socket->nonblocking = false;
 
     return 0;
 }
 
+int cpn_socket_init(struct cpn_socket *socket,
+        const char *host, uint32_t port, enum cpn_channel_type type)
+{
+    return init_socket(socket, host, port, type, false);
+}
+
+int cpn_socket_init_shared(struct cpn_socket *socket,
+        const char *host, uint32_t port, enum cpn_channel_type type)
+{
+    return init_socket(socket, host, port, type, true);
+}
+
 int cpn_socket_close(struct cpn_socket *socket)
 {
     if (socket->fd < 0) {
@@ -165,13 +204,58 @@ int cpn_socket_enable_broadcast(struct cpn_socket *socket)
     return 0;
 }
 
+int cpn_socket_set_backlog(struct cpn_socket *s, int backlog)
+{
+    if (backlog <= 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Invalid backlog %d", backlog);
+        return -1;
+    }
+
+    s->backlog = backlog;
+
+    return 0;
+}
+
+int cpn_socket_set_incoming_cpu(struct cpn_socket *s, int cpu)
+{
+#ifdef SO_INCOMING_CPU
+    if (setsockopt(s->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to set incoming CPU: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+#else
+    UNUSED(s);
+    UNUSED(cpu);
+    cpn_log(LOG_LEVEL_ERROR, "Setting incoming CPU is not supported");
+    return -1;
+#endif
+}
+
+int cpn_socket_set_nonblocking(struct cpn_socket *s)
+{
+    int flags;
+
+    if ((flags = fcntl(s->fd, F_GETFL)) < 0 ||
+            fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to set socket non-blocking: %s", strerror(errno));
+        return -1;
+    }
+
+    s->nonblocking = true;
+
+    return 0;
+}
+
 int cpn_socket_listen(struct cpn_socket *s)
 {
     int fd;
 
     assert(s->fd >= 0);
 
-    fd = listen(s->fd, 16);
+    fd = listen(s->fd, s->backlog);
     if (fd < 0) {
         cpn_log(LOG_LEVEL_ERROR, "Could not listen: %s", strerror(errno));
         return -1;
@@ -182,7 +266,7 @@ int cpn_socket_listen(struct cpn_socket *s)
 
 int cpn_socket_accept(struct cpn_socket *s, struct cpn_channel *out)
 {
-    int fd, opt;
+    int fd, opt, err;
     socklen_t addrsize;
     struct sockaddr_storage addr;
 
@@ -196,17 +280,24 @@ int cpn_socket_accept(struct cpn_socket *s, struct cpn_channel *out)
                 fd = accept(s->fd, (struct sockaddr*) &addr, &addrsize);
 
                 if (fd < 0) {
+                    if ((errno == EAGAIN || errno == EWOULDBLOCK) && s->nonblocking)
+                        return -1;
                     if (errno == EAGAIN || errno == EINTR)
                         continue;
+                    /* Callers need to tell transient errors apart */
+                    err = errno;
                     cpn_log(LOG_LEVEL_ERROR, "Could not accept connection: %s",
-                            strerror(errno));
+                            strerror(err));
+                    errno = err;
                     return -1;
                 }
 
                 opt = 1;
                 if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) < 0) {
-                    cpn_log(LOG_LEVEL_DEBUG, "Unable to enable keepalive: %s", strerror(errno));
+                    err = errno;
+                    cpn_log(LOG_LEVEL_DEBUG, "Unable to enable keepalive: %s", strerror(err));
                     close(fd);
+                    errno = err;
                     return -1;
                 }
 
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "capone/common.h"
+#include "capone/log.h"
+#include "capone/ticket.h"
+
+#define TICKET_VERSION 1
+
+/* Sealed tickets are made up of the nonce, followed by the
+ * encrypted version, expiry, client identity and secret */
+#define TICKET_PLAINLEN (1 + 8 + CPN_CRYPTO_SIGN_PKBYTES + CPN_CRYPTO_SYMMETRIC_KEYBYTES)
+#define TICKET_SEALEDLEN (CPN_CRYPTO_SYMMETRIC_NONCEBYTES + TICKET_PLAINLEN + CPN_CRYPTO_SYMMETRIC_MACBYTES)
+
+/* Ticket files are made up of the server identity and secret,
+ * followed by the sealed ticket */
+#define TICKET_FILE_HEADERLEN (CPN_CRYPTO_SIGN_PKBYTES + CPN_CRYPTO_SYMMETRIC_KEYBYTES)
+
+static pthread_once_t ticket_key_once = PTHREAD_ONCE_INIT;
+static struct cpn_symmetric_key ticket_key;
+
+static void init_ticket_key(void)
+{
+    cpn_symmetric_key_generate(&ticket_key);
+}
+
+void cpn_ticket_clear(struct cpn_ticket *ticket)
+{
+    cpn_memzero(ticket, sizeof(*ticket));
+}
+
+int cpn_ticket_from_file(struct cpn_ticket *out, const char *file)
+{
+    uint8_t buf[TICKET_FILE_HEADERLEN + CPN_TICKET_MAXLEN + 1];
+    size_t len = 0;
+    ssize_t ret;
+    int fd, err = -1;
+
+    if ((fd = open(file, O_RDONLY)) < 0) {
+        cpn_log(LOG_LEVEL_VERBOSE, "Could not open ticket: %s", strerror(errno));
+        return -1;
+    }
+
+    while (len < sizeof(buf)) {
+        ret = read(fd, buf + len, sizeof(buf) - len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Could not read ticket: %s", strerror(errno));
+            goto out;
+        }
+        if (ret == 0)
+            break;
+        len += ret;
+    }
+
+    if (len <= TICKET_FILE_HEADERLEN || len > TICKET_FILE_HEADERLEN + CPN_TICKET_MAXLEN) {
+        cpn_log(LOG_LEVEL_ERROR, "Ticket has invalid length");
+        goto out;
+    }
+
+    memcpy(out->identity.data, buf, CPN_CRYPTO_SIGN_PKBYTES);
+    memcpy(out->secret.data, buf + CPN_CRYPTO_SIGN_PKBYTES, CPN_CRYPTO_SYMMETRIC_KEYBYTES);
+    memcpy(out->data, buf + TICKET_FILE_HEADERLEN, len - TICKET_FILE_HEADERLEN);
+    out->len = len - TICKET_FILE_HEADERLEN;
+
+    err = 0;
+
+out:
+    cpn_memzero(buf, sizeof(buf));
+    close(fd);
+
+    return err;
+}
+
+int cpn_ticket_to_file(const char *file, const struct cpn_ticket *ticket)
+{
+    uint8_t buf[TICKET_FILE_HEADERLEN + CPN_TICKET_MAXLEN];
+    size_t len, written = 0;
+    ssize_t ret;
+    int fd, err = -1;
+
+    if (ticket->len == 0 || ticket->len > CPN_TICKET_MAXLEN) {
+        cpn_log(LOG_LEVEL_ERROR, "Cannot write invalid ticket");
+        return -1;
+    }
+
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Could not open ticket: %s", strerror(errno));
+        return -1;
+    }
+
+    memcpy(buf, ticket->identity.data, CPN_CRYPTO_SIGN_PKBYTES);
+    memcpy(buf + CPN_CRYPTO_SIGN_PKBYTES, ticket->secret.data, CPN_CRYPTO_SYMMETRIC_KEYBYTES);
+    memcpy(buf + TICKET_FILE_HEADERLEN, ticket->data, ticket->len);
+    len = TICKET_FILE_HEADERLEN + ticket->len;
+
+    while (written < len) {
+        ret = write(fd, buf + written, len - written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Could not write ticket: %s", strerror(errno));
+            goto out;
+        }
+        written += ret;
+    }
+
+    err = 0;
+
+out:
+    cpn_memzero(buf, sizeof(buf));
+    close(fd);
+
+    return err;
+}
+
+int cpn_ticket_seal(uint8_t *out, size_t *outlen,
+        const struct cpn_sign_pk *client,
+        const struct cpn_symmetric_key *secret,
+        uint32_t lifetime)
+{
+    uint8_t plain[TICKET_PLAINLEN];
+    struct cpn_symmetric_key_nonce nonce;
+    uint64_t expiry;
+    int i, err;
+
+    pthread_once(&ticket_key_once, init_ticket_key);
+
+    expiry = (uint64_t) time(NULL) + lifetime;
+
+    plain[0] = TICKET_VERSION;
+    for (i = 0; i < 8; i++)
+        plain[1 + i] = (expiry >> (56 - 8 * i)) & 0xff;
+    memcpy(plain + 9, client->data, CPN_CRYPTO_SIGN_PKBYTES);
+    memcpy(plain + 9 + CPN_CRYPTO_SIGN_PKBYTES, secret->data, CPN_CRYPTO_SYMMETRIC_KEYBYTES);
+
+    /* Nonces are random as tickets are sealed concurrently by
+     * all connections */
+    cpn_randombytes(nonce.data, sizeof(nonce.data));
+    memcpy(out, nonce.data, sizeof(nonce.data));
+
+    err = cpn_symmetric_key_encrypt(out + sizeof(nonce.data), &ticket_key,
+            CPN_SYMMETRIC_CIPHER_SECRETBOX, &nonce, plain, sizeof(plain));
+    cpn_memzero(plain, sizeof(plain));
+
+    if (err < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to seal ticket");
+        return -1;
+    }
+
+    *outlen = TICKET_SEALEDLEN;
+
+    return 0;
+}
+
+int cpn_ticket_open(struct cpn_symmetric_key *out,
+        const uint8_t *data, size_t datalen,
+        const struct cpn_sign_pk *client)
+{
+    uint8_t sealed[TICKET_SEALEDLEN], plain[TICKET_PLAINLEN];
+    struct cpn_symmetric_key_nonce nonce;
+    uint64_t expiry = 0;
+    int i, err = -1;
+
+    pthread_once(&ticket_key_once, init_ticket_key);
+
+    if (datalen != TICKET_SEALEDLEN) {
+        cpn_log(LOG_LEVEL_VERBOSE, "Ticket has invalid length");
+        return -1;
+    }
+
+    memcpy(nonce.data, data, sizeof(nonce.data));
+    memcpy(sealed, data + sizeof(nonce.data), datalen - sizeof(nonce.data));
+
+    if (cpn_symmetric_key_decrypt(plain, &ticket_key, CPN_SYMMETRIC_CIPHER_SECRETBOX,
+                &nonce, sealed, datalen - sizeof(nonce.data)) < 0)
+    {
+        cpn_log(LOG_LEVEL_VERBOSE, "Ticket could not be opened");
+        goto out;
+    }
+
+    if (plain[0] != TICKET_VERSION) {
+        cpn_log(LOG_LEVEL_VERBOSE, "Ticket has unknown version");
+        goto out;
+    }
+
+    for (i = 0; i < 8; i++)
+        expiry = (expiry << 8) | plain[1 + i];
+    if (expiry <= (uint64_t) time(NULL)) {
+        cpn_log(LOG_LEVEL_VERBOSE, "Ticket has expired");
+        goto out;
+    }
+
+    if (memcmp(plain + 9, client->data, CPN_CRYPTO_SIGN_PKBYTES)) {
+        cpn_log(LOG_LEVEL_VERBOSE, "Ticket has been issued to another client");
+        goto out;
+    }
+
+    memcpy(out->data, plain + 9 + CPN_CRYPTO_SIGN_PKBYTES, CPN_CRYPTO_SYMMETRIC_KEYBYTES);
+
+    err = 0;
+
+out:
+    cpn_memzero(plain, sizeof(plain));
+
+    return err;
+}
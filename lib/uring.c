@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Batched channel I/O via io_uring.
+ *
+ * Data is sent out of a small set of registered buffers. Each
+ * buffer is submitted as a fixed write linked to the previous
+ * one, so that the kernel keeps them in order, and the whole
+ * chain is only submitted once all buffers are in use or the
+ * message is complete. Data is received by a single multishot
+ * receive, which keeps on filling buffers from a provided
+ * buffer ring until it runs out of them.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+#endif
+
+#include "capone/buf.h"
+#include "capone/common.h"
+#include "capone/log.h"
+
+#define URING_ENTRIES 64
+
+#define URING_SENDBUFS 8
+#define URING_SENDBUFLEN (64 * 1024)
+
+#define URING_RECVBUFS 16
+#define URING_RECVBUFLEN (16 * 1024)
+#define URING_RECVGROUP 0
+
+/* Completions not belonging to a send carry these tags */
+#define URING_RECV ((uint64_t) -1)
+#define URING_CANCEL ((uint64_t) -2)
+
+#ifdef HAVE_LIBURING
+
+struct recv_chunk {
+    unsigned short bid;
+    size_t len;
+    size_t off;
+};
+
+struct cpn_uring {
+    struct io_uring ring;
+    int fd;
+
+    uint8_t *sendbufs;
+    size_t sendlens[URING_SENDBUFS];
+    int sendres[URING_SENDBUFS];
+    unsigned nqueued;
+    unsigned ninflight;
+
+    struct io_uring_buf_ring *bufring;
+    uint8_t *recvbufs;
+    struct recv_chunk chunks[URING_RECVBUFS];
+    unsigned chunkhead;
+    unsigned nchunks;
+    bool armed;
+    bool closed;
+    int error;
+};
+
+static void recycle_chunk(struct cpn_uring *u, const struct recv_chunk *chunk)
+{
+    io_uring_buf_ring_add(u->bufring, u->recvbufs + chunk->bid * URING_RECVBUFLEN,
+            URING_RECVBUFLEN, chunk->bid,
+            io_uring_buf_ring_mask(URING_RECVBUFS), 0);
+    io_uring_buf_ring_advance(u->bufring, 1);
+}
+
+static void handle_completion(struct cpn_uring *u, const struct io_uring_cqe *cqe)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    struct recv_chunk *chunk;
+
+    if (data == URING_CANCEL)
+        return;
+
+    if (data != URING_RECV) {
+        u->sendres[data] = cqe->res;
+        u->ninflight--;
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        u->armed = false;
+
+    if (cqe->res > 0) {
+        chunk = &u->chunks[(u->chunkhead + u->nchunks) % URING_RECVBUFS];
+        chunk->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        chunk->len = cqe->res;
+        chunk->off = 0;
+        u->nchunks++;
+    } else if (cqe->res == 0) {
+        u->closed = true;
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        /* Running out of buffers only stops the receive until
+         * we have consumed some of them */
+        u->error = -cqe->res;
+    }
+}
+
+static int wait_completions(struct cpn_uring *u)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, n = 0;
+    int ret;
+
+    do {
+        ret = io_uring_submit_and_wait(&u->ring, 1);
+    } while (ret == -EINTR);
+
+    if (ret < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to wait for completions: %s", strerror(-ret));
+        return -1;
+    }
+
+    io_uring_for_each_cqe(&u->ring, head, cqe) {
+        handle_completion(u, cqe);
+        n++;
+    }
+    io_uring_cq_advance(&u->ring, n);
+
+    return 0;
+}
+
+static int arm_receive(struct cpn_uring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = io_uring_get_sqe(&u->ring)) == NULL)
+        return -1;
+
+    io_uring_prep_recv_multishot(sqe, u->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECVGROUP;
+    io_uring_sqe_set_data64(sqe, URING_RECV);
+
+    u->armed = true;
+
+    return 0;
+}
+
+static ssize_t send_remainder(int fd, const uint8_t *data, size_t len)
+{
+    ssize_t ret;
+    size_t written = 0;
+
+    while (written < len) {
+        ret = send(fd, data + written, len - written, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        } else if (ret == 0) {
+            return 0;
+        }
+        written += ret;
+    }
+
+    return written;
+}
+
+int uring_open(struct cpn_uring **out, int fd)
+{
+    struct cpn_uring *u;
+    struct iovec iov[URING_SENDBUFS];
+    unsigned short i;
+    int err;
+
+    if ((u = calloc(1, sizeof(*u))) == NULL)
+        return -1;
+    u->fd = fd;
+
+    if ((err = io_uring_queue_init(URING_ENTRIES, &u->ring, 0)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to set up io_uring: %s", strerror(-err));
+        free(u);
+        return -1;
+    }
+
+    if ((u->sendbufs = malloc(URING_SENDBUFS * URING_SENDBUFLEN)) == NULL)
+        goto out_err;
+
+    for (i = 0; i < URING_SENDBUFS; i++) {
+        iov[i].iov_base = u->sendbufs + i * URING_SENDBUFLEN;
+        iov[i].iov_len = URING_SENDBUFLEN;
+    }
+
+    if ((err = io_uring_register_buffers(&u->ring, iov, URING_SENDBUFS)) < 0) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to register buffers: %s", strerror(-err));
+        goto out_err;
+    }
+
+    u->bufring = io_uring_setup_buf_ring(&u->ring, URING_RECVBUFS, URING_RECVGROUP, 0, &err);
+    if (u->bufring == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Unable to set up buffer ring: %s", strerror(-err));
+        goto out_err;
+    }
+
+    if ((u->recvbufs = malloc(URING_RECVBUFS * URING_RECVBUFLEN)) == NULL)
+        goto out_err;
+
+    for (i = 0; i < URING_RECVBUFS; i++) {
+        io_uring_buf_ring_add(u->bufring, u->recvbufs + i * URING_RECVBUFLEN,
+                URING_RECVBUFLEN, i, io_uring_buf_ring_mask(URING_RECVBUFS), i);
+    }
+    io_uring_buf_ring_advance(u->bufring, URING_RECVBUFS);
+
+    *out = u;
+
+    return 0;
+
+out_err:
+    if (u->bufring)
+        io_uring_free_buf_ring(&u->ring, u->bufring, URING_RECVBUFS, URING_RECVGROUP);
+    io_uring_queue_exit(&u->ring);
+    free(u->recvbufs);
+    free(u->sendbufs);
+    free(u);
+
+    return -1;
+}
+
+int uring_close(struct cpn_uring *u, struct cpn_buf *leftover)
+{
+    struct io_uring_sqe *sqe;
+    struct recv_chunk *chunk;
+    int err = 0;
+
+    if (u->armed && (sqe = io_uring_get_sqe(&u->ring)) != NULL) {
+        io_uring_prep_cancel64(sqe, URING_RECV, 0);
+        io_uring_sqe_set_data64(sqe, URING_CANCEL);
+    }
+
+    /* Data might still arrive until the receive has been
+     * cancelled, which we have to keep, too */
+    while (u->armed || u->ninflight) {
+        if (wait_completions(u) < 0) {
+            err = -1;
+            break;
+        }
+    }
+
+    while (u->nchunks) {
+        chunk = &u->chunks[u->chunkhead];
+        if (leftover && cpn_buf_append_data(leftover,
+                    u->recvbufs + chunk->bid * URING_RECVBUFLEN + chunk->off,
+                    chunk->len - chunk->off) < 0)
+            err = -1;
+        u->chunkhead = (u->chunkhead + 1) % URING_RECVBUFS;
+        u->nchunks--;
+    }
+
+    io_uring_free_buf_ring(&u->ring, u->bufring, URING_RECVBUFS, URING_RECVGROUP);
+    io_uring_unregister_buffers(&u->ring);
+    io_uring_queue_exit(&u->ring);
+    free(u->recvbufs);
+    free(u->sendbufs);
+    free(u);
+
+    return err;
+}
+
+uint8_t *uring_send_buffer(struct cpn_uring *u, size_t *len)
+{
+    *len = URING_SENDBUFLEN;
+    return u->sendbufs + u->nqueued * URING_SENDBUFLEN;
+}
+
+ssize_t uring_queue_send(struct cpn_uring *u, size_t len, bool last)
+{
+    struct io_uring_sqe *sqe;
+    ssize_t ret, written = 0;
+    unsigned i, nqueued;
+
+    if ((sqe = io_uring_get_sqe(&u->ring)) == NULL) {
+        cpn_log(LOG_LEVEL_ERROR, "Submission queue is full");
+        return -1;
+    }
+
+    io_uring_prep_write_fixed(sqe, u->fd, u->sendbufs + u->nqueued * URING_SENDBUFLEN,
+            len, 0, u->nqueued);
+    io_uring_sqe_set_data64(sqe, u->nqueued);
+    /* Linking the writes guarantees their order on the wire */
+    sqe->flags |= IOSQE_IO_LINK;
+
+    u->sendlens[u->nqueued++] = len;
+
+    if (!last && u->nqueued < URING_SENDBUFS)
+        return len;
+
+    /* The last write in a chain must not be linked, as the
+     * chain would otherwise extend to the next submission */
+    sqe->flags &= ~IOSQE_IO_LINK;
+
+    nqueued = u->nqueued;
+    u->ninflight = nqueued;
+    u->nqueued = 0;
+
+    while (u->ninflight) {
+        if (wait_completions(u) < 0)
+            return -1;
+    }
+
+    /* A short write breaks the chain and cancels all writes
+     * linked to it, so we send the remaining data ourselves */
+    for (i = 0; i < nqueued; i++) {
+        const uint8_t *buf = u->sendbufs + i * URING_SENDBUFLEN;
+
+        ret = u->sendres[i];
+        if (ret == -ECANCELED)
+            ret = 0;
+
+        if (ret < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Could not send data: %s", strerror(-ret));
+            return -1;
+        }
+
+        if ((size_t) ret < u->sendlens[i]) {
+            if ((ret = send_remainder(u->fd, buf + ret, u->sendlens[i] - ret)) <= 0) {
+                if (ret < 0)
+                    cpn_log(LOG_LEVEL_ERROR, "Could not send data: %s", strerror(errno));
+                return ret;
+            }
+        }
+
+        written += u->sendlens[i];
+    }
+
+    return written;
+}
+
+ssize_t uring_receive(struct cpn_uring *u, uint8_t *out, size_t len)
+{
+    struct recv_chunk *chunk;
+    size_t received = 0, n;
+
+    while (u->nchunks == 0) {
+        if (u->error) {
+            cpn_log(LOG_LEVEL_ERROR, "Could not receive data: %s", strerror(u->error));
+            return -1;
+        } else if (u->closed) {
+            return 0;
+        }
+
+        if (!u->armed && arm_receive(u) < 0) {
+            cpn_log(LOG_LEVEL_ERROR, "Unable to arm receive");
+            return -1;
+        }
+
+        if (wait_completions(u) < 0)
+            return -1;
+    }
+
+    while (u->nchunks && received < len) {
+        chunk = &u->chunks[u->chunkhead];
+        n = MIN(len - received, chunk->len - chunk->off);
+
+        memcpy(out + received, u->recvbufs + chunk->bid * URING_RECVBUFLEN + chunk->off, n);
+        chunk->off += n;
+        received += n;
+
+        if (chunk->off == chunk->len) {
+            recycle_chunk(u, chunk);
+            u->chunkhead = (u->chunkhead + 1) % URING_RECVBUFS;
+            u->nchunks--;
+        }
+    }
+
+    return received;
+}
+
+bool uring_is_available(void)
+{
+    struct io_uring ring;
+
+    if (io_uring_queue_init(2, &ring, 0) < 0)
+        return false;
+    io_uring_queue_exit(&ring);
+
+    return true;
+}
+
+bool uring_has_pending(const struct cpn_uring *u)
+{
+    return u->nchunks > 0;
+}
+
+#else
+
+struct cpn_uring;
+
+int uring_open(struct cpn_uring **out, int fd)
+{
+    UNUSED(out);
+    UNUSED(fd);
+    cpn_log(LOG_LEVEL_ERROR, "Built without io_uring support");
+    return -1;
+}
+
+int uring_close(struct cpn_uring *u, struct cpn_buf *leftover)
+{
+    UNUSED(u);
+    UNUSED(leftover);
+    return -1;
+}
+
+uint8_t *uring_send_buffer(struct cpn_uring *u, size_t *len)
+{
+    UNUSED(u);
+    *len = 0;
+    return NULL;
+}
+
+ssize_t uring_queue_send(struct cpn_uring *u, size_t len, bool last)
+{
+    UNUSED(u);
+    UNUSED(len);
+    UNUSED(last);
+    return -1;
+}
+
+ssize_t uring_receive(struct cpn_uring *u, uint8_t *out, size_t len)
+{
+    UNUSED(u);
+    UNUSED(out);
+    UNUSED(len);
+    return -1;
+}
+
+bool uring_is_available(void)
+{
+    return false;
+}
+
+bool uring_has_pending(const struct cpn_uring *u)
+{
+    UNUSED(u);
+    return false;
+}
+
+#endif
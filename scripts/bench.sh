@@ -6,7 +6,7 @@ echo "datalen,pkglen,wxplain,rxplain,tpplain,wxenc,rxenc,tpenc"
 
 for datalen in 256 1024 102400 10240000
 do
-    for pkglen in 64 128 256 512 1024 1500 2048 4096
+    for pkglen in 64 128 256 512 1024 1500 2048 4096 8192 16384
     do
         PLAIN=$(./build/cpn-bench-throughput --plain ${datalen} ${pkglen} | awk '!(NR%2) {printf "%s %s", $NF, p} {p=$NF}')
         PLAIN_WX=$(echo "$PLAIN" | cut -d ' ' -f 1)
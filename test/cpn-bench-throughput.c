@@ -32,11 +32,30 @@
 struct client_args {
     uint32_t datalen;
     uint32_t blocklen;
+    uint32_t batchlen;
+    uint32_t framelen;
     uint32_t repeats;
 };
 
 static char encrypt;
 static struct cpn_symmetric_key key;
+static enum cpn_symmetric_cipher ciphers[3];
+static size_t nciphers;
+
+static const char *suite_name(enum cpn_symmetric_cipher cipher)
+{
+    return encrypt ? cpn_symmetric_cipher_to_string(cipher) : "plain";
+}
+
+static int enable_suite(struct cpn_channel *channel,
+        enum cpn_symmetric_cipher cipher, enum cpn_channel_nonce nonce)
+{
+    if (!encrypt)
+        return 0;
+    if (cpn_channel_set_cipher(channel, cipher) < 0)
+        return -1;
+    return cpn_channel_enable_encryption(channel, &key, nonce);
+}
 
 static void *client(void *payload)
 {
@@ -45,6 +64,7 @@ static void *client(void *payload)
     uint8_t *data = malloc(args->datalen);
     uint64_t start, end;
     uint32_t i;
+    size_t c;
 
     if (cpn_bench_set_affinity(2) < 0) {
         puts("Unable to set sched affinity");
@@ -60,22 +80,35 @@ static void *client(void *payload)
         goto out;
     }
 
-    if (encrypt) {
-        cpn_channel_enable_encryption(&channel, &key, CPN_CHANNEL_NONCE_CLIENT);
-    }
-
     cpn_channel_set_blocklen(&channel, args->blocklen);
+    if (args->batchlen && cpn_channel_set_batchlen(&channel, args->batchlen) < 0) {
+        puts("Invalid batch length");
+        goto out;
+    }
+    if (args->framelen && (cpn_channel_set_framelen(&channel, args->framelen) < 0 ||
+                cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES) < 0)) {
+        puts("Invalid frame length");
+        goto out;
+    }
 
-    start = cpn_bench_nsecs();
-    for (i = 0; i < args->repeats; i++) {
-        if (cpn_channel_write_data(&channel, data, args->datalen) < 0) {
-            puts("Unable to write data");
+    for (c = 0; c < nciphers; c++) {
+        if (enable_suite(&channel, ciphers[c], CPN_CHANNEL_NONCE_CLIENT) < 0) {
+            puts("Unable to enable encryption");
             goto out;
         }
-    }
-    end = cpn_bench_nsecs();
 
-    printf("send (ns):\t%"PRIu64"\n", (end - start) / args->repeats);
+        start = cpn_bench_nsecs();
+        for (i = 0; i < args->repeats; i++) {
+            if (cpn_channel_write_data(&channel, data, args->datalen) < 0) {
+                puts("Unable to write data");
+                goto out;
+            }
+        }
+        end = cpn_bench_nsecs();
+
+        printf("%s send (ns):\t%"PRIu64"\n", suite_name(ciphers[c]),
+                (end - start) / args->repeats);
+    }
 
 out:
     free(data);
@@ -86,9 +119,11 @@ out:
 int main(int argc, const char *argv[])
 {
     struct cpn_opt opts[] = {
-        CPN_OPTS_OPT_COUNTER('e', "--encrypt", "Benchmark sending encrypted text"),
+        CPN_OPTS_OPT_COUNTER('e', "--encrypt", "Benchmark sending encrypted text with each cipher suite"),
         CPN_OPTS_OPT_UINT32('d', "--data-length", "Length of data to send", "LENGTH", false),
         CPN_OPTS_OPT_UINT32('b', "--block-length", "Length of blocks to split by", "LENGTH", false),
+        CPN_OPTS_OPT_UINT32('B', "--batch-length", "Number of blocks to write at once", "COUNT", true),
+        CPN_OPTS_OPT_UINT32('f', "--frame-length", "Use frames of given maximum length instead of blocks", "LENGTH", true),
         CPN_OPTS_OPT_END
     };
     struct client_args args;
@@ -98,6 +133,7 @@ int main(int argc, const char *argv[])
     uint8_t *data;
     uint64_t start, end;
     uint32_t i;
+    size_t c;
 
     if (cpn_opts_parse_cmd(opts, argc, argv) < 0)
         return -1;
@@ -105,9 +141,26 @@ int main(int argc, const char *argv[])
     encrypt = opts[0].value.counter;
     args.datalen = opts[1].value.uint32;
     args.blocklen = opts[2].value.uint32;
+    args.batchlen = opts[3].set ? opts[3].value.uint32 : 0;
+    args.framelen = opts[4].set ? opts[4].value.uint32 : 0;
 
     data = malloc(args.datalen);
 
+    /* Without encryption, there is only a single plain suite */
+    if (encrypt) {
+        enum cpn_symmetric_cipher all[] = {
+            CPN_SYMMETRIC_CIPHER_SECRETBOX,
+            CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305,
+            CPN_SYMMETRIC_CIPHER_AES256GCM
+        };
+
+        for (c = 0; c < ARRAY_SIZE(all); c++)
+            if (cpn_symmetric_cipher_is_available(all[c]))
+                ciphers[nciphers++] = all[c];
+    } else {
+        nciphers = 1;
+    }
+
     /* Always average over 1GB of data sent */
     args.repeats = (1024 * 1024 * 1024) / args.datalen;
 
@@ -136,27 +189,36 @@ int main(int argc, const char *argv[])
         return -1;
     }
 
-    if (encrypt) {
-        cpn_channel_enable_encryption(&channel, &key, CPN_CHANNEL_NONCE_SERVER);
-    }
-
     cpn_channel_set_blocklen(&channel, args.blocklen);
+    if (args.framelen && (cpn_channel_set_framelen(&channel, args.framelen) < 0 ||
+                cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES) < 0)) {
+        puts("Invalid frame length");
+        return -1;
+    }
 
-    start = cpn_bench_nsecs();
-    for (i = 0; i < args.repeats; i++) {
-        if (cpn_channel_receive_data(&channel, data, args.datalen) < 0) {
-            puts("Unable to receive data");
+    for (c = 0; c < nciphers; c++) {
+        if (enable_suite(&channel, ciphers[c], CPN_CHANNEL_NONCE_SERVER) < 0) {
+            puts("Unable to enable encryption");
             return -1;
         }
+
+        start = cpn_bench_nsecs();
+        for (i = 0; i < args.repeats; i++) {
+            if (cpn_channel_receive_data(&channel, data, args.datalen) < 0) {
+                puts("Unable to receive data");
+                return -1;
+            }
+        }
+        end = cpn_bench_nsecs();
+
+        printf("%s recv (ns):\t%"PRIu64"\n", suite_name(ciphers[c]),
+                (end - start) / args.repeats);
     }
-    end = cpn_bench_nsecs();
 
     if (cpn_join(&t, NULL) < 0) {
         puts("Unable to await client thread");
         return -1;
     }
 
-    printf("recv (ns):\t%"PRIu64"\n", (end - start) / args.repeats);
-
     return 0;
 }
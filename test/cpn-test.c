@@ -34,13 +34,19 @@ extern int cfg_test_run_suite(void);
 extern int channel_test_run_suite(void);
 extern int cmdparse_test_run_suite(void);
 extern int common_test_run_suite(void);
+extern int compression_test_run_suite(void);
 extern int global_test_run_suite(void);
 extern int list_test_run_suite(void);
+extern int mux_test_run_suite(void);
+extern int pool_test_run_suite(void);
 extern int proto_test_run_suite(void);
 extern int protobuf_test_run_suite(void);
+extern int reactor_test_run_suite(void);
+extern int relay_test_run_suite(void);
 extern int socket_test_run_suite(void);
 extern int service_test_run_suite(void);
 extern int session_test_run_suite(void);
+extern int ticket_test_run_suite(void);
 
 extern int capabilities_service_test_run_suite(void);
 extern int exec_service_test_run_suite(void);
@@ -63,13 +69,19 @@ static int (*suite_fns[])(void) = {
     channel_test_run_suite,
     cmdparse_test_run_suite,
     common_test_run_suite,
+    compression_test_run_suite,
     global_test_run_suite,
     list_test_run_suite,
+    mux_test_run_suite,
+    pool_test_run_suite,
     socket_test_run_suite,
     service_test_run_suite,
     session_test_run_suite,
     proto_test_run_suite,
     protobuf_test_run_suite,
+    reactor_test_run_suite,
+    relay_test_run_suite,
+    ticket_test_run_suite,
 
     capabilities_service_test_run_suite,
     exec_service_test_run_suite,
@@ -87,6 +87,22 @@ static void appending_hex_succeeds()
     assert_int_equal(buf.length, 8);
 }
 
+static void reserving_allocates_without_changing_content()
+{
+    assert_success(cpn_buf_set(&buf, "test"));
+    assert_success(cpn_buf_reserve(&buf, 1024));
+    assert_true(buf.allocated >= 1024);
+    assert_int_equal(buf.length, strlen("test"));
+    assert_string_equal(buf.data, "test");
+}
+
+static void reserving_less_does_not_shrink()
+{
+    assert_success(cpn_buf_reserve(&buf, 1024));
+    assert_success(cpn_buf_reserve(&buf, 16));
+    assert_true(buf.allocated >= 1024);
+}
+
 static void printf_succeeds_on_empty_buf()
 {
     assert_success(cpn_buf_printf(&buf, "%s", "test"));
@@ -112,6 +128,9 @@ int buf_test_run_suite(void)
         test(appending_empty_does_nothing),
         test(appending_hex_succeeds),
 
+        test(reserving_allocates_without_changing_content),
+        test(reserving_less_does_not_shrink),
+
         test(printf_succeeds_on_empty_buf),
         test(printf_succeeds_on_nonempty_buf)
     };
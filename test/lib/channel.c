@@ -15,12 +15,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 
 #include <sodium/crypto_box.h>
 #include <sodium/randombytes.h>
 #include <sodium/utils.h>
 
+#include "capone/buf.h"
 #include "capone/common.h"
 #include "capone/channel.h"
 
@@ -33,6 +37,13 @@ struct relay_args {
     int *fds;
 };
 
+struct write_args {
+    struct cpn_channel *c;
+    uint8_t *data;
+    uint32_t len;
+    int result;
+};
+
 static struct cpn_symmetric_key key;
 static struct cpn_channel channel, remote;
 
@@ -128,7 +139,7 @@ static void write_data_udp()
 
 static void write_data_with_different_block_lengths()
 {
-    size_t lengths[] = { 64, 128, 512, 1024, 2048 };
+    size_t lengths[] = { 64, 128, 512, 1024, 2048, 16384 };
     uint8_t sender[] = "test";
     uint8_t receiver[sizeof(sender)];
     uint8_t i;
@@ -146,6 +157,15 @@ static void write_data_with_different_block_lengths()
     }
 }
 
+static void set_blocklen_exceeding_maximum_fails()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_success(cpn_channel_set_blocklen(&channel, 16384));
+    assert_failure(cpn_channel_set_blocklen(&channel, 16385));
+    assert_int_equal(channel.blocklen, 16384);
+}
+
 static void write_some_data()
 {
     uint8_t m[4096];
@@ -236,110 +256,180 @@ static void write_with_response()
     assert_string_equal(buf, m2);
 }
 
-static void write_protobuf()
+static void write_framed_data()
 {
-    TestMessage msg, *recv = NULL;
-    char value[] = "test";
+    uint8_t sender[] = "test";
+    uint8_t receiver[sizeof(sender)];
 
     stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
 
-    test_message__init(&msg);
-    msg.value = value;
-
-    assert_success(cpn_channel_write_protobuf(&channel, (ProtobufCMessage *)&msg));
-    assert_success(cpn_channel_receive_protobuf(&remote, &test_message__descriptor,
-            (ProtobufCMessage **) &recv));
+    assert_success(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remote, CPN_CHANNEL_FRAMING_FRAMES));
 
-    assert_string_equal(msg.value, recv->value);
+    assert_success(cpn_channel_write_data(&channel, sender, sizeof(sender)));
+    assert_int_equal(cpn_channel_receive_data(&remote, receiver, sizeof(receiver)),
+            sizeof(sender));
 
-    test_message__free_unpacked(recv, NULL);
+    assert_string_equal(sender, receiver);
 }
 
-static void write_encrypted_data()
+static void write_encrypted_data_with_different_frame_lengths()
 {
-    unsigned char msg[] = "test", buf[sizeof(msg)];
+    size_t lengths[] = { 21, 64, 512, 16384, 32768 };
+    unsigned char msg[40000], buf[sizeof(msg)];
+    uint8_t i;
+
+    randombytes_buf(msg, sizeof(msg));
 
     stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
 
     cpn_channel_enable_encryption(&channel, &key, 0);
     cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remote, CPN_CHANNEL_FRAMING_FRAMES));
 
-    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
-    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+        assert_success(cpn_channel_set_framelen(&channel, lengths[i]));
+        assert_success(cpn_channel_set_framelen(&remote, lengths[i]));
 
-    assert_string_equal(msg, buf);
+        assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+        assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+        assert_memory_equal(msg, buf, sizeof(msg));
+    }
 }
 
-static void write_some_encrypted_data()
+static void write_encrypted_data_with_different_ciphers()
 {
-    unsigned char msg[2048], buf[sizeof(msg)];
+    enum cpn_symmetric_cipher ciphers[] = {
+        CPN_SYMMETRIC_CIPHER_SECRETBOX,
+        CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305,
+        CPN_SYMMETRIC_CIPHER_AES256GCM
+    };
+    unsigned char msg[4000], buf[sizeof(msg)];
+    uint8_t i;
 
-    memset(msg, 1, sizeof(msg));
+    randombytes_buf(msg, sizeof(msg));
 
     stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
 
     cpn_channel_enable_encryption(&channel, &key, 0);
     cpn_channel_enable_encryption(&remote, &key, 1);
 
-    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
-    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    for (i = 0; i < ARRAY_SIZE(ciphers); i++) {
+        if (!cpn_symmetric_cipher_is_available(ciphers[i])) {
+            assert_failure(cpn_channel_set_cipher(&channel, ciphers[i]));
+            continue;
+        }
 
-    assert_memory_equal(msg, buf, sizeof(msg));
+        assert_success(cpn_channel_set_cipher(&channel, ciphers[i]));
+        assert_success(cpn_channel_set_cipher(&remote, ciphers[i]));
+
+        assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+        assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+        assert_memory_equal(msg, buf, sizeof(msg));
+    }
 }
 
-static void write_multiple_encrypted_messages()
+static void write_encrypted_data_with_mismatching_ciphers_fails()
 {
-    unsigned char m1[] = "test", m2[] = "somewhatlongermessage",
-                  buf[sizeof(m2)];
+    unsigned char msg[] = "test", buf[sizeof(msg)];
 
     stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
 
     cpn_channel_enable_encryption(&channel, &key, 0);
     cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_set_cipher(&channel, CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305));
 
-    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
-    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
-    assert_string_equal(m1, buf);
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_failure(cpn_channel_receive_data(&remote, buf, sizeof(buf)));
+}
 
-    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
-    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
-    assert_string_equal(m2, buf);
+static void write_frames_exceeding_framelen_fails()
+{
+    unsigned char msg[1024], buf[sizeof(msg)];
+
+    memset(msg, 1, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_success(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remote, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framelen(&remote, 512));
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_failure(cpn_channel_receive_data(&remote, buf, sizeof(buf)));
 }
 
-static void write_encrypted_messages_increments_nonce()
+static void set_framelen_exceeding_maximum_fails()
 {
-    unsigned char m1[] = "test", m2[] = "somewhatlongermessage",
-                  buf[sizeof(m2)];
-    struct cpn_symmetric_key_nonce nonce;
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_int_equal(channel.framelen, 32768);
+    assert_success(cpn_channel_set_framelen(&channel, 1024));
+    assert_failure(cpn_channel_set_framelen(&channel, 32769));
+    assert_int_equal(channel.framelen, 1024);
+}
+
+static void set_frames_on_udp_fails()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_UDP);
 
+    assert_failure(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_int_equal(channel.framing, CPN_CHANNEL_FRAMING_BLOCKS);
+}
+
+static void set_datagrams_on_tcp_fails()
+{
     stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
 
-    cpn_channel_enable_encryption(&channel, &key, 0);
-    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_failure(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_DATAGRAMS));
+    assert_int_equal(channel.framing, CPN_CHANNEL_FRAMING_BLOCKS);
+}
+
+static void stub_datagrams(bool encrypted)
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_UDP);
+    assert_success(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_DATAGRAMS));
+    assert_success(cpn_channel_set_framing(&remote, CPN_CHANNEL_FRAMING_DATAGRAMS));
+
+    if (encrypted) {
+        cpn_channel_enable_encryption(&channel, &key, 0);
+        cpn_channel_enable_encryption(&remote, &key, 1);
+    }
+}
+
+/* Receive a datagram without passing it to the channel */
+static ssize_t intercept_datagram(uint8_t *out, size_t len)
+{
+    return recv(remote.fd, out, len, 0);
+}
+
+static void resend_datagram(const uint8_t *data, size_t len)
+{
+    assert_int_equal(sendto(channel.fd, data, len, 0,
+                (struct sockaddr *) &channel.addr, channel.addrlen), len);
+}
+
+static void write_datagrams()
+{
+    unsigned char m1[] = "test", m2[] = "somewhatlongermessage", buf[sizeof(m2)];
+
+    stub_datagrams(false);
 
-    memcpy(&nonce, &channel.local_nonce, sizeof(nonce));
     assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
-    assert_memory_not_equal(&nonce, &channel.local_nonce, sizeof(nonce));
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
 
-    memcpy(&nonce, &channel.local_nonce, sizeof(nonce));
     assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
-    assert_memory_not_equal(&nonce, &channel.remote_nonce, sizeof(nonce));
     assert_string_equal(m1, buf);
-
-    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
     assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
     assert_string_equal(m2, buf);
 }
 
-static void write_encrypted_message_with_response()
+static void write_encrypted_datagrams()
 {
-    unsigned char m1[] = "test", m2[] = "response",
-                  buf[sizeof(m2)];
-
-    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    unsigned char m1[] = "test", m2[] = "response", buf[sizeof(m2)];
 
-    cpn_channel_enable_encryption(&channel, &key, 0);
-    cpn_channel_enable_encryption(&remote, &key, 1);
+    stub_datagrams(true);
 
     assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
     assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
@@ -350,154 +440,1284 @@ static void write_encrypted_message_with_response()
     assert_string_equal(m2, buf);
 }
 
-static void write_encrypted_message_with_invalid_nonces_fails()
+static void write_encrypted_datagram_protobuf()
 {
-    unsigned char m[] = "test", buf[sizeof(m)];
+    TestMessage msg, *recv = NULL;
 
-    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    stub_datagrams(true);
 
-    cpn_channel_enable_encryption(&channel, &key, 0);
-    cpn_channel_enable_encryption(&remote, &key, 0);
+    test_message__init(&msg);
+    msg.value = "test";
 
-    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
-    assert_failure(cpn_channel_receive_data(&remote, buf, sizeof(buf)));
-}
+    assert_success(cpn_channel_write_protobuf(&channel, &msg.base));
+    assert_success(cpn_channel_receive_protobuf(&remote, &test_message__descriptor,
+                (ProtobufCMessage **) &recv));
+    assert_string_equal(msg.value, recv->value);
 
-static void connect_fails_without_other_side()
-{
-    assert_success(cpn_channel_init_from_host(&channel, "127.0.0.1", 8080, CPN_CHANNEL_TYPE_TCP));
-    assert_failure(cpn_channel_connect(&channel));
+    test_message__free_unpacked(recv, NULL);
 }
 
-static void *relay_fn(void *payload)
+static void lost_datagrams_do_not_block_later_ones()
 {
-    struct relay_args *args = (struct relay_args *) payload;
+    unsigned char m1[] = "lost", m2[] = "received", buf[64];
 
-    switch (args->nfds) {
-        case 1:
-            cpn_channel_relay(args->c, 1, args->fds[0]);
-            break;
-        case 2:
-            cpn_channel_relay(args->c, 2, args->fds[0], args->fds[1]);
-            break;
-    }
+    stub_datagrams(true);
 
-    return NULL;
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_true(intercept_datagram(buf, sizeof(buf)) > 0);
+
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
 }
 
-static void relaying_data_to_socket_succeeds()
+static void reordered_datagrams_are_received()
 {
-    uint8_t data[] = "bla", buf[sizeof(data)];
-    struct cpn_channel c1, c2, r1, r2;
-    struct cpn_thread thread;
-    struct relay_args args;
-    int fds[1];
+    unsigned char m1[] = "first", m2[] = "second", buf[64], datagram[64];
+    ssize_t len;
 
-    memset(&c1, 0, sizeof(c1));
-    memset(&c2, 0, sizeof(c2));
-    memset(&r1, 0, sizeof(r1));
-    memset(&r2, 0, sizeof(r2));
+    stub_datagrams(true);
 
-    stub_sockets(&c1, &r1, CPN_CHANNEL_TYPE_TCP);
-    stub_sockets(&c2, &r2, CPN_CHANNEL_TYPE_TCP);
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_true((len = intercept_datagram(datagram, sizeof(datagram))) > 0);
 
-    fds[0] = c2.fd;
-    args.c = &r1;
-    args.nfds = ARRAY_SIZE(fds);
-    args.fds = fds;
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
 
-    assert_success(cpn_spawn(&thread, relay_fn, &args));
+    resend_datagram(datagram, len);
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
+    assert_string_equal(m1, buf);
+}
 
-    assert_success(cpn_channel_write_data(&c1, data, sizeof(data)));
-    assert_int_equal(recv(r2.fd, buf, sizeof(buf), 0), sizeof(data));
-    assert_string_equal(data, buf);
+static void replayed_datagrams_are_dropped()
+{
+    unsigned char m1[] = "first", m2[] = "second", buf[64], datagram[64];
+    ssize_t len;
 
-    shutdown(c1.fd, SHUT_RDWR);
-    shutdown(c2.fd, SHUT_RDWR);
-    shutdown(r1.fd, SHUT_RDWR);
-    shutdown(r2.fd, SHUT_RDWR);
+    stub_datagrams(true);
 
-    assert_success(cpn_join(&thread, NULL));
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_true((len = intercept_datagram(datagram, sizeof(datagram))) > 0);
+
+    resend_datagram(datagram, len);
+    resend_datagram(datagram, len);
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
+
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
+    assert_string_equal(m1, buf);
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
 }
 
-static void relaying_data_to_channel_succeeds()
+static void tampered_datagrams_are_dropped()
 {
-    uint8_t data[] = "bla", buf[sizeof(data)];
-    struct cpn_channel c1, c2, r1, r2;
-    struct cpn_thread thread;
-    struct relay_args args;
-    int fds[1];
+    unsigned char m1[] = "first", m2[] = "second", buf[64], datagram[64];
+    ssize_t len;
 
-    memset(&c1, 0, sizeof(c1));
-    memset(&c2, 0, sizeof(c2));
-    memset(&r1, 0, sizeof(r1));
-    memset(&r2, 0, sizeof(r2));
+    stub_datagrams(true);
 
-    stub_sockets(&c1, &r1, CPN_CHANNEL_TYPE_TCP);
-    stub_sockets(&c2, &r2, CPN_CHANNEL_TYPE_TCP);
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_true((len = intercept_datagram(datagram, sizeof(datagram))) > 0);
 
-    fds[0] = r1.fd;
+    datagram[len - 1] ^= 1;
+    resend_datagram(datagram, len);
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
 
-    args.c = &c2;
-    args.nfds = ARRAY_SIZE(fds);
-    args.fds = fds;
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
+}
 
-    assert_success(cpn_spawn(&thread, relay_fn, &args));
+static void stale_datagrams_are_dropped()
+{
+    unsigned char m1[] = "stale", m2[] = "fresh", buf[64], datagram[64];
+    ssize_t len;
 
-    assert_int_equal(send(c1.fd, data, sizeof(data), 0), sizeof(data));
-    assert_int_equal(cpn_channel_receive_data(&r2, buf, sizeof(buf)), sizeof(data));
-    assert_string_equal(data, buf);
+    stub_datagrams(true);
 
-    shutdown(c1.fd, SHUT_RDWR);
-    shutdown(c2.fd, SHUT_RDWR);
-    shutdown(r1.fd, SHUT_RDWR);
-    shutdown(r2.fd, SHUT_RDWR);
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_true((len = intercept_datagram(datagram, sizeof(datagram))) > 0);
 
-    assert_success(cpn_join(&thread, NULL));
+    /* Skip past the replay window */
+    channel.txseq += 64;
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
+
+    assert_success(cpn_channel_set_nonblocking(&remote, true));
+    resend_datagram(datagram, len);
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)),
+            CPN_CHANNEL_WOULD_BLOCK);
 }
 
-static void relaying_multiple_sockets_succeeds()
+static void unencrypted_datagrams_do_not_change_address()
 {
-    uint8_t data[] = "bla", buf[sizeof(data)];
-    struct cpn_channel c1, c2, c3, r1, r2, r3;
-    struct cpn_thread thread;
-    struct relay_args args;
-    int fds[2];
-
-    stub_sockets(&c1, &r1, CPN_CHANNEL_TYPE_TCP);
-    stub_sockets(&c2, &r2, CPN_CHANNEL_TYPE_TCP);
-    stub_sockets(&c3, &r3, CPN_CHANNEL_TYPE_TCP);
-
-    fds[0] = r2.fd;
-    fds[1] = r3.fd;
+    unsigned char msg[] = "spoofed", buf[64], datagram[64];
+    struct sockaddr_storage addr;
+    struct cpn_channel spoofer;
+    socklen_t addrlen;
+    ssize_t len;
 
-    args.c = &c1;
-    args.nfds = ARRAY_SIZE(fds);
-    args.fds = fds;
+    memset(&spoofer, 0, sizeof(spoofer));
 
-    assert_success(cpn_spawn(&thread, relay_fn, &args));
+    stub_datagrams(false);
+    assert_success(cpn_channel_init_from_host(&spoofer, "127.0.0.1", 0, CPN_CHANNEL_TYPE_UDP));
+    memcpy(&addr, &remote.addr, remote.addrlen);
+    addrlen = remote.addrlen;
 
-    assert_int_equal(send(c2.fd, data, sizeof(data), 0), sizeof(data));
-    assert_int_equal(cpn_channel_receive_data(&r1, buf, sizeof(buf)), sizeof(data));
-    assert_string_equal(buf, data);
-    assert_int_equal(send(c3.fd, data, sizeof(data), 0), sizeof(data));
-    assert_int_equal(cpn_channel_receive_data(&r1, buf, sizeof(buf)), sizeof(data));
-    assert_string_equal(buf, data);
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_true((len = intercept_datagram(datagram, sizeof(datagram))) > 0);
+    assert_int_equal(sendto(spoofer.fd, datagram, len, 0,
+                (struct sockaddr *) &channel.addr, channel.addrlen), len);
 
-    shutdown(c1.fd, SHUT_RDWR);
-    shutdown(c2.fd, SHUT_RDWR);
-    shutdown(c3.fd, SHUT_RDWR);
-    shutdown(r1.fd, SHUT_RDWR);
-    shutdown(r2.fd, SHUT_RDWR);
-    shutdown(r3.fd, SHUT_RDWR);
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    assert_int_equal(remote.addrlen, addrlen);
+    assert_memory_equal(&remote.addr, &addr, addrlen);
 
-    assert_success(cpn_join(&thread, NULL));
+    cpn_channel_close(&spoofer);
 }
 
-static void relaying_partially_closed_sockets_succeeds()
+static void unencrypted_datagrams_do_not_advance_window()
 {
-    uint8_t data[] = "bla", buf[sizeof(data)];
-    struct cpn_channel c1, c2, c3, r1, r2, r3;
+    unsigned char m1[] = "first", m2[] = "second", buf[64];
+
+    stub_datagrams(false);
+
+    /* Unauthenticated sequence numbers must not cause any
+     * datagram to be dropped */
+    channel.txseq += 128;
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    channel.txseq -= 128;
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
+
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
+    assert_string_equal(m1, buf);
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
+}
+
+static void datagram_exceeding_framelen_fails()
+{
+    unsigned char msg[32768];
+
+    memset(msg, 0, sizeof(msg));
+
+    stub_datagrams(true);
+
+    assert_failure(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+}
+
+static void datagram_encryption_derives_key_from_stream()
+{
+    struct cpn_channel client_stream, server_stream;
+    unsigned char m1[] = "request", m2[] = "response", buf[64];
+
+    stub_sockets(&client_stream, &server_stream, CPN_CHANNEL_TYPE_TCP);
+    cpn_channel_enable_encryption(&client_stream, &key, CPN_CHANNEL_NONCE_CLIENT);
+    cpn_channel_enable_encryption(&server_stream, &key, CPN_CHANNEL_NONCE_SERVER);
+
+    stub_datagrams(false);
+    assert_success(cpn_channel_enable_datagram_encryption(&channel, &client_stream));
+    assert_success(cpn_channel_enable_datagram_encryption(&remote, &server_stream));
+    assert_memory_not_equal(&channel.key, &key, sizeof(key));
+
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
+    assert_string_equal(m1, buf);
+
+    assert_success(cpn_channel_write_data(&remote, m2, sizeof(m2)));
+    assert_int_equal(cpn_channel_receive_data(&channel, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
+
+    cpn_channel_close(&client_stream);
+    cpn_channel_close(&server_stream);
+}
+
+static void datagram_encryption_without_stream_encryption_fails()
+{
+    struct cpn_channel client_stream, server_stream;
+
+    stub_sockets(&client_stream, &server_stream, CPN_CHANNEL_TYPE_TCP);
+    stub_datagrams(false);
+
+    assert_failure(cpn_channel_enable_datagram_encryption(&channel, &client_stream));
+
+    cpn_channel_close(&client_stream);
+    cpn_channel_close(&server_stream);
+}
+
+static void write_protobuf()
+{
+    TestMessage msg, *recv = NULL;
+    char value[] = "test";
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    test_message__init(&msg);
+    msg.value = value;
+
+    assert_success(cpn_channel_write_protobuf(&channel, (ProtobufCMessage *)&msg));
+    assert_success(cpn_channel_receive_protobuf(&remote, &test_message__descriptor,
+            (ProtobufCMessage **) &recv));
+
+    assert_string_equal(msg.value, recv->value);
+
+    test_message__free_unpacked(recv, NULL);
+}
+
+static void write_large_protobuf()
+{
+    TestMessage msg, *recv = NULL;
+    char value[20000];
+
+    memset(value, 'a', sizeof(value));
+    value[sizeof(value) - 1] = '\0';
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    test_message__init(&msg);
+    msg.value = value;
+
+    assert_success(cpn_channel_write_protobuf(&channel, (ProtobufCMessage *)&msg));
+    assert_success(cpn_channel_receive_protobuf(&remote, &test_message__descriptor,
+            (ProtobufCMessage **) &recv));
+
+    assert_string_equal(msg.value, recv->value);
+
+    test_message__free_unpacked(recv, NULL);
+}
+
+static void write_compressed_data()
+{
+    uint8_t msg[20000], buf[sizeof(msg)];
+
+    if (!cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        skip();
+
+    memset(msg, 'a', sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_set_compression(&channel, CPN_COMPRESSION_LZ4));
+    assert_success(cpn_channel_set_compression(&remote, CPN_COMPRESSION_LZ4));
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    assert_memory_equal(buf, msg, sizeof(msg));
+
+    /* Incompressible data is passed through */
+    randombytes_buf(msg, sizeof(msg));
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    assert_memory_equal(buf, msg, sizeof(msg));
+}
+
+static void write_compressed_protobuf()
+{
+    TestMessage msg, *recv = NULL;
+    char value[20000];
+
+    if (!cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        skip();
+
+    memset(value, 'a', sizeof(value));
+    value[sizeof(value) - 1] = '\0';
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_success(cpn_channel_set_compression(&channel, CPN_COMPRESSION_LZ4));
+    assert_success(cpn_channel_set_compression(&remote, CPN_COMPRESSION_LZ4));
+    assert_success(cpn_channel_set_compression_level(&channel, CPN_COMPRESSION_LEVEL_MAX));
+
+    test_message__init(&msg);
+    msg.value = value;
+
+    assert_success(cpn_channel_write_protobuf(&channel, (ProtobufCMessage *)&msg));
+    assert_success(cpn_channel_receive_protobuf(&remote, &test_message__descriptor,
+            (ProtobufCMessage **) &recv));
+
+    assert_string_equal(msg.value, recv->value);
+
+    test_message__free_unpacked(recv, NULL);
+}
+
+static void receive_compressed_exceeding_maxmsglen_fails()
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+    uint8_t msg[20000];
+
+    if (!cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        skip();
+
+    memset(msg, 'a', sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_success(cpn_channel_set_compression(&channel, CPN_COMPRESSION_LZ4));
+    assert_success(cpn_channel_set_compression(&remote, CPN_COMPRESSION_LZ4));
+    assert_success(cpn_channel_set_maxmsglen(&remote, sizeof(msg) - 1));
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_failure(cpn_channel_receive_buf(&remote, &buf));
+
+    cpn_buf_clear(&buf);
+}
+
+static void set_invalid_compression_level_fails()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_failure(cpn_channel_set_compression_level(&channel, -1));
+    assert_failure(cpn_channel_set_compression_level(&channel, CPN_COMPRESSION_LEVEL_MAX + 1));
+    assert_int_equal(channel.compression_level, CPN_COMPRESSION_LEVEL_DEFAULT);
+}
+
+static void receive_into_buf()
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+    uint8_t msg[10000];
+
+    randombytes_buf(msg, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_buf(&remote, &buf), sizeof(msg));
+
+    assert_int_equal(buf.length, sizeof(msg));
+    assert_memory_equal(buf.data, msg, sizeof(msg));
+
+    cpn_buf_clear(&buf);
+}
+
+static void receive_frames_into_buf()
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+    uint8_t msg[100000];
+
+    randombytes_buf(msg, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remote, CPN_CHANNEL_FRAMING_FRAMES));
+
+    assert_success(cpn_buf_append(&buf, "prefix"));
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_buf(&remote, &buf), sizeof(msg));
+
+    assert_int_equal(buf.length, strlen("prefix") + sizeof(msg));
+    assert_memory_equal(buf.data, "prefix", strlen("prefix"));
+    assert_memory_equal(buf.data + strlen("prefix"), msg, sizeof(msg));
+
+    cpn_buf_clear(&buf);
+}
+
+static void receive_exceeding_maxmsglen_fails()
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+    uint8_t msg[1024];
+
+    memset(msg, 1, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_success(cpn_channel_set_maxmsglen(&remote, sizeof(msg) - 1));
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_failure(cpn_channel_receive_buf(&remote, &buf));
+
+    cpn_buf_clear(&buf);
+}
+
+static void send_block_announcing(uint32_t len)
+{
+    uint8_t block[512];
+    uint32_t networklen = htonl(len);
+
+    memset(block, 1, sizeof(block));
+    memcpy(block, &networklen, sizeof(networklen));
+
+    assert_int_equal(write(channel.fd, block, sizeof(block)), sizeof(block));
+}
+
+static void receive_buf_does_not_allocate_announced_length()
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    send_block_announcing(1024 * 1024);
+    assert_success(cpn_channel_close(&channel));
+
+    assert_true(cpn_channel_receive_buf(&remote, &buf) <= 0);
+    assert_true(buf.allocated < 1024 * 1024);
+
+    cpn_buf_clear(&buf);
+}
+
+static void nonblocking_receive_does_not_allocate_announced_length()
+{
+    struct cpn_buf buf = CPN_BUF_INIT;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    assert_success(cpn_channel_set_nonblocking(&remote, true));
+
+    send_block_announcing(1024 * 1024);
+
+    assert_int_equal(cpn_channel_receive_buf(&remote, &buf), CPN_CHANNEL_WOULD_BLOCK);
+    assert_true(remote.rxmsg.allocated < 1024 * 1024);
+
+    cpn_buf_clear(&buf);
+}
+
+struct stream_args {
+    uint8_t *data;
+    size_t len;
+    size_t chunks;
+};
+
+static int receive_chunk(const uint8_t *data, size_t len, uint32_t total, void *payload)
+{
+    struct stream_args *args = (struct stream_args *) payload;
+
+    assert_true(args->len + len <= total);
+
+    memcpy(args->data + args->len, data, len);
+    args->len += len;
+    args->chunks++;
+
+    return 0;
+}
+
+static void receive_stream_passes_all_chunks()
+{
+    struct stream_args args;
+    uint8_t msg[10000], buf[sizeof(msg)];
+
+    randombytes_buf(msg, sizeof(msg));
+
+    args.data = buf;
+    args.len = 0;
+    args.chunks = 0;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_stream(&remote, receive_chunk, &args), sizeof(msg));
+
+    assert_int_equal(args.len, sizeof(msg));
+    assert_true(args.chunks > 1);
+    assert_memory_equal(buf, msg, sizeof(msg));
+}
+
+static void write_encrypted_data()
+{
+    unsigned char msg[] = "test", buf[sizeof(msg)];
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+
+    assert_string_equal(msg, buf);
+}
+
+static void write_some_encrypted_data()
+{
+    unsigned char msg[2048], buf[sizeof(msg)];
+
+    memset(msg, 1, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+
+    assert_memory_equal(msg, buf, sizeof(msg));
+}
+
+static void write_encrypted_data_with_different_batch_lengths()
+{
+    size_t lengths[] = { 1, 3, 32, 256 };
+    unsigned char msg[8192], buf[sizeof(msg)];
+    uint8_t i;
+
+    randombytes_buf(msg, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+        assert_success(cpn_channel_set_batchlen(&channel, lengths[i]));
+
+        assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+        assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+        assert_memory_equal(msg, buf, sizeof(msg));
+    }
+}
+
+static void set_invalid_batch_length_fails()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_failure(cpn_channel_set_batchlen(&channel, 0));
+    assert_failure(cpn_channel_set_batchlen(&channel, 257));
+}
+
+static void write_multiple_encrypted_messages()
+{
+    unsigned char m1[] = "test", m2[] = "somewhatlongermessage",
+                  buf[sizeof(m2)];
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
+    assert_string_equal(m1, buf);
+
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
+}
+
+static void write_encrypted_messages_increments_nonce()
+{
+    unsigned char m1[] = "test", m2[] = "somewhatlongermessage",
+                  buf[sizeof(m2)];
+    struct cpn_symmetric_key_nonce nonce;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    memcpy(&nonce, &channel.local_nonce, sizeof(nonce));
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_memory_not_equal(&nonce, &channel.local_nonce, sizeof(nonce));
+
+    memcpy(&nonce, &channel.local_nonce, sizeof(nonce));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
+    assert_memory_not_equal(&nonce, &channel.remote_nonce, sizeof(nonce));
+    assert_string_equal(m1, buf);
+
+    assert_success(cpn_channel_write_data(&channel, m2, sizeof(m2)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
+}
+
+static void write_encrypted_message_with_response()
+{
+    unsigned char m1[] = "test", m2[] = "response",
+                  buf[sizeof(m2)];
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    assert_success(cpn_channel_write_data(&channel, m1, sizeof(m1)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m1));
+    assert_string_equal(m1, buf);
+
+    assert_success(cpn_channel_write_data(&remote, m2, sizeof(m2)));
+    assert_int_equal(cpn_channel_receive_data(&channel, buf, sizeof(buf)), sizeof(m2));
+    assert_string_equal(m2, buf);
+}
+
+static void write_encrypted_message_with_invalid_nonces_fails()
+{
+    unsigned char m[] = "test", buf[sizeof(m)];
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 0);
+
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_failure(cpn_channel_receive_data(&remote, buf, sizeof(buf)));
+}
+
+static void write_encrypted_data_across_key_update()
+{
+    unsigned char m[] = "test", buf[sizeof(m)];
+    struct cpn_symmetric_key updated;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    assert_success(cpn_symmetric_key_generate(&updated));
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_update_key(&remote, &updated));
+
+    /* Remote still accepts data sent with the previous key */
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m));
+    assert_memory_equal(m, buf, sizeof(m));
+
+    assert_success(cpn_channel_update_key(&channel, &updated));
+
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m));
+    assert_memory_equal(m, buf, sizeof(m));
+
+    assert_success(cpn_channel_write_data(&remote, m, sizeof(m)));
+    assert_int_equal(cpn_channel_receive_data(&channel, buf, sizeof(buf)), sizeof(m));
+    assert_memory_equal(m, buf, sizeof(m));
+}
+
+static void write_large_encrypted_data_across_key_update()
+{
+    unsigned char m[4096], buf[sizeof(m)];
+    struct cpn_symmetric_key updated;
+
+    randombytes_buf(m, sizeof(m));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    assert_success(cpn_symmetric_key_generate(&updated));
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_update_key(&remote, &updated));
+
+    /* Blocks following the first one are decrypted directly into
+     * the receiver's buffer while trying both keys */
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m));
+    assert_memory_equal(m, buf, sizeof(m));
+
+    assert_success(cpn_channel_update_key(&channel, &updated));
+
+    memset(buf, 0, sizeof(buf));
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m));
+    assert_memory_equal(m, buf, sizeof(m));
+}
+
+static void write_encrypted_data_with_unexpected_key_fails()
+{
+    unsigned char m[] = "test", buf[sizeof(m)];
+    struct cpn_symmetric_key updated;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    assert_success(cpn_symmetric_key_generate(&updated));
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_update_key(&channel, &updated));
+
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_failure(cpn_channel_receive_data(&remote, buf, sizeof(buf)));
+}
+
+static int count_pending(struct cpn_channel *c, void *payload)
+{
+    UNUSED(c);
+    (*(int *) payload)++;
+    return 0;
+}
+
+static void free_pending(void *payload)
+{
+    *(int *) payload = -1;
+}
+
+static void pending_callback_runs_once_before_receiving()
+{
+    unsigned char m[] = "test", buf[sizeof(m)];
+    int count = 0;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    cpn_channel_set_pending(&remote, count_pending, free_pending, &count);
+
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_int_equal(count, 0);
+
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m));
+    assert_int_equal(count, 1);
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m));
+    assert_int_equal(count, 1);
+
+    assert_success(cpn_channel_close(&remote));
+    assert_int_equal(count, 1);
+}
+
+static void closing_channel_frees_pending_payload()
+{
+    int count = 0;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    cpn_channel_set_pending(&remote, count_pending, free_pending, &count);
+
+    assert_success(cpn_channel_close(&remote));
+    assert_int_equal(count, -1);
+}
+
+static void nonblocking_receive_without_data_would_block()
+{
+    uint8_t buf[10];
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    assert_success(cpn_channel_set_nonblocking(&remote, true));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)),
+            CPN_CHANNEL_WOULD_BLOCK);
+}
+
+static void nonblocking_receive_continues_partial_message()
+{
+    struct cpn_channel sender;
+    struct sockaddr_storage addr;
+    unsigned char msg[2000], buf[sizeof(msg)], data[8192];
+    int fds[2];
+    ssize_t len;
+
+    randombytes_buf(msg, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_set_nonblocking(&remote, true));
+
+    /* Generate the message's ciphertext via a separate channel
+     * such that we can send it in two halves */
+    assert_success(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    memset(&addr, 0, sizeof(addr));
+    assert_success(cpn_channel_init_from_fd(&sender, fds[0],
+                (struct sockaddr *) &addr, sizeof(addr), CPN_CHANNEL_TYPE_TCP));
+    cpn_channel_enable_encryption(&sender, &key, 0);
+    assert_success(cpn_channel_write_data(&sender, msg, sizeof(msg)));
+
+    len = recv(fds[1], data, sizeof(data), 0);
+    assert_true(len > (ssize_t) sizeof(msg));
+
+    assert_int_equal(send(channel.fd, data, len / 2 + 3, 0), len / 2 + 3);
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)),
+            CPN_CHANNEL_WOULD_BLOCK);
+
+    assert_int_equal(send(channel.fd, data + len / 2 + 3, len - len / 2 - 3, 0),
+            len - len / 2 - 3);
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    assert_memory_equal(msg, buf, sizeof(msg));
+
+    close(fds[1]);
+    cpn_channel_close(&sender);
+}
+
+static void nonblocking_write_queues_pending_data()
+{
+    unsigned char msg[65536], buf[sizeof(msg)];
+    int i, written, received = 0, ret;
+
+    memset(msg, 1, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    assert_success(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remote, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_nonblocking(&channel, true));
+    assert_success(cpn_channel_set_nonblocking(&remote, true));
+
+    for (i = 0; i < 1000; i++) {
+        ret = cpn_channel_write_data(&channel, msg, sizeof(msg));
+        if (ret == CPN_CHANNEL_WOULD_BLOCK)
+            break;
+        assert_success(ret);
+    }
+    assert_int_equal(ret, CPN_CHANNEL_WOULD_BLOCK);
+    assert_failure(cpn_channel_set_nonblocking(&channel, false));
+    written = i + 1;
+
+    while (received < written) {
+        ret = cpn_channel_flush(&channel);
+        assert_true(ret == 0 || ret == CPN_CHANNEL_WOULD_BLOCK);
+
+        ret = cpn_channel_receive_data(&remote, buf, sizeof(buf));
+        if (ret == CPN_CHANNEL_WOULD_BLOCK)
+            continue;
+        assert_int_equal(ret, sizeof(msg));
+        assert_memory_equal(msg, buf, sizeof(msg));
+        received++;
+    }
+
+    assert_success(cpn_channel_flush(&channel));
+    assert_success(cpn_channel_set_nonblocking(&channel, false));
+}
+
+static void nonblocking_on_udp_fails()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_UDP);
+
+    assert_failure(cpn_channel_set_nonblocking(&channel, true));
+}
+
+static void io_uring_on_udp_fails()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_UDP);
+    assert_failure(cpn_channel_set_io(&channel, CPN_CHANNEL_IO_URING));
+}
+
+static void write_encrypted_data_with_io_uring()
+{
+    unsigned char msg[60000], buf[sizeof(msg)];
+    size_t i;
+
+    if (!cpn_channel_io_is_available(CPN_CHANNEL_IO_URING))
+        skip();
+
+    randombytes_buf(msg, sizeof(msg));
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_set_io(&channel, CPN_CHANNEL_IO_URING));
+    assert_success(cpn_channel_set_io(&remote, CPN_CHANNEL_IO_URING));
+
+    for (i = 1; i <= 3; i++) {
+        assert_success(cpn_channel_write_data(&channel, msg, i * 100));
+        assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), i * 100);
+        assert_memory_equal(buf, msg, i * 100);
+    }
+
+    /* Large messages span multiple registered buffers */
+    assert_success(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remote, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    assert_memory_equal(buf, msg, sizeof(msg));
+}
+
+static void io_uring_keeps_data_when_switching_to_nonblocking()
+{
+    unsigned char msg[] = "test", buf[sizeof(msg)];
+
+    if (!cpn_channel_io_is_available(CPN_CHANNEL_IO_URING))
+        skip();
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    assert_success(cpn_channel_set_io(&remote, CPN_CHANNEL_IO_URING));
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+
+    assert_success(cpn_channel_set_nonblocking(&remote, true));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    assert_string_equal(msg, buf);
+    assert_false(cpn_channel_has_pending_input(&remote));
+}
+
+static void receive_keeps_read_ahead_data_between_messages()
+{
+    unsigned char msg[] = "test", buf[sizeof(msg)];
+    int i;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    for (i = 0; i < 3; i++)
+        assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+
+    /* Wait for all messages to arrive so that they get read at once */
+    assert_success(shutdown(channel.fd, SHUT_WR));
+
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    assert_true(cpn_channel_has_pending_input(&remote));
+
+    for (i = 0; i < 2; i++) {
+        memset(buf, 0, sizeof(buf));
+        assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+        assert_string_equal(msg, buf);
+    }
+
+    assert_false(cpn_channel_has_pending_input(&remote));
+}
+
+static void receive_keeps_read_ahead_data_when_switching_to_nonblocking()
+{
+    unsigned char msg[] = "test", buf[sizeof(msg)];
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_success(cpn_channel_write_data(&channel, msg, sizeof(msg)));
+    assert_success(shutdown(channel.fd, SHUT_WR));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+
+    assert_success(cpn_channel_set_nonblocking(&remote, true));
+    memset(buf, 0, sizeof(buf));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(msg));
+    assert_string_equal(msg, buf);
+    assert_false(cpn_channel_has_pending_input(&remote));
+}
+
+static void *write_fn(void *payload)
+{
+    struct write_args *args = (struct write_args *) payload;
+
+    args->result = cpn_channel_write_data(args->c, args->data, args->len);
+
+    return NULL;
+}
+
+static void assert_large_message_is_transferred(size_t len)
+{
+    struct cpn_thread thread;
+    struct write_args args;
+    uint8_t *msg, *buf;
+
+    msg = malloc(len);
+    buf = malloc(len);
+    randombytes_buf(msg, len);
+
+    args.c = &channel;
+    args.data = msg;
+    args.len = len;
+    args.result = -1;
+
+    /* Messages exceed the socket buffers, so they have to be
+     * written while receiving */
+    assert_success(cpn_spawn(&thread, write_fn, &args));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, len), len);
+    assert_success(cpn_join(&thread, NULL));
+    assert_success(args.result);
+    assert_memory_equal(msg, buf, len);
+
+    free(msg);
+    free(buf);
+}
+
+static void write_large_encrypted_data_in_parallel()
+{
+    unsigned char m[] = "test", buf[sizeof(m)];
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    assert_large_message_is_transferred(3 * 1024 * 1024 + 17);
+
+    /* Nonces have to continue after the last unit */
+    assert_success(cpn_channel_write_data(&channel, m, sizeof(m)));
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(m));
+    assert_string_equal(m, buf);
+}
+
+static void write_large_encrypted_frames_in_parallel()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+    assert_success(cpn_channel_set_framing(&channel, CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remote, CPN_CHANNEL_FRAMING_FRAMES));
+
+    assert_large_message_is_transferred(2 * 1024 * 1024 + 5);
+}
+
+static void parallel_encryption_matches_sequential_encryption()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_TCP);
+
+    cpn_channel_enable_encryption(&channel, &key, 0);
+    cpn_channel_enable_encryption(&remote, &key, 1);
+
+    assert_success(cpn_channel_set_parallel(&remote, false));
+    assert_large_message_is_transferred(1024 * 1024);
+
+    assert_success(cpn_channel_set_parallel(&remote, true));
+    assert_success(cpn_channel_set_parallel(&channel, false));
+    assert_large_message_is_transferred(1024 * 1024);
+}
+
+static void parallel_on_udp_fails()
+{
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_UDP);
+    assert_failure(cpn_channel_set_parallel(&channel, true));
+}
+
+static void channel_from_datagram_receives_datagram()
+{
+    uint8_t data[] = "test", datagram[512], buf[sizeof(data)];
+    struct cpn_channel probe;
+    ssize_t len;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_UDP);
+
+    assert_success(cpn_channel_write_data(&channel, data, sizeof(data)));
+    assert_true((len = recv(remote.fd, datagram, sizeof(datagram), 0)) > 0);
+
+    assert_success(cpn_channel_init_from_datagram(&probe, dup(remote.fd),
+                (struct sockaddr *) &remote.addr, remote.addrlen, datagram, len));
+    assert_int_equal(cpn_channel_receive_data(&probe, buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(data, buf);
+
+    cpn_channel_close(&probe);
+}
+
+static void channel_from_datagram_does_not_receive_further_datagrams()
+{
+    uint8_t data[] = "test", datagram[512], buf[sizeof(data)];
+    struct cpn_channel probe;
+    ssize_t len;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_UDP);
+
+    assert_success(cpn_channel_write_data(&channel, data, sizeof(data)));
+    assert_true((len = recv(remote.fd, datagram, sizeof(datagram), 0)) > 0);
+    assert_success(cpn_channel_write_data(&channel, data, sizeof(data)));
+
+    assert_success(cpn_channel_init_from_datagram(&probe, dup(remote.fd),
+                (struct sockaddr *) &remote.addr, remote.addrlen, datagram, len));
+    assert_int_equal(cpn_channel_receive_data(&probe, buf, sizeof(buf)), sizeof(data));
+    assert_failure(cpn_channel_receive_data(&probe, buf, sizeof(buf)));
+
+    /* The second datagram is still queued on the socket */
+    assert_int_equal(cpn_channel_receive_data(&remote, buf, sizeof(buf)), sizeof(data));
+
+    cpn_channel_close(&probe);
+}
+
+static void channel_from_truncated_datagram_fails()
+{
+    uint8_t data[] = "test", datagram[512], buf[sizeof(data)];
+    struct cpn_channel probe;
+    ssize_t len;
+
+    stub_sockets(&channel, &remote, CPN_CHANNEL_TYPE_UDP);
+
+    assert_success(cpn_channel_write_data(&channel, data, sizeof(data)));
+    assert_true((len = recv(remote.fd, datagram, sizeof(datagram), 0)) > 0);
+    assert_success(cpn_channel_write_data(&channel, data, sizeof(data)));
+
+    assert_success(cpn_channel_init_from_datagram(&probe, dup(remote.fd),
+                (struct sockaddr *) &remote.addr, remote.addrlen, datagram, len / 2));
+    assert_failure(cpn_channel_receive_data(&probe, buf, sizeof(buf)));
+
+    cpn_channel_close(&probe);
+}
+
+static void connect_fails_without_other_side()
+{
+    assert_success(cpn_channel_init_from_host(&channel, "127.0.0.1", 8080, CPN_CHANNEL_TYPE_TCP));
+    assert_failure(cpn_channel_connect(&channel));
+}
+
+static void *relay_fn(void *payload)
+{
+    struct relay_args *args = (struct relay_args *) payload;
+
+    switch (args->nfds) {
+        case 1:
+            cpn_channel_relay(args->c, 1, args->fds[0]);
+            break;
+        case 2:
+            cpn_channel_relay(args->c, 2, args->fds[0], args->fds[1]);
+            break;
+    }
+
+    return NULL;
+}
+
+static void relaying_data_to_socket_succeeds()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+    struct cpn_channel c1, c2, r1, r2;
+    struct cpn_thread thread;
+    struct relay_args args;
+    int fds[1];
+
+    memset(&c1, 0, sizeof(c1));
+    memset(&c2, 0, sizeof(c2));
+    memset(&r1, 0, sizeof(r1));
+    memset(&r2, 0, sizeof(r2));
+
+    stub_sockets(&c1, &r1, CPN_CHANNEL_TYPE_TCP);
+    stub_sockets(&c2, &r2, CPN_CHANNEL_TYPE_TCP);
+
+    fds[0] = c2.fd;
+    args.c = &r1;
+    args.nfds = ARRAY_SIZE(fds);
+    args.fds = fds;
+
+    assert_success(cpn_spawn(&thread, relay_fn, &args));
+
+    assert_success(cpn_channel_write_data(&c1, data, sizeof(data)));
+    assert_int_equal(recv(r2.fd, buf, sizeof(buf), 0), sizeof(data));
+    assert_string_equal(data, buf);
+
+    shutdown(c1.fd, SHUT_RDWR);
+    shutdown(c2.fd, SHUT_RDWR);
+    shutdown(r1.fd, SHUT_RDWR);
+    shutdown(r2.fd, SHUT_RDWR);
+
+    assert_success(cpn_join(&thread, NULL));
+
+    cpn_channel_close(&c1);
+    cpn_channel_close(&c2);
+    cpn_channel_close(&r1);
+    cpn_channel_close(&r2);
+}
+
+static void relaying_read_ahead_data_succeeds()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+    struct cpn_channel c1, c2, r1, r2;
+    struct cpn_thread thread;
+    struct relay_args args;
+    int fds[1];
+
+    memset(&c1, 0, sizeof(c1));
+    memset(&c2, 0, sizeof(c2));
+    memset(&r1, 0, sizeof(r1));
+    memset(&r2, 0, sizeof(r2));
+
+    stub_sockets(&c1, &r1, CPN_CHANNEL_TYPE_TCP);
+    stub_sockets(&c2, &r2, CPN_CHANNEL_TYPE_TCP);
+
+    /* The second message is read ahead with the first one and
+     * thus has to be relayed from the channel's buffer */
+    assert_success(cpn_channel_write_data(&c1, data, sizeof(data)));
+    assert_success(cpn_channel_write_data(&c1, data, sizeof(data)));
+    assert_success(shutdown(c1.fd, SHUT_WR));
+    assert_int_equal(cpn_channel_receive_data(&r1, buf, sizeof(buf)), sizeof(data));
+    assert_true(cpn_channel_has_pending_input(&r1));
+
+    fds[0] = c2.fd;
+    args.c = &r1;
+    args.nfds = ARRAY_SIZE(fds);
+    args.fds = fds;
+
+    assert_success(cpn_spawn(&thread, relay_fn, &args));
+
+    memset(buf, 0, sizeof(buf));
+    assert_int_equal(recv(r2.fd, buf, sizeof(buf), 0), sizeof(data));
+    assert_string_equal(data, buf);
+
+    shutdown(c2.fd, SHUT_RDWR);
+    shutdown(r1.fd, SHUT_RDWR);
+    shutdown(r2.fd, SHUT_RDWR);
+
+    assert_success(cpn_join(&thread, NULL));
+
+    cpn_channel_close(&c1);
+    cpn_channel_close(&c2);
+    cpn_channel_close(&r1);
+    cpn_channel_close(&r2);
+}
+
+static void relaying_data_to_channel_succeeds()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+    struct cpn_channel c1, c2, r1, r2;
+    struct cpn_thread thread;
+    struct relay_args args;
+    int fds[1];
+
+    memset(&c1, 0, sizeof(c1));
+    memset(&c2, 0, sizeof(c2));
+    memset(&r1, 0, sizeof(r1));
+    memset(&r2, 0, sizeof(r2));
+
+    stub_sockets(&c1, &r1, CPN_CHANNEL_TYPE_TCP);
+    stub_sockets(&c2, &r2, CPN_CHANNEL_TYPE_TCP);
+
+    fds[0] = r1.fd;
+
+    args.c = &c2;
+    args.nfds = ARRAY_SIZE(fds);
+    args.fds = fds;
+
+    assert_success(cpn_spawn(&thread, relay_fn, &args));
+
+    assert_int_equal(send(c1.fd, data, sizeof(data), 0), sizeof(data));
+    assert_int_equal(cpn_channel_receive_data(&r2, buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(data, buf);
+
+    shutdown(c1.fd, SHUT_RDWR);
+    shutdown(c2.fd, SHUT_RDWR);
+    shutdown(r1.fd, SHUT_RDWR);
+    shutdown(r2.fd, SHUT_RDWR);
+
+    assert_success(cpn_join(&thread, NULL));
+
+    cpn_channel_close(&c1);
+    cpn_channel_close(&c2);
+    cpn_channel_close(&r1);
+    cpn_channel_close(&r2);
+}
+
+static void relaying_multiple_sockets_succeeds()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+    struct cpn_channel c1, c2, c3, r1, r2, r3;
+    struct cpn_thread thread;
+    struct relay_args args;
+    int fds[2];
+
+    stub_sockets(&c1, &r1, CPN_CHANNEL_TYPE_TCP);
+    stub_sockets(&c2, &r2, CPN_CHANNEL_TYPE_TCP);
+    stub_sockets(&c3, &r3, CPN_CHANNEL_TYPE_TCP);
+
+    fds[0] = r2.fd;
+    fds[1] = r3.fd;
+
+    args.c = &c1;
+    args.nfds = ARRAY_SIZE(fds);
+    args.fds = fds;
+
+    assert_success(cpn_spawn(&thread, relay_fn, &args));
+
+    assert_int_equal(send(c2.fd, data, sizeof(data), 0), sizeof(data));
+    assert_int_equal(cpn_channel_receive_data(&r1, buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(buf, data);
+    assert_int_equal(send(c3.fd, data, sizeof(data), 0), sizeof(data));
+    assert_int_equal(cpn_channel_receive_data(&r1, buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(buf, data);
+
+    shutdown(c1.fd, SHUT_RDWR);
+    shutdown(c2.fd, SHUT_RDWR);
+    shutdown(c3.fd, SHUT_RDWR);
+    shutdown(r1.fd, SHUT_RDWR);
+    shutdown(r2.fd, SHUT_RDWR);
+    shutdown(r3.fd, SHUT_RDWR);
+
+    assert_success(cpn_join(&thread, NULL));
+
+    cpn_channel_close(&c1);
+    cpn_channel_close(&c2);
+    cpn_channel_close(&c3);
+    cpn_channel_close(&r1);
+    cpn_channel_close(&r2);
+    cpn_channel_close(&r3);
+}
+
+static void relaying_partially_closed_sockets_succeeds()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+    struct cpn_channel c1, c2, c3, r1, r2, r3;
     struct cpn_thread thread;
     struct relay_args args;
     int fds[2];
@@ -531,6 +1751,13 @@ static void relaying_partially_closed_sockets_succeeds()
     shutdown(r3.fd, SHUT_RDWR);
 
     assert_success(cpn_join(&thread, NULL));
+
+    cpn_channel_close(&c1);
+    cpn_channel_close(&c2);
+    cpn_channel_close(&c3);
+    cpn_channel_close(&r1);
+    cpn_channel_close(&r2);
+    cpn_channel_close(&r3);
 }
 
 
@@ -549,22 +1776,79 @@ int channel_test_run_suite(void)
         test(write_data),
         test(write_data_udp),
         test(write_data_with_different_block_lengths),
+        test(set_blocklen_exceeding_maximum_fails),
         test(write_some_data),
         test(write_some_data_udp),
         test(receive_fails_with_too_small_buffer),
         test(write_multiple_messages),
         test(write_repeated_before_read),
         test(write_with_response),
+        test(write_framed_data),
+        test(write_encrypted_data_with_different_frame_lengths),
+        test(write_frames_exceeding_framelen_fails),
+        test(set_framelen_exceeding_maximum_fails),
+        test(set_frames_on_udp_fails),
+        test(set_datagrams_on_tcp_fails),
+        test(write_datagrams),
+        test(write_encrypted_datagrams),
+        test(write_encrypted_datagram_protobuf),
+        test(lost_datagrams_do_not_block_later_ones),
+        test(reordered_datagrams_are_received),
+        test(replayed_datagrams_are_dropped),
+        test(tampered_datagrams_are_dropped),
+        test(stale_datagrams_are_dropped),
+        test(unencrypted_datagrams_do_not_change_address),
+        test(unencrypted_datagrams_do_not_advance_window),
+        test(datagram_exceeding_framelen_fails),
+        test(datagram_encryption_derives_key_from_stream),
+        test(datagram_encryption_without_stream_encryption_fails),
         test(write_protobuf),
+        test(write_large_protobuf),
+        test(write_compressed_data),
+        test(write_compressed_protobuf),
+        test(receive_compressed_exceeding_maxmsglen_fails),
+        test(set_invalid_compression_level_fails),
+        test(receive_into_buf),
+        test(receive_frames_into_buf),
+        test(receive_exceeding_maxmsglen_fails),
+        test(receive_buf_does_not_allocate_announced_length),
+        test(nonblocking_receive_does_not_allocate_announced_length),
+        test(receive_stream_passes_all_chunks),
         test(write_encrypted_data),
         test(write_some_encrypted_data),
+        test(write_encrypted_data_with_different_batch_lengths),
+        test(write_encrypted_data_with_different_ciphers),
+        test(write_encrypted_data_with_mismatching_ciphers_fails),
+        test(set_invalid_batch_length_fails),
         test(write_multiple_encrypted_messages),
         test(write_encrypted_messages_increments_nonce),
         test(write_encrypted_message_with_response),
         test(write_encrypted_message_with_invalid_nonces_fails),
+        test(write_encrypted_data_across_key_update),
+        test(write_large_encrypted_data_across_key_update),
+        test(write_encrypted_data_with_unexpected_key_fails),
+        test(pending_callback_runs_once_before_receiving),
+        test(closing_channel_frees_pending_payload),
+        test(nonblocking_receive_without_data_would_block),
+        test(nonblocking_receive_continues_partial_message),
+        test(nonblocking_write_queues_pending_data),
+        test(nonblocking_on_udp_fails),
+        test(io_uring_on_udp_fails),
+        test(write_encrypted_data_with_io_uring),
+        test(io_uring_keeps_data_when_switching_to_nonblocking),
+        test(receive_keeps_read_ahead_data_between_messages),
+        test(receive_keeps_read_ahead_data_when_switching_to_nonblocking),
+        test(write_large_encrypted_data_in_parallel),
+        test(write_large_encrypted_frames_in_parallel),
+        test(parallel_encryption_matches_sequential_encryption),
+        test(parallel_on_udp_fails),
+        test(channel_from_datagram_receives_datagram),
+        test(channel_from_datagram_does_not_receive_further_datagrams),
+        test(channel_from_truncated_datagram_fails),
         test(connect_fails_without_other_side),
 
         test(relaying_data_to_socket_succeeds),
+        test(relaying_read_ahead_data_succeeds),
         test(relaying_data_to_channel_succeeds),
         test(relaying_multiple_sockets_succeeds),
         test(relaying_partially_closed_sockets_succeeds)
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <sodium/randombytes.h>
+
+#include "capone/common.h"
+#include "capone/compression.h"
+
+#include "test.h"
+
+#define DATALEN 4096
+
+static struct cpn_buf compressed, decompressed;
+static uint8_t data[DATALEN];
+
+static int setup()
+{
+    size_t i;
+
+    /* Repeating text compresses well */
+    for (i = 0; i < sizeof(data); i++)
+        data[i] = "capone"[i % 6];
+
+    return 0;
+}
+
+static int teardown()
+{
+    cpn_buf_clear(&compressed);
+    cpn_buf_clear(&decompressed);
+    return 0;
+}
+
+static void assert_roundtrip(enum cpn_compression compression, int level,
+        const uint8_t *in, size_t len)
+{
+    assert_success(cpn_compress(&compressed, compression, level, in, len));
+    assert_success(cpn_decompress(&decompressed, (uint8_t *) compressed.data,
+                compressed.length, len));
+    assert_int_equal(decompressed.length, len);
+    assert_memory_equal(decompressed.data, in, len);
+}
+
+static void compress_without_compression_stores_data()
+{
+    assert_roundtrip(CPN_COMPRESSION_NONE, CPN_COMPRESSION_LEVEL_DEFAULT, data, sizeof(data));
+    assert_int_equal(compressed.length, sizeof(data) + 1);
+}
+
+static void compress_with_lz4_shrinks_data()
+{
+    int levels[] = { 1, 4, CPN_COMPRESSION_LEVEL_MAX };
+    size_t i;
+
+    if (!cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        skip();
+
+    for (i = 0; i < ARRAY_SIZE(levels); i++) {
+        cpn_buf_reset(&compressed);
+        cpn_buf_reset(&decompressed);
+
+        assert_roundtrip(CPN_COMPRESSION_LZ4, levels[i], data, sizeof(data));
+        assert_true(compressed.length < sizeof(data) / 4);
+    }
+}
+
+static void compress_incompressible_data_stores_data()
+{
+    randombytes_buf(data, sizeof(data));
+
+    if (!cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        skip();
+
+    assert_roundtrip(CPN_COMPRESSION_LZ4, CPN_COMPRESSION_LEVEL_DEFAULT, data, sizeof(data));
+    assert_int_equal(compressed.length, sizeof(data) + 1);
+}
+
+static void compress_small_data_stores_data()
+{
+    if (!cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        skip();
+
+    assert_roundtrip(CPN_COMPRESSION_LZ4, CPN_COMPRESSION_LEVEL_DEFAULT, data, 16);
+    assert_int_equal(compressed.length, 17);
+}
+
+static void compress_empty_data_succeeds()
+{
+    assert_roundtrip(CPN_COMPRESSION_NONE, CPN_COMPRESSION_LEVEL_DEFAULT, data, 0);
+}
+
+static void decompress_exceeding_maxlen_fails()
+{
+    assert_success(cpn_compress(&compressed, CPN_COMPRESSION_NONE,
+                CPN_COMPRESSION_LEVEL_DEFAULT, data, sizeof(data)));
+    assert_failure(cpn_decompress(&decompressed, (uint8_t *) compressed.data,
+                compressed.length, sizeof(data) - 1));
+}
+
+static void decompress_exceeding_maxlen_with_lz4_fails()
+{
+    if (!cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        skip();
+
+    assert_success(cpn_compress(&compressed, CPN_COMPRESSION_LZ4,
+                CPN_COMPRESSION_LEVEL_DEFAULT, data, sizeof(data)));
+    assert_failure(cpn_decompress(&decompressed, (uint8_t *) compressed.data,
+                compressed.length, sizeof(data) - 1));
+    assert_int_equal(decompressed.allocated, 0);
+}
+
+static void decompress_truncated_data_fails()
+{
+    if (!cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        skip();
+
+    assert_success(cpn_compress(&compressed, CPN_COMPRESSION_LZ4,
+                CPN_COMPRESSION_LEVEL_DEFAULT, data, sizeof(data)));
+    assert_failure(cpn_decompress(&decompressed, (uint8_t *) compressed.data,
+                compressed.length - 1, sizeof(data)));
+}
+
+static void decompress_empty_data_fails()
+{
+    assert_failure(cpn_decompress(&decompressed, data, 0, sizeof(data)));
+}
+
+static void decompress_unknown_algorithm_fails()
+{
+    uint8_t unknown[] = { 0xff, 'a', 'b', 'c' };
+
+    assert_failure(cpn_decompress(&decompressed, unknown, sizeof(unknown), sizeof(data)));
+}
+
+int compression_test_run_suite(void)
+{
+    const struct CMUnitTest tests[] = {
+        test(compress_without_compression_stores_data),
+        test(compress_with_lz4_shrinks_data),
+        test(compress_incompressible_data_stores_data),
+        test(compress_small_data_stores_data),
+        test(compress_empty_data_succeeds),
+        test(decompress_exceeding_maxlen_fails),
+        test(decompress_exceeding_maxlen_with_lz4_fails),
+        test(decompress_truncated_data_fails),
+        test(decompress_empty_data_fails),
+        test(decompress_unknown_algorithm_fails)
+    };
+
+    return execute_test_suite("compression", tests, setup, teardown);
+}
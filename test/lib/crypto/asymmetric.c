@@ -18,6 +18,7 @@
 #include <string.h>
 
 #include "capone/crypto/asymmetric.h"
+#include "capone/crypto/symmetric.h"
 
 #include "test.h"
 
@@ -64,6 +65,27 @@ static void encrypt_key_public_from_too_long_bin_fails()
     assert_failure(cpn_asymmetric_pk_from_bin(&pk, enc_pair.pk.data, sizeof(enc_pair.pk) + 1));
 }
 
+static void converted_sign_keys_agree_on_shared_key()
+{
+    struct cpn_sign_keys a, b;
+    struct cpn_asymmetric_keys a_enc, b_enc;
+    struct cpn_asymmetric_pk a_pk, b_pk;
+    struct cpn_symmetric_key a_shared, b_shared;
+
+    assert_success(cpn_sign_keys_generate(&a));
+    assert_success(cpn_sign_keys_generate(&b));
+
+    assert_success(cpn_asymmetric_keys_from_sign_keys(&a_enc, &a));
+    assert_success(cpn_asymmetric_keys_from_sign_keys(&b_enc, &b));
+    assert_success(cpn_asymmetric_pk_from_sign_pk(&a_pk, &a.pk));
+    assert_success(cpn_asymmetric_pk_from_sign_pk(&b_pk, &b.pk));
+    assert_memory_equal(&a_pk, &a_enc.pk, sizeof(a_pk));
+
+    assert_success(cpn_symmetric_key_from_scalarmult(&a_shared, &a_enc, &b_pk, true));
+    assert_success(cpn_symmetric_key_from_scalarmult(&b_shared, &b_enc, &a_pk, false));
+    assert_memory_equal(&a_shared, &b_shared, sizeof(a_shared));
+}
+
 
 int crypto_asymmetric_test_run_suite(void)
 {
@@ -73,6 +95,8 @@ int crypto_asymmetric_test_run_suite(void)
         test(encrypt_key_public_from_bin_succeeds),
         test(encrypt_key_public_from_too_short_bin_fails),
         test(encrypt_key_public_from_too_long_bin_fails),
+
+        test(converted_sign_keys_agree_on_shared_key),
     };
 
     return execute_test_suite("encrypt", tests, setup, teardown);
@@ -115,6 +115,60 @@ static void symmetric_key_hex_from_key_succeeds()
     assert_string_equal(key_hex.data, SYMMETRIC_KEY);
 }
 
+static void encrypt_and_decrypt_with_ciphers_succeeds()
+{
+    enum cpn_symmetric_cipher ciphers[] = {
+        CPN_SYMMETRIC_CIPHER_SECRETBOX,
+        CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305,
+        CPN_SYMMETRIC_CIPHER_AES256GCM
+    };
+    struct cpn_symmetric_key_nonce nonce;
+    uint8_t data[64 + CPN_CRYPTO_SYMMETRIC_MACBYTES];
+    size_t i;
+
+    assert_success(cpn_symmetric_key_generate(&key));
+    memset(&nonce, 0, sizeof(nonce));
+
+    for (i = 0; i < ARRAY_SIZE(ciphers); i++) {
+        if (!cpn_symmetric_cipher_is_available(ciphers[i]))
+            continue;
+
+        memset(data, 'a', sizeof(data));
+        assert_success(cpn_symmetric_key_encrypt(data, &key, ciphers[i],
+                    &nonce, data, sizeof(data) - CPN_CRYPTO_SYMMETRIC_MACBYTES));
+        assert_success(cpn_symmetric_key_decrypt(data, &key, ciphers[i],
+                    &nonce, data, sizeof(data)));
+        assert_memory_equal(data, "aaaa", 4);
+    }
+}
+
+static void decrypt_tampered_data_fails()
+{
+    enum cpn_symmetric_cipher ciphers[] = {
+        CPN_SYMMETRIC_CIPHER_SECRETBOX,
+        CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305,
+        CPN_SYMMETRIC_CIPHER_AES256GCM
+    };
+    struct cpn_symmetric_key_nonce nonce;
+    uint8_t data[64 + CPN_CRYPTO_SYMMETRIC_MACBYTES];
+    size_t i;
+
+    assert_success(cpn_symmetric_key_generate(&key));
+    memset(&nonce, 0, sizeof(nonce));
+
+    for (i = 0; i < ARRAY_SIZE(ciphers); i++) {
+        if (!cpn_symmetric_cipher_is_available(ciphers[i]))
+            continue;
+
+        memset(data, 'a', sizeof(data));
+        assert_success(cpn_symmetric_key_encrypt(data, &key, ciphers[i],
+                    &nonce, data, sizeof(data) - CPN_CRYPTO_SYMMETRIC_MACBYTES));
+        data[10] ^= 1;
+        assert_failure(cpn_symmetric_key_decrypt(data, &key, ciphers[i],
+                    &nonce, data, sizeof(data)));
+    }
+}
+
 int crypto_symmetric_test_run_suite(void)
 {
     const struct CMUnitTest tests[] = {
@@ -129,7 +183,10 @@ int crypto_symmetric_test_run_suite(void)
         test(symmetric_key_hex_from_bin_succeeds),
         test(symmetric_key_hex_from_too_short_bin_fails),
         test(symmetric_key_hex_from_too_long_bin_fails),
-        test(symmetric_key_hex_from_key_succeeds)
+        test(symmetric_key_hex_from_key_succeeds),
+
+        test(encrypt_and_decrypt_with_ciphers_succeeds),
+        test(decrypt_tampered_data_fails)
     };
 
     return execute_test_suite("keys", tests, setup, teardown);
@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <sodium/randombytes.h>
+
+#include "capone/common.h"
+#include "capone/channel.h"
+#include "capone/mux.h"
+
+#include "test.h"
+
+#define NSTREAMS 8
+#define MAX_STREAMS 64
+#define LARGE_DATALEN (4 * 1024 * 1024)
+
+struct large_data {
+    int fd;
+    const uint8_t *data;
+};
+
+static struct cpn_channel client, server;
+static struct cpn_mux client_mux, server_mux;
+static bool client_running, server_running;
+static struct cpn_channel streams[NSTREAMS], accepted[NSTREAMS];
+
+static int setup()
+{
+    size_t i;
+
+    stub_sockets(&client, &server, CPN_CHANNEL_TYPE_TCP);
+
+    assert_success(cpn_mux_init(&client_mux, &client, CPN_MUX_ROLE_CLIENT));
+    client_running = true;
+    assert_success(cpn_mux_init(&server_mux, &server, CPN_MUX_ROLE_SERVER));
+    server_running = true;
+
+    for (i = 0; i < NSTREAMS; i++)
+        streams[i].fd = accepted[i].fd = -1;
+
+    return 0;
+}
+
+static int teardown()
+{
+    size_t i;
+
+    for (i = 0; i < NSTREAMS; i++) {
+        if (streams[i].fd >= 0)
+            cpn_channel_close(&streams[i]);
+        if (accepted[i].fd >= 0)
+            cpn_channel_close(&accepted[i]);
+    }
+
+    if (client_running)
+        cpn_mux_free(&client_mux);
+    if (server_running)
+        cpn_mux_free(&server_mux);
+
+    if (client.fd >= 0)
+        cpn_channel_close(&client);
+    if (server.fd >= 0)
+        cpn_channel_close(&server);
+
+    return 0;
+}
+
+static void *write_large_data(void *payload)
+{
+    struct large_data *args = (struct large_data *) payload;
+
+    assert_int_equal(write(args->fd, args->data, LARGE_DATALEN), LARGE_DATALEN);
+
+    return NULL;
+}
+
+static void read_large_data(int fd, const uint8_t *data)
+{
+    static uint8_t buf[LARGE_DATALEN];
+    size_t received = 0;
+    ssize_t ret;
+
+    while (received < sizeof(buf)) {
+        ret = read(fd, buf + received, sizeof(buf) - received);
+        assert_true(ret > 0);
+        received += ret;
+    }
+
+    assert_memory_equal(buf, data, sizeof(buf));
+}
+
+static void assert_receive(struct cpn_channel *c, const char *msg)
+{
+    uint8_t buf[64];
+
+    assert_int_equal(cpn_channel_receive_data(c, buf, sizeof(buf)), strlen(msg) + 1);
+    assert_string_equal(buf, msg);
+}
+
+static void assert_send(struct cpn_channel *c, const char *msg)
+{
+    assert_success(cpn_channel_write_data(c, (uint8_t *) msg, strlen(msg) + 1));
+}
+
+static void opening_stream_succeeds()
+{
+    assert_success(cpn_mux_open(&client_mux, &streams[0]));
+    assert_send(&streams[0], "request");
+
+    assert_success(cpn_mux_accept(&server_mux, &accepted[0]));
+    assert_receive(&accepted[0], "request");
+    assert_send(&accepted[0], "response");
+    assert_receive(&streams[0], "response");
+}
+
+static void opening_stream_on_server_succeeds()
+{
+    assert_success(cpn_mux_open(&server_mux, &streams[0]));
+    assert_send(&streams[0], "request");
+
+    assert_success(cpn_mux_accept(&client_mux, &accepted[0]));
+    assert_receive(&accepted[0], "request");
+    assert_send(&accepted[0], "response");
+    assert_receive(&streams[0], "response");
+}
+
+static void opening_multiple_streams_succeeds()
+{
+    uint8_t buf[16];
+    uint32_t i, value;
+
+    for (i = 0; i < NSTREAMS; i++) {
+        assert_success(cpn_mux_open(&client_mux, &streams[i]));
+        assert_success(cpn_channel_write_data(&streams[i], (uint8_t *) &i, sizeof(i)));
+    }
+
+    /* Echo back whatever the stream carries, so that each
+     * client stream has to receive its own index */
+    for (i = 0; i < NSTREAMS; i++) {
+        assert_success(cpn_mux_accept(&server_mux, &accepted[i]));
+        assert_int_equal(cpn_channel_receive_data(&accepted[i], buf, sizeof(buf)), sizeof(value));
+        assert_success(cpn_channel_write_data(&accepted[i], buf, sizeof(value)));
+    }
+
+    for (i = 0; i < NSTREAMS; i++) {
+        assert_int_equal(cpn_channel_receive_data(&streams[i], buf, sizeof(buf)), sizeof(value));
+        memcpy(&value, buf, sizeof(value));
+        assert_int_equal(value, i);
+    }
+}
+
+static void transferring_data_exceeding_window_succeeds()
+{
+    static uint8_t data[LARGE_DATALEN];
+    struct large_data args;
+    struct cpn_thread t;
+
+    randombytes_buf(data, sizeof(data));
+
+    assert_success(cpn_mux_open(&client_mux, &streams[0]));
+    args.fd = streams[0].fd;
+    args.data = data;
+    assert_success(cpn_spawn(&t, write_large_data, &args));
+
+    assert_success(cpn_mux_accept(&server_mux, &accepted[0]));
+    read_large_data(accepted[0].fd, data);
+
+    assert_success(cpn_join(&t, NULL));
+}
+
+static void stalled_stream_does_not_block_other_streams()
+{
+    static uint8_t data[LARGE_DATALEN];
+    struct large_data args;
+    struct cpn_thread t;
+
+    randombytes_buf(data, sizeof(data));
+
+    assert_success(cpn_mux_open(&client_mux, &streams[0]));
+    args.fd = streams[0].fd;
+    args.data = data;
+    assert_success(cpn_spawn(&t, write_large_data, &args));
+    assert_success(cpn_mux_accept(&server_mux, &accepted[0]));
+
+    /* The first stream is not read until the second one has
+     * completed its exchange */
+    assert_success(cpn_mux_open(&client_mux, &streams[1]));
+    assert_send(&streams[1], "request");
+    assert_success(cpn_mux_accept(&server_mux, &accepted[1]));
+    assert_receive(&accepted[1], "request");
+    assert_send(&accepted[1], "response");
+    assert_receive(&streams[1], "response");
+
+    read_large_data(accepted[0].fd, data);
+    assert_success(cpn_join(&t, NULL));
+}
+
+static void closing_stream_signals_end_of_file()
+{
+    uint8_t buf[16];
+
+    assert_success(cpn_mux_open(&client_mux, &streams[0]));
+    assert_send(&streams[0], "request");
+    assert_success(cpn_channel_close(&streams[0]));
+    streams[0].fd = -1;
+
+    assert_success(cpn_mux_accept(&server_mux, &accepted[0]));
+    assert_receive(&accepted[0], "request");
+    assert_int_equal(read(accepted[0].fd, buf, sizeof(buf)), 0);
+}
+
+static void closing_channel_fails_accept()
+{
+    uint8_t buf[16];
+
+    assert_success(cpn_mux_open(&server_mux, &streams[0]));
+
+    cpn_mux_free(&client_mux);
+    client_running = false;
+    assert_success(cpn_channel_close(&client));
+
+    assert_failure(cpn_mux_accept(&server_mux, &accepted[0]));
+    assert_int_equal(read(streams[0].fd, buf, sizeof(buf)), 0);
+}
+
+static void accepting_stream_without_waiting_succeeds()
+{
+    struct pollfd pfd;
+
+    pfd.fd = cpn_mux_accept_fd(&server_mux);
+    pfd.events = POLLIN;
+
+    assert_int_equal(cpn_mux_try_accept(&server_mux, &accepted[0]), CPN_CHANNEL_WOULD_BLOCK);
+    assert_int_equal(poll(&pfd, 1, 0), 0);
+
+    assert_success(cpn_mux_open(&client_mux, &streams[0]));
+    assert_send(&streams[0], "request");
+
+    assert_int_equal(poll(&pfd, 1, -1), 1);
+    assert_success(cpn_mux_try_accept(&server_mux, &accepted[0]));
+    assert_receive(&accepted[0], "request");
+
+    assert_int_equal(cpn_mux_try_accept(&server_mux, &accepted[1]), CPN_CHANNEL_WOULD_BLOCK);
+    assert_int_equal(poll(&pfd, 1, 0), 0);
+}
+
+static void closing_channel_fails_try_accept()
+{
+    struct pollfd pfd;
+
+    pfd.fd = cpn_mux_accept_fd(&server_mux);
+    pfd.events = POLLIN;
+
+    cpn_mux_free(&client_mux);
+    client_running = false;
+    assert_success(cpn_channel_close(&client));
+
+    assert_int_equal(poll(&pfd, 1, -1), 1);
+    assert_failure(cpn_mux_try_accept(&server_mux, &accepted[0]));
+}
+
+static void opening_too_many_streams_closes_excess_stream()
+{
+    struct cpn_channel opened[MAX_STREAMS + 1], remote[MAX_STREAMS];
+    uint8_t buf[16];
+    uint32_t i, value;
+
+    for (i = 0; i < MAX_STREAMS + 1; i++) {
+        assert_success(cpn_mux_open(&client_mux, &opened[i]));
+        assert_success(cpn_channel_write_data(&opened[i], (uint8_t *) &i, sizeof(i)));
+    }
+
+    /* Streams are opened in order, so the last one is rejected */
+    assert_int_equal(read(opened[MAX_STREAMS].fd, buf, sizeof(buf)), 0);
+
+    for (i = 0; i < MAX_STREAMS; i++) {
+        assert_success(cpn_mux_accept(&server_mux, &remote[i]));
+        assert_int_equal(cpn_channel_receive_data(&remote[i], buf, sizeof(buf)), sizeof(value));
+        memcpy(&value, buf, sizeof(value));
+        assert_int_equal(value, i);
+    }
+
+    for (i = 0; i < MAX_STREAMS; i++) {
+        cpn_channel_close(&opened[i]);
+        cpn_channel_close(&remote[i]);
+    }
+    cpn_channel_close(&opened[MAX_STREAMS]);
+}
+
+static void multiplexing_udp_channel_fails()
+{
+    struct cpn_channel c, r;
+    struct cpn_mux mux;
+
+    stub_sockets(&c, &r, CPN_CHANNEL_TYPE_UDP);
+    assert_failure(cpn_mux_init(&mux, &c, CPN_MUX_ROLE_CLIENT));
+
+    cpn_channel_close(&c);
+    cpn_channel_close(&r);
+}
+
+int mux_test_run_suite(void)
+{
+    const struct CMUnitTest tests[] = {
+        test(opening_stream_succeeds),
+        test(opening_stream_on_server_succeeds),
+        test(opening_multiple_streams_succeeds),
+        test(transferring_data_exceeding_window_succeeds),
+        test(stalled_stream_does_not_block_other_streams),
+        test(closing_stream_signals_end_of_file),
+        test(closing_channel_fails_accept),
+        test(accepting_stream_without_waiting_succeeds),
+        test(closing_channel_fails_try_accept),
+        test(opening_too_many_streams_closes_excess_stream),
+        test(multiplexing_udp_channel_fails)
+    };
+
+    return execute_test_suite("mux", tests, setup, teardown);
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <unistd.h>
+
+#include "capone/common.h"
+#include "capone/pool.h"
+
+#include "test.h"
+
+static struct cpn_pool pool;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool released;
+static size_t running, max_running, finished;
+static uint32_t recorded[4];
+static size_t nrecorded;
+
+static int setup()
+{
+    released = false;
+    running = max_running = finished = nrecorded = 0;
+    return 0;
+}
+
+static int teardown()
+{
+    return 0;
+}
+
+static void *count(void *payload)
+{
+    UNUSED(payload);
+
+    pthread_mutex_lock(&mutex);
+    finished++;
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+static void *record(void *payload)
+{
+    pthread_mutex_lock(&mutex);
+    recorded[nrecorded++] = *(uint32_t *) payload;
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+static void *block(void *payload)
+{
+    UNUSED(payload);
+
+    pthread_mutex_lock(&mutex);
+    running++;
+    max_running = MAX(max_running, running);
+    while (!released)
+        pthread_cond_wait(&cond, &mutex);
+    running--;
+    finished++;
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+static void release(void)
+{
+    pthread_mutex_lock(&mutex);
+    released = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+static void wait_for_completed(size_t completed)
+{
+    struct cpn_pool_stats stats;
+
+    do {
+        usleep(1000);
+        cpn_pool_get_stats(&stats, &pool);
+    } while (stats.completed < completed);
+}
+
+static void wait_for_running(size_t n)
+{
+    size_t current;
+
+    do {
+        usleep(1000);
+        pthread_mutex_lock(&mutex);
+        current = running;
+        pthread_mutex_unlock(&mutex);
+    } while (current < n);
+}
+
+static void initializing_without_threads_fails()
+{
+    assert_failure(cpn_pool_init(&pool, 0, 1));
+}
+
+static void initializing_without_queue_fails()
+{
+    assert_failure(cpn_pool_init(&pool, 1, 0));
+}
+
+static void submitted_jobs_are_run()
+{
+    struct cpn_pool_stats stats;
+    size_t i;
+
+    assert_success(cpn_pool_init(&pool, 4, 16));
+    for (i = 0; i < 16; i++)
+        assert_success(cpn_pool_submit(&pool, NULL, count, NULL));
+    wait_for_completed(16);
+
+    cpn_pool_get_stats(&stats, &pool);
+    assert_int_equal(stats.queued, 0);
+    assert_int_equal(stats.active, 0);
+    assert_int_equal(stats.rejected, 0);
+
+    cpn_pool_free(&pool);
+
+    assert_int_equal(finished, 16);
+}
+
+static void freeing_runs_queued_jobs()
+{
+    size_t i;
+
+    assert_success(cpn_pool_init(&pool, 1, 8));
+    for (i = 0; i < 8; i++)
+        assert_success(cpn_pool_submit(&pool, NULL, count, NULL));
+    cpn_pool_free(&pool);
+
+    assert_int_equal(finished, 8);
+}
+
+static void submitting_to_full_queue_fails()
+{
+    struct cpn_pool_stats stats;
+
+    assert_success(cpn_pool_init(&pool, 1, 1));
+
+    assert_success(cpn_pool_submit(&pool, NULL, block, NULL));
+    wait_for_running(1);
+    assert_success(cpn_pool_submit(&pool, NULL, block, NULL));
+    assert_failure(cpn_pool_submit(&pool, NULL, block, NULL));
+
+    cpn_pool_get_stats(&stats, &pool);
+    assert_int_equal(stats.queued, 1);
+    assert_int_equal(stats.max_queued, 1);
+    assert_int_equal(stats.active, 1);
+    assert_int_equal(stats.rejected, 1);
+
+    release();
+    cpn_pool_free(&pool);
+
+    assert_int_equal(finished, 2);
+}
+
+static void limit_bounds_concurrent_jobs()
+{
+    struct cpn_pool_limit limit = { 2, 0, 0 };
+    size_t i;
+
+    assert_success(cpn_pool_init(&pool, 4, 8));
+    for (i = 0; i < 6; i++)
+        assert_success(cpn_pool_submit(&pool, &limit, block, NULL));
+    wait_for_running(2);
+
+    release();
+    cpn_pool_free(&pool);
+
+    assert_int_equal(max_running, 2);
+    assert_int_equal(finished, 6);
+    assert_int_equal(limit.active, 0);
+}
+
+static void limited_jobs_do_not_hold_back_others()
+{
+    struct cpn_pool_limit limit = { 1, 0, 0 };
+
+    assert_success(cpn_pool_init(&pool, 2, 8));
+    assert_success(cpn_pool_submit(&pool, &limit, block, NULL));
+    wait_for_running(1);
+    assert_success(cpn_pool_submit(&pool, &limit, block, NULL));
+    assert_success(cpn_pool_submit(&pool, NULL, count, NULL));
+
+    /* The second limited job has to wait, but the unlimited one
+     * is run by the idle worker */
+    wait_for_completed(1);
+    assert_int_equal(finished, 1);
+
+    release();
+    cpn_pool_free(&pool);
+
+    assert_int_equal(max_running, 1);
+    assert_int_equal(finished, 3);
+}
+
+static void higher_priority_jobs_are_run_first()
+{
+    struct cpn_pool_limit low = { 0, 0, 0 }, high = { 0, 0, 5 };
+
+    assert_success(cpn_pool_init(&pool, 1, 8));
+    assert_success(cpn_pool_submit(&pool, NULL, block, NULL));
+    wait_for_running(1);
+    assert_success(cpn_pool_submit(&pool, &low, record, &low.priority));
+    assert_success(cpn_pool_submit(&pool, &high, record, &high.priority));
+
+    release();
+    cpn_pool_free(&pool);
+
+    assert_int_equal(nrecorded, 2);
+    assert_int_equal(recorded[0], 5);
+    assert_int_equal(recorded[1], 0);
+}
+
+static void jobs_are_admitted_without_target()
+{
+    assert_success(cpn_pool_init(&pool, 1, 8));
+    assert_success(cpn_pool_submit(&pool, NULL, block, NULL));
+    assert_success(cpn_pool_submit(&pool, NULL, block, NULL));
+    usleep(10000);
+
+    assert_true(cpn_pool_admits(&pool, NULL));
+
+    release();
+    cpn_pool_free(&pool);
+}
+
+static void low_priority_jobs_are_shed_above_target()
+{
+    struct cpn_pool_limit high = { 0, 0, 1 };
+    struct cpn_pool_stats stats;
+
+    assert_success(cpn_pool_init(&pool, 1, 8));
+    cpn_pool_set_target(&pool, 1, 5, 1);
+    assert_success(cpn_pool_submit(&pool, NULL, block, NULL));
+    wait_for_running(1);
+    assert_success(cpn_pool_submit(&pool, NULL, count, NULL));
+    usleep(10000);
+
+    /* The sojourn time has to stay above the target for a whole
+     * interval before jobs are shed */
+    assert_true(cpn_pool_admits(&pool, NULL));
+    usleep(10000);
+    assert_false(cpn_pool_admits(&pool, NULL));
+    assert_true(cpn_pool_admits(&pool, &high));
+
+    cpn_pool_get_stats(&stats, &pool);
+    assert_int_equal(stats.shed, 1);
+    assert_int_equal(stats.min_priority, 1);
+
+    /* Admission recovers as soon as the queue has drained */
+    release();
+    wait_for_completed(2);
+    assert_true(cpn_pool_admits(&pool, NULL));
+
+    cpn_pool_free(&pool);
+}
+
+static void highest_priority_jobs_are_never_shed()
+{
+    struct cpn_pool_limit high = { 0, 0, 1 };
+    struct cpn_pool_stats stats;
+
+    assert_success(cpn_pool_init(&pool, 1, 8));
+    cpn_pool_set_target(&pool, 1, 5, 1);
+    assert_success(cpn_pool_submit(&pool, NULL, block, NULL));
+    wait_for_running(1);
+    assert_success(cpn_pool_submit(&pool, NULL, count, NULL));
+    usleep(10000);
+
+    /* The required priority must not rise beyond the highest one
+     * no matter how long the queue stays above the target */
+    assert_true(cpn_pool_admits(&pool, NULL));
+    usleep(10000);
+    assert_false(cpn_pool_admits(&pool, NULL));
+    usleep(10000);
+    assert_true(cpn_pool_admits(&pool, &high));
+    usleep(10000);
+    assert_true(cpn_pool_admits(&pool, &high));
+
+    cpn_pool_get_stats(&stats, &pool);
+    assert_int_equal(stats.min_priority, 1);
+
+    release();
+    cpn_pool_free(&pool);
+}
+
+static void jobs_held_back_by_limit_do_not_cause_shedding()
+{
+    struct cpn_pool_limit limit = { 1, 0, 0 };
+    struct cpn_pool_stats stats;
+
+    assert_success(cpn_pool_init(&pool, 2, 8));
+    cpn_pool_set_target(&pool, 1, 5, 0);
+    assert_success(cpn_pool_submit(&pool, &limit, block, NULL));
+    wait_for_running(1);
+    assert_success(cpn_pool_submit(&pool, &limit, block, NULL));
+
+    /* The queued job waits for its limit while a worker is
+     * idle, so the pool itself is not overloaded */
+    assert_true(cpn_pool_admits(&pool, NULL));
+    usleep(10000);
+    assert_true(cpn_pool_admits(&pool, NULL));
+    usleep(10000);
+    assert_true(cpn_pool_admits(&pool, NULL));
+
+    cpn_pool_get_stats(&stats, &pool);
+    assert_int_equal(stats.shed, 0);
+    assert_int_equal(stats.sojourn, 0);
+
+    release();
+    cpn_pool_free(&pool);
+}
+
+int pool_test_run_suite(void)
+{
+    const struct CMUnitTest tests[] = {
+        test(initializing_without_threads_fails),
+        test(initializing_without_queue_fails),
+        test(submitted_jobs_are_run),
+        test(freeing_runs_queued_jobs),
+        test(submitting_to_full_queue_fails),
+        test(limit_bounds_concurrent_jobs),
+        test(limited_jobs_do_not_hold_back_others),
+        test(higher_priority_jobs_are_run_first),
+        test(jobs_are_admitted_without_target),
+        test(low_priority_jobs_are_shed_above_target),
+        test(highest_priority_jobs_are_never_shed),
+        test(jobs_held_back_by_limit_do_not_cause_shedding)
+    };
+
+    return execute_test_suite("pool", tests, setup, teardown);
+}
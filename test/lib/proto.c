@@ -16,10 +16,15 @@
  */
 
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 #include "capone/client.h"
 #include "capone/channel.h"
 #include "capone/common.h"
+#include "capone/mux.h"
+#include "capone/pool.h"
+#include "capone/reactor.h"
 #include "capone/socket.h"
 #include "capone/server.h"
 #include "capone/service.h"
@@ -63,6 +68,23 @@ struct handle_session_args {
     int result;
 };
 
+struct query_multiplexed_args {
+    struct cpn_query_results results[2];
+    int result;
+};
+
+struct query_ik_args {
+    const struct cpn_sign_pk *remote_key;
+    struct cpn_query_results results;
+    int result;
+};
+
+struct async_handshake_args {
+    struct cpn_reactor *reactor;
+    struct cpn_sign_pk key;
+    int result;
+};
+
 struct handle_termination_args {
     struct cpn_channel *channel;
     struct cpn_sign_pk *terminator;
@@ -129,6 +151,114 @@ static void *initiate_connection(void *payload)
     return NULL;
 }
 
+static void *initiate_resumable_connection(void *payload)
+{
+    struct cpn_ticket *ticket = (struct cpn_ticket *) payload;
+    struct cpn_channel c;
+
+    if (cpn_client_connect_resumable(&c, "127.0.0.1", 31248,
+                &local_keys, &remote_keys.pk, ticket) == 0)
+        UNUSED(cpn_channel_write_data(&c, (uint8_t *) "test", 5));
+
+    UNUSED(cpn_channel_close(&c));
+
+    return NULL;
+}
+
+static void *query_multiplexed(void *payload)
+{
+    struct query_multiplexed_args *args = (struct query_multiplexed_args *) payload;
+    struct cpn_channel c, streams[2];
+    struct cpn_mux mux;
+    size_t i;
+
+    args->result = -1;
+
+    if (cpn_client_connect_mux(&mux, &c, "127.0.0.1", 31248,
+                &local_keys, &remote_keys.pk) < 0)
+        goto out;
+
+    /* Both queries share the connection and its handshake */
+    for (i = 0; i < ARRAY_SIZE(streams); i++) {
+        if (cpn_mux_open(&mux, &streams[i]) < 0)
+            break;
+        args->result = cpn_client_query_service(&args->results[i], &streams[i]);
+        cpn_channel_close(&streams[i]);
+        if (args->result < 0)
+            break;
+    }
+
+    cpn_mux_free(&mux);
+
+out:
+    UNUSED(cpn_channel_close(&c));
+
+    return NULL;
+}
+
+static void *query_ik(void *payload)
+{
+    struct query_ik_args *args = (struct query_ik_args *) payload;
+    struct cpn_channel c;
+
+    args->result = -1;
+
+    if (cpn_client_connect_ik(&c, "127.0.0.1", 31248,
+                &local_keys, args->remote_key) < 0)
+        goto out;
+
+    args->result = cpn_client_query_service(&args->results, &c);
+
+out:
+    UNUSED(cpn_channel_close(&c));
+
+    return NULL;
+}
+
+static void *request_ik(void *payload)
+{
+    struct query_ik_args *args = (struct query_ik_args *) payload;
+    ConnectionInitiationMessage msg = CONNECTION_INITIATION_MESSAGE__INIT;
+    struct cpn_channel c;
+
+    args->result = -1;
+
+    if (cpn_client_connect_ik(&c, "127.0.0.1", 31248,
+                &local_keys, args->remote_key) < 0)
+        goto out;
+
+    /* The client would complete the handshake before sending a
+     * request, so we have to send it as early data ourselves */
+    msg.type = CONNECTION_INITIATION_MESSAGE__TYPE__REQUEST;
+    args->result = cpn_channel_write_protobuf(&c, &msg.base);
+
+out:
+    UNUSED(cpn_channel_close(&c));
+
+    return NULL;
+}
+
+static void handshake_done(struct cpn_channel *c,
+        const struct cpn_sign_pk *key, int result, void *payload)
+{
+    struct async_handshake_args *args = (struct async_handshake_args *) payload;
+
+    UNUSED(c);
+
+    args->result = result;
+    if (key)
+        memcpy(&args->key, key, sizeof(args->key));
+
+    cpn_reactor_stop(args->reactor);
+}
+
+static void *delay(void *payload)
+{
+    UNUSED(payload);
+    usleep(200000);
+    return NULL;
+}
+
 static void *await_discovery(void *payload)
 {
     struct await_discovery_args *args = (struct await_discovery_args *) payload;
@@ -200,6 +330,601 @@ static void connection_initiation_succeeds()
     assert_success(cpn_socket_close(&s));
 }
 
+static void connection_initiation_negotiates_frames()
+{
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, initiate_connection, NULL));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_channel_set_framelen(&c, 1024));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+
+    assert_int_equal(c.framing, CPN_CHANNEL_FRAMING_FRAMES);
+    assert_int_equal(c.framelen, 1024);
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+
+    assert_success(cpn_socket_close(&s));
+}
+
+static void connection_initiation_negotiates_cipher()
+{
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, initiate_connection, NULL));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+
+    if (cpn_symmetric_cipher_is_available(CPN_SYMMETRIC_CIPHER_AES256GCM))
+        assert_int_equal(c.cipher, CPN_SYMMETRIC_CIPHER_AES256GCM);
+    else
+        assert_int_equal(c.cipher, CPN_SYMMETRIC_CIPHER_XCHACHA20POLY1305);
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+
+    assert_success(cpn_socket_close(&s));
+}
+
+static void connection_initiation_negotiates_compression()
+{
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, initiate_connection, NULL));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+
+    if (cpn_compression_is_available(CPN_COMPRESSION_LZ4))
+        assert_int_equal(c.compression, CPN_COMPRESSION_LZ4);
+    else
+        assert_int_equal(c.compression, CPN_COMPRESSION_NONE);
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+
+    assert_success(cpn_socket_close(&s));
+}
+
+static void connection_initiation_with_disabled_compression_succeeds()
+{
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, initiate_connection, NULL));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_channel_set_compression_level(&c, 0));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+
+    assert_int_equal(c.compression, CPN_COMPRESSION_NONE);
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+
+    assert_success(cpn_socket_close(&s));
+}
+
+static void connection_initiation_negotiates_multiplexing()
+{
+    struct query_multiplexed_args args;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c, stream;
+    struct cpn_sign_pk key;
+    struct cpn_mux mux;
+    size_t i;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, query_multiplexed, &args));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+    assert_true(c.multiplexed);
+
+    assert_success(cpn_mux_init(&mux, &c, CPN_MUX_ROLE_SERVER));
+    for (i = 0; i < ARRAY_SIZE(args.results); i++) {
+        assert_success(cpn_mux_accept(&mux, &stream));
+        assert_success(await_type(&stream, CONNECTION_INITIATION_MESSAGE__TYPE__QUERY));
+        assert_success(cpn_server_handle_query(&stream, &service));
+        assert_success(cpn_channel_close(&stream));
+    }
+    assert_failure(cpn_mux_accept(&mux, &stream));
+    cpn_mux_free(&mux);
+
+    assert_success(cpn_join(&t, NULL));
+    assert_success(args.result);
+
+    for (i = 0; i < ARRAY_SIZE(args.results); i++) {
+        assert_string_equal(args.results[i].name, "Foo");
+        cpn_query_results_free(&args.results[i]);
+    }
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_socket_close(&s));
+}
+
+static void accept_resumable_connection(struct cpn_socket *s, struct cpn_ticket *ticket)
+{
+    struct cpn_thread t;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+    uint8_t buf[5];
+
+    assert_success(cpn_spawn(&t, initiate_resumable_connection, ticket));
+    assert_success(cpn_socket_accept(s, &c));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+    assert_memory_equal(&key, &local_keys.pk, sizeof(key));
+
+    assert_int_equal(cpn_channel_receive_data(&c, buf, sizeof(buf)), sizeof(buf));
+    assert_string_equal(buf, "test");
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+}
+
+static void connection_initiation_issues_ticket()
+{
+    struct cpn_socket s;
+    struct cpn_ticket ticket;
+
+    cpn_ticket_clear(&ticket);
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    accept_resumable_connection(&s, &ticket);
+    assert_int_not_equal(ticket.len, 0);
+    assert_memory_equal(&ticket.identity, &remote_keys.pk, sizeof(ticket.identity));
+
+    assert_success(cpn_socket_close(&s));
+}
+
+static void connection_initiation_resumes_with_ticket()
+{
+    struct cpn_socket s;
+    struct cpn_ticket ticket, issued;
+
+    cpn_ticket_clear(&ticket);
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    accept_resumable_connection(&s, &ticket);
+    memcpy(&issued, &ticket, sizeof(issued));
+
+    /* Resumed handshakes do not issue new tickets */
+    accept_resumable_connection(&s, &ticket);
+    assert_memory_equal(&ticket, &issued, sizeof(ticket));
+
+    assert_success(cpn_socket_close(&s));
+}
+
+static void connection_initiation_with_invalid_ticket_falls_back()
+{
+    struct cpn_socket s;
+    struct cpn_ticket ticket;
+    uint8_t data[CPN_TICKET_MAXLEN];
+
+    cpn_ticket_clear(&ticket);
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    accept_resumable_connection(&s, &ticket);
+    ticket.data[0] ^= 1;
+    memcpy(data, ticket.data, sizeof(data));
+
+    accept_resumable_connection(&s, &ticket);
+    assert_memory_not_equal(ticket.data, data, ticket.len);
+
+    assert_success(cpn_socket_close(&s));
+}
+
+static void ik_connection_queries_service()
+{
+    struct query_ik_args args;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+
+    args.remote_key = &remote_keys.pk;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, query_ik, &args));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+    assert_memory_equal(&key, &local_keys.pk, sizeof(key));
+
+    assert_success(await_type(&c, CONNECTION_INITIATION_MESSAGE__TYPE__QUERY));
+    assert_success(cpn_server_handle_query(&c, &service));
+    assert_success(cpn_join(&t, NULL));
+
+    assert_success(args.result);
+    assert_string_equal(args.results.name, "Foo");
+
+    cpn_query_results_free(&args.results);
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_socket_close(&s));
+}
+
+static void ik_connection_with_smaller_framelen_succeeds()
+{
+    struct query_ik_args args;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+
+    args.remote_key = &remote_keys.pk;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, query_ik, &args));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_channel_set_framelen(&c, 512));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+
+    assert_success(await_type(&c, CONNECTION_INITIATION_MESSAGE__TYPE__QUERY));
+    assert_success(cpn_server_handle_query(&c, &service));
+    assert_success(cpn_join(&t, NULL));
+
+    assert_success(args.result);
+    assert_string_equal(args.results.name, "Foo");
+
+    cpn_query_results_free(&args.results);
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_socket_close(&s));
+}
+
+static void ik_connection_refuses_early_request()
+{
+    struct query_ik_args args;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+    enum cpn_command command;
+
+    args.remote_key = &remote_keys.pk;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, request_ik, &args));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+
+    /* The request could have been replayed by an attacker */
+    assert_failure(cpn_server_await_command(&command, &c));
+
+    assert_success(cpn_join(&t, NULL));
+    assert_success(args.result);
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_socket_close(&s));
+}
+
+static void ik_connection_with_wrong_key_fails()
+{
+    struct query_ik_args args;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+    struct cpn_sign_pk key;
+
+    args.remote_key = &local_keys.pk;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, query_ik, &args));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption(&c, &remote_keys, &key));
+
+    /* Early data is encrypted for the wrong server */
+    assert_failure(await_type(&c, CONNECTION_INITIATION_MESSAGE__TYPE__QUERY));
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+    assert_failure(args.result);
+
+    assert_success(cpn_socket_close(&s));
+}
+
+static void async_connection_initiation_succeeds()
+{
+    struct async_handshake_args args;
+    struct cpn_reactor reactor;
+    struct cpn_pool pool;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+
+    assert_success(cpn_reactor_init(&reactor));
+    assert_success(cpn_pool_init(&pool, 2, 4));
+    args.reactor = &reactor;
+    args.result = -1;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, initiate_connection, NULL));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption_async(&reactor, &pool, &c,
+                &remote_keys, handshake_done, &args));
+    assert_success(cpn_reactor_run(&reactor));
+
+    assert_success(args.result);
+    assert_memory_equal(&args.key, &local_keys.pk, sizeof(args.key));
+    assert_int_equal(c.crypto, CPN_CHANNEL_CRYPTO_SYMMETRIC);
+    assert_false(c.nonblocking);
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+
+    cpn_pool_free(&pool);
+    cpn_reactor_free(&reactor);
+    assert_success(cpn_socket_close(&s));
+}
+
+static void async_ik_connection_queries_service()
+{
+    struct async_handshake_args args;
+    struct query_ik_args query_args;
+    struct cpn_reactor reactor;
+    struct cpn_pool pool;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+
+    assert_success(cpn_reactor_init(&reactor));
+    assert_success(cpn_pool_init(&pool, 2, 4));
+    args.reactor = &reactor;
+    args.result = -1;
+    query_args.remote_key = &remote_keys.pk;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, query_ik, &query_args));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption_async(&reactor, &pool, &c,
+                &remote_keys, handshake_done, &args));
+    assert_success(cpn_reactor_run(&reactor));
+    assert_success(args.result);
+
+    assert_success(await_type(&c, CONNECTION_INITIATION_MESSAGE__TYPE__QUERY));
+    assert_success(cpn_server_handle_query(&c, &service));
+    assert_success(cpn_join(&t, NULL));
+
+    assert_success(query_args.result);
+    assert_string_equal(query_args.results.name, "Foo");
+
+    cpn_query_results_free(&query_args.results);
+    assert_success(cpn_channel_close(&c));
+    cpn_pool_free(&pool);
+    cpn_reactor_free(&reactor);
+    assert_success(cpn_socket_close(&s));
+}
+
+static void async_connection_under_load_answers_cookie()
+{
+    struct async_handshake_args args;
+    struct cpn_reactor reactor;
+    struct cpn_pool pool;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+
+    assert_success(cpn_reactor_init(&reactor));
+    assert_success(cpn_pool_init(&pool, 1, 4));
+    args.reactor = &reactor;
+    args.result = -1;
+
+    /* Keep the only worker busy with one job queued behind it */
+    assert_success(cpn_pool_submit(&pool, NULL, delay, NULL));
+    assert_success(cpn_pool_submit(&pool, NULL, delay, NULL));
+    cpn_server_set_cookie_threshold(1);
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, initiate_connection, NULL));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption_async(&reactor, &pool, &c,
+                &remote_keys, handshake_done, &args));
+    assert_success(cpn_reactor_run(&reactor));
+    cpn_server_set_cookie_threshold(0);
+
+    assert_success(args.result);
+    assert_memory_equal(&args.key, &local_keys.pk, sizeof(args.key));
+    assert_int_equal(c.crypto, CPN_CHANNEL_CRYPTO_SYMMETRIC);
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+
+    cpn_pool_free(&pool);
+    cpn_reactor_free(&reactor);
+    assert_success(cpn_socket_close(&s));
+}
+
+static void async_ik_connection_under_load_fails()
+{
+    struct async_handshake_args args;
+    struct query_ik_args query_args;
+    struct cpn_reactor reactor;
+    struct cpn_pool pool;
+    struct cpn_thread t;
+    struct cpn_socket s;
+    struct cpn_channel c;
+
+    assert_success(cpn_reactor_init(&reactor));
+    assert_success(cpn_pool_init(&pool, 1, 4));
+    args.reactor = &reactor;
+    args.result = 0;
+    query_args.remote_key = &remote_keys.pk;
+
+    /* Keep the only worker busy with one job queued behind it */
+    assert_success(cpn_pool_submit(&pool, NULL, delay, NULL));
+    assert_success(cpn_pool_submit(&pool, NULL, delay, NULL));
+    cpn_server_set_cookie_threshold(1);
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_spawn(&t, query_ik, &query_args));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_server_await_encryption_async(&reactor, &pool, &c,
+                &remote_keys, handshake_done, &args));
+    assert_success(cpn_reactor_run(&reactor));
+    cpn_server_set_cookie_threshold(0);
+    assert_failure(args.result);
+
+    assert_success(cpn_channel_close(&c));
+    assert_success(cpn_join(&t, NULL));
+    assert_failure(query_args.result);
+
+    cpn_pool_free(&pool);
+    cpn_reactor_free(&reactor);
+    assert_success(cpn_socket_close(&s));
+}
+
+static void async_connection_with_closed_client_fails()
+{
+    struct async_handshake_args args;
+    struct cpn_reactor reactor;
+    struct cpn_pool pool;
+    struct cpn_socket s;
+    struct cpn_channel c, client;
+
+    assert_success(cpn_reactor_init(&reactor));
+    assert_success(cpn_pool_init(&pool, 2, 4));
+    args.reactor = &reactor;
+    args.result = 0;
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_channel_init_from_host(&client, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_channel_connect(&client));
+    assert_success(cpn_socket_accept(&s, &c));
+    assert_success(cpn_channel_close(&client));
+
+    assert_success(cpn_server_await_encryption_async(&reactor, &pool, &c,
+                &remote_keys, handshake_done, &args));
+    assert_success(cpn_reactor_run(&reactor));
+    assert_failure(args.result);
+
+    assert_success(cpn_channel_close(&c));
+    cpn_pool_free(&pool);
+    cpn_reactor_free(&reactor);
+    assert_success(cpn_socket_close(&s));
+}
+
+static void async_connection_with_silent_client_times_out()
+{
+    struct async_handshake_args args;
+    struct cpn_reactor reactor;
+    struct cpn_pool pool;
+    struct cpn_socket s;
+    struct cpn_channel c, client;
+
+    assert_success(cpn_reactor_init(&reactor));
+    assert_success(cpn_pool_init(&pool, 2, 4));
+    args.reactor = &reactor;
+    args.result = 0;
+    cpn_server_set_handshake_timeout(100);
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_channel_init_from_host(&client, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_channel_connect(&client));
+    assert_success(cpn_socket_accept(&s, &c));
+
+    assert_success(cpn_server_await_encryption_async(&reactor, &pool, &c,
+                &remote_keys, handshake_done, &args));
+    assert_success(cpn_reactor_run(&reactor));
+    cpn_server_set_handshake_timeout(10 * 1000);
+    assert_failure(args.result);
+
+    assert_success(cpn_channel_close(&client));
+    assert_success(cpn_channel_close(&c));
+    cpn_pool_free(&pool);
+    cpn_reactor_free(&reactor);
+    assert_success(cpn_socket_close(&s));
+}
+
+static void async_connection_exceeding_max_handshakes_fails()
+{
+    struct async_handshake_args args;
+    struct cpn_reactor reactor;
+    struct cpn_pool pool;
+    struct cpn_socket s;
+    struct cpn_channel c1, c2, client1, client2;
+
+    assert_success(cpn_reactor_init(&reactor));
+    assert_success(cpn_pool_init(&pool, 2, 4));
+    args.reactor = &reactor;
+    args.result = 0;
+    cpn_server_set_max_handshakes(1);
+
+    assert_success(cpn_socket_init(&s, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_socket_listen(&s));
+
+    assert_success(cpn_channel_init_from_host(&client1, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_channel_connect(&client1));
+    assert_success(cpn_socket_accept(&s, &c1));
+    assert_success(cpn_channel_init_from_host(&client2, "127.0.0.1", 31248, CPN_CHANNEL_TYPE_TCP));
+    assert_success(cpn_channel_connect(&client2));
+    assert_success(cpn_socket_accept(&s, &c2));
+
+    assert_success(cpn_server_await_encryption_async(&reactor, &pool, &c1,
+                &remote_keys, handshake_done, &args));
+    assert_failure(cpn_server_await_encryption_async(&reactor, &pool, &c2,
+                &remote_keys, handshake_done, &args));
+
+    assert_success(cpn_channel_close(&client1));
+    assert_success(cpn_reactor_run(&reactor));
+    assert_failure(args.result);
+    cpn_server_set_max_handshakes(0);
+
+    assert_success(cpn_channel_close(&client2));
+    assert_success(cpn_channel_close(&c1));
+    assert_success(cpn_channel_close(&c2));
+    cpn_pool_free(&pool);
+    cpn_reactor_free(&reactor);
+    assert_success(cpn_socket_close(&s));
+}
+
 static void discovery_without_services_succeeds()
 {
     struct await_discovery_args args;
@@ -326,6 +1051,61 @@ static void query_succeeds()
     cpn_query_results_free(&results);
 }
 
+static void *await_queries(void *payload)
+{
+    struct await_query_args *args = (struct await_query_args *) payload;
+    enum cpn_command command;
+
+    await_type(args->channel, CONNECTION_INITIATION_MESSAGE__TYPE__QUERY);
+    if ((args->result = cpn_server_handle_query(args->channel, args->s)) < 0)
+        return NULL;
+
+    if ((args->result = cpn_server_await_next_command(&command, args->channel, -1)) < 0)
+        return NULL;
+    if (command != CPN_COMMAND_QUERY) {
+        args->result = -1;
+        return NULL;
+    }
+    args->result = cpn_server_handle_query(args->channel, args->s);
+
+    return NULL;
+}
+
+static void persistent_connection_handles_multiple_queries()
+{
+    struct cpn_thread t;
+    struct await_query_args args = {
+        &remote, &service, 0
+    };
+    struct cpn_query_results results;
+
+    cpn_spawn(&t, await_queries, &args);
+    assert_success(cpn_client_query_service(&results, &local));
+    cpn_query_results_free(&results);
+    assert_success(cpn_client_query_service(&results, &local));
+    cpn_join(&t, NULL);
+
+    assert_success(args.result);
+    assert_string_equal(results.name, "Foo");
+
+    cpn_query_results_free(&results);
+}
+
+static void awaiting_next_command_fails_when_idle()
+{
+    enum cpn_command command;
+
+    assert_failure(cpn_server_await_next_command(&command, &remote, 10));
+}
+
+static void awaiting_next_command_fails_when_closed()
+{
+    enum cpn_command command;
+
+    assert_success(shutdown(local.fd, SHUT_WR));
+    assert_failure(cpn_server_await_next_command(&command, &remote, -1));
+}
+
 static void query_refuses_with_invalid_version()
 {
     ConnectionInitiationMessage initialization = CONNECTION_INITIATION_MESSAGE__INIT;
@@ -601,6 +1381,25 @@ int proto_test_run_suite(void)
 
     const struct CMUnitTest tests[] = {
         test(connection_initiation_succeeds),
+        test(connection_initiation_negotiates_frames),
+        test(connection_initiation_negotiates_cipher),
+        test(connection_initiation_negotiates_compression),
+        test(connection_initiation_with_disabled_compression_succeeds),
+        test(connection_initiation_negotiates_multiplexing),
+        test(connection_initiation_issues_ticket),
+        test(connection_initiation_resumes_with_ticket),
+        test(connection_initiation_with_invalid_ticket_falls_back),
+        test(ik_connection_queries_service),
+        test(ik_connection_with_wrong_key_fails),
+        test(ik_connection_with_smaller_framelen_succeeds),
+        test(ik_connection_refuses_early_request),
+        test(async_connection_initiation_succeeds),
+        test(async_ik_connection_queries_service),
+        test(async_connection_under_load_answers_cookie),
+        test(async_ik_connection_under_load_fails),
+        test(async_connection_with_closed_client_fails),
+        test(async_connection_with_silent_client_times_out),
+        test(async_connection_exceeding_max_handshakes_fails),
 
         test(discovery_without_services_succeeds),
         test(discovery_with_services_succeeds),
@@ -610,6 +1409,9 @@ int proto_test_run_suite(void)
         test(query_succeeds),
         test(query_refuses_with_invalid_version),
         test(whitelisted_query_succeeds),
+        test(persistent_connection_handles_multiple_queries),
+        test(awaiting_next_command_fails_when_idle),
+        test(awaiting_next_command_fails_when_closed),
 
         test(request_constructs_session),
         test(request_refuses_with_invalid_version),
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <unistd.h>
+
+#include "capone/common.h"
+#include "capone/reactor.h"
+
+#include "test.h"
+
+static struct cpn_reactor reactor;
+static struct cpn_thread thread;
+static int fds[2];
+static int invocations, expirations;
+
+static int setup()
+{
+    invocations = expirations = 0;
+    assert_success(pipe(fds));
+    assert_success(cpn_reactor_init(&reactor));
+    return 0;
+}
+
+static int teardown()
+{
+    cpn_reactor_free(&reactor);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static void *run_reactor(void *payload)
+{
+    UNUSED(payload);
+    UNUSED(cpn_reactor_run(&reactor));
+    return NULL;
+}
+
+static void read_and_stop(int fd, void *payload)
+{
+    char c;
+
+    UNUSED(payload);
+
+    assert_int_equal(read(fd, &c, 1), 1);
+    invocations++;
+    cpn_reactor_stop(&reactor);
+}
+
+static void read_one(int fd, void *payload)
+{
+    char c;
+
+    UNUSED(payload);
+
+    assert_int_equal(read(fd, &c, 1), 1);
+    invocations++;
+}
+
+static void count_writable_and_stop(int fd, void *payload)
+{
+    UNUSED(fd);
+    UNUSED(payload);
+
+    invocations++;
+    cpn_reactor_stop(&reactor);
+}
+
+static void count_writable(int fd, void *payload)
+{
+    UNUSED(fd);
+    UNUSED(payload);
+
+    invocations++;
+}
+
+static void count_and_stop(void *payload)
+{
+    int *stop_after = (int *) payload;
+
+    if (++expirations >= *stop_after)
+        cpn_reactor_stop(&reactor);
+}
+
+static void count_timeout(void *payload)
+{
+    (*(int *) payload)++;
+}
+
+static void stop_reactor(void *payload)
+{
+    UNUSED(payload);
+    cpn_reactor_stop(&reactor);
+}
+
+static void readable_fd_invokes_callback()
+{
+    assert_success(cpn_reactor_add(&reactor, fds[0], false, read_and_stop, NULL));
+    assert_int_equal(write(fds[1], "x", 1), 1);
+
+    assert_success(cpn_reactor_run(&reactor));
+    assert_int_equal(invocations, 1);
+}
+
+static void writable_fd_invokes_callback()
+{
+    assert_success(cpn_reactor_add_writable(&reactor, fds[1], count_writable_and_stop, NULL));
+
+    assert_success(cpn_reactor_run(&reactor));
+    assert_int_equal(invocations, 1);
+}
+
+static void adding_fd_while_running_succeeds()
+{
+    assert_success(cpn_spawn(&thread, run_reactor, NULL));
+
+    assert_success(cpn_reactor_add(&reactor, fds[0], false, read_and_stop, NULL));
+    assert_int_equal(write(fds[1], "x", 1), 1);
+
+    assert_success(cpn_join(&thread, NULL));
+    assert_int_equal(invocations, 1);
+}
+
+static void adding_fd_twice_fails()
+{
+    assert_success(cpn_reactor_add(&reactor, fds[0], false, read_one, NULL));
+    assert_failure(cpn_reactor_add(&reactor, fds[0], false, read_one, NULL));
+}
+
+static void removing_unknown_fd_fails()
+{
+    assert_failure(cpn_reactor_remove(&reactor, fds[0]));
+}
+
+static void removed_fd_is_not_dispatched()
+{
+    int stop_after = 2;
+
+    assert_success(cpn_reactor_add(&reactor, fds[0], false, read_one, NULL));
+    assert_success(cpn_reactor_remove(&reactor, fds[0]));
+    assert_int_equal(write(fds[1], "x", 1), 1);
+
+    assert_success(cpn_reactor_set_timer(&reactor, 5, count_and_stop, &stop_after));
+    assert_success(cpn_reactor_run(&reactor));
+
+    assert_int_equal(invocations, 0);
+}
+
+static void readding_removed_fd_succeeds()
+{
+    assert_success(cpn_reactor_add(&reactor, fds[0], false, read_one, NULL));
+    assert_success(cpn_reactor_remove(&reactor, fds[0]));
+    assert_success(cpn_reactor_add(&reactor, fds[0], false, read_and_stop, NULL));
+    assert_int_equal(write(fds[1], "x", 1), 1);
+
+    assert_success(cpn_reactor_run(&reactor));
+    assert_int_equal(invocations, 1);
+}
+
+static void timer_fires_periodically()
+{
+    int stop_after = 3;
+
+    assert_success(cpn_reactor_set_timer(&reactor, 1, count_and_stop, &stop_after));
+    assert_success(cpn_reactor_run(&reactor));
+
+    assert_int_equal(expirations, 3);
+}
+
+static void timeout_fires_once()
+{
+    int fired = 0;
+
+    assert_success(cpn_reactor_add_timeout(&reactor, 1, count_timeout, &fired));
+    assert_success(cpn_reactor_add_timeout(&reactor, 20, stop_reactor, NULL));
+    assert_success(cpn_reactor_run(&reactor));
+
+    assert_int_equal(fired, 1);
+}
+
+static void removed_timeout_does_not_fire()
+{
+    int fired = 0;
+
+    assert_success(cpn_reactor_add_timeout(&reactor, 1, count_timeout, &fired));
+    assert_success(cpn_reactor_remove_timeout(&reactor, count_timeout, &fired));
+    assert_success(cpn_reactor_add_timeout(&reactor, 20, stop_reactor, NULL));
+    assert_success(cpn_reactor_run(&reactor));
+
+    assert_int_equal(fired, 0);
+}
+
+static void removing_expired_timeout_fails()
+{
+    int fired = 0;
+
+    assert_success(cpn_reactor_add_timeout(&reactor, 1, count_timeout, &fired));
+    assert_success(cpn_reactor_add_timeout(&reactor, 20, stop_reactor, NULL));
+    assert_success(cpn_reactor_run(&reactor));
+
+    assert_failure(cpn_reactor_remove_timeout(&reactor, count_timeout, &fired));
+}
+
+static void timeout_fires_while_fds_are_busy()
+{
+    int fired = 0;
+
+    /* A level-triggered fd which is never drained must not
+     * starve timeouts */
+    assert_success(cpn_reactor_add_writable(&reactor, fds[1], count_writable, NULL));
+    assert_success(cpn_reactor_add_timeout(&reactor, 5, count_timeout, &fired));
+    assert_success(cpn_reactor_add_timeout(&reactor, 20, stop_reactor, NULL));
+    assert_success(cpn_reactor_run(&reactor));
+
+    assert_int_equal(fired, 1);
+}
+
+static void level_triggered_fd_is_dispatched_until_drained()
+{
+    int stop_after = 3;
+
+    assert_success(cpn_reactor_add(&reactor, fds[0], false, read_one, NULL));
+    assert_int_equal(write(fds[1], "xy", 2), 2);
+
+    assert_success(cpn_reactor_set_timer(&reactor, 5, count_and_stop, &stop_after));
+    assert_success(cpn_reactor_run(&reactor));
+
+    assert_int_equal(invocations, 2);
+}
+
+#ifdef HAVE_EPOLL
+static void edge_triggered_fd_is_dispatched_once()
+{
+    int stop_after = 3;
+
+    assert_success(cpn_reactor_add(&reactor, fds[0], true, read_one, NULL));
+    assert_int_equal(write(fds[1], "xy", 2), 2);
+
+    assert_success(cpn_reactor_set_timer(&reactor, 5, count_and_stop, &stop_after));
+    assert_success(cpn_reactor_run(&reactor));
+
+    /* Data which has not been consumed is not reported again */
+    assert_int_equal(invocations, 1);
+}
+#endif
+
+int reactor_test_run_suite(void)
+{
+    const struct CMUnitTest tests[] = {
+        test(readable_fd_invokes_callback),
+        test(writable_fd_invokes_callback),
+        test(adding_fd_while_running_succeeds),
+        test(adding_fd_twice_fails),
+        test(removing_unknown_fd_fails),
+        test(removed_fd_is_not_dispatched),
+        test(readding_removed_fd_succeeds),
+        test(timer_fires_periodically),
+        test(timeout_fires_once),
+        test(removed_timeout_does_not_fire),
+        test(removing_expired_timeout_fails),
+        test(timeout_fires_while_fds_are_busy),
+        test(level_triggered_fd_is_dispatched_until_drained),
+#ifdef HAVE_EPOLL
+        test(edge_triggered_fd_is_dispatched_once),
+#endif
+    };
+
+    return execute_test_suite("reactor", tests, setup, teardown);
+}
@@ -0,0 +1,473 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <sodium/randombytes.h>
+
+#include "capone/common.h"
+#include "capone/channel.h"
+#include "capone/relay.h"
+#include "capone/crypto/symmetric.h"
+
+#include "test.h"
+
+#define NRELAYS 16
+#define LARGE_DATALEN (1024 * 1024)
+#define STALLED_DATALEN (4 * LARGE_DATALEN)
+#define STALLED_CHUNKLEN (64 * 1024)
+
+struct relay_result {
+    int calls;
+    int result;
+};
+
+struct await_args {
+    struct cpn_channel *c;
+    int fd;
+    int result;
+};
+
+static struct cpn_relay relay;
+static struct cpn_channel channels[NRELAYS], remotes[NRELAYS];
+static int fds[NRELAYS][2];
+static struct relay_result results[NRELAYS];
+
+static int setup()
+{
+    size_t i;
+
+    assert_success(cpn_relay_init(&relay));
+
+    for (i = 0; i < NRELAYS; i++) {
+        memset(&channels[i], 0, sizeof(channels[i]));
+        memset(&remotes[i], 0, sizeof(remotes[i]));
+        channels[i].fd = remotes[i].fd = -1;
+        fds[i][0] = fds[i][1] = -1;
+        results[i].calls = 0;
+        results[i].result = 1;
+    }
+
+    return 0;
+}
+
+static int teardown()
+{
+    size_t i;
+
+    cpn_relay_free(&relay);
+
+    for (i = 0; i < NRELAYS; i++) {
+        if (channels[i].fd >= 0)
+            cpn_channel_close(&channels[i]);
+        if (remotes[i].fd >= 0)
+            cpn_channel_close(&remotes[i]);
+        if (fds[i][0] >= 0)
+            close(fds[i][0]);
+        if (fds[i][1] >= 0)
+            close(fds[i][1]);
+    }
+
+    return 0;
+}
+
+static void store_result(int result, void *payload)
+{
+    struct relay_result *r = (struct relay_result *) payload;
+
+    r->calls++;
+    r->result = result;
+}
+
+static void *run_relay(void *payload)
+{
+    cpn_relay_run((struct cpn_relay *) payload, false);
+    return NULL;
+}
+
+static void *run_relay_until_idle(void *payload)
+{
+    cpn_relay_run((struct cpn_relay *) payload, true);
+    return NULL;
+}
+
+static void *await_relay(void *payload)
+{
+    struct await_args *args = (struct await_args *) payload;
+
+    args->result = cpn_relay_await(args->c, &args->fd, 1);
+
+    return NULL;
+}
+
+static void *write_large_data(void *payload)
+{
+    uint8_t *data = (uint8_t *) payload;
+
+    assert_int_equal(write(fds[0][0], data, LARGE_DATALEN), LARGE_DATALEN);
+    assert_success(shutdown(fds[0][0], SHUT_WR));
+
+    return NULL;
+}
+
+static void *write_large_channel_data(void *payload)
+{
+    assert_success(cpn_channel_write_data(&channels[0], (uint8_t *) payload, LARGE_DATALEN));
+    return NULL;
+}
+
+static void *write_chunked_channel_data(void *payload)
+{
+    uint8_t *data = (uint8_t *) payload;
+    size_t i;
+
+    for (i = 0; i < STALLED_DATALEN; i += STALLED_CHUNKLEN)
+        assert_success(cpn_channel_write_data(&channels[0], data + i, STALLED_CHUNKLEN));
+
+    return NULL;
+}
+
+static void stub_relay(size_t i)
+{
+    stub_sockets(&channels[i], &remotes[i], CPN_CHANNEL_TYPE_TCP);
+    assert_success(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]));
+}
+
+static void add_relay(size_t i)
+{
+    stub_relay(i);
+    assert_success(cpn_relay_add(&relay, &remotes[i], &fds[i][1], 1,
+                store_result, &results[i]));
+}
+
+static void relay_large_data_to_fd(void)
+{
+    static uint8_t data[LARGE_DATALEN], buf[LARGE_DATALEN];
+    struct cpn_thread t, writer;
+    size_t received = 0;
+    ssize_t ret;
+
+    randombytes_buf(data, sizeof(data));
+
+    assert_success(cpn_spawn(&t, run_relay, &relay));
+    assert_success(cpn_spawn(&writer, write_large_channel_data, data));
+
+    while (received < sizeof(data)) {
+        ret = read(fds[0][0], buf + received, sizeof(buf) - received);
+        assert_true(ret > 0);
+        received += ret;
+    }
+    assert_memory_equal(data, buf, sizeof(data));
+
+    assert_success(cpn_join(&writer, NULL));
+    assert_success(cpn_relay_stop(&relay));
+    assert_success(cpn_join(&t, NULL));
+}
+
+static void relaying_multiple_sessions_succeeds()
+{
+    struct cpn_thread t;
+    uint8_t buf[32];
+    size_t i;
+
+    for (i = 0; i < NRELAYS; i++)
+        add_relay(i);
+
+    assert_success(cpn_spawn(&t, run_relay, &relay));
+
+    for (i = 0; i < NRELAYS; i++) {
+        char data[32];
+
+        snprintf(data, sizeof(data), "to-fd-%"PRIuMAX, (uintmax_t) i);
+        assert_success(cpn_channel_write_data(&channels[i], (uint8_t *) data, strlen(data) + 1));
+        assert_int_equal(read(fds[i][0], buf, sizeof(buf)), strlen(data) + 1);
+        assert_string_equal(buf, data);
+
+        snprintf(data, sizeof(data), "to-channel-%"PRIuMAX, (uintmax_t) i);
+        assert_int_equal(write(fds[i][0], data, strlen(data) + 1), strlen(data) + 1);
+        assert_int_equal(cpn_channel_receive_data(&channels[i], buf, sizeof(buf)), strlen(data) + 1);
+        assert_string_equal(buf, data);
+    }
+
+    assert_success(cpn_relay_stop(&relay));
+    assert_success(cpn_join(&t, NULL));
+
+    for (i = 0; i < NRELAYS; i++)
+        assert_int_equal(results[i].calls, 0);
+}
+
+static void relaying_large_data_to_channel_succeeds()
+{
+    static uint8_t data[LARGE_DATALEN], buf[LARGE_DATALEN];
+    struct cpn_thread t, writer;
+    size_t received = 0;
+    ssize_t ret;
+
+    randombytes_buf(data, sizeof(data));
+
+    add_relay(0);
+    assert_success(cpn_spawn(&t, run_relay_until_idle, &relay));
+    assert_success(cpn_spawn(&writer, write_large_data, data));
+
+    while (received < sizeof(data)) {
+        ret = cpn_channel_receive_data(&channels[0], buf + received, sizeof(buf) - received);
+        assert_true(ret > 0);
+        received += ret;
+    }
+    assert_memory_equal(data, buf, sizeof(data));
+
+    assert_success(cpn_join(&writer, NULL));
+    assert_success(cpn_join(&t, NULL));
+
+    assert_int_equal(results[0].calls, 1);
+    assert_int_equal(results[0].result, 0);
+}
+
+static void relaying_large_data_to_fd_succeeds()
+{
+    add_relay(0);
+    relay_large_data_to_fd();
+}
+
+static void relaying_large_framed_data_to_fd_succeeds()
+{
+    stub_relay(0);
+    assert_success(cpn_channel_set_framing(&channels[0], CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remotes[0], CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_relay_add(&relay, &remotes[0], &fds[0][1], 1,
+                store_result, &results[0]));
+
+    relay_large_data_to_fd();
+}
+
+static void relaying_framed_data_to_channel_succeeds()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+
+    stub_relay(0);
+    assert_success(cpn_channel_set_framing(&channels[0], CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_channel_set_framing(&remotes[0], CPN_CHANNEL_FRAMING_FRAMES));
+    assert_success(cpn_relay_add(&relay, &remotes[0], &fds[0][1], 1,
+                store_result, &results[0]));
+
+    assert_int_equal(write(fds[0][0], data, sizeof(data)), sizeof(data));
+    assert_success(shutdown(fds[0][0], SHUT_WR));
+    assert_success(cpn_relay_run(&relay, true));
+
+    assert_int_equal(cpn_channel_receive_data(&channels[0], buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(buf, data);
+    assert_int_equal(results[0].result, 0);
+}
+
+static void relaying_encrypted_data_succeeds()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+    struct cpn_symmetric_key key;
+
+    stub_relay(0);
+    assert_success(cpn_symmetric_key_generate(&key));
+    assert_success(cpn_channel_enable_encryption(&channels[0], &key, CPN_CHANNEL_NONCE_CLIENT));
+    assert_success(cpn_channel_enable_encryption(&remotes[0], &key, CPN_CHANNEL_NONCE_SERVER));
+    assert_success(cpn_relay_add(&relay, &remotes[0], &fds[0][1], 1,
+                store_result, &results[0]));
+
+    relay_large_data_to_fd();
+
+    assert_int_equal(write(fds[0][0], data, sizeof(data)), sizeof(data));
+    assert_success(shutdown(fds[0][0], SHUT_WR));
+    assert_success(cpn_relay_run(&relay, true));
+
+    assert_int_equal(cpn_channel_receive_data(&channels[0], buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(buf, data);
+    assert_int_equal(results[0].result, 0);
+}
+
+static void relaying_with_stalled_consumer_keeps_other_direction()
+{
+    static uint8_t data[STALLED_DATALEN], buf[STALLED_DATALEN];
+    uint8_t msg[] = "bla", msgbuf[sizeof(msg)];
+    struct cpn_symmetric_key key;
+    struct cpn_thread t, writer;
+    size_t received = 0;
+    ssize_t ret;
+
+    randombytes_buf(data, sizeof(data));
+
+    stub_relay(0);
+    assert_success(cpn_symmetric_key_generate(&key));
+    assert_success(cpn_channel_enable_encryption(&channels[0], &key, CPN_CHANNEL_NONCE_CLIENT));
+    assert_success(cpn_channel_enable_encryption(&remotes[0], &key, CPN_CHANNEL_NONCE_SERVER));
+    assert_success(cpn_relay_add(&relay, &remotes[0], &fds[0][1], 1,
+                store_result, &results[0]));
+
+    assert_success(cpn_spawn(&t, run_relay, &relay));
+    assert_success(cpn_spawn(&writer, write_chunked_channel_data, data));
+
+    /* Nobody is consuming data relayed to the fd, yet data
+     * relayed to the channel must still get through */
+    assert_int_equal(write(fds[0][0], msg, sizeof(msg)), sizeof(msg));
+    assert_int_equal(cpn_channel_receive_data(&channels[0], msgbuf, sizeof(msgbuf)), sizeof(msg));
+    assert_string_equal(msgbuf, msg);
+
+    while (received < sizeof(data)) {
+        ret = read(fds[0][0], buf + received, sizeof(buf) - received);
+        assert_true(ret > 0);
+        received += ret;
+    }
+    assert_memory_equal(data, buf, sizeof(data));
+
+    assert_success(cpn_join(&writer, NULL));
+    assert_success(cpn_relay_stop(&relay));
+    assert_success(cpn_join(&t, NULL));
+}
+
+static void relay_finishes_when_fds_are_closed()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+
+    add_relay(0);
+
+    assert_int_equal(write(fds[0][0], data, sizeof(data)), sizeof(data));
+    assert_success(shutdown(fds[0][0], SHUT_WR));
+
+    assert_success(cpn_relay_run(&relay, true));
+    assert_int_equal(results[0].calls, 1);
+    assert_int_equal(results[0].result, 0);
+
+    assert_int_equal(cpn_channel_receive_data(&channels[0], buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(buf, data);
+    assert_false(remotes[0].nonblocking);
+}
+
+static void relay_fails_when_channel_is_closed()
+{
+    add_relay(0);
+
+    assert_success(shutdown(channels[0].fd, SHUT_RDWR));
+
+    assert_success(cpn_relay_run(&relay, true));
+    assert_int_equal(results[0].calls, 1);
+    assert_int_equal(results[0].result, -1);
+}
+
+static void adding_relay_without_fds_fails()
+{
+    stub_sockets(&channels[0], &remotes[0], CPN_CHANNEL_TYPE_TCP);
+
+    assert_failure(cpn_relay_add(&relay, &remotes[0], NULL, 0, store_result, &results[0]));
+}
+
+static void adding_relay_with_udp_channel_fails()
+{
+    stub_sockets(&channels[0], &remotes[0], CPN_CHANNEL_TYPE_UDP);
+    assert_success(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[0]));
+
+    assert_failure(cpn_relay_add(&relay, &remotes[0], &fds[0][1], 1,
+                store_result, &results[0]));
+}
+
+static void awaiting_shared_relay_succeeds()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+    struct await_args args;
+    struct cpn_thread t;
+
+    stub_sockets(&channels[0], &remotes[0], CPN_CHANNEL_TYPE_TCP);
+    assert_success(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[0]));
+
+    args.c = &remotes[0];
+    args.fd = fds[0][1];
+    args.result = 1;
+
+    assert_success(cpn_spawn(&t, await_relay, &args));
+
+    assert_success(cpn_channel_write_data(&channels[0], data, sizeof(data)));
+    assert_int_equal(read(fds[0][0], buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(buf, data);
+
+    assert_success(shutdown(fds[0][0], SHUT_WR));
+    assert_success(cpn_join(&t, NULL));
+    assert_success(args.result);
+}
+
+static void notify_detached(int result, void *payload)
+{
+    uint8_t byte = 0;
+
+    results[0].calls++;
+    results[0].result = result;
+
+    assert_int_equal(write(*(int *) payload, &byte, sizeof(byte)), sizeof(byte));
+}
+
+static void detaching_relay_takes_over_channel()
+{
+    uint8_t data[] = "bla", buf[sizeof(data)];
+
+    stub_sockets(&channels[0], &remotes[0], CPN_CHANNEL_TYPE_TCP);
+    assert_success(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[0]));
+    assert_success(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[1]));
+
+    assert_success(cpn_relay_detach(&remotes[0], &fds[0][1], 1,
+                notify_detached, &fds[1][1]));
+    assert_int_equal(remotes[0].fd, -1);
+    fds[0][1] = -1;
+
+    assert_success(cpn_channel_write_data(&channels[0], data, sizeof(data)));
+    assert_int_equal(read(fds[0][0], buf, sizeof(buf)), sizeof(data));
+    assert_string_equal(buf, data);
+
+    assert_success(shutdown(fds[0][0], SHUT_WR));
+    assert_int_equal(read(fds[1][0], buf, 1), 1);
+    assert_int_equal(results[0].calls, 1);
+    assert_success(results[0].result);
+
+    /* The relay has closed the channel when finishing */
+    assert_int_equal(read(channels[0].fd, buf, sizeof(buf)), 0);
+}
+
+static void detaching_relay_without_fds_keeps_channel()
+{
+    stub_sockets(&channels[0], &remotes[0], CPN_CHANNEL_TYPE_TCP);
+
+    assert_failure(cpn_relay_detach(&remotes[0], NULL, 0, NULL, NULL));
+    assert_int_not_equal(remotes[0].fd, -1);
+}
+
+int relay_test_run_suite(void)
+{
+    const struct CMUnitTest tests[] = {
+        test(relaying_multiple_sessions_succeeds),
+        test(relaying_large_data_to_channel_succeeds),
+        test(relaying_large_data_to_fd_succeeds),
+        test(relaying_large_framed_data_to_fd_succeeds),
+        test(relaying_framed_data_to_channel_succeeds),
+        test(relaying_encrypted_data_succeeds),
+        test(relaying_with_stalled_consumer_keeps_other_direction),
+        test(relay_finishes_when_fds_are_closed),
+        test(relay_fails_when_channel_is_closed),
+        test(adding_relay_without_fds_fails),
+        test(adding_relay_with_udp_channel_fails),
+        test(awaiting_shared_relay_succeeds),
+        test(detaching_relay_takes_over_channel),
+        test(detaching_relay_without_fds_keeps_channel)
+    };
+
+    return execute_test_suite("relay", tests, setup, teardown);
+}
@@ -17,6 +17,7 @@
 
 #include <string.h>
 
+#include "capone/channel.h"
 #include "capone/common.h"
 #include "capone/service.h"
 
@@ -53,6 +54,8 @@ static void test_service_from_config()
     assert_string_equal(service.name, "foo");
     assert_string_equal(service.location, "space");
     assert_int_equal(service.port, 7777);
+    assert_int_equal(service.concurrency, 0);
+    assert_int_equal(service.priority, CPN_SERVICE_PRIORITY_BULK);
 
     /* Check plugin pointers */
     assert_string_equal(service.plugin->type, "exec");
@@ -62,6 +65,93 @@ static void test_service_from_config()
     assert_non_null(service.plugin->version);
 }
 
+static void test_service_with_concurrency_from_config()
+{
+    static char *service_config =
+        "[service]\n"
+        "name=foo\n"
+        "type=exec\n"
+        "location=space\n"
+        "port=7777\n"
+        "concurrency=8\n";
+
+    assert_success(cpn_cfg_parse_string(&cfg, service_config, strlen(service_config)));
+    assert_success(cpn_service_from_config(&service, "foo", &cfg));
+
+    assert_int_equal(service.concurrency, 8);
+}
+
+static void test_service_with_priority_from_config()
+{
+    static char *service_config =
+        "[service]\n"
+        "name=foo\n"
+        "type=exec\n"
+        "location=space\n"
+        "port=7777\n"
+        "priority=7\n";
+
+    assert_success(cpn_cfg_parse_string(&cfg, service_config, strlen(service_config)));
+    assert_success(cpn_service_from_config(&service, "foo", &cfg));
+
+    assert_int_equal(service.priority, 7);
+}
+
+static void test_interactive_service_has_higher_priority()
+{
+    static char *service_config =
+        "[service]\n"
+        "name=foo\n"
+        "type=synergy\n"
+        "location=space\n"
+        "port=7777\n";
+
+    assert_success(cpn_cfg_parse_string(&cfg, service_config, strlen(service_config)));
+    assert_success(cpn_service_from_config(&service, "foo", &cfg));
+
+    assert_int_equal(service.priority, CPN_SERVICE_PRIORITY_INTERACTIVE);
+}
+
+static void test_interactive_service_lowers_framelen()
+{
+    const struct cpn_service_plugin *plugin;
+    struct cpn_channel channel;
+
+    memset(&channel, 0, sizeof(channel));
+    channel.framelen = 32768;
+
+    assert_success(cpn_service_plugin_for_type(&plugin, "synergy"));
+    assert_success(cpn_service_plugin_setup_channel(plugin, &channel));
+    assert_int_equal(channel.framelen, plugin->framelen);
+    assert_true(plugin->framelen < 32768);
+}
+
+static void test_interactive_service_keeps_lower_negotiated_framelen()
+{
+    const struct cpn_service_plugin *plugin;
+    struct cpn_channel channel;
+
+    memset(&channel, 0, sizeof(channel));
+    channel.framelen = 64;
+
+    assert_success(cpn_service_plugin_for_type(&plugin, "synergy"));
+    assert_success(cpn_service_plugin_setup_channel(plugin, &channel));
+    assert_int_equal(channel.framelen, 64);
+}
+
+static void test_bulk_service_keeps_negotiated_framelen()
+{
+    const struct cpn_service_plugin *plugin;
+    struct cpn_channel channel;
+
+    memset(&channel, 0, sizeof(channel));
+    channel.framelen = 32768;
+
+    assert_success(cpn_service_plugin_for_type(&plugin, "exec"));
+    assert_success(cpn_service_plugin_setup_channel(plugin, &channel));
+    assert_int_equal(channel.framelen, 32768);
+}
+
 static void test_invalid_service_from_config_fails()
 {
     static char *service_config =
@@ -120,6 +210,12 @@ int service_test_run_suite(void)
 {
     const struct CMUnitTest tests[] = {
         test(test_service_from_config),
+        test(test_service_with_concurrency_from_config),
+        test(test_service_with_priority_from_config),
+        test(test_interactive_service_has_higher_priority),
+        test(test_interactive_service_lowers_framelen),
+        test(test_interactive_service_keeps_lower_negotiated_framelen),
+        test(test_bulk_service_keeps_negotiated_framelen),
         test(test_invalid_service_from_config_fails),
         test(test_incomplete_service_from_config_fails),
         test(test_services_from_config),
@@ -91,6 +91,53 @@ static void getting_address_succeeds()
     assert_int_equal(port, 12345);
 }
 
+static void shared_sockets_listen_on_same_port()
+{
+    struct cpn_socket shared[2];
+    struct cpn_channel connected;
+
+    assert_success(cpn_socket_init_shared(&shared[0], "127.0.0.1", 8080, type));
+    assert_success(cpn_socket_init_shared(&shared[1], "127.0.0.1", 8080, type));
+    assert_success(cpn_socket_set_backlog(&shared[0], 128));
+    assert_success(cpn_socket_listen(&shared[0]));
+    assert_success(cpn_socket_listen(&shared[1]));
+
+    /* Close one of the sockets such that the kernel has to
+     * direct the connection to the other one */
+    assert_success(cpn_socket_close(&shared[1]));
+
+    assert_success(cpn_channel_init_from_host(&channel, "127.0.0.1", 8080, type));
+    assert_success(cpn_channel_connect(&channel));
+    assert_success(cpn_socket_accept(&shared[0], &connected));
+
+    assert_success(cpn_channel_close(&connected));
+    assert_success(cpn_socket_close(&shared[0]));
+}
+
+static void setting_invalid_backlog_fails()
+{
+    assert_success(cpn_socket_init(&remote, "127.0.0.1", 8080, type));
+    assert_failure(cpn_socket_set_backlog(&remote, 0));
+    assert_int_equal(remote.backlog, CPN_SOCKET_BACKLOG);
+}
+
+static void setting_incoming_cpu_succeeds()
+{
+    assert_success(cpn_socket_init_shared(&remote, "127.0.0.1", 8080, type));
+    assert_success(cpn_socket_set_incoming_cpu(&remote, 0));
+}
+
+static void nonblocking_accept_without_connection_fails()
+{
+    struct cpn_channel connected;
+
+    assert_success(cpn_socket_init(&remote, "127.0.0.1", 8080, type));
+    assert_success(cpn_socket_set_nonblocking(&remote));
+    assert_success(cpn_socket_listen(&remote));
+
+    assert_failure(cpn_socket_accept(&remote, &connected));
+}
+
 int socket_test_run_suite(void)
 {
     const struct CMUnitTest tests[] = {
@@ -99,7 +146,11 @@ int socket_test_run_suite(void)
         test(set_local_address_to_empty_address),
         test(set_local_address_to_invalid_address),
         test(connect_to_localhost_succeeds),
-        test(getting_address_succeeds)
+        test(getting_address_succeeds),
+        test(shared_sockets_listen_on_same_port),
+        test(setting_invalid_backlog_fails),
+        test(setting_incoming_cpu_succeeds),
+        test(nonblocking_accept_without_connection_fails)
     };
 
     return execute_test_suite("socket", tests, NULL, NULL);
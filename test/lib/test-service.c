@@ -80,7 +80,9 @@ int cpn_test_init_service(const struct cpn_service_plugin **out)
         handle,
         invoke,
         parse,
-        &test_params__descriptor
+        &test_params__descriptor,
+        CPN_SERVICE_PRIORITY_BULK,
+        0
     };
 
     *out = &plugin;
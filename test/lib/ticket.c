@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2016 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+#include <unistd.h>
+
+#include "capone/common.h"
+#include "capone/ticket.h"
+
+#include "test.h"
+
+static struct cpn_sign_keys client, other;
+static struct cpn_symmetric_key secret;
+static struct cpn_ticket ticket;
+static char file[] = "capone-ticket.XXXXXX";
+
+static int setup()
+{
+    int fd;
+
+    assert_success(cpn_sign_keys_generate(&client));
+    assert_success(cpn_sign_keys_generate(&other));
+    assert_success(cpn_symmetric_key_generate(&secret));
+    cpn_ticket_clear(&ticket);
+
+    strcpy(file, "capone-ticket.XXXXXX");
+    fd = mkstemp(file);
+    assert(fd >= 0);
+    close(fd);
+
+    return 0;
+}
+
+static int teardown()
+{
+    unlink(file);
+    return 0;
+}
+
+static void sealed_ticket_opens()
+{
+    struct cpn_symmetric_key opened;
+
+    assert_success(cpn_ticket_seal(ticket.data, &ticket.len,
+                &client.pk, &secret, CPN_TICKET_LIFETIME));
+    assert_true(ticket.len <= CPN_TICKET_MAXLEN);
+
+    assert_success(cpn_ticket_open(&opened, ticket.data, ticket.len, &client.pk));
+    assert_memory_equal(&opened, &secret, sizeof(secret));
+}
+
+static void opening_ticket_for_other_client_fails()
+{
+    struct cpn_symmetric_key opened;
+
+    assert_success(cpn_ticket_seal(ticket.data, &ticket.len,
+                &client.pk, &secret, CPN_TICKET_LIFETIME));
+    assert_failure(cpn_ticket_open(&opened, ticket.data, ticket.len, &other.pk));
+}
+
+static void opening_expired_ticket_fails()
+{
+    struct cpn_symmetric_key opened;
+
+    assert_success(cpn_ticket_seal(ticket.data, &ticket.len,
+                &client.pk, &secret, 0));
+    assert_failure(cpn_ticket_open(&opened, ticket.data, ticket.len, &client.pk));
+}
+
+static void opening_modified_ticket_fails()
+{
+    struct cpn_symmetric_key opened;
+
+    assert_success(cpn_ticket_seal(ticket.data, &ticket.len,
+                &client.pk, &secret, CPN_TICKET_LIFETIME));
+    ticket.data[ticket.len - 1] ^= 1;
+    assert_failure(cpn_ticket_open(&opened, ticket.data, ticket.len, &client.pk));
+}
+
+static void opening_truncated_ticket_fails()
+{
+    struct cpn_symmetric_key opened;
+
+    assert_success(cpn_ticket_seal(ticket.data, &ticket.len,
+                &client.pk, &secret, CPN_TICKET_LIFETIME));
+    assert_failure(cpn_ticket_open(&opened, ticket.data, ticket.len - 1, &client.pk));
+}
+
+static void written_ticket_reads_back()
+{
+    struct cpn_ticket read;
+
+    memcpy(&ticket.identity, &other.pk, sizeof(ticket.identity));
+    memcpy(&ticket.secret, &secret, sizeof(ticket.secret));
+    assert_success(cpn_ticket_seal(ticket.data, &ticket.len,
+                &client.pk, &secret, CPN_TICKET_LIFETIME));
+
+    assert_success(cpn_ticket_to_file(file, &ticket));
+    assert_success(cpn_ticket_from_file(&read, file));
+
+    assert_memory_equal(&read.identity, &ticket.identity, sizeof(ticket.identity));
+    assert_memory_equal(&read.secret, &ticket.secret, sizeof(ticket.secret));
+    assert_int_equal(read.len, ticket.len);
+    assert_memory_equal(read.data, ticket.data, ticket.len);
+}
+
+static void writing_empty_ticket_fails()
+{
+    assert_failure(cpn_ticket_to_file(file, &ticket));
+}
+
+static void reading_empty_file_fails()
+{
+    struct cpn_ticket read;
+    assert_failure(cpn_ticket_from_file(&read, file));
+}
+
+int ticket_test_run_suite(void)
+{
+    const struct CMUnitTest tests[] = {
+        test(sealed_ticket_opens),
+        test(opening_ticket_for_other_client_fails),
+        test(opening_expired_ticket_fails),
+        test(opening_modified_ticket_fails),
+        test(opening_truncated_ticket_fails),
+
+        test(written_ticket_reads_back),
+        test(writing_empty_ticket_fails),
+        test(reading_empty_file_fails)
+    };
+
+    return execute_test_suite("ticket", tests, setup, teardown);
+}